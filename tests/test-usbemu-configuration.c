@@ -175,6 +175,230 @@ test_properties_max_power_1 (void)
   }
 }
 
+static void
+test_descriptor_bytes_1 (void)
+{
+  const guint8 expected[] = {
+    /* configuration */
+    0x09, USBEMU_DESCRIPTOR_TYPE_CONFIGURATION, 0x09, 0x00, 0x00, 0x00, 0x00,
+    USBEMU_CONFIGURATION_ATTR_RESERVED_7, 0x01,
+  };
+  UsbemuConfiguration *configuration;
+  GBytes *bytes;
+  gsize size;
+  gconstpointer data;
+
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  g_assert_nonnull (bytes);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size, expected, sizeof (expected));
+
+  /* cached until modified. */
+  g_assert_true (usbemu_configuration_get_descriptor_bytes (configuration) ==
+                 bytes);
+  usbemu_configuration_set_max_power (configuration, 500);
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpuint (size, ==, sizeof (expected));
+  g_assert_cmpuint (((const guint8*) data)[8], ==, 250);
+}
+
+/* @n class specific descriptors of 255 bytes. */
+static GBytes*
+_new_class_descriptors (guint n)
+{
+  guint8 *data;
+  guint i;
+
+  data = g_malloc0 (n * 255);
+  for (i = 0; i < n; i++) {
+    data[i * 255] = 255;
+    data[i * 255 + 1] = 0x24;
+  }
+
+  return g_bytes_new_take (data, n * 255);
+}
+
+static void
+test_descriptor_bytes_2 (void)
+{
+  UsbemuConfiguration *configuration;
+  GBytes *bytes;
+
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+
+  /* 65289 bytes with the configuration descriptor. */
+  bytes = _new_class_descriptors (256);
+  usbemu_configuration_set_extra_descriptors (configuration, bytes);
+  g_bytes_unref (bytes);
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  g_assert_nonnull (bytes);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 65289);
+
+  /* one more would not fit wTotalLength. */
+  bytes = _new_class_descriptors (257);
+  usbemu_configuration_set_extra_descriptors (configuration, bytes);
+  g_bytes_unref (bytes);
+  g_assert_null (usbemu_configuration_get_descriptor_bytes (configuration));
+  g_assert_null (usbemu_configuration_get_descriptor_bytes_slice (configuration,
+                                                                  9));
+}
+
+static void
+test_descriptor_bytes_interfaces_1 (void)
+{
+  const UsbemuEndpointEntry entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { USBEMU_EP_2, USBEMU_ENDPOINT_DIRECTION_OUT,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { USBEMU_EP_3, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_INTERRUPT, 0, 8, 0, 10000 },
+    { 0, },
+  };
+  const guint8 expected[] = {
+    /* configuration */
+    0x09, USBEMU_DESCRIPTOR_TYPE_CONFIGURATION, 0x30, 0x00, 0x01, 0x00, 0x00,
+    USBEMU_CONFIGURATION_ATTR_RESERVED_7, 0x01,
+    /* interface 0, alternate setting 0 */
+    0x09, USBEMU_DESCRIPTOR_TYPE_INTERFACE, 0x00, 0x00, 0x00,
+    USBEMU_CLASS_VENDOR_SPECIFIC, 0x00, USBEMU_PROTOCOL_VENDOR_SPECIFIC, 0x00,
+    /* interface 0, alternate setting 1 */
+    0x09, USBEMU_DESCRIPTOR_TYPE_INTERFACE, 0x00, 0x01, 0x03,
+    USBEMU_CLASS_VENDOR_SPECIFIC, 0x00, USBEMU_PROTOCOL_VENDOR_SPECIFIC, 0x00,
+    /* endpoints */
+    0x07, USBEMU_DESCRIPTOR_TYPE_ENDPOINT, 0x81, 0x02, 0x40, 0x00, 0x00,
+    0x07, USBEMU_DESCRIPTOR_TYPE_ENDPOINT, 0x02, 0x02, 0x40, 0x00, 0x00,
+    0x07, USBEMU_DESCRIPTOR_TYPE_ENDPOINT, 0x83, 0x03, 0x08, 0x00, 0x0A,
+  };
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[3];
+  GBytes *bytes, *slice;
+  gsize size;
+  gconstpointer data;
+
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+
+  interfaces[0] = usbemu_interface_new ();
+  interfaces[1] = usbemu_interface_new ();
+  interfaces[2] = NULL;
+  g_test_queue_unref (interfaces[0]);
+  g_test_queue_unref (interfaces[1]);
+  g_assert_cmpint (usbemu_configuration_add_alternate_interfaces (configuration,
+                                                                  interfaces),
+                   ==, 0);
+
+  /* modifying an interface invalidates the bundle. */
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 9 + 9 + 9);
+  g_assert_true (usbemu_interface_add_endpoint_entries (interfaces[1], entries,
+                                                        NULL));
+
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size, expected, sizeof (expected));
+
+  /* truncated requests share the same buffer. */
+  slice = usbemu_configuration_get_descriptor_bytes_slice (configuration,
+                                                           USBEMU_CONFIGURATION_DESCRIPTOR_SIZE);
+  g_assert_cmpuint (g_bytes_get_size (slice), ==,
+                    USBEMU_CONFIGURATION_DESCRIPTOR_SIZE);
+  g_assert_true (g_bytes_get_data (slice, NULL) == data);
+  g_bytes_unref (slice);
+
+  slice = usbemu_configuration_get_descriptor_bytes_slice (configuration,
+                                                           G_MAXUINT16);
+  g_assert_true (slice == bytes);
+  g_bytes_unref (slice);
+}
+
+static void
+test_interfaces_lookup_1 (void)
+{
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *first[3], *second[2];
+
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+
+  g_assert_null (usbemu_configuration_get_interface (configuration, 0, 0));
+  g_assert_cmpuint (usbemu_configuration_get_n_alternate_settings (configuration, 0),
+                    ==, 0);
+
+  first[0] = usbemu_interface_new ();
+  first[1] = usbemu_interface_new ();
+  first[2] = NULL;
+  second[0] = usbemu_interface_new ();
+  second[1] = NULL;
+  g_test_queue_unref (first[0]);
+  g_test_queue_unref (first[1]);
+  g_test_queue_unref (second[0]);
+  g_assert_cmpint (usbemu_configuration_add_alternate_interfaces (configuration,
+                                                                  first),
+                   ==, 0);
+  g_assert_cmpint (usbemu_configuration_add_alternate_interfaces (configuration,
+                                                                  second),
+                   ==, 1);
+
+  g_assert_cmpuint (usbemu_configuration_get_n_alternate_interfaces (configuration),
+                    ==, 2);
+  g_assert_cmpuint (usbemu_configuration_get_n_alternate_settings (configuration, 0),
+                    ==, 2);
+  g_assert_cmpuint (usbemu_configuration_get_n_alternate_settings (configuration, 1),
+                    ==, 1);
+  g_assert_cmpuint (usbemu_configuration_get_n_alternate_settings (configuration, 2),
+                    ==, 0);
+
+  g_assert_true (usbemu_configuration_get_interface (configuration, 0, 0) ==
+                 first[0]);
+  g_assert_true (usbemu_configuration_get_interface (configuration, 0, 1) ==
+                 first[1]);
+  g_assert_true (usbemu_configuration_get_interface (configuration, 1, 0) ==
+                 second[0]);
+  g_assert_null (usbemu_configuration_get_interface (configuration, 0, 2));
+  g_assert_null (usbemu_configuration_get_interface (configuration, 1, 1));
+  g_assert_null (usbemu_configuration_get_interface (configuration, 2, 0));
+}
+
+static void
+test_interfaces_peek_1 (void)
+{
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[3];
+  UsbemuInterface * const *peeked;
+  guint n_alternate_settings;
+
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+
+  n_alternate_settings = G_MAXUINT;
+  g_assert_null (usbemu_configuration_peek_alternate_interfaces (configuration,
+                                                                 0,
+                                                                 &n_alternate_settings));
+  g_assert_cmpuint (n_alternate_settings, ==, 0);
+
+  interfaces[0] = usbemu_interface_new ();
+  interfaces[1] = usbemu_interface_new ();
+  interfaces[2] = NULL;
+  g_test_queue_unref (interfaces[0]);
+  g_test_queue_unref (interfaces[1]);
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+
+  peeked = usbemu_configuration_peek_alternate_interfaces (configuration, 0,
+                                                           &n_alternate_settings);
+  g_assert_cmpuint (n_alternate_settings, ==, 2);
+  g_assert_true (peeked[0] == interfaces[0]);
+  g_assert_true (peeked[1] == interfaces[1]);
+
+  /* borrowed, no additional references taken. */
+  g_assert_cmpuint (G_OBJECT (interfaces[0])->ref_count, ==, 2);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -203,5 +427,21 @@ main (int   argc,
   g_test_add_func ("/UsbemuConfiguration/properties/max-power",
                    test_properties_max_power_1);
 
+  /* descriptors */
+
+  g_test_add_func ("/UsbemuConfiguration/descriptor/bytes",
+                   test_descriptor_bytes_1);
+  g_test_add_func ("/UsbemuConfiguration/descriptor/bytes-too-large",
+                   test_descriptor_bytes_2);
+  g_test_add_func ("/UsbemuConfiguration/descriptor/bytes-interfaces",
+                   test_descriptor_bytes_interfaces_1);
+
+  /* interfaces */
+
+  g_test_add_func ("/UsbemuConfiguration/interfaces/lookup",
+                   test_interfaces_lookup_1);
+  g_test_add_func ("/UsbemuConfiguration/interfaces/peek",
+                   test_interfaces_peek_1);
+
   return g_test_run ();
 }
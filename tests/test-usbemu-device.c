@@ -20,10 +20,88 @@
 #endif
 
 #include <locale.h>
+#include <string.h>
 #include <glib.h>
 
 #include "usbemu/usbemu.h"
 
+/* Counts calls of the transfer hooks, and optionally emits a signal per
+ * completion to compare the cost of both. */
+#define TEST_TYPE_HOOK_DEVICE (test_hook_device_get_type ())
+G_DECLARE_FINAL_TYPE (TestHookDevice, test_hook_device,
+                      TEST, HOOK_DEVICE, UsbemuDevice)
+
+struct _TestHookDevice {
+  UsbemuDevice parent_instance;
+
+  gboolean emit;
+  guint n_completed;
+  guint n_resets;
+};
+
+G_DEFINE_TYPE (TestHookDevice, test_hook_device, USBEMU_TYPE_DEVICE)
+
+static guint test_hook_device_signal_completed;
+
+static void
+test_hook_device_complete_urb (UsbemuDevice *device,
+                               UsbemuUrb    *urb)
+{
+  TestHookDevice *self = TEST_HOOK_DEVICE (device);
+
+  if (self->emit)
+    g_signal_emit (device, test_hook_device_signal_completed, 0, urb);
+  else
+    self->n_completed++;
+}
+
+static void
+test_hook_device_reset (UsbemuDevice *device)
+{
+  TEST_HOOK_DEVICE (device)->n_resets++;
+}
+
+static void
+test_hook_device_class_init (TestHookDeviceClass *klass)
+{
+  USBEMU_DEVICE_CLASS (klass)->complete_urb = test_hook_device_complete_urb;
+  USBEMU_DEVICE_CLASS (klass)->reset = test_hook_device_reset;
+
+  test_hook_device_signal_completed =
+      g_signal_new ("urb-completed", G_TYPE_FROM_CLASS (klass),
+                    G_SIGNAL_RUN_LAST, 0, NULL, NULL,
+                    g_cclosure_marshal_VOID__POINTER,
+                    G_TYPE_NONE, 1, G_TYPE_POINTER);
+}
+
+static void
+test_hook_device_init (TestHookDevice *device)
+{
+}
+
+static void
+_on_urb_completed (TestHookDevice *device,
+                   UsbemuUrb      *urb,
+                   gpointer        user_data)
+{
+  device->n_completed++;
+}
+
+/* Submit @urb @n times, returns seconds elapsed. */
+static gdouble
+_submit_repeatedly (UsbemuDevice *device,
+                    UsbemuUrb    *urb,
+                    guint         n)
+{
+  guint i;
+
+  g_test_timer_start ();
+  for (i = 0; i < n; i++)
+    usbemu_device_submit_urb (device, urb, NULL, NULL);
+
+  return g_test_timer_elapsed ();
+}
+
 static void
 test_instanciation_new_1 (void)
 {
@@ -51,6 +129,32 @@ test_properties_specification_num_1 (void)
   g_assert_cmpint (usbemu_device_get_specification_num (device), ==, 0x210);
 }
 
+static void
+test_properties_speed_1 (void)
+{
+  UsbemuDevice *device;
+  UsbemuSpeeds speed;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  /* derived from the specification number by default. */
+  g_assert_cmpint (usbemu_device_get_speed (device), ==, USBEMU_SPEED_FULL);
+  usbemu_device_set_specification_num (device, 0x200);
+  g_assert_cmpint (usbemu_device_get_speed (device), ==, USBEMU_SPEED_HIGH);
+  usbemu_device_set_specification_num (device, 0x320);
+  g_assert_cmpint (usbemu_device_get_speed (device), ==, USBEMU_SPEED_SUPER);
+
+  /* explicit, whatever the specification number. */
+  usbemu_device_set_speed (device, USBEMU_SPEED_LOW);
+  g_assert_cmpint (usbemu_device_get_speed (device), ==, USBEMU_SPEED_LOW);
+  g_object_get (device, USBEMU_DEVICE_PROP_SPEED, &speed, NULL);
+  g_assert_cmpint (speed, ==, USBEMU_SPEED_LOW);
+
+  g_object_set (device, USBEMU_DEVICE_PROP_SPEED, USBEMU_SPEED_UNKNOWN, NULL);
+  g_assert_cmpint (usbemu_device_get_speed (device), ==, USBEMU_SPEED_SUPER);
+}
+
 static void
 test_properties_class_1 (void)
 {
@@ -263,6 +367,862 @@ test_properties_serial_1 (void)
   }
 }
 
+static void
+test_descriptor_bytes_1 (void)
+{
+  const guint8 expected[USBEMU_DEVICE_DESCRIPTOR_SIZE] = {
+    USBEMU_DEVICE_DESCRIPTOR_SIZE, USBEMU_DESCRIPTOR_TYPE_DEVICE,
+    0x00, 0x01, /* bcdUSB */
+    USBEMU_CLASS_USE_INTERFACE_DESCRIPTOR,
+    USBEMU_SUB_CLASS_USE_INTERFACE_DESCRIPTOR,
+    USBEMU_PROTOCOL_USE_INTERFACE_DESCRIPTOR,
+    0x00, /* bMaxPacketSize0 */
+    0xad, 0xde, /* idVendor */
+    0xef, 0xbe, /* idProduct */
+    0x00, 0x01, /* bcdDevice */
+    0x01, 0x02, 0x03, /* iManufacturer, iProduct, iSerialNumber */
+    0x00, /* bNumConfigurations */
+  };
+  UsbemuDevice *device;
+  GBytes *bytes;
+  gsize size;
+  gconstpointer data;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  bytes = usbemu_device_get_descriptor_bytes (device);
+  g_assert_nonnull (bytes);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size, expected, sizeof (expected));
+
+  /* cached until modified. */
+  g_assert_true (usbemu_device_get_descriptor_bytes (device) == bytes);
+}
+
+static void
+test_descriptor_bytes_invalidate_1 (void)
+{
+  UsbemuDevice *device;
+  UsbemuConfiguration *configuration;
+  GBytes *bytes;
+  const guint8 *data;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  bytes = g_bytes_ref (usbemu_device_get_descriptor_bytes (device));
+  usbemu_device_set_vendor_id (device, 0x1234);
+  g_assert_true (usbemu_device_get_descriptor_bytes (device) != bytes);
+  g_bytes_unref (bytes);
+
+  data = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device), NULL);
+  g_assert_cmphex (data[8], ==, 0x34);
+  g_assert_cmphex (data[9], ==, 0x12);
+
+  usbemu_device_set_specification_num (device, 0x210);
+  usbemu_device_set_max_packet_size (device, 64);
+  data = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device), NULL);
+  g_assert_cmphex (data[2], ==, 0x10);
+  g_assert_cmphex (data[3], ==, 0x02);
+  g_assert_cmpuint (data[7], ==, 64);
+
+  configuration = usbemu_configuration_new ();
+  g_assert_true (usbemu_device_add_configuration (device, configuration));
+  g_object_unref (configuration);
+  data = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device), NULL);
+  g_assert_cmpuint (data[17], ==, 1);
+}
+
+static void
+test_descriptor_strings_1 (void)
+{
+  const guint8 languages[] = { 0x04, USBEMU_DESCRIPTOR_TYPE_STRING, 0x09, 0x04 };
+  const guint8 manufacturer[] = {
+    0x0E, USBEMU_DESCRIPTOR_TYPE_STRING,
+    'u', 0, 's', 0, 'b', 0, 'e', 0, 'm', 0, 'u', 0,
+  };
+  UsbemuDevice *device;
+  GBytes *bytes;
+  gsize size;
+  gconstpointer data;
+  const guint8 *descriptor;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  bytes = usbemu_device_get_string_descriptor_bytes (device, 0,
+                                                     USBEMU_LANGID_ENGLISH_US);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size, languages, sizeof (languages));
+
+  /* default strings have indexes assigned. */
+  descriptor = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device),
+                                 NULL);
+  g_assert_cmpuint (descriptor[14], ==, 1);
+  g_assert_cmpuint (descriptor[15], ==, 2);
+  g_assert_cmpuint (descriptor[16], ==, 3);
+
+  bytes = usbemu_device_get_string_descriptor_bytes (device, descriptor[14],
+                                                     USBEMU_LANGID_ENGLISH_US);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size, manufacturer, sizeof (manufacturer));
+  g_assert_null (usbemu_device_get_string_descriptor_bytes (device, 4,
+                                                            USBEMU_LANGID_ENGLISH_US));
+
+  /* identical strings share an index, and free slots are reused. */
+  usbemu_device_set_product_name (device, PACKAGE_NAME);
+  descriptor = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device),
+                                 NULL);
+  g_assert_cmpuint (descriptor[15], ==, 1);
+  g_assert_null (usbemu_device_get_string_descriptor_bytes (device, 2,
+                                                            USBEMU_LANGID_ENGLISH_US));
+  usbemu_device_set_serial (device, NULL);
+  descriptor = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device),
+                                 NULL);
+  g_assert_cmpuint (descriptor[16], ==, 0);
+}
+
+static void
+test_descriptor_strings_2 (void)
+{
+  UsbemuDevice *device;
+  GString *name;
+  GBytes *bytes;
+  const guint8 *data;
+  const guint8 *descriptor;
+  gsize size;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  /* 126 UTF-16 code units fill the largest descriptor. */
+  name = g_string_new (NULL);
+  g_string_append_printf (name, "%0124d", 0);
+  g_string_append_unichar (name, 0x1F600);
+  usbemu_device_set_product_name (device, name->str);
+  descriptor = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device),
+                                 NULL);
+  bytes = usbemu_device_get_string_descriptor_bytes (device, descriptor[15],
+                                                     USBEMU_LANGID_ENGLISH_US);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpuint (size, ==, 254);
+  g_assert_cmpuint (data[0], ==, 254);
+  g_assert_cmpuint (data[250] | (data[251] << 8), ==, 0xD83D);
+  g_assert_cmpuint (data[252] | (data[253] << 8), ==, 0xDE00);
+
+  /* one more unit, the surrogate pair is dropped as a whole. */
+  g_string_prepend_c (name, '0');
+  usbemu_device_set_product_name (device, name->str);
+  descriptor = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device),
+                                 NULL);
+  bytes = usbemu_device_get_string_descriptor_bytes (device, descriptor[15],
+                                                     USBEMU_LANGID_ENGLISH_US);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpuint (size, ==, 252);
+  g_assert_cmpuint (data[0], ==, 252);
+  g_assert_cmpuint (data[250], ==, '0');
+
+  g_string_free (name, TRUE);
+}
+
+static void
+test_descriptor_strings_languages_1 (void)
+{
+  const guint16 langids[] = { USBEMU_LANGID_ENGLISH_US, 0x0407 };
+  const guint8 languages[] = {
+    0x06, USBEMU_DESCRIPTOR_TYPE_STRING, 0x09, 0x04, 0x07, 0x04,
+  };
+  const guint8 translated[] = {
+    0x08, USBEMU_DESCRIPTOR_TYPE_STRING, 'G', 0, 'e', 0, 'r', 0,
+  };
+  UsbemuDevice *device;
+  UsbemuConfiguration *configuration;
+  GBytes *bytes;
+  gsize size, n_langids;
+  gconstpointer data;
+  const guint8 *descriptor;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  usbemu_device_set_languages (device, langids, G_N_ELEMENTS (langids));
+  g_assert_true (usbemu_device_get_languages (device, &n_langids) != NULL);
+  g_assert_cmpuint (n_langids, ==, G_N_ELEMENTS (langids));
+  bytes = usbemu_device_get_string_descriptor_bytes (device, 0, 0);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size, languages, sizeof (languages));
+
+  /* configuration names are interned when added to a device. */
+  configuration = usbemu_configuration_new_full ("Eng", 0, 0);
+  g_assert_true (usbemu_device_add_configuration (device, configuration));
+  g_object_unref (configuration);
+  descriptor =
+      g_bytes_get_data (usbemu_configuration_get_descriptor_bytes (configuration),
+                        NULL);
+  g_assert_cmpuint (descriptor[6], ==, 4);
+
+  usbemu_device_set_string_translation (device, 0x0407, "Eng", "Ger");
+  bytes = usbemu_device_get_string_descriptor_bytes (device, 4, 0x0407);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size, translated, sizeof (translated));
+
+  /* unsupported languages fall back to the default one. */
+  bytes = usbemu_device_get_string_descriptor_bytes (device, 4, 0x0411);
+  g_assert_cmpuint (((const guint8*) g_bytes_get_data (bytes, NULL))[2], ==,
+                    'E');
+}
+
+static void
+test_configurations_peek_1 (void)
+{
+  UsbemuDevice *device;
+  UsbemuConfiguration *configurations[2];
+  UsbemuConfiguration * const *peeked;
+  guint n_configurations;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  n_configurations = G_MAXUINT;
+  usbemu_device_peek_configurations (device, &n_configurations);
+  g_assert_cmpuint (n_configurations, ==, 0);
+
+  configurations[0] = usbemu_configuration_new ();
+  configurations[1] = usbemu_configuration_new ();
+  g_test_queue_unref (configurations[0]);
+  g_test_queue_unref (configurations[1]);
+  g_assert_true (usbemu_device_add_configuration (device, configurations[0]));
+  g_assert_true (usbemu_device_add_configuration (device, configurations[1]));
+
+  peeked = usbemu_device_peek_configurations (device, &n_configurations);
+  g_assert_cmpuint (n_configurations, ==, 2);
+  g_assert_true (peeked[0] == configurations[0]);
+  g_assert_true (peeked[1] == configurations[1]);
+  g_assert_true (usbemu_device_get_configuration (device, 2) == peeked[1]);
+}
+
+static void
+test_configurations_routing_1 (void)
+{
+  const UsbemuEndpointEntry alt0_entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_INTERRUPT, 0, 8, 0, 10000 },
+    { 0, },
+  };
+  const UsbemuEndpointEntry alt1_entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_OUT,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { 0, },
+  };
+  UsbemuDevice *device;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[3];
+  UsbemuEndpointEntry entry;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+  interfaces[0] = usbemu_interface_new ();
+  interfaces[1] = usbemu_interface_new ();
+  interfaces[2] = NULL;
+  g_test_queue_unref (interfaces[0]);
+  g_test_queue_unref (interfaces[1]);
+  g_assert_true (usbemu_interface_add_endpoint_entries (interfaces[0],
+                                                        alt0_entries, NULL));
+  g_assert_true (usbemu_interface_add_endpoint_entries (interfaces[1],
+                                                        alt1_entries, NULL));
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (device, configuration);
+
+  /* not configured. */
+  g_assert_cmpuint (usbemu_device_get_active_configuration (device), ==, 0);
+  g_assert_null (usbemu_device_lookup_endpoint (device, 0x81, NULL));
+  g_assert_false (usbemu_device_set_alternate_setting (device, 0, 1));
+  g_assert_false (usbemu_device_set_active_configuration (device, 2));
+
+  g_assert_true (usbemu_device_set_active_configuration (device, 1));
+  g_assert_cmpuint (usbemu_device_get_active_configuration (device), ==, 1);
+  g_assert_true (usbemu_device_lookup_endpoint (device, 0x81, &entry) ==
+                 interfaces[0]);
+  g_assert_cmpint (entry.transfer, ==, USBEMU_ENDPOINT_TRANSFER_INTERRUPT);
+  g_assert_null (usbemu_device_lookup_endpoint (device, 0x01, NULL));
+  g_assert_null (usbemu_device_lookup_endpoint (device, 0x00, NULL));
+
+  g_assert_false (usbemu_device_set_alternate_setting (device, 0, 2));
+  g_assert_false (usbemu_device_set_alternate_setting (device, 1, 0));
+  g_assert_true (usbemu_device_set_alternate_setting (device, 0, 1));
+  g_assert_cmpuint (usbemu_device_get_alternate_setting (device, 0), ==, 1);
+  g_assert_true (usbemu_device_lookup_endpoint (device, 0x81, &entry) ==
+                 interfaces[1]);
+  g_assert_cmpint (entry.transfer, ==, USBEMU_ENDPOINT_TRANSFER_BULK);
+  g_assert_true (usbemu_device_lookup_endpoint (device, 0x01, &entry) ==
+                 interfaces[1]);
+  g_assert_cmpint (entry.direction, ==, USBEMU_ENDPOINT_DIRECTION_OUT);
+
+  /* SET_CONFIGURATION resets alternate settings. */
+  g_assert_true (usbemu_device_set_active_configuration (device, 1));
+  g_assert_cmpuint (usbemu_device_get_alternate_setting (device, 0), ==, 0);
+  g_assert_true (usbemu_device_lookup_endpoint (device, 0x81, NULL) ==
+                 interfaces[0]);
+
+  g_assert_true (usbemu_device_set_active_configuration (device, 0));
+  g_assert_null (usbemu_device_lookup_endpoint (device, 0x81, NULL));
+}
+
+static const guint8 import_descriptors[] = {
+  /* device */
+  0x12, USBEMU_DESCRIPTOR_TYPE_DEVICE, 0x10, 0x01, 0x00, 0x00, 0x00, 0x40,
+  0x34, 0x12, 0x78, 0x56, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+  /* configuration */
+  0x09, USBEMU_DESCRIPTOR_TYPE_CONFIGURATION, 0x3A, 0x00, 0x01, 0x01, 0x00,
+  0x80, 0x32,
+  /* class specific, kept with the configuration */
+  0x04, 0x24, 0x01, 0x02,
+  /* interface 0, alternate setting 0 */
+  0x09, USBEMU_DESCRIPTOR_TYPE_INTERFACE, 0x00, 0x00, 0x01, 0x03, 0x01, 0x01,
+  0x00,
+  /* HID, kept with the interface */
+  0x09, 0x21, 0x11, 0x01, 0x00, 0x01, 0x22, 0x3F, 0x00,
+  0x07, USBEMU_DESCRIPTOR_TYPE_ENDPOINT, 0x81, 0x03, 0x08, 0x00, 0x0A,
+  /* class specific, kept with the endpoint */
+  0x04, 0x25, 0x01, 0x00,
+  /* interface 0, alternate setting 1 */
+  0x09, USBEMU_DESCRIPTOR_TYPE_INTERFACE, 0x00, 0x01, 0x01, 0xFF, 0x00, 0x00,
+  0x00,
+  0x07, USBEMU_DESCRIPTOR_TYPE_ENDPOINT, 0x82, 0x05, 0x00, 0x02, 0x01,
+};
+
+static void
+test_descriptor_import_1 (void)
+{
+  UsbemuDevice *device;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interface;
+  const UsbemuEndpointEntry *entries;
+  GBytes *bytes;
+  GError *error = NULL;
+  gsize size;
+  gconstpointer data;
+
+  device = usbemu_device_new_from_descriptors (import_descriptors,
+                                               sizeof (import_descriptors),
+                                               &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (device);
+  g_test_queue_unref (device);
+
+  g_assert_cmpuint (usbemu_device_get_vendor_id (device), ==, 0x1234);
+  g_assert_cmpuint (usbemu_device_get_product_id (device), ==, 0x5678);
+  g_assert_null (usbemu_device_get_product_name (device));
+  g_assert_cmpuint (usbemu_device_get_n_configurations (device), ==, 1);
+
+  configuration = usbemu_device_get_configuration (device, 1);
+  g_assert_cmpuint (usbemu_configuration_get_max_power (configuration), ==,
+                    100);
+  g_assert_cmpuint (usbemu_configuration_get_n_alternate_settings (configuration, 0),
+                    ==, 2);
+
+  interface = usbemu_configuration_get_interface (configuration, 0, 0);
+  g_assert_cmpuint (usbemu_interface_get_class (interface), ==,
+                    USBEMU_CLASS_HID);
+  entries = usbemu_interface_get_endpoint_entries (interface);
+  g_assert_cmpuint (entries[0].endpoint_number, ==, USBEMU_EP_1);
+  g_assert_cmpuint (entries[0].direction, ==, USBEMU_ENDPOINT_DIRECTION_IN);
+  g_assert_cmpuint (entries[0].transfer, ==,
+                    USBEMU_ENDPOINT_TRANSFER_INTERRUPT);
+  g_assert_cmpuint (entries[0].max_packet_size, ==, 8);
+  g_assert_cmpuint (entries[0].interval, ==, 10000);
+  g_assert_cmpuint (entries[1].endpoint_number, ==, 0);
+  g_assert_cmpuint (g_bytes_get_size (usbemu_interface_get_extra_descriptors (interface)),
+                    ==, 9);
+
+  interface = usbemu_configuration_get_interface (configuration, 0, 1);
+  entries = usbemu_interface_get_endpoint_entries (interface);
+  g_assert_cmpuint (entries[0].transfer, ==,
+                    USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS);
+  g_assert_cmpuint (entries[0].attributes, ==,
+                    USBEMU_ENDPOINT_ISOCHRONOUS_SYNC_ASYNC);
+  g_assert_cmpuint (entries[0].max_packet_size, ==, 512);
+
+  /* re-emitted verbatim. */
+  bytes = usbemu_device_get_descriptor_bytes (device);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size, import_descriptors,
+                   USBEMU_DEVICE_DESCRIPTOR_SIZE);
+
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size,
+                   import_descriptors + USBEMU_DEVICE_DESCRIPTOR_SIZE,
+                   sizeof (import_descriptors) - USBEMU_DEVICE_DESCRIPTOR_SIZE);
+}
+
+static const guint8 import_long_descriptors[] = {
+  /* device */
+  0x12, USBEMU_DESCRIPTOR_TYPE_DEVICE, 0x10, 0x01, 0x00, 0x00, 0x00, 0x40,
+  0x34, 0x12, 0x78, 0x56, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+  /* configuration */
+  0x09, USBEMU_DESCRIPTOR_TYPE_CONFIGURATION, 0x2C, 0x00, 0x01, 0x01, 0x00,
+  0x80, 0x32,
+  /* interface 0, alternate setting 0, with a trailing byte */
+  0x0A, USBEMU_DESCRIPTOR_TYPE_INTERFACE, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00,
+  0x00, 0xA5,
+  /* interface 0, alternate setting 1 */
+  0x09, USBEMU_DESCRIPTOR_TYPE_INTERFACE, 0x00, 0x01, 0x01, 0x01, 0x02, 0x00,
+  0x00,
+  /* audio 1.0 endpoint with bRefresh and bSynchAddress */
+  0x09, USBEMU_DESCRIPTOR_TYPE_ENDPOINT, 0x01, 0x09, 0xC8, 0x00, 0x01, 0x00,
+  0x00,
+  /* class specific, kept with the endpoint */
+  0x07, 0x25, 0x01, 0x00, 0x00, 0x00, 0x00,
+};
+
+static void
+test_descriptor_import_2 (void)
+{
+  UsbemuDevice *device;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interface;
+  const UsbemuEndpointEntry *entries;
+  GBytes *bytes;
+  GError *error = NULL;
+  gsize size;
+  gconstpointer data;
+
+  device = usbemu_device_new_from_descriptors (import_long_descriptors,
+                                               sizeof (import_long_descriptors),
+                                               &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (device);
+  g_test_queue_unref (device);
+
+  configuration = usbemu_device_get_configuration (device, 1);
+  interface = usbemu_configuration_get_interface (configuration, 0, 1);
+  entries = usbemu_interface_get_endpoint_entries (interface);
+  g_assert_cmpuint (entries[0].transfer, ==,
+                    USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS);
+  g_assert_cmpuint (entries[0].max_packet_size, ==, 200);
+  g_assert_cmpuint (g_bytes_get_size (usbemu_interface_get_endpoint_extra_descriptors (interface,
+                                                                                     USBEMU_EP_1,
+                                                                                     USBEMU_ENDPOINT_DIRECTION_OUT)),
+                    ==, 7);
+
+  /* bLength and trailing fields are kept. */
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  data = g_bytes_get_data (bytes, &size);
+  g_assert_cmpmem (data, size,
+                   import_long_descriptors + USBEMU_DEVICE_DESCRIPTOR_SIZE,
+                   sizeof (import_long_descriptors) -
+                       USBEMU_DEVICE_DESCRIPTOR_SIZE);
+}
+
+static void
+test_descriptor_import_invalid_1 (void)
+{
+  guint8 descriptors[sizeof (import_descriptors)];
+  UsbemuDevice *device;
+  GError *error = NULL;
+
+  /* truncated */
+  device = usbemu_device_new_from_descriptors (import_descriptors,
+                                               sizeof (import_descriptors) - 1,
+                                               &error);
+  g_assert_null (device);
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR);
+  g_clear_error (&error);
+
+  /* wTotalLength splitting a descriptor */
+  memcpy (descriptors, import_descriptors, sizeof (descriptors));
+  descriptors[20] = 0x30;
+  device = usbemu_device_new_from_descriptors (descriptors,
+                                               sizeof (descriptors), &error);
+  g_assert_null (device);
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR);
+  g_clear_error (&error);
+
+  /* zero length descriptor */
+  memcpy (descriptors, import_descriptors, sizeof (descriptors));
+  descriptors[27] = 0x00;
+  device = usbemu_device_new_from_descriptors (descriptors,
+                                               sizeof (descriptors), &error);
+  g_assert_null (device);
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR);
+  g_clear_error (&error);
+
+  /* bNumEndpoints mismatch */
+  memcpy (descriptors, import_descriptors, sizeof (descriptors));
+  descriptors[35] = 0x02;
+  device = usbemu_device_new_from_descriptors (descriptors,
+                                               sizeof (descriptors), &error);
+  g_assert_null (device);
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR);
+  g_clear_error (&error);
+
+  /* alternate setting out of order */
+  memcpy (descriptors, import_descriptors, sizeof (descriptors));
+  descriptors[63] = 0x02;
+  device = usbemu_device_new_from_descriptors (descriptors,
+                                               sizeof (descriptors), &error);
+  g_assert_null (device);
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR);
+  g_clear_error (&error);
+}
+
+static void
+test_template_1 (void)
+{
+  UsbemuDevice *template_device, *device, *other, *owner;
+  UsbemuConfiguration *configuration, *shared, *copy;
+  UsbemuInterface *interfaces[2];
+  GBytes *bytes, *template_bytes;
+  guint8 index;
+
+  template_device = usbemu_device_new ();
+  g_test_queue_unref (template_device);
+  usbemu_device_set_vendor_id (template_device, 0x1234);
+
+  configuration = usbemu_configuration_new_full ("config", 0, 100);
+  g_test_queue_unref (configuration);
+  interfaces[0] = usbemu_interface_new_full ("interface",
+                                             USBEMU_CLASS_VENDOR_SPECIFIC,
+                                             0, 0);
+  interfaces[1] = NULL;
+  g_test_queue_unref (interfaces[0]);
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (template_device, configuration);
+
+  device = usbemu_device_new_from_template (template_device);
+  g_test_queue_unref (device);
+  g_assert_cmpuint (usbemu_device_get_vendor_id (device), ==, 0x1234);
+  g_assert_cmpstr (usbemu_device_get_serial (device), ==,
+                   usbemu_device_get_serial (template_device));
+
+  /* configurations are shared, as copies left to the template. */
+  other = usbemu_device_new_from_template (template_device);
+  g_test_queue_unref (other);
+  shared = usbemu_device_peek_configurations (device, NULL)[0];
+  g_assert_true (shared != configuration);
+  g_assert_true (usbemu_device_peek_configurations (other, NULL)[0] == shared);
+
+  /* per device strings do not leak into the template. */
+  usbemu_device_set_serial (device, "instance");
+  g_assert_cmpstr (usbemu_device_get_serial (template_device), !=, "instance");
+  index = ((const guint8*) g_bytes_get_data (usbemu_device_get_descriptor_bytes (device),
+                                             NULL))[16];
+  bytes = usbemu_device_get_string_descriptor_bytes (device, index,
+                                                     USBEMU_LANGID_ENGLISH_US);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 2 + 8 * 2);
+  g_assert_cmpuint (((const guint8*) g_bytes_get_data (bytes, NULL))[2], ==,
+                    'i');
+  index = ((const guint8*) g_bytes_get_data (usbemu_device_get_descriptor_bytes (template_device),
+                                             NULL))[16];
+  bytes = usbemu_device_get_string_descriptor_bytes (template_device, index,
+                                                     USBEMU_LANGID_ENGLISH_US);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 2 + 32 * 2);
+
+  /* copied on first access, with identical descriptors. */
+  copy = usbemu_device_get_configuration (device, 1);
+  g_assert_true (copy != shared);
+  owner = usbemu_configuration_get_device (copy);
+  g_assert_true (owner == device);
+  g_object_unref (owner);
+  g_assert_true (usbemu_device_peek_configurations (other, NULL)[0] == shared);
+  g_assert_true (usbemu_device_get_configuration (template_device, 1) ==
+                 configuration);
+  template_bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  bytes = usbemu_configuration_get_descriptor_bytes (copy);
+  g_assert_true (g_bytes_equal (bytes, template_bytes));
+  bytes = usbemu_configuration_get_descriptor_bytes (shared);
+  g_assert_true (g_bytes_equal (bytes, template_bytes));
+}
+
+static void
+test_template_2 (void)
+{
+  UsbemuDevice *template_device, *device, *other, *owner;
+  UsbemuConfiguration *configuration, *shared, *copy;
+  UsbemuInterface *interfaces[2];
+  GBytes *bytes;
+  guint8 index;
+
+  template_device = usbemu_device_new ();
+  g_test_queue_unref (template_device);
+
+  configuration = usbemu_configuration_new_full ("config", 0, 100);
+  g_test_queue_unref (configuration);
+  interfaces[0] = usbemu_interface_new ();
+  interfaces[1] = NULL;
+  g_test_queue_unref (interfaces[0]);
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (template_device, configuration);
+
+  device = usbemu_device_new_from_template (template_device);
+  g_test_queue_unref (device);
+  usbemu_device_set_serial (device, "instance");
+
+  /* the template still modifies its own configurations, */
+  usbemu_configuration_set_name (configuration, "renamed");
+  usbemu_interface_set_class (interfaces[0], USBEMU_CLASS_HID);
+  g_assert_cmpstr (usbemu_configuration_get_name (configuration), ==,
+                   "renamed");
+  owner = usbemu_configuration_get_device (configuration);
+  g_assert_true (owner == template_device);
+  g_object_unref (owner);
+
+  /* unseen by devices created before, which still resolve the old name, */
+  shared = usbemu_device_peek_configurations (device, NULL)[0];
+  g_assert_cmpstr (usbemu_configuration_get_name (shared), ==, "config");
+  g_assert_cmpuint (usbemu_interface_get_class (usbemu_configuration_get_interface (shared, 0, 0)),
+                    !=, USBEMU_CLASS_HID);
+  index = ((const guint8*) g_bytes_get_data (usbemu_configuration_get_descriptor_bytes (shared),
+                                             NULL))[6];
+  bytes = usbemu_device_get_string_descriptor_bytes (device, index,
+                                                     USBEMU_LANGID_ENGLISH_US);
+  g_assert_nonnull (bytes);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 2 + 6 * 2);
+  g_assert_cmpuint (((const guint8*) g_bytes_get_data (bytes, NULL))[2], ==,
+                    'c');
+
+  /* but seen by those created after. */
+  other = usbemu_device_new_from_template (template_device);
+  g_test_queue_unref (other);
+  shared = usbemu_device_peek_configurations (other, NULL)[0];
+  g_assert_cmpstr (usbemu_configuration_get_name (shared), ==, "renamed");
+  index = ((const guint8*) g_bytes_get_data (usbemu_configuration_get_descriptor_bytes (shared),
+                                             NULL))[6];
+  bytes = usbemu_device_get_string_descriptor_bytes (other, index,
+                                                     USBEMU_LANGID_ENGLISH_US);
+  g_assert_nonnull (bytes);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 2 + 7 * 2);
+  g_assert_cmpuint (((const guint8*) g_bytes_get_data (bytes, NULL))[2], ==,
+                    'r');
+
+  /* Devices modify the copies they get on first access. */
+  copy = usbemu_device_get_configuration (device, 1);
+  usbemu_configuration_set_max_power (copy, 200);
+  owner = usbemu_configuration_get_device (copy);
+  g_assert_true (owner == device);
+  g_object_unref (owner);
+  g_assert_cmpuint (usbemu_configuration_get_max_power (shared), ==, 100);
+  g_assert_cmpuint (usbemu_configuration_get_max_power (configuration), ==,
+                    100);
+
+  /* Only shared copies themselves are read-only. */
+  g_assert_null (usbemu_configuration_get_device (shared));
+  g_test_expect_message ("usbemu", G_LOG_LEVEL_CRITICAL,
+                         "*assertion*shared*failed*");
+  usbemu_configuration_set_name (shared, "modified");
+  g_test_assert_expected_messages ();
+  g_assert_cmpstr (usbemu_configuration_get_name (shared), ==, "renamed");
+}
+
+static void
+test_template_3 (void)
+{
+  const guint16 langids[] = { USBEMU_LANGID_ENGLISH_US, 0x0407 };
+  UsbemuDevice *template_device, *device;
+  GBytes *bytes;
+  const guint8 *descriptor;
+  guint8 index;
+
+  template_device = usbemu_device_new ();
+  g_test_queue_unref (template_device);
+  usbemu_device_set_manufacturer_name (template_device, "shared");
+
+  device = usbemu_device_new_from_template (template_device);
+  g_test_queue_unref (device);
+
+  /* references taken on inherited strings survive the merge of the
+   * overlay, and so does the string while any is left. */
+  usbemu_device_set_product_name (device, "shared");
+  descriptor = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device),
+                                 NULL);
+  index = descriptor[14];
+  g_assert_cmpuint (descriptor[15], ==, index);
+  usbemu_device_set_languages (device, langids, G_N_ELEMENTS (langids));
+  usbemu_device_set_product_name (device, NULL);
+
+  bytes = usbemu_device_get_string_descriptor_bytes (device, index,
+                                                     USBEMU_LANGID_ENGLISH_US);
+  g_assert_nonnull (bytes);
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 2 + 6 * 2);
+
+  usbemu_device_set_manufacturer_name (device, NULL);
+  g_assert_null (usbemu_device_get_string_descriptor_bytes (device, index,
+                                                            USBEMU_LANGID_ENGLISH_US));
+
+  /* the template keeps its own. */
+  g_assert_nonnull (usbemu_device_get_string_descriptor_bytes (template_device,
+                                                               index,
+                                                               USBEMU_LANGID_ENGLISH_US));
+}
+
+static void
+test_validate_1 (void)
+{
+  const UsbemuEndpointEntry entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { USBEMU_EP_2, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_INTERRUPT, 0, 8, 0, 10000 },
+    { 0, },
+  };
+  UsbemuDevice *device;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[2];
+  GError *error = NULL;
+
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+  usbemu_device_set_specification_num (device, 0x110);
+
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+  interfaces[0] = usbemu_interface_new ();
+  interfaces[1] = NULL;
+  g_test_queue_unref (interfaces[0]);
+  g_assert_true (usbemu_interface_add_endpoint_entries (interfaces[0], entries,
+                                                        NULL));
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (device, configuration);
+
+  g_assert_true (usbemu_device_validate (device, &error));
+  g_assert_no_error (error);
+
+  /* full-speed bulk max packet size is not valid at high-speed. */
+  usbemu_device_set_specification_num (device, 0x200);
+  g_assert_false (usbemu_device_validate (device, &error));
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR);
+  g_clear_error (&error);
+}
+
+static void
+test_validate_2 (void)
+{
+  const UsbemuEndpointEntry entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { USBEMU_EP_2, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_INTERRUPT, 0, 8, 0, 10000 },
+    { 0, },
+  };
+  UsbemuDevice *device;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[2];
+  const guint8 *data;
+  GError *error = NULL;
+
+  /* full-speed device compliant with USB 2.0. */
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+  usbemu_device_set_specification_num (device, 0x200);
+  usbemu_device_set_speed (device, USBEMU_SPEED_FULL);
+
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+  interfaces[0] = usbemu_interface_new ();
+  interfaces[1] = NULL;
+  g_test_queue_unref (interfaces[0]);
+  g_assert_true (usbemu_interface_add_endpoint_entries (interfaces[0], entries,
+                                                        NULL));
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (device, configuration);
+
+  g_assert_true (usbemu_device_validate (device, &error));
+  g_assert_no_error (error);
+
+  /* bInterval of the interrupt endpoint counts 1 ms frames. */
+  data = g_bytes_get_data (usbemu_configuration_get_descriptor_bytes (configuration),
+                           NULL);
+  g_assert_cmpuint (data[9 + 9 + 7 + 6], ==, 10);
+
+  /* low-speed devices have no bulk endpoints. */
+  usbemu_device_set_speed (device, USBEMU_SPEED_LOW);
+  g_assert_false (usbemu_device_validate (device, &error));
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR);
+  g_clear_error (&error);
+
+  /* and the interval is reencoded on speed changes. */
+  usbemu_device_set_speed (device, USBEMU_SPEED_HIGH);
+  data = g_bytes_get_data (usbemu_configuration_get_descriptor_bytes (configuration),
+                           NULL);
+  g_assert_cmpuint (data[9 + 9 + 7 + 6], ==, 7);
+}
+
+static void
+test_hooks_complete_1 (void)
+{
+  TestHookDevice *device;
+  UsbemuUrb *urb;
+
+  device = g_object_new (TEST_TYPE_HOOK_DEVICE, NULL);
+  g_test_queue_unref (device);
+  urb = usbemu_urb_new (0x81, 8, 0);
+  g_test_queue_destroy ((GDestroyNotify) usbemu_urb_unref, urb);
+
+  /* detached, so completed right away. */
+  _submit_repeatedly (USBEMU_DEVICE (device), urb, 16);
+  g_assert_cmpuint (device->n_completed, ==, 16);
+  g_assert_cmpint (urb->status, ==, USBEMU_URB_STATUS_SHUTDOWN);
+}
+
+static void
+test_hooks_reset_1 (void)
+{
+  TestHookDevice *device;
+  UsbemuConfiguration *configuration;
+
+  device = g_object_new (TEST_TYPE_HOOK_DEVICE, NULL);
+  g_test_queue_unref (device);
+  configuration = usbemu_configuration_new ();
+  g_test_queue_unref (configuration);
+  usbemu_device_add_configuration (USBEMU_DEVICE (device), configuration);
+
+  g_assert_true (usbemu_device_set_active_configuration (USBEMU_DEVICE (device),
+                                                         1));
+  usbemu_device_reset (USBEMU_DEVICE (device));
+  g_assert_cmpuint (device->n_resets, ==, 1);
+  g_assert_cmpuint (usbemu_device_get_active_configuration (USBEMU_DEVICE (device)),
+                    ==, 0);
+  g_assert_cmpuint (usbemu_device_get_address (USBEMU_DEVICE (device)), ==, 0);
+}
+
+static void
+test_perf_hooks_1 (void)
+{
+  const guint n = 1000000;
+  TestHookDevice *device;
+  UsbemuUrb *urb;
+  gdouble hook, signal;
+
+  device = g_object_new (TEST_TYPE_HOOK_DEVICE, NULL);
+  g_test_queue_unref (device);
+  urb = usbemu_urb_new (0x81, 8, 0);
+  g_test_queue_destroy ((GDestroyNotify) usbemu_urb_unref, urb);
+
+  hook = _submit_repeatedly (USBEMU_DEVICE (device), urb, n);
+  g_assert_cmpuint (device->n_completed, ==, n);
+
+  device->emit = TRUE;
+  device->n_completed = 0;
+  g_signal_connect (device, "urb-completed", G_CALLBACK (_on_urb_completed),
+                    NULL);
+  signal = _submit_repeatedly (USBEMU_DEVICE (device), urb, n);
+  g_assert_cmpuint (device->n_completed, ==, n);
+
+  g_test_minimized_result (hook * 1e9 / n,
+                           "submit and complete with hook: %.1f ns/URB",
+                           hook * 1e9 / n);
+  g_test_minimized_result (signal * 1e9 / n,
+                           "submit and complete with signal: %.1f ns/URB",
+                           signal * 1e9 / n);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -282,6 +1242,9 @@ main (int   argc,
   /* specification-num */
   g_test_add_func ("/UsbemuDevice/properties/specification-num",
                    test_properties_specification_num_1);
+  /* speed */
+  g_test_add_func ("/UsbemuDevice/properties/speed",
+                   test_properties_speed_1);
   /* class code */
   g_test_add_func ("/UsbemuDevice/properties/class",
                    test_properties_class_1);
@@ -313,5 +1276,60 @@ main (int   argc,
   g_test_add_func ("/UsbemuDevice/properties/serial",
                    test_properties_serial_1);
 
+  /* descriptors */
+
+  g_test_add_func ("/UsbemuDevice/descriptor/bytes",
+                   test_descriptor_bytes_1);
+  g_test_add_func ("/UsbemuDevice/descriptor/bytes-invalidate",
+                   test_descriptor_bytes_invalidate_1);
+  g_test_add_func ("/UsbemuDevice/descriptor/strings",
+                   test_descriptor_strings_1);
+  g_test_add_func ("/UsbemuDevice/descriptor/strings-truncated",
+                   test_descriptor_strings_2);
+  g_test_add_func ("/UsbemuDevice/descriptor/strings-languages",
+                   test_descriptor_strings_languages_1);
+  g_test_add_func ("/UsbemuDevice/descriptor/import",
+                   test_descriptor_import_1);
+  g_test_add_func ("/UsbemuDevice/descriptor/import-long",
+                   test_descriptor_import_2);
+  g_test_add_func ("/UsbemuDevice/descriptor/import-invalid",
+                   test_descriptor_import_invalid_1);
+
+  /* validation */
+
+  g_test_add_func ("/UsbemuDevice/validate",
+                   test_validate_1);
+  g_test_add_func ("/UsbemuDevice/validate/speed",
+                   test_validate_2);
+
+  /* templates */
+
+  g_test_add_func ("/UsbemuDevice/template",
+                   test_template_1);
+  g_test_add_func ("/UsbemuDevice/template/copy-on-write",
+                   test_template_2);
+  g_test_add_func ("/UsbemuDevice/template/strings",
+                   test_template_3);
+
+  /* configurations */
+
+  g_test_add_func ("/UsbemuDevice/configurations/peek",
+                   test_configurations_peek_1);
+  g_test_add_func ("/UsbemuDevice/configurations/routing",
+                   test_configurations_routing_1);
+
+  /* transfer hooks */
+
+  g_test_add_func ("/UsbemuDevice/hooks/complete",
+                   test_hooks_complete_1);
+  g_test_add_func ("/UsbemuDevice/hooks/reset",
+                   test_hooks_reset_1);
+
+  /* benchmarks, run with -m perf */
+
+  if (g_test_perf ())
+    g_test_add_func ("/UsbemuDevice/perf/hooks",
+                     test_perf_hooks_1);
+
   return g_test_run ();
 }
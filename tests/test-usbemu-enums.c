@@ -28,6 +28,7 @@ static void
 test_basic_1 (void)
 {
   g_assert_true (G_TYPE_IS_ENUM (USBEMU_TYPE_CLASSES));
+  g_assert_true (G_TYPE_IS_ENUM (USBEMU_TYPE_DESCRIPTOR_TYPES));
   g_assert_true (G_TYPE_IS_ENUM (USBEMU_TYPE_ENDPOINT_DIRECTIONS));
   g_assert_true (G_TYPE_IS_ENUM (USBEMU_TYPE_ENDPOINT_ISOCHRONOUS_SYNCS));
   g_assert_true (G_TYPE_IS_ENUM (USBEMU_TYPE_ENDPOINT_ISOCHRONOUS_USAGES));
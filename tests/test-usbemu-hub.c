@@ -0,0 +1,253 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <locale.h>
+#include <string.h>
+#include <glib.h>
+
+#include "usbemu/usbemu.h"
+
+static void
+test_instanciation_new_1 (void)
+{
+  UsbemuHub *hub;
+
+  hub = usbemu_hub_new (4);
+  g_assert_nonnull (hub);
+  g_assert_true (USBEMU_IS_HUB (hub));
+  g_assert_true (USBEMU_IS_DEVICE (hub));
+  g_assert_cmpuint (usbemu_hub_get_n_ports (hub), ==, 4);
+
+  g_object_unref (hub);
+}
+
+static void
+test_descriptor_1 (void)
+{
+  const UsbemuEndpointEntry *entries;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interface;
+  UsbemuDevice *device;
+  UsbemuHub *hub;
+
+  hub = usbemu_hub_new (USBEMU_HUB_MAX_PORTS);
+  g_test_queue_unref (hub);
+  device = USBEMU_DEVICE (hub);
+
+  g_assert_cmpint (usbemu_device_get_class (device), ==, USBEMU_CLASS_HUB);
+  g_assert_cmpint (usbemu_device_get_specification_num (device), ==, 0x200);
+  g_assert_cmpuint (usbemu_device_get_n_configurations (device), ==, 1);
+
+  configuration = usbemu_device_get_configuration (device, 1);
+  interface = usbemu_configuration_get_interface (configuration, 0, 0);
+  g_assert_nonnull (interface);
+  g_assert_cmpint (usbemu_interface_get_class (interface), ==,
+                   USBEMU_CLASS_HUB);
+
+  /* One interrupt IN endpoint, wide enough for a bit per port and one for
+   * the hub. */
+  g_assert_cmpuint (usbemu_interface_get_n_endpoints (interface), ==, 1);
+  entries = usbemu_interface_get_endpoint_entries (interface);
+  g_assert_cmpint (entries[0].endpoint_number, ==, USBEMU_EP_1);
+  g_assert_cmpint (entries[0].direction, ==, USBEMU_ENDPOINT_DIRECTION_IN);
+  g_assert_cmpint (entries[0].transfer, ==,
+                   USBEMU_ENDPOINT_TRANSFER_INTERRUPT);
+  g_assert_cmpuint (entries[0].max_packet_size, ==, 4);
+}
+
+static void
+test_ports_attach_1 (void)
+{
+  UsbemuDevice *devices[2];
+  UsbemuHub *hub;
+  GError *error = NULL;
+
+  hub = usbemu_hub_new (2);
+  g_test_queue_unref (hub);
+  devices[0] = usbemu_device_new ();
+  devices[1] = usbemu_device_new ();
+  g_test_queue_unref (devices[0]);
+  g_test_queue_unref (devices[1]);
+
+  g_assert_null (usbemu_hub_get_device (hub, 1));
+  g_assert_true (usbemu_hub_attach_device (hub, 1, devices[0], &error));
+  g_assert_no_error (error);
+  g_assert_true (usbemu_hub_get_device (hub, 1) == devices[0]);
+
+  /* The hub is not attached, neither are the devices plugged into it. */
+  g_assert_false (usbemu_device_get_attached (devices[0]));
+
+  /* Port in use. */
+  g_assert_false (usbemu_hub_attach_device (hub, 1, devices[1], &error));
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_DEVICE_UNAVAILABLE);
+  g_clear_error (&error);
+
+  /* Device already plugged into a port. */
+  g_assert_false (usbemu_hub_attach_device (hub, 2, devices[0], &error));
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_DEVICE_UNAVAILABLE);
+  g_clear_error (&error);
+
+  g_assert_true (usbemu_hub_detach_device (hub, 1));
+  g_assert_null (usbemu_hub_get_device (hub, 1));
+  g_assert_false (usbemu_hub_detach_device (hub, 1));
+
+  g_assert_true (usbemu_hub_attach_device (hub, 2, devices[0], &error));
+  g_assert_no_error (error);
+}
+
+static void
+_on_ports_changed (UsbemuHub *hub,
+                   guint      first_port,
+                   guint      n_ports,
+                   guint     *ranges)
+{
+  ranges[0]++;
+  ranges[1] = first_port;
+  ranges[2] = n_ports;
+}
+
+static void
+test_ports_attach_many_1 (void)
+{
+  UsbemuDevice *devices[4];
+  UsbemuHub *hub;
+  GError *error = NULL;
+  guint ranges[3] = { 0, };
+  guint i;
+
+  hub = usbemu_hub_new (8);
+  g_test_queue_unref (hub);
+  g_signal_connect (hub, USBEMU_HUB_SIGNAL_PORTS_CHANGED,
+                    G_CALLBACK (_on_ports_changed), ranges);
+  for (i = 0; i < G_N_ELEMENTS (devices); i++) {
+    devices[i] = usbemu_device_new ();
+    g_test_queue_unref (devices[i]);
+  }
+
+  /* NULL leaves port 4 empty. */
+  devices[2] = NULL;
+  g_assert_true (usbemu_hub_attach_devices (hub, 2, devices, 4, &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (ranges[0], ==, 1);
+  g_assert_cmpuint (ranges[1], ==, 2);
+  g_assert_cmpuint (ranges[2], ==, 4);
+  g_assert_true (usbemu_hub_get_device (hub, 2) == devices[0]);
+  g_assert_null (usbemu_hub_get_device (hub, 4));
+  g_assert_true (usbemu_hub_get_device (hub, 5) == devices[3]);
+
+  /* All or nothing: port 2 is in use. */
+  devices[2] = usbemu_device_new ();
+  g_test_queue_unref (devices[2]);
+  g_assert_false (usbemu_hub_attach_devices (hub, 1, &devices[2], 2, &error));
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_DEVICE_UNAVAILABLE);
+  g_clear_error (&error);
+  g_assert_null (usbemu_hub_get_device (hub, 1));
+  g_assert_cmpuint (ranges[0], ==, 1);
+
+  /* and the same device can't be plugged twice. */
+  devices[3] = devices[2];
+  g_assert_false (usbemu_hub_attach_devices (hub, 6, &devices[2], 2, &error));
+  g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_DEVICE_UNAVAILABLE);
+  g_clear_error (&error);
+  g_assert_true (usbemu_hub_attach_device (hub, 6, devices[2], &error));
+  g_assert_no_error (error);
+  g_assert_cmpuint (ranges[0], ==, 2);
+
+  g_assert_cmpuint (usbemu_hub_detach_devices (hub, 1, 8), ==, 4);
+  g_assert_cmpuint (ranges[0], ==, 3);
+  g_assert_cmpuint (usbemu_hub_detach_devices (hub, 1, 8), ==, 0);
+  g_assert_cmpuint (ranges[0], ==, 3);
+}
+
+static void
+test_ports_status_1 (void)
+{
+  UsbemuHubPortStatus status;
+  UsbemuHubPortChange change;
+  UsbemuDevice *device;
+  UsbemuHub *hub;
+
+  hub = usbemu_hub_new (1);
+  g_test_queue_unref (hub);
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  /* Ports are not powered until the host asks, so a device plugged in is
+   * neither connected nor reported. */
+  g_assert_true (usbemu_hub_attach_device (hub, 1, device, NULL));
+  usbemu_hub_get_port_status (hub, 1, &status, &change);
+  g_assert_cmpint (status, ==, USBEMU_HUB_PORT_STATUS_NONE);
+  g_assert_cmpint (change, ==, USBEMU_HUB_PORT_CHANGE_NONE);
+
+  g_assert_null (usbemu_hub_lookup_address (hub, 0));
+}
+
+static void
+test_ports_dispose_1 (void)
+{
+  UsbemuDevice *device;
+  UsbemuHub *hub;
+
+  hub = usbemu_hub_new (1);
+  device = usbemu_device_new ();
+  g_test_queue_unref (device);
+
+  g_assert_true (usbemu_hub_attach_device (hub, 1, device, NULL));
+  g_object_unref (hub);
+
+  /* Released by the hub, so free to be plugged elsewhere. */
+  hub = usbemu_hub_new (1);
+  g_test_queue_unref (hub);
+  g_assert_true (usbemu_hub_attach_device (hub, 1, device, NULL));
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_bug_base (PACKAGE_BUGREPORT);
+
+  /* instanciation */
+
+  g_test_add_func ("/UsbemuHub/instanciation/new",
+                   test_instanciation_new_1);
+
+  /* descriptors */
+
+  g_test_add_func ("/UsbemuHub/descriptor",
+                   test_descriptor_1);
+
+  /* ports */
+
+  g_test_add_func ("/UsbemuHub/ports/attach",
+                   test_ports_attach_1);
+  g_test_add_func ("/UsbemuHub/ports/attach-many",
+                   test_ports_attach_many_1);
+  g_test_add_func ("/UsbemuHub/ports/status",
+                   test_ports_status_1);
+  g_test_add_func ("/UsbemuHub/ports/dispose",
+                   test_ports_dispose_1);
+
+  return g_test_run ();
+}
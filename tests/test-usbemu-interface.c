@@ -205,6 +205,112 @@ test_properties_protocol_1 (void)
   }
 }
 
+static void
+test_endpoints_add_1 (void)
+{
+  const UsbemuEndpointEntry entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_OUT,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { 0, },
+  };
+  const UsbemuEndpointEntry invalid[][2] = {
+    /* duplicated address */
+    { { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+        USBEMU_ENDPOINT_TRANSFER_INTERRUPT, 0, 8, 0, 10000 }, { 0, } },
+    /* control transfer */
+    { { USBEMU_EP_2, USBEMU_ENDPOINT_DIRECTION_IN,
+        USBEMU_ENDPOINT_TRANSFER_CONTROL, 0, 8, 0, 0 }, { 0, } },
+    /* attributes on non-isochronous endpoint */
+    { { USBEMU_EP_2, USBEMU_ENDPOINT_DIRECTION_IN,
+        USBEMU_ENDPOINT_TRANSFER_BULK,
+        USBEMU_ENDPOINT_ISOCHRONOUS_SYNC_ASYNC, 64, 0, 0 }, { 0, } },
+    /* additional transactions on non-periodic endpoint */
+    { { USBEMU_EP_2, USBEMU_ENDPOINT_DIRECTION_IN,
+        USBEMU_ENDPOINT_TRANSFER_BULK, 0, 512, 1, 0 }, { 0, } },
+    /* too many additional transactions */
+    { { USBEMU_EP_2, USBEMU_ENDPOINT_DIRECTION_IN,
+        USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS, 0, 1024, 3, 125 }, { 0, } },
+  };
+  UsbemuInterface *interface;
+  GError *error = NULL;
+  gsize i;
+
+  interface = usbemu_interface_new ();
+  g_test_queue_unref (interface);
+
+  g_assert_true (usbemu_interface_add_endpoint_entries (interface, entries,
+                                                        &error));
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (invalid); i++) {
+    g_assert_false (usbemu_interface_add_endpoint_entries (interface,
+                                                           invalid[i],
+                                                           &error));
+    g_assert_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR);
+    g_clear_error (&error);
+  }
+
+  /* nothing added on failure. */
+  g_assert_cmpuint (usbemu_interface_get_endpoint_entries (interface)[2].endpoint_number,
+                    ==, 0);
+}
+
+static void
+assert_entry_equal (const UsbemuEndpointEntry *a,
+                    const UsbemuEndpointEntry *b)
+{
+  g_assert_cmpuint (a->endpoint_number, ==, b->endpoint_number);
+  g_assert_cmpuint (a->direction, ==, b->direction);
+  g_assert_cmpuint (a->transfer, ==, b->transfer);
+  g_assert_cmpuint (a->attributes, ==, b->attributes);
+  g_assert_cmpuint (a->max_packet_size, ==, b->max_packet_size);
+  g_assert_cmpuint (a->additional_transactions, ==,
+                    b->additional_transactions);
+  g_assert_cmpuint (a->interval, ==, b->interval);
+}
+
+static void
+test_endpoints_entry_1 (void)
+{
+  const UsbemuEndpointEntry entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS,
+      USBEMU_ENDPOINT_ISOCHRONOUS_SYNC_ADAPTIVE |
+        USBEMU_ENDPOINT_ISOCHRONOUS_USAGE_FEEDBACK, 1024, 2, 125 },
+    { USBEMU_EP_15, USBEMU_ENDPOINT_DIRECTION_OUT,
+      USBEMU_ENDPOINT_TRANSFER_INTERRUPT, 0, 64, 0, 255000 },
+    { 0, },
+  };
+  UsbemuInterface *interface;
+  UsbemuEndpointEntry entry;
+  const UsbemuEndpointEntry *view;
+  gsize i;
+
+  interface = usbemu_interface_new ();
+  g_test_queue_unref (interface);
+
+  g_assert_cmpuint (usbemu_interface_get_n_endpoints (interface), ==, 0);
+  g_assert_false (usbemu_interface_get_endpoint_entry (interface, 0, &entry));
+
+  g_assert_true (usbemu_interface_add_endpoint_entries (interface, entries,
+                                                        NULL));
+  g_assert_cmpuint (usbemu_interface_get_n_endpoints (interface), ==, 2);
+
+  /* packed storage round trips every field. */
+  for (i = 0; i < 2; i++) {
+    g_assert_true (usbemu_interface_get_endpoint_entry (interface, i, &entry));
+    assert_entry_equal (&entry, &entries[i]);
+  }
+  g_assert_false (usbemu_interface_get_endpoint_entry (interface, 2, &entry));
+
+  view = usbemu_interface_get_endpoint_entries (interface);
+  for (i = 0; i < 2; i++)
+    assert_entry_equal (&view[i], &entries[i]);
+  g_assert_cmpuint (view[2].endpoint_number, ==, 0);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -236,5 +342,12 @@ main (int   argc,
   g_test_add_func ("/UsbemuInterface/properties/protocol",
                    test_properties_protocol_1);
 
+  /* endpoints */
+
+  g_test_add_func ("/UsbemuInterface/endpoints/add",
+                   test_endpoints_add_1);
+  g_test_add_func ("/UsbemuInterface/endpoints/entry",
+                   test_endpoints_entry_1);
+
   return g_test_run ();
 }
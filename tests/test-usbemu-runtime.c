@@ -0,0 +1,420 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <locale.h>
+#include <string.h>
+#include <glib.h>
+
+#include "usbemu/usbemu.h"
+
+/* Calls run with usbemu_device_invoke(), and where they ran. */
+typedef struct {
+  GMutex lock;
+  GCond cond;
+  guint n_pending;
+  guint n_spins;
+  GThread *thread;
+  gboolean owned;
+  GMainContext *context;
+} TestInvoke;
+
+static void
+_test_invoke_init (TestInvoke   *invoke,
+                   GMainContext *context)
+{
+  g_mutex_init (&invoke->lock);
+  g_cond_init (&invoke->cond);
+  invoke->n_pending = 0;
+  invoke->n_spins = 0;
+  invoke->thread = NULL;
+  invoke->owned = FALSE;
+  invoke->context = context;
+}
+
+static void
+_test_invoke_clear (TestInvoke *invoke)
+{
+  g_cond_clear (&invoke->cond);
+  g_mutex_clear (&invoke->lock);
+}
+
+static void
+_test_invoke_wait (TestInvoke *invoke)
+{
+  g_mutex_lock (&invoke->lock);
+  while (invoke->n_pending != 0)
+    g_cond_wait (&invoke->cond, &invoke->lock);
+  g_mutex_unlock (&invoke->lock);
+}
+
+static gboolean
+_on_invoke (gpointer user_data)
+{
+  TestInvoke *invoke = user_data;
+  volatile guint32 hash = 5381;
+  guint i;
+
+  /* Stands for the work of a device handling a transfer. */
+  for (i = 0; i < invoke->n_spins; i++)
+    hash = hash * 33 + i;
+
+  g_mutex_lock (&invoke->lock);
+  invoke->thread = g_thread_self ();
+  if (invoke->context != NULL)
+    invoke->owned = g_main_context_is_owner (invoke->context);
+  if (--invoke->n_pending == 0)
+    g_cond_signal (&invoke->cond);
+  g_mutex_unlock (&invoke->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+test_instanciation_new_1 (void)
+{
+  UsbemuRuntime *runtime;
+  guint n_workers;
+
+  runtime = usbemu_runtime_new (2);
+  g_assert_nonnull (runtime);
+  g_assert_true (USBEMU_IS_RUNTIME (runtime));
+  g_assert_cmpuint (usbemu_runtime_get_n_workers (runtime), ==, 2);
+
+  g_object_get (runtime, USBEMU_RUNTIME_PROP_N_WORKERS, &n_workers, NULL);
+  g_assert_cmpuint (n_workers, ==, 2);
+
+  g_object_unref (runtime);
+}
+
+static void
+test_instanciation_new_2 (void)
+{
+  UsbemuRuntime *runtime;
+
+  /* One worker per processor by default. */
+  runtime = usbemu_runtime_new (0);
+  g_assert_cmpuint (usbemu_runtime_get_n_workers (runtime), ==,
+                    g_get_num_processors ());
+
+  g_object_unref (runtime);
+}
+
+static void
+test_workers_1 (void)
+{
+  UsbemuRuntime *runtime;
+  GMainContext *contexts[4];
+  guint i, j;
+
+  runtime = usbemu_runtime_new (G_N_ELEMENTS (contexts));
+  g_test_queue_unref (runtime);
+
+  for (i = 0; i < G_N_ELEMENTS (contexts); i++) {
+    contexts[i] = usbemu_runtime_get_worker_context (runtime, i);
+    g_assert_nonnull (contexts[i]);
+    g_assert_true (contexts[i] != g_main_context_default ());
+    for (j = 0; j < i; j++)
+      g_assert_true (contexts[i] != contexts[j]);
+  }
+}
+
+static void
+test_assign_1 (void)
+{
+  UsbemuRuntime *runtime;
+  UsbemuDevice *devices[5];
+  guint i;
+
+  runtime = usbemu_runtime_new (2);
+  g_test_queue_unref (runtime);
+
+  /* Devices not assigned are served by whoever uses them. */
+  devices[0] = usbemu_device_new ();
+  g_test_queue_unref (devices[0]);
+  g_assert_null (usbemu_device_get_context (devices[0]));
+
+  /* Workers are assigned in turn. */
+  for (i = 0; i < G_N_ELEMENTS (devices); i++) {
+    if (i != 0) {
+      devices[i] = usbemu_device_new ();
+      g_test_queue_unref (devices[i]);
+    }
+
+    g_assert_cmpuint (usbemu_runtime_assign_device (runtime, devices[i]),
+                      ==, i % 2);
+    g_assert_true (usbemu_device_get_context (devices[i]) ==
+                   usbemu_runtime_get_worker_context (runtime, i % 2));
+  }
+}
+
+static void
+test_invoke_1 (void)
+{
+  UsbemuRuntime *runtime;
+  UsbemuDevice *device;
+  TestInvoke invoke;
+  guint index;
+
+  runtime = usbemu_runtime_new (2);
+  device = usbemu_device_new ();
+
+  index = usbemu_runtime_assign_device (runtime, device);
+  _test_invoke_init (&invoke,
+                     usbemu_runtime_get_worker_context (runtime, index));
+
+  invoke.n_pending = 1;
+  usbemu_device_invoke (device, _on_invoke, &invoke, NULL);
+  _test_invoke_wait (&invoke);
+
+  g_assert_nonnull (invoke.thread);
+  g_assert_true (invoke.thread != g_thread_self ());
+  g_assert_true (invoke.owned);
+
+  g_object_unref (device);
+  g_object_unref (runtime);
+  _test_invoke_clear (&invoke);
+}
+
+static void
+test_invoke_2 (void)
+{
+  UsbemuDevice *device;
+  TestInvoke invoke;
+
+  /* Unassigned devices run calls in the thread-default context. */
+  device = usbemu_device_new ();
+  _test_invoke_init (&invoke, g_main_context_default ());
+
+  invoke.n_pending = 1;
+  usbemu_device_invoke (device, _on_invoke, &invoke, NULL);
+  g_assert_true (invoke.thread == g_thread_self ());
+  g_assert_cmpuint (invoke.n_pending, ==, 0);
+
+  g_object_unref (device);
+  _test_invoke_clear (&invoke);
+}
+
+/* One device created from a template, exercised on its worker. */
+typedef struct {
+  TestInvoke *invoke;
+  UsbemuDevice *device;
+  GBytes *expected;
+  gchar *serial;
+  gboolean matched;
+} TestTemplateInstance;
+
+static gboolean
+_on_template_instance (gpointer user_data)
+{
+  TestTemplateInstance *instance = user_data;
+  UsbemuConfiguration *configuration;
+  GBytes *bytes;
+  const guint8 *data;
+  gboolean matched;
+  guint8 index;
+
+  /* Adds a per device string while others read the shared table. */
+  usbemu_device_set_serial (instance->device, instance->serial);
+
+  /* Peeked, as getting it would copy it. */
+  configuration = usbemu_device_peek_configurations (instance->device, NULL)[0];
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  matched = g_bytes_equal (bytes, instance->expected);
+
+  index = ((const guint8*) g_bytes_get_data (bytes, NULL))[6];
+  bytes = usbemu_device_get_string_descriptor_bytes (instance->device, index,
+                                                     USBEMU_LANGID_ENGLISH_US);
+  matched = matched && (bytes != NULL) && (g_bytes_get_size (bytes) == 2 + 6 * 2);
+
+  data = g_bytes_get_data (usbemu_device_get_descriptor_bytes (instance->device),
+                           NULL);
+  bytes = usbemu_device_get_string_descriptor_bytes (instance->device,
+                                                     data[16],
+                                                     USBEMU_LANGID_ENGLISH_US);
+  matched = matched && (bytes != NULL) &&
+            (g_bytes_get_size (bytes) == 2 + strlen (instance->serial) * 2);
+
+  g_mutex_lock (&instance->invoke->lock);
+  instance->matched = matched;
+  if (--instance->invoke->n_pending == 0)
+    g_cond_signal (&instance->invoke->cond);
+  g_mutex_unlock (&instance->invoke->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+test_assign_2 (void)
+{
+  UsbemuRuntime *runtime;
+  UsbemuDevice *template_device;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[2];
+  GBytes *expected;
+  TestTemplateInstance instances[32];
+  TestInvoke invoke;
+  guint i, round;
+
+  runtime = usbemu_runtime_new (4);
+  g_test_queue_unref (runtime);
+
+  template_device = usbemu_device_new ();
+  g_test_queue_unref (template_device);
+  configuration = usbemu_configuration_new_full ("config", 0, 100);
+  g_test_queue_unref (configuration);
+  interfaces[0] = usbemu_interface_new_full ("interface",
+                                             USBEMU_CLASS_VENDOR_SPECIFIC,
+                                             0, 0);
+  interfaces[1] = NULL;
+  g_test_queue_unref (interfaces[0]);
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (template_device, configuration);
+
+  /* Instances of one template on every worker share copies of its
+   * configurations, and its strings. */
+  _test_invoke_init (&invoke, NULL);
+  for (i = 0; i < G_N_ELEMENTS (instances); i++) {
+    instances[i].invoke = &invoke;
+    instances[i].device = usbemu_device_new_from_template (template_device);
+    usbemu_runtime_assign_device (runtime, instances[i].device);
+    instances[i].serial = g_strdup_printf ("serial-%u", i);
+  }
+  expected = usbemu_configuration_get_descriptor_bytes (configuration);
+  for (i = 0; i < G_N_ELEMENTS (instances); i++)
+    instances[i].expected = expected;
+
+  for (round = 0; round < 16; round++) {
+    invoke.n_pending = G_N_ELEMENTS (instances);
+    for (i = 0; i < G_N_ELEMENTS (instances); i++) {
+      instances[i].matched = FALSE;
+      usbemu_device_invoke (instances[i].device, _on_template_instance,
+                            &instances[i], NULL);
+    }
+    _test_invoke_wait (&invoke);
+
+    for (i = 0; i < G_N_ELEMENTS (instances); i++)
+      g_assert_true (instances[i].matched);
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (instances); i++) {
+    g_object_unref (instances[i].device);
+    g_free (instances[i].serial);
+  }
+  _test_invoke_clear (&invoke);
+}
+
+/* Seconds to run @n_calls calls of @n_spins iterations each, spread over
+ * @n_devices devices of a runtime with @n_workers workers. */
+static gdouble
+_invoke_storm (guint n_workers,
+               guint n_devices,
+               guint n_calls,
+               guint n_spins)
+{
+  UsbemuRuntime *runtime;
+  UsbemuDevice **devices;
+  TestInvoke invoke;
+  gdouble elapsed;
+  guint i;
+
+  runtime = usbemu_runtime_new (n_workers);
+  devices = g_new (UsbemuDevice*, n_devices);
+  for (i = 0; i < n_devices; i++) {
+    devices[i] = usbemu_device_new ();
+    usbemu_runtime_assign_device (runtime, devices[i]);
+  }
+
+  _test_invoke_init (&invoke, NULL);
+  invoke.n_spins = n_spins;
+  invoke.n_pending = n_calls;
+
+  g_test_timer_start ();
+  for (i = 0; i < n_calls; i++)
+    usbemu_device_invoke (devices[i % n_devices], _on_invoke, &invoke, NULL);
+  _test_invoke_wait (&invoke);
+  elapsed = g_test_timer_elapsed ();
+
+  for (i = 0; i < n_devices; i++)
+    g_object_unref (devices[i]);
+  g_free (devices);
+  g_object_unref (runtime);
+  _test_invoke_clear (&invoke);
+
+  return elapsed;
+}
+
+static void
+test_perf_scaling_1 (void)
+{
+  const guint n_devices = 64;
+  const guint n_calls = 20000;
+  const guint n_spins = 20000;
+  guint n_workers;
+  gdouble single, sharded;
+
+  n_workers = g_get_num_processors ();
+  single = _invoke_storm (1, n_devices, n_calls, n_spins);
+  sharded = _invoke_storm (n_workers, n_devices, n_calls, n_spins);
+
+  g_test_maximized_result (n_calls / single,
+                           "1 worker: %.0f calls/s", n_calls / single);
+  g_test_maximized_result (n_calls / sharded,
+                           "%u workers: %.0f calls/s",
+                           n_workers, n_calls / sharded);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_bug_base (PACKAGE_BUGREPORT);
+
+  /* instanciation */
+
+  g_test_add_func ("/UsbemuRuntime/instanciation/new",
+                   test_instanciation_new_1);
+  g_test_add_func ("/UsbemuRuntime/instanciation/new-default",
+                   test_instanciation_new_2);
+
+  /* workers */
+
+  g_test_add_func ("/UsbemuRuntime/workers",
+                   test_workers_1);
+  g_test_add_func ("/UsbemuRuntime/assign",
+                   test_assign_1);
+  g_test_add_func ("/UsbemuRuntime/assign/template",
+                   test_assign_2);
+  g_test_add_func ("/UsbemuRuntime/invoke",
+                   test_invoke_1);
+  g_test_add_func ("/UsbemuRuntime/invoke/unassigned",
+                   test_invoke_2);
+
+  /* benchmarks, run with -m perf */
+
+  if (g_test_perf ())
+    g_test_add_func ("/UsbemuRuntime/perf/scaling",
+                     test_perf_scaling_1);
+
+  return g_test_run ();
+}
@@ -0,0 +1,133 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <locale.h>
+#include <string.h>
+#include <glib.h>
+
+#include "usbemu/usbemu.h"
+
+static void
+test_instanciation_new_1 (void)
+{
+  UsbemuUrb *urb;
+  guint i;
+
+  urb = usbemu_urb_new (0x81, 100, 4);
+  g_assert_nonnull (urb);
+  g_assert_cmpuint (urb->endpoint_address, ==, 0x81);
+  g_assert_cmpuint (urb->buffer_length, ==, 100);
+  g_assert_cmpuint (urb->n_iso_packets, ==, 4);
+  for (i = 0; i < urb->n_iso_packets; i++) {
+    g_assert_cmpuint (urb->iso_packets[i].offset, ==, 0);
+    g_assert_cmpuint (urb->iso_packets[i].length, ==, 0);
+  }
+  /* buffer must not overlap packet descriptors. */
+  memset (urb->buffer, 0xFF, urb->buffer_length);
+  g_assert_cmpuint (urb->iso_packets[3].status, ==, 0);
+
+  g_assert_true (usbemu_urb_ref (urb) == urb);
+  usbemu_urb_unref (urb);
+  usbemu_urb_unref (urb);
+
+  /* larger than any size class. */
+  urb = usbemu_urb_new (0x02, 16 * 1024 * 1024, 0);
+  g_assert_null (urb->iso_packets);
+  memset (urb->buffer, 0, urb->buffer_length);
+  usbemu_urb_unref (urb);
+}
+
+static void
+test_pool_reuse_1 (void)
+{
+  UsbemuUrbPoolStats before, after;
+  UsbemuUrb *urbs[256];
+  guint round, i;
+
+  /* warm up */
+  for (i = 0; i < G_N_ELEMENTS (urbs); i++)
+    urbs[i] = usbemu_urb_new (0x81, 512 * (i % 8 + 1), 0);
+  for (i = 0; i < G_N_ELEMENTS (urbs); i++)
+    usbemu_urb_unref (urbs[i]);
+
+  usbemu_urb_pool_get_stats (&before);
+  for (round = 0; round < 100; round++) {
+    for (i = 0; i < G_N_ELEMENTS (urbs); i++)
+      urbs[i] = usbemu_urb_new (0x81, 512 * (i % 8 + 1), 0);
+    for (i = 0; i < G_N_ELEMENTS (urbs); i++)
+      usbemu_urb_unref (urbs[G_N_ELEMENTS (urbs) - 1 - i]);
+  }
+  usbemu_urb_pool_get_stats (&after);
+
+  g_assert_cmpuint (after.n_slabs, ==, before.n_slabs);
+  g_assert_cmpuint (after.n_oversized, ==, before.n_oversized);
+}
+
+static gpointer
+_free_urbs (gpointer user_data)
+{
+  GPtrArray *urbs = user_data;
+
+  g_ptr_array_unref (urbs);
+
+  return NULL;
+}
+
+static void
+test_pool_threads_1 (void)
+{
+  UsbemuUrbPoolStats before, after;
+  GPtrArray *urbs;
+  guint round, i;
+
+  usbemu_urb_pool_get_stats (&before);
+  /* blocks freed by other threads return to the shared depot on exit. */
+  for (round = 0; round < 10; round++) {
+    urbs = g_ptr_array_new_with_free_func ((GDestroyNotify) usbemu_urb_unref);
+    for (i = 0; i < 500; i++)
+      g_ptr_array_add (urbs, usbemu_urb_new (0x01, 1024, 0));
+    g_thread_join (g_thread_new ("free-urbs", _free_urbs, urbs));
+  }
+  usbemu_urb_pool_get_stats (&after);
+
+  /* 500 blocks of 2KiB fit in a few slabs, filled once. */
+  g_assert_cmpuint (after.n_slabs - before.n_slabs, <=, 4);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_bug_base (PACKAGE_BUGREPORT);
+
+  g_test_add_func ("/UsbemuUrb/instanciation/new",
+                   test_instanciation_new_1);
+
+  /* pool */
+
+  g_test_add_func ("/UsbemuUrb/pool/reuse", test_pool_reuse_1);
+  g_test_add_func ("/UsbemuUrb/pool/threads", test_pool_threads_1);
+
+  return g_test_run ();
+}
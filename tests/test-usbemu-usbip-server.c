@@ -0,0 +1,2056 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <locale.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+#include "usbemu/usbemu.h"
+
+#define USBIP_VERSION 0x0111
+#define OP_REQ_IMPORT 0x8003
+#define OP_REP_IMPORT 0x0003
+#define OP_REQ_DEVLIST 0x8005
+#define OP_REP_DEVLIST 0x0005
+#define USBIP_CMD_SUBMIT 1
+#define USBIP_CMD_UNLINK 2
+#define USBIP_RET_SUBMIT 3
+#define USBIP_RET_UNLINK 4
+#define USBIP_HEADER_SIZE 48
+#define USBIP_DEVICE_SIZE 312
+#define USBIP_ISO_PACKET_SIZE 16
+
+/* Bulk OUT 0x01 stores data that bulk IN 0x81 returns. Interrupt IN 0x82
+ * never completes until cancelled. */
+#define TEST_TYPE_LOOPBACK_DEVICE (test_loopback_device_get_type ())
+G_DECLARE_FINAL_TYPE (TestLoopbackDevice, test_loopback_device,
+                      TEST, LOOPBACK_DEVICE, UsbemuDevice)
+
+struct _TestLoopbackDevice {
+  UsbemuDevice parent_instance;
+
+  GByteArray *data;
+  /* Thread the last URB was submitted from. */
+  GThread *thread;
+};
+
+G_DEFINE_TYPE (TestLoopbackDevice, test_loopback_device, USBEMU_TYPE_DEVICE)
+
+static void
+test_loopback_device_finalize (GObject *object)
+{
+  TestLoopbackDevice *device = TEST_LOOPBACK_DEVICE (object);
+
+  g_byte_array_unref (device->data);
+
+  G_OBJECT_CLASS (test_loopback_device_parent_class)->finalize (object);
+}
+
+static void
+test_loopback_device_submit_urb (UsbemuDevice *device,
+                                 UsbemuUrb    *urb)
+{
+  TestLoopbackDevice *self = TEST_LOOPBACK_DEVICE (device);
+  GBytes *data, *payload;
+  gsize length;
+
+  self->thread = g_thread_self ();
+
+  switch (urb->endpoint_address) {
+    case 0x01:
+      /* received in place. */
+      g_assert_nonnull (usbemu_urb_get_payload (urb));
+      g_assert_true (usbemu_urb_peek_data (urb) == urb->buffer);
+      g_byte_array_append (self->data, urb->buffer, urb->buffer_length);
+      urb->actual_length = urb->buffer_length;
+      break;
+    case 0x81:
+      /* handed out without filling the buffer. */
+      length = MIN (urb->buffer_length, self->data->len);
+      data = g_byte_array_free_to_bytes (self->data);
+      payload = g_bytes_new_from_bytes (data, 0, length);
+      usbemu_urb_set_payload (urb, payload);
+      g_assert_cmpuint (urb->actual_length, ==, length);
+      self->data = g_byte_array_new ();
+      g_byte_array_append (self->data,
+                           (const guint8*) g_bytes_get_data (data, NULL) + length,
+                           g_bytes_get_size (data) - length);
+      g_bytes_unref (payload);
+      g_bytes_unref (data);
+      break;
+    case 0x82:
+      /* left pending, see usbemu_device_peek_urb(). */
+      return;
+    default:
+      USBEMU_DEVICE_CLASS (test_loopback_device_parent_class)->submit_urb (device, urb);
+      return;
+  }
+
+  usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_COMPLETED);
+}
+
+static void
+test_loopback_device_cancel_urb (UsbemuDevice *device,
+                                 UsbemuUrb    *urb)
+{
+  if (urb->endpoint_address == 0x82)
+    usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_CANCELLED);
+}
+
+static void
+test_loopback_device_class_init (TestLoopbackDeviceClass *klass)
+{
+  G_OBJECT_CLASS (klass)->finalize = test_loopback_device_finalize;
+  USBEMU_DEVICE_CLASS (klass)->submit_urb = test_loopback_device_submit_urb;
+  USBEMU_DEVICE_CLASS (klass)->cancel_urb = test_loopback_device_cancel_urb;
+}
+
+static void
+test_loopback_device_init (TestLoopbackDevice *device)
+{
+  device->data = g_byte_array_new ();
+}
+
+/* Answers class and vendor requests addressed to it, or to its endpoints,
+ * with bRequest and its bInterfaceNumber. */
+#define TEST_TYPE_CLASS_INTERFACE (test_class_interface_get_type ())
+G_DECLARE_FINAL_TYPE (TestClassInterface, test_class_interface,
+                      TEST, CLASS_INTERFACE, UsbemuInterface)
+
+struct _TestClassInterface {
+  UsbemuInterface parent_instance;
+
+  guint n_requests;
+};
+
+G_DEFINE_TYPE (TestClassInterface, test_class_interface, USBEMU_TYPE_INTERFACE)
+
+static void
+test_class_interface_control_request (UsbemuInterface          *interface,
+                                      UsbemuDevice             *device,
+                                      UsbemuUrb                *urb,
+                                      const UsbemuControlSetup *setup)
+{
+  TestClassInterface *self = TEST_CLASS_INTERFACE (interface);
+
+  if ((setup->bmRequestType & USBEMU_REQUEST_TYPE_MASK) ==
+      USBEMU_REQUEST_TYPE_STANDARD) {
+    USBEMU_INTERFACE_CLASS (test_class_interface_parent_class)->control_request (
+        interface, device, urb, setup);
+    return;
+  }
+
+  self->n_requests++;
+  urb->buffer[0] = setup->bRequest;
+  urb->buffer[1] = usbemu_interface_get_interface_number (interface);
+  urb->actual_length = 2;
+  usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_COMPLETED);
+}
+
+static void
+test_class_interface_class_init (TestClassInterfaceClass *klass)
+{
+  USBEMU_INTERFACE_CLASS (klass)->control_request =
+      test_class_interface_control_request;
+}
+
+static void
+test_class_interface_init (TestClassInterface *interface)
+{
+}
+
+static TestLoopbackDevice*
+_new_loopback_device (void)
+{
+  const UsbemuEndpointEntry entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_OUT,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_BULK, 0, 64, 0, 0 },
+    { USBEMU_EP_2, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_INTERRUPT, 0, 8, 0, 10000 },
+    { 0, },
+  };
+  TestLoopbackDevice *device;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[2];
+
+  device = g_object_new (TEST_TYPE_LOOPBACK_DEVICE, NULL);
+  usbemu_device_set_vendor_id (USBEMU_DEVICE (device), 0x1234);
+
+  configuration = usbemu_configuration_new ();
+  interfaces[0] = g_object_new (TEST_TYPE_CLASS_INTERFACE,
+                                USBEMU_INTERFACE_PROP_CLASS,
+                                USBEMU_CLASS_VENDOR_SPECIFIC,
+                                USBEMU_INTERFACE_PROP_SUB_CLASS, 0x01,
+                                USBEMU_INTERFACE_PROP_PROTOCOL, 0x02,
+                                NULL);
+  interfaces[1] = NULL;
+  g_assert_true (usbemu_interface_add_endpoint_entries (interfaces[0],
+                                                        entries, NULL));
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (USBEMU_DEVICE (device), configuration);
+  g_object_unref (interfaces[0]);
+  g_object_unref (configuration);
+
+  return device;
+}
+
+/* Isochronous IN 0x83 only, to serve with a UsbemuIsoStream. */
+static TestLoopbackDevice*
+_new_iso_device (void)
+{
+  const UsbemuEndpointEntry entries[] = {
+    { USBEMU_EP_3, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS, 0, 192, 0, 1000 },
+    { 0, },
+  };
+  TestLoopbackDevice *device;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[2];
+
+  device = g_object_new (TEST_TYPE_LOOPBACK_DEVICE, NULL);
+
+  configuration = usbemu_configuration_new ();
+  interfaces[0] = usbemu_interface_new ();
+  interfaces[1] = NULL;
+  g_assert_true (usbemu_interface_add_endpoint_entries (interfaces[0],
+                                                        entries, NULL));
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (USBEMU_DEVICE (device), configuration);
+  g_object_unref (interfaces[0]);
+  g_object_unref (configuration);
+
+  return device;
+}
+
+static void
+put_u16 (guint8  *p,
+         guint16  value)
+{
+  p[0] = value >> 8;
+  p[1] = value & 0xFF;
+}
+
+static void
+put_u32 (guint8  *p,
+         guint32  value)
+{
+  put_u16 (p, value >> 16);
+  put_u16 (p + 2, value & 0xFFFF);
+}
+
+static guint16
+get_u16 (const guint8 *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static guint32
+get_u32 (const guint8 *p)
+{
+  return ((guint32) get_u16 (p) << 16) | get_u16 (p + 2);
+}
+
+static UsbemuUsbipServer*
+_start_server (GSocketAddress **address)
+{
+  UsbemuUsbipServer *server;
+  GInetAddress *loopback;
+  GSocketAddress *any_port;
+  GError *error = NULL;
+
+  loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  any_port = g_inet_socket_address_new (loopback, 0);
+  g_object_unref (loopback);
+
+  server = usbemu_usbip_server_new ();
+  g_assert_true (usbemu_usbip_server_listen (server, any_port, address,
+                                             &error));
+  g_assert_no_error (error);
+  g_object_unref (any_port);
+
+  return server;
+}
+
+static GSocket*
+_client_connect (GSocketAddress *address)
+{
+  GSocket *socket;
+  GError *error = NULL;
+
+  socket = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM,
+                         G_SOCKET_PROTOCOL_TCP, &error);
+  g_assert_no_error (error);
+  /* Completes without the server accepting it. */
+  g_assert_true (g_socket_connect (socket, address, NULL, &error));
+  g_assert_no_error (error);
+  g_socket_set_blocking (socket, FALSE);
+
+  return socket;
+}
+
+static void
+_client_send (GSocket       *socket,
+              gconstpointer  data,
+              gsize          size)
+{
+  GError *error = NULL;
+  gssize sent;
+
+  while (size != 0) {
+    sent = g_socket_send (socket, data, size, NULL, &error);
+    if (sent < 0) {
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+      g_clear_error (&error);
+      g_main_context_iteration (NULL, TRUE);
+      continue;
+    }
+
+    data = (const guint8*) data + sent;
+    size -= sent;
+  }
+}
+
+/* Run the server until @size bytes have been received. */
+static void
+_client_receive (GSocket  *socket,
+                 gpointer  buffer,
+                 gsize     size)
+{
+  GError *error = NULL;
+  gssize received;
+
+  while (size != 0) {
+    received = g_socket_receive (socket, buffer, size, NULL, &error);
+    if (received < 0) {
+      g_assert_error (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK);
+      g_clear_error (&error);
+      g_main_context_iteration (NULL, TRUE);
+      continue;
+    }
+
+    g_assert_cmpint (received, >, 0);
+    buffer = (guint8*) buffer + received;
+    size -= received;
+  }
+}
+
+/* Returns devid of the imported device. */
+static guint32
+_client_import (GSocket     *socket,
+                const gchar *busid,
+                guint32      status)
+{
+  guint8 request[8 + 32] = { 0, };
+  guint8 reply[8 + USBIP_DEVICE_SIZE];
+
+  put_u16 (request, USBIP_VERSION);
+  put_u16 (request + 2, OP_REQ_IMPORT);
+  memcpy (request + 8, busid, strlen (busid));
+  _client_send (socket, request, sizeof (request));
+
+  _client_receive (socket, reply, 8);
+  g_assert_cmpuint (get_u16 (reply), ==, USBIP_VERSION);
+  g_assert_cmpuint (get_u16 (reply + 2), ==, OP_REP_IMPORT);
+  g_assert_cmpuint (get_u32 (reply + 4), ==, status);
+  if (status != 0)
+    return 0;
+
+  _client_receive (socket, reply + 8, USBIP_DEVICE_SIZE);
+  g_assert_cmpstr ((const gchar*) reply + 8 + 256, ==, busid);
+
+  return (get_u32 (reply + 8 + 288) << 16) | get_u32 (reply + 8 + 292);
+}
+
+static void
+_client_submit (GSocket       *socket,
+                guint32        seqnum,
+                guint32        devid,
+                guint8         endpoint_address,
+                const guint8  *setup,
+                gconstpointer  data,
+                gsize          length)
+{
+  guint8 header[USBIP_HEADER_SIZE] = { 0, };
+  gboolean in = (endpoint_address & USBEMU_ENDPOINT_DIRECTION_IN) != 0;
+
+  put_u32 (header, USBIP_CMD_SUBMIT);
+  put_u32 (header + 4, seqnum);
+  put_u32 (header + 8, devid);
+  put_u32 (header + 12, in ? 1 : 0);
+  put_u32 (header + 16, endpoint_address & 0x0F);
+  put_u32 (header + 24, length);
+  put_u32 (header + 32, 0xFFFFFFFF);
+  if (setup != NULL)
+    memcpy (header + 40, setup, 8);
+  _client_send (socket, header, sizeof (header));
+  if (!in)
+    _client_send (socket, data, length);
+}
+
+static void
+_client_unlink (GSocket *socket,
+                guint32  seqnum,
+                guint32  devid,
+                guint32  unlink_seqnum)
+{
+  guint8 header[USBIP_HEADER_SIZE] = { 0, };
+
+  put_u32 (header, USBIP_CMD_UNLINK);
+  put_u32 (header + 4, seqnum);
+  put_u32 (header + 8, devid);
+  put_u32 (header + 20, unlink_seqnum);
+  _client_send (socket, header, sizeof (header));
+}
+
+/* Receive a USBIP_RET_* header and return the status field. */
+static gint32
+_client_receive_ret (GSocket *socket,
+                     guint32  command,
+                     guint32  seqnum,
+                     guint32 *actual_length)
+{
+  guint8 header[USBIP_HEADER_SIZE];
+
+  _client_receive (socket, header, sizeof (header));
+  g_assert_cmpuint (get_u32 (header), ==, command);
+  g_assert_cmpuint (get_u32 (header + 4), ==, seqnum);
+  if (actual_length != NULL)
+    *actual_length = get_u32 (header + 24);
+
+  return (gint32) get_u32 (header + 20);
+}
+
+static void
+test_devlist_1 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *devices[2];
+  GSocket *socket;
+  guint8 request[8] = { 0, };
+  guint8 reply[12];
+  guint8 entry[USBIP_DEVICE_SIZE];
+  guint8 interface[4];
+  gboolean seen[2] = { FALSE, FALSE };
+  guint i, index;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  for (i = 0; i < G_N_ELEMENTS (devices); i++) {
+    devices[i] = _new_loopback_device ();
+    g_test_queue_unref (devices[i]);
+  }
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (devices[1]), 1);
+  g_assert_true (usbemu_usbip_server_export_device (server,
+                                                    USBEMU_DEVICE (devices[0]),
+                                                    "1-1", NULL));
+  g_assert_true (usbemu_usbip_server_export_device (server,
+                                                    USBEMU_DEVICE (devices[1]),
+                                                    "1-2", NULL));
+  g_assert_false (usbemu_usbip_server_export_device (server,
+                                                     USBEMU_DEVICE (devices[1]),
+                                                     "1-3", NULL));
+  g_assert_true (usbemu_usbip_server_lookup_device (server, "1-2") ==
+                 USBEMU_DEVICE (devices[1]));
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+
+  put_u16 (request, USBIP_VERSION);
+  put_u16 (request + 2, OP_REQ_DEVLIST);
+  _client_send (socket, request, sizeof (request));
+
+  _client_receive (socket, reply, sizeof (reply));
+  g_assert_cmpuint (get_u16 (reply + 2), ==, OP_REP_DEVLIST);
+  g_assert_cmpuint (get_u32 (reply + 4), ==, 0);
+  g_assert_cmpuint (get_u32 (reply + 8), ==, 2);
+
+  for (i = 0; i < 2; i++) {
+    _client_receive (socket, entry, sizeof (entry));
+    index = g_str_equal ((const gchar*) entry + 256, "1-1") ? 0 : 1;
+    g_assert_false (seen[index]);
+    seen[index] = TRUE;
+
+    g_assert_cmpuint (get_u16 (entry + 300), ==, 0x1234);
+    g_assert_cmpuint (entry[310], ==, 1);
+    g_assert_cmpuint (entry[309], ==, index);
+    g_assert_cmpuint (entry[311], ==, index);
+    if (index == 1) {
+      _client_receive (socket, interface, sizeof (interface));
+      g_assert_cmpuint (interface[0], ==, USBEMU_CLASS_VENDOR_SPECIFIC);
+      g_assert_cmpuint (interface[1], ==, 0x01);
+      g_assert_cmpuint (interface[2], ==, 0x02);
+    }
+  }
+}
+
+static void
+test_import_1 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  GSocket *sockets[2];
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  g_assert_true (usbemu_usbip_server_export_device (server,
+                                                    USBEMU_DEVICE (device),
+                                                    "1-1", NULL));
+
+  sockets[0] = _client_connect (address);
+  sockets[1] = _client_connect (address);
+  g_test_queue_unref (sockets[0]);
+  g_test_queue_unref (sockets[1]);
+
+  _client_import (sockets[1], "9-9", 4);
+  _client_import (sockets[0], "1-1", 0);
+  g_assert_true (usbemu_device_get_attached (USBEMU_DEVICE (device)));
+  _client_import (sockets[1], "1-1", 2);
+
+  g_socket_close (sockets[0], NULL);
+  while (usbemu_device_get_attached (USBEMU_DEVICE (device)))
+    g_main_context_iteration (NULL, TRUE);
+
+  /* importable again. */
+  _client_import (sockets[1], "1-1", 0);
+  g_assert_true (usbemu_usbip_server_unexport_device (server,
+                                                      USBEMU_DEVICE (device)));
+  g_assert_false (usbemu_device_get_attached (USBEMU_DEVICE (device)));
+  g_assert_null (usbemu_usbip_server_lookup_device (server, "1-1"));
+}
+
+static void
+_test_submit (gboolean io_uring)
+{
+  const guint8 vendor_setup[8] = { 0xC0, 0x01, 0x00, 0x00, 0x00, 0x00,
+                                   0x08, 0x00 };
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  GSocket *socket;
+  guint32 devid, actual_length;
+  gchar data[5];
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+  g_object_set (server, USBEMU_USBIP_SERVER_PROP_IO_URING, io_uring, NULL);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  _client_submit (socket, 1, devid, 0x01, NULL, "hello", 5);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 1,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 5);
+
+  _client_submit (socket, 2, devid, 0x81, NULL, NULL, 64);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 2,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 5);
+  _client_receive (socket, data, sizeof (data));
+  g_assert_cmpmem (data, sizeof (data), "hello", 5);
+
+  /* unhandled requests and unknown endpoints stall with -EPIPE. */
+  _client_submit (socket, 3, devid, 0x80, vendor_setup, NULL, 8);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 3,
+                                        &actual_length), ==, -32);
+  g_assert_cmpuint (actual_length, ==, 0);
+  _client_submit (socket, 4, devid, 0x83, NULL, NULL, 8);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 4, NULL),
+                   ==, -32);
+}
+
+static void
+test_submit_1 (void)
+{
+  _test_submit (TRUE);
+}
+
+static void
+test_submit_2 (void)
+{
+  /* Polling sockets even where io_uring is available. */
+  _test_submit (FALSE);
+}
+
+static void
+test_enumeration_1 (void)
+{
+  const guint8 get_device_descriptor[8] = { 0x80, 0x06, 0x00, 0x01,
+                                            0x00, 0x00, 0x40, 0x00 };
+  const guint8 get_configuration_descriptor[8] = { 0x80, 0x06, 0x00, 0x02,
+                                                   0x00, 0x00, 0x09, 0x00 };
+  const guint8 get_string_descriptor[8] = { 0x80, 0x06, 0x63, 0x03,
+                                            0x09, 0x04, 0xFF, 0x00 };
+  const guint8 set_configuration[8] = { 0x00, 0x09, 0x01, 0x00,
+                                        0x00, 0x00, 0x00, 0x00 };
+  const guint8 get_configuration[8] = { 0x80, 0x08, 0x00, 0x00,
+                                        0x00, 0x00, 0x01, 0x00 };
+  const guint8 get_interface[8] = { 0x81, 0x0A, 0x00, 0x00,
+                                    0x00, 0x00, 0x01, 0x00 };
+  const guint8 get_device_status[8] = { 0x80, 0x00, 0x00, 0x00,
+                                        0x00, 0x00, 0x02, 0x00 };
+  const guint8 get_endpoint_status[8] = { 0x82, 0x00, 0x00, 0x00,
+                                          0x81, 0x00, 0x02, 0x00 };
+  const guint8 set_endpoint_halt[8] = { 0x02, 0x03, 0x00, 0x00,
+                                        0x81, 0x00, 0x00, 0x00 };
+  const guint8 clear_endpoint_halt[8] = { 0x02, 0x01, 0x00, 0x00,
+                                          0x81, 0x00, 0x00, 0x00 };
+  const guint8 port_reset[8] = { 0x23, 0x03, 0x04, 0x00,
+                                 0x01, 0x00, 0x00, 0x00 };
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  GSocket *socket;
+  GBytes *bytes;
+  guint32 devid, actual_length;
+  guint8 data[18];
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  /* left unconfigured, as the host finds it. */
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  _client_submit (socket, 1, devid, 0x80, get_device_descriptor, NULL, 0x40);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 1,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, USBEMU_DEVICE_DESCRIPTOR_SIZE);
+  _client_receive (socket, data, USBEMU_DEVICE_DESCRIPTOR_SIZE);
+  bytes = usbemu_device_get_descriptor_bytes (USBEMU_DEVICE (device));
+  g_assert_cmpmem (data, USBEMU_DEVICE_DESCRIPTOR_SIZE,
+                   g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+
+  /* truncated to wLength. */
+  _client_submit (socket, 2, devid, 0x80, get_configuration_descriptor, NULL,
+                  9);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 2,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 9);
+  _client_receive (socket, data, 9);
+  bytes = usbemu_configuration_get_descriptor_bytes (
+      usbemu_device_get_configuration (USBEMU_DEVICE (device), 1));
+  g_assert_cmpmem (data, 9, g_bytes_get_data (bytes, NULL), 9);
+
+  /* no such string. */
+  _client_submit (socket, 3, devid, 0x80, get_string_descriptor, NULL, 0xFF);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 3, NULL),
+                   ==, -32);
+
+  _client_submit (socket, 4, devid, 0x00, set_configuration, NULL, 0);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 4, NULL),
+                   ==, 0);
+  g_assert_cmpuint (usbemu_device_get_active_configuration (USBEMU_DEVICE (device)),
+                    ==, 1);
+
+  _client_submit (socket, 5, devid, 0x80, get_configuration, NULL, 1);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 5,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 1);
+  _client_receive (socket, data, 1);
+  g_assert_cmpuint (data[0], ==, 1);
+
+  _client_submit (socket, 6, devid, 0x80, get_interface, NULL, 1);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 6,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 1);
+  _client_receive (socket, data, 1);
+  g_assert_cmpuint (data[0], ==, 0);
+
+  _client_submit (socket, 7, devid, 0x80, get_device_status, NULL, 2);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 7,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 2);
+  _client_receive (socket, data, 2);
+  g_assert_cmpuint (data[1], ==, 0);
+
+  /* a halted endpoint stalls until the halt is cleared. */
+  _client_submit (socket, 8, devid, 0x00, set_endpoint_halt, NULL, 0);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 8, NULL),
+                   ==, 0);
+  g_assert_true (usbemu_device_get_endpoint_halt (USBEMU_DEVICE (device),
+                                                  0x81));
+  _client_submit (socket, 9, devid, 0x80, get_endpoint_status, NULL, 2);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 9,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 2);
+  _client_receive (socket, data, 2);
+  g_assert_cmpuint (data[0], ==, 1);
+  _client_submit (socket, 10, devid, 0x81, NULL, NULL, 8);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 10, NULL),
+                   ==, -32);
+
+  _client_submit (socket, 11, devid, 0x00, clear_endpoint_halt, NULL, 0);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 11, NULL),
+                   ==, 0);
+  g_assert_false (usbemu_device_get_endpoint_halt (USBEMU_DEVICE (device),
+                                                   0x81));
+  _client_submit (socket, 12, devid, 0x81, NULL, NULL, 8);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 12,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 0);
+
+  /* back to the default state. */
+  _client_submit (socket, 13, devid, 0x00, port_reset, NULL, 0);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 13, NULL),
+                   ==, 0);
+  g_assert_cmpuint (usbemu_device_get_active_configuration (USBEMU_DEVICE (device)),
+                    ==, 0);
+  g_assert_true (usbemu_device_get_attached (USBEMU_DEVICE (device)));
+}
+
+static void
+test_class_requests_1 (void)
+{
+  const guint8 interface_setup[8] = { 0xA1, 0x01, 0x00, 0x01,
+                                      0x00, 0x00, 0x08, 0x00 };
+  const guint8 endpoint_setup[8] = { 0xC2, 0x05, 0x00, 0x00,
+                                     0x81, 0x00, 0x08, 0x00 };
+  const guint8 no_interface_setup[8] = { 0xA1, 0x01, 0x00, 0x01,
+                                         0x01, 0x00, 0x08, 0x00 };
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  TestClassInterface *interface;
+  GSocket *socket;
+  guint32 devid, actual_length;
+  guint8 data[2];
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* not configured, so handled by the device. */
+  _client_submit (socket, 1, devid, 0x80, interface_setup, NULL, 8);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 1, NULL),
+                   ==, -32);
+
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  interface = TEST_CLASS_INTERFACE (
+      usbemu_device_lookup_interface (USBEMU_DEVICE (device), 0));
+  g_assert_nonnull (interface);
+  g_assert_null (usbemu_device_lookup_interface (USBEMU_DEVICE (device), 1));
+
+  _client_submit (socket, 2, devid, 0x80, interface_setup, NULL, 8);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 2,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 2);
+  _client_receive (socket, data, sizeof (data));
+  g_assert_cmpuint (data[0], ==, 0x01);
+  g_assert_cmpuint (data[1], ==, 0);
+
+  _client_submit (socket, 3, devid, 0x80, endpoint_setup, NULL, 8);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 3,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 2);
+  _client_receive (socket, data, sizeof (data));
+  g_assert_cmpuint (data[0], ==, 0x05);
+
+  _client_submit (socket, 4, devid, 0x80, no_interface_setup, NULL, 8);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 4, NULL),
+                   ==, -32);
+
+  g_assert_cmpuint (interface->n_requests, ==, 2);
+}
+
+static void
+test_batching_1 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  GSocket *socket;
+  UsbemuUsbipStats stats;
+  guint32 devid, actual_length, seqnum;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+  g_object_set (server, USBEMU_USBIP_SERVER_PROP_BATCH_SIZE, 4, NULL);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  g_assert_false (usbemu_usbip_server_get_stats (server,
+                                                 USBEMU_DEVICE (device),
+                                                 &stats));
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* queued while the server is not running, so decoded in one go. */
+  for (seqnum = 1; seqnum <= 8; seqnum++)
+    _client_submit (socket, seqnum, devid, 0x01, NULL, "hello", 5);
+  for (seqnum = 1; seqnum <= 8; seqnum++) {
+    g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, seqnum,
+                                          &actual_length), ==, 0);
+    g_assert_cmpuint (actual_length, ==, 5);
+  }
+
+  g_assert_true (usbemu_usbip_server_get_stats (server,
+                                                USBEMU_DEVICE (device),
+                                                &stats));
+  /* including the OP_REP_IMPORT. */
+  g_assert_cmpuint (stats.n_replies, ==, 9);
+  g_assert_cmpuint (stats.n_bytes, ==, 8 + 312 + 8 * 48);
+  g_assert_cmpuint (stats.n_send_calls, <, stats.n_replies);
+  g_assert_cmpuint (stats.max_queue_depth, <=, 4);
+}
+
+static gpointer
+_queue_worker (gpointer user_data)
+{
+  UsbemuEndpointQueue *queue = user_data;
+  UsbemuUrb *urb;
+
+  while ((urb = usbemu_endpoint_queue_pop_wait (queue)) != NULL) {
+    urb->actual_length = urb->buffer_length;
+    usbemu_endpoint_queue_complete (queue, urb, USBEMU_URB_STATUS_COMPLETED);
+  }
+
+  return NULL;
+}
+
+static void
+test_endpoint_queue_1 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  UsbemuEndpointQueue *queue;
+  GThread *worker;
+  GSocket *socket;
+  guint32 devid, actual_length, seqnum;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  /* smaller than the burst, so that submissions wait for room. */
+  queue = usbemu_endpoint_queue_new (8, NULL);
+  usbemu_device_set_endpoint_queue (USBEMU_DEVICE (device), 0x01, queue);
+  g_assert_true (usbemu_device_get_endpoint_queue (USBEMU_DEVICE (device),
+                                                   0x01) == queue);
+  worker = g_thread_new ("endpoint-queue", _queue_worker, queue);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  for (seqnum = 1; seqnum <= 64; seqnum++)
+    _client_submit (socket, seqnum, devid, 0x01, NULL, "hello", 5);
+  for (seqnum = 1; seqnum <= 64; seqnum++) {
+    g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, seqnum,
+                                          &actual_length), ==, 0);
+    g_assert_cmpuint (actual_length, ==, 5);
+  }
+  /* handled by the worker, not by the device class. */
+  g_assert_cmpuint (device->data->len, ==, 0);
+
+  usbemu_endpoint_queue_close (queue);
+  g_thread_join (worker);
+  usbemu_device_set_endpoint_queue (USBEMU_DEVICE (device), 0x01, NULL);
+  usbemu_endpoint_queue_unref (queue);
+
+  _client_submit (socket, 100, devid, 0x01, NULL, "hello", 5);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 100, NULL),
+                   ==, 0);
+  g_assert_cmpuint (device->data->len, ==, 5);
+}
+
+static void
+test_endpoint_queue_2 (void)
+{
+  const struct rlimit limit = { 0, 0 };
+  UsbemuEndpointQueue *queue;
+  GError *error = NULL;
+
+  if (g_test_subprocess ()) {
+    /* no file descriptor left for the wakeups. */
+    g_assert_cmpint (setrlimit (RLIMIT_NOFILE, &limit), ==, 0);
+    queue = usbemu_endpoint_queue_new (8, &error);
+    g_assert_null (queue);
+    g_assert_nonnull (error);
+    g_clear_error (&error);
+    return;
+  }
+
+  g_test_trap_subprocess (NULL, 0, 0);
+  g_test_trap_assert_passed ();
+}
+
+static UsbemuUrb*
+_queue_pop_iterating (UsbemuEndpointQueue *queue)
+{
+  UsbemuUrb *urb;
+
+  while ((urb = usbemu_endpoint_queue_pop (queue)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  return urb;
+}
+
+static void
+test_endpoint_queue_3 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  UsbemuEndpointQueue *queue;
+  GSocket *socket;
+  UsbemuUrb *urbs[4];
+  guint8 data[256];
+  guint32 devid, actual_length;
+  guint i, j;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  queue = usbemu_endpoint_queue_new (8, NULL);
+  usbemu_device_set_endpoint_queue (USBEMU_DEVICE (device), 0x01, queue);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* each received alone, and kept pending while the next ones arrive. */
+  for (i = 0; i < G_N_ELEMENTS (urbs); i++) {
+    memset (data, 'a' + i, sizeof (data));
+    _client_submit (socket, i + 1, devid, 0x01, NULL, data, sizeof (data));
+    urbs[i] = _queue_pop_iterating (queue);
+    g_assert_cmpuint (urbs[i]->seqnum, ==, i + 1);
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (urbs); i++) {
+    g_assert_cmpuint (urbs[i]->buffer_length, ==, sizeof (data));
+    for (j = 0; j < sizeof (data); j++)
+      g_assert_cmpuint (urbs[i]->buffer[j], ==, 'a' + i);
+
+    urbs[i]->actual_length = urbs[i]->buffer_length;
+    usbemu_endpoint_queue_complete (queue, urbs[i],
+                                    USBEMU_URB_STATUS_COMPLETED);
+    g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, i + 1,
+                                          &actual_length), ==, 0);
+    g_assert_cmpuint (actual_length, ==, sizeof (data));
+  }
+
+  usbemu_device_set_endpoint_queue (USBEMU_DEVICE (device), 0x01, NULL);
+  usbemu_endpoint_queue_unref (queue);
+}
+
+/* Fills packets with their index, except the eighth one. */
+static gsize
+_iso_fill (UsbemuIsoStream *stream,
+           guint8          *data,
+           gsize            length,
+           gpointer         user_data)
+{
+  guint *n_calls = user_data;
+
+  if (++(*n_calls) == 8)
+    return 0;
+
+  memset (data, *n_calls, length);
+  return length;
+}
+
+static void
+_client_submit_iso (GSocket *socket,
+                    guint32  seqnum,
+                    guint32  devid,
+                    guint8   endpoint_address,
+                    guint    n_packets,
+                    guint    packet_length)
+{
+  guint8 header[USBIP_HEADER_SIZE] = { 0, };
+  guint8 descriptor[USBIP_ISO_PACKET_SIZE] = { 0, };
+  guint i;
+
+  put_u32 (header, USBIP_CMD_SUBMIT);
+  put_u32 (header + 4, seqnum);
+  put_u32 (header + 8, devid);
+  put_u32 (header + 12, 1);
+  put_u32 (header + 16, endpoint_address & 0x0F);
+  put_u32 (header + 20, USBEMU_URB_FLAG_ISO_ASAP);
+  put_u32 (header + 24, n_packets * packet_length);
+  put_u32 (header + 32, n_packets);
+  put_u32 (header + 36, 1);
+  _client_send (socket, header, sizeof (header));
+
+  for (i = 0; i < n_packets; i++) {
+    put_u32 (descriptor, i * packet_length);
+    put_u32 (descriptor + 4, packet_length);
+    _client_send (socket, descriptor, sizeof (descriptor));
+  }
+}
+
+/* Receive the packed data and packet descriptors of an isochronous IN
+ * reply, and check the data against _iso_fill(). */
+static void
+_client_receive_iso (GSocket *socket,
+                     guint32  actual_length,
+                     guint    n_packets,
+                     guint    first_call,
+                     guint   *packet_lengths)
+{
+  guint8 *data, descriptor[USBIP_ISO_PACKET_SIZE];
+  guint i, j, offset;
+
+  data = g_malloc (actual_length);
+  _client_receive (socket, data, actual_length);
+
+  for (i = 0, offset = 0; i < n_packets; i++) {
+    _client_receive (socket, descriptor, sizeof (descriptor));
+    g_assert_cmpint ((gint32) get_u32 (descriptor + 12), ==, 0);
+    packet_lengths[i] = get_u32 (descriptor + 8);
+    for (j = 0; j < packet_lengths[i]; j++)
+      g_assert_cmpuint (data[offset + j], ==, first_call + i);
+    offset += packet_lengths[i];
+  }
+  g_assert_cmpuint (offset, ==, actual_length);
+
+  g_free (data);
+}
+
+static void
+test_iso_stream_1 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  UsbemuIsoStream *stream;
+  UsbemuIsoStreamStats stats;
+  GSocket *socket;
+  guint32 devid, actual_length;
+  guint n_calls = 0, lengths[8];
+  gint64 start;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_iso_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  /* 44.1 kHz 16-bit stereo, 176.4 bytes per 1 ms interval. */
+  stream = usbemu_iso_stream_new (176400, _iso_fill, &n_calls, NULL);
+  usbemu_device_set_iso_stream (USBEMU_DEVICE (device), 0x83, stream);
+  g_assert_true (usbemu_device_get_iso_stream (USBEMU_DEVICE (device),
+                                               0x83) == stream);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  start = g_get_monotonic_time ();
+  _client_submit_iso (socket, 1, devid, 0x83, 8, 192);
+  _client_submit_iso (socket, 2, devid, 0x83, 8, 192);
+
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 1,
+                                        &actual_length), ==, 0);
+  g_assert_cmpint (g_get_monotonic_time () - start, >=, 8 * 1000);
+  g_assert_cmpuint (actual_length, ==, 1234);
+  _client_receive_iso (socket, actual_length, 8, 1, lengths);
+  g_assert_cmpuint (lengths[0], ==, 176);
+  g_assert_cmpuint (lengths[2], ==, 177);
+  /* underrun */
+  g_assert_cmpuint (lengths[7], ==, 0);
+
+  /* queued back to back, the fractional remainder carried over. */
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 2,
+                                        &actual_length), ==, 0);
+  g_assert_cmpint (g_get_monotonic_time () - start, >=, 16 * 1000);
+  g_assert_cmpuint (actual_length, ==, 2822 - 1411);
+  _client_receive_iso (socket, actual_length, 8, 9, lengths);
+
+  usbemu_iso_stream_get_stats (stream, &stats);
+  g_assert_cmpuint (stats.n_urbs, ==, 2);
+  g_assert_cmpuint (stats.n_packets, ==, 16);
+  g_assert_cmpuint (stats.n_bytes, ==, 1234 + 1411);
+  g_assert_cmpuint (stats.n_underruns, ==, 1);
+  g_assert_cmpuint (stats.n_missed_frames, ==, 0);
+
+  /* the host falls behind. */
+  g_usleep (5 * 1000);
+  _client_submit_iso (socket, 3, devid, 0x83, 1, 192);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 3,
+                                        &actual_length), ==, 0);
+  _client_receive_iso (socket, actual_length, 1, 17, lengths);
+  usbemu_iso_stream_get_stats (stream, &stats);
+  g_assert_cmpuint (stats.n_missed_frames, >=, 4);
+
+  usbemu_device_set_iso_stream (USBEMU_DEVICE (device), 0x83, NULL);
+  usbemu_iso_stream_unref (stream);
+}
+
+/* Receive the RET_SUBMIT header of an isochronous URB and return its
+ * start_frame. */
+static guint32
+_client_receive_iso_ret (GSocket *socket,
+                         guint32  seqnum,
+                         guint32 *actual_length)
+{
+  guint8 header[USBIP_HEADER_SIZE];
+
+  _client_receive (socket, header, sizeof (header));
+  g_assert_cmpuint (get_u32 (header), ==, USBIP_RET_SUBMIT);
+  g_assert_cmpuint (get_u32 (header + 4), ==, seqnum);
+  g_assert_cmpint ((gint32) get_u32 (header + 20), ==, 0);
+  *actual_length = get_u32 (header + 24);
+
+  return get_u32 (header + 28);
+}
+
+static void
+test_iso_stream_2 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  UsbemuIsoStream *stream;
+  GSocket *socket;
+  guint32 devid, actual_length, start_frame;
+  guint n_calls = 0, lengths[32];
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_iso_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  stream = usbemu_iso_stream_new (0, _iso_fill, &n_calls, NULL);
+  usbemu_device_set_iso_stream (USBEMU_DEVICE (device), 0x83, stream);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* the second URB is cancelled while the first one is in progress. */
+  _client_submit_iso (socket, 1, devid, 0x83, 32, 192);
+  _client_submit_iso (socket, 2, devid, 0x83, 8, 192);
+  _client_unlink (socket, 3, devid, 2);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_UNLINK, 3, NULL),
+                   ==, -104);
+  _client_submit_iso (socket, 4, devid, 0x83, 8, 192);
+
+  start_frame = _client_receive_iso_ret (socket, 1, &actual_length);
+  _client_receive_iso (socket, actual_length, 32, 1, lengths);
+
+  /* scheduled in the frames the cancelled URB gave back. */
+  g_assert_cmpuint (_client_receive_iso_ret (socket, 4, &actual_length), ==,
+                    (start_frame + 32) & 0x7FF);
+  _client_receive_iso (socket, actual_length, 8, 33, lengths);
+
+  usbemu_device_set_iso_stream (USBEMU_DEVICE (device), 0x83, NULL);
+  usbemu_iso_stream_unref (stream);
+}
+
+typedef struct {
+  guint n_polls;
+  guint n_reports;
+  guint n_answered;
+  gint64 answered[4];
+} TestReports;
+
+/* Answers with a report of 8 bytes set to its index if one is queued. */
+static gboolean
+_poll_reports (UsbemuDevice *device,
+               UsbemuUrb    *urb,
+               gpointer      user_data)
+{
+  TestReports *reports = user_data;
+
+  reports->n_polls++;
+  if (reports->n_reports == 0)
+    return FALSE;
+
+  reports->n_reports--;
+  urb->actual_length = MIN (urb->buffer_length, 8);
+  memset (urb->buffer, reports->n_answered, urb->actual_length);
+  reports->answered[reports->n_answered++] = g_get_monotonic_time ();
+
+  return TRUE;
+}
+
+static void
+_client_receive_report (GSocket *socket,
+                        guint32  seqnum,
+                        guint8   index)
+{
+  guint8 data[8];
+  guint32 actual_length;
+
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, seqnum,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, sizeof (data));
+  _client_receive (socket, data, sizeof (data));
+  g_assert_cmpuint (data[0], ==, index);
+  g_assert_cmpuint (data[7], ==, index);
+}
+
+static void
+test_interrupt_poll_1 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  TestReports reports = { 0, };
+  GSocket *socket;
+  guint32 devid;
+  gint64 start, woken;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+  usbemu_device_set_interrupt_poll (USBEMU_DEVICE (device), 0x82,
+                                    _poll_reports, &reports, NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* NAKed once per interval of 10 ms, never more often. */
+  start = g_get_monotonic_time ();
+  _client_submit (socket, 1, devid, 0x82, NULL, NULL, 8);
+  while (g_get_monotonic_time () - start < 35 * 1000)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpuint (reports.n_polls, >=, 2);
+  g_assert_cmpuint (reports.n_polls, <=,
+                    (g_get_monotonic_time () - start) / 10000 + 1);
+
+  /* polled right away once data is queued. */
+  reports.n_reports = 1;
+  woken = g_get_monotonic_time ();
+  usbemu_device_wake_interrupt (USBEMU_DEVICE (device), 0x82);
+  _client_receive_report (socket, 1, 0);
+  g_assert_cmpint (reports.answered[0] - woken, <, 10000);
+
+  /* and at the declared cadence from then on. */
+  reports.n_reports = 2;
+  _client_submit (socket, 2, devid, 0x82, NULL, NULL, 8);
+  _client_submit (socket, 3, devid, 0x82, NULL, NULL, 8);
+  _client_receive_report (socket, 2, 1);
+  _client_receive_report (socket, 3, 2);
+  g_assert_cmpint (reports.answered[1] - reports.answered[0], >=, 9000);
+  g_assert_cmpint (reports.answered[2] - reports.answered[1], >=, 9000);
+
+  usbemu_device_set_interrupt_poll (USBEMU_DEVICE (device), 0x82,
+                                    NULL, NULL, NULL);
+}
+
+/* Send a hub class request without data stage to @port and expect it to
+ * complete. */
+static void
+_client_port_feature (GSocket *socket,
+                      guint32  seqnum,
+                      guint32  devid,
+                      guint8   request,
+                      guint8   feature,
+                      guint8   port)
+{
+  const guint8 setup[8] = { 0x23, request, feature, 0x00,
+                            port, 0x00, 0x00, 0x00 };
+
+  _client_submit (socket, seqnum, devid, 0x00, setup, NULL, 0);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, seqnum,
+                                        NULL), ==, 0);
+}
+
+static guint32
+_client_port_status (GSocket *socket,
+                     guint32  seqnum,
+                     guint32  devid,
+                     guint8   port)
+{
+  const guint8 setup[8] = { 0xA3, 0x00, 0x00, 0x00,
+                            port, 0x00, 0x04, 0x00 };
+  guint32 actual_length;
+  guint8 data[4];
+
+  _client_submit (socket, seqnum, devid, 0x80, setup, NULL, 4);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, seqnum,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 4);
+  _client_receive (socket, data, sizeof (data));
+
+  /* wPortStatus in the low half, wPortChange in the high half. */
+  return data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+}
+
+static void
+test_hub_1 (void)
+{
+  const guint8 descriptor_setup[8] = { 0xA0, 0x06, 0x00, 0x29,
+                                       0x00, 0x00, 0x10, 0x00 };
+  const guint8 device_setup[8] = { 0x80, 0x06, 0x00, 0x01,
+                                   0x00, 0x00, 0x12, 0x00 };
+  const guint8 address_setup[8] = { 0x00, 0x05, 0x05, 0x00,
+                                    0x00, 0x00, 0x00, 0x00 };
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  UsbemuHub *hub;
+  UsbemuDevice *devices[3];
+  UsbemuHubPortStatus status;
+  UsbemuHubPortChange change;
+  GSocket *socket;
+  guint32 devid, bus, actual_length;
+  guint8 data[18];
+  guint i;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  hub = usbemu_hub_new (4);
+  g_test_queue_unref (hub);
+  for (i = 0; i < G_N_ELEMENTS (devices); i++) {
+    devices[i] = usbemu_device_new ();
+    g_test_queue_unref (devices[i]);
+  }
+  usbemu_device_set_specification_num (devices[1], 0x200);
+  g_assert_true (usbemu_hub_attach_device (hub, 1, devices[0], NULL));
+  g_assert_true (usbemu_hub_attach_device (hub, 2, devices[1], NULL));
+  g_assert_true (usbemu_hub_attach_device (hub, 4, devices[2], NULL));
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (hub), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (hub), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* attached along with the hub. */
+  g_assert_true (usbemu_device_get_attached (devices[0]));
+  g_assert_true (usbemu_device_get_attached (devices[2]));
+
+  _client_submit (socket, 1, devid, 0x80, descriptor_setup, NULL, 16);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 1,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 9);
+  _client_receive (socket, data, actual_length);
+  g_assert_cmpuint (data[1], ==, 0x29);
+  g_assert_cmpuint (data[2], ==, 4);
+
+  /* All connections are reported in one bitmap once ports are powered. */
+  for (i = 1; i <= 4; i++)
+    _client_port_feature (socket, 1 + i, devid, 0x03, 8, i);
+  _client_submit (socket, 6, devid, 0x81, NULL, NULL, 1);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 6,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 1);
+  _client_receive (socket, data, 1);
+  g_assert_cmpuint (data[0], ==, (1 << 1) | (1 << 2) | (1 << 4));
+
+  g_assert_cmphex (_client_port_status (socket, 7, devid, 1), ==,
+                   0x00010101);
+  g_assert_cmphex (_client_port_status (socket, 8, devid, 2), ==,
+                   0x00010501);
+  g_assert_cmphex (_client_port_status (socket, 9, devid, 3), ==,
+                   0x00000100);
+
+  _client_port_feature (socket, 10, devid, 0x01, 16, 1);
+  _client_port_feature (socket, 11, devid, 0x01, 16, 2);
+  _client_port_feature (socket, 12, devid, 0x01, 16, 4);
+
+  /* Nothing left to report until port 1 is reset, which reaches the hub
+   * instead of resetting it. */
+  _client_submit (socket, 13, devid, 0x81, NULL, NULL, 1);
+  _client_port_feature (socket, 14, devid, 0x03, 4, 1);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 13,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 1);
+  _client_receive (socket, data, 1);
+  g_assert_cmpuint (data[0], ==, 1 << 1);
+
+  usbemu_hub_get_port_status (hub, 1, &status, &change);
+  g_assert_cmphex (status, ==, USBEMU_HUB_PORT_STATUS_CONNECTION |
+                               USBEMU_HUB_PORT_STATUS_ENABLE |
+                               USBEMU_HUB_PORT_STATUS_POWER);
+  g_assert_cmphex (change, ==, USBEMU_HUB_PORT_CHANGE_RESET);
+
+  /* Only the enabled port answers the default address. */
+  g_assert_true (usbemu_hub_lookup_address (hub, 0) == devices[0]);
+
+  /* and requests with that address as devnum reach it, up to SET_ADDRESS. */
+  bus = devid & 0xFFFF0000;
+  _client_submit (socket, 15, bus, 0x80, device_setup, NULL, 18);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 15,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 18);
+  _client_receive (socket, data, actual_length);
+  g_assert_cmpuint (data[1], ==, 0x01);
+
+  _client_submit (socket, 16, bus, 0x00, address_setup, NULL, 0);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 16, NULL),
+                   ==, 0);
+  g_assert_cmpuint (usbemu_device_get_address (devices[0]), ==, 5);
+
+  _client_submit (socket, 17, bus | 5, 0x80, device_setup, NULL, 18);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 17,
+                                        &actual_length), ==, 0);
+  _client_receive (socket, data, actual_length);
+
+  /* nothing answers the default address anymore. */
+  _client_submit (socket, 18, bus, 0x80, device_setup, NULL, 18);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 18, NULL),
+                   ==, -108);
+}
+
+static void
+_submit_pending (UsbemuDevice *device)
+{
+  UsbemuUrb *urb;
+
+  urb = usbemu_urb_new (0x82, 8, 0);
+  usbemu_device_submit_urb (device, urb, NULL, NULL);
+  usbemu_urb_unref (urb);
+  g_assert_nonnull (usbemu_device_peek_urb (device, 0x82));
+}
+
+static void
+test_hub_2 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  UsbemuHub *hubs[2];
+  UsbemuDevice *devices[2];
+  GSocket *socket;
+  guint i;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  hubs[0] = usbemu_hub_new (2);
+  hubs[1] = usbemu_hub_new (1);
+  for (i = 0; i < G_N_ELEMENTS (devices); i++) {
+    g_test_queue_unref (hubs[i]);
+    devices[i] = USBEMU_DEVICE (_new_loopback_device ());
+    g_test_queue_unref (devices[i]);
+    usbemu_device_set_active_configuration (devices[i], 1);
+  }
+  g_assert_true (usbemu_hub_attach_device (hubs[0], 1, devices[0], NULL));
+  g_assert_true (usbemu_hub_attach_device (hubs[0], 2, USBEMU_DEVICE (hubs[1]),
+                                           NULL));
+  g_assert_true (usbemu_hub_attach_device (hubs[1], 1, devices[1], NULL));
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (hubs[0]), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (hubs[0]), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  _client_import (socket, "1-1", 0);
+
+  /* unplugging cancels what is pending on the device. */
+  _submit_pending (devices[0]);
+  g_assert_true (usbemu_hub_detach_device (hubs[0], 1));
+  g_assert_null (usbemu_device_peek_urb (devices[0], 0x82));
+
+  /* a reset of a hub in between cancels what is behind it. */
+  _submit_pending (devices[1]);
+  usbemu_device_reset (USBEMU_DEVICE (hubs[1]));
+  g_assert_null (usbemu_device_peek_urb (devices[1], 0x82));
+
+  /* and so does the host going away, however deep. */
+  _submit_pending (devices[1]);
+  g_socket_close (socket, NULL);
+  while (usbemu_device_get_attached (USBEMU_DEVICE (hubs[0])))
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_null (usbemu_device_peek_urb (devices[1], 0x82));
+}
+
+static void
+test_enumeration_2 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  UsbemuDevice *device;
+  GSocket *socket;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = USBEMU_DEVICE (_new_loopback_device ());
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (device, 1);
+  usbemu_usbip_server_export_device (server, device, "1-1", NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  _client_import (socket, "1-1", 0);
+
+  /* endpoints still routed keep their URBs, */
+  _submit_pending (device);
+  g_assert_true (usbemu_device_set_active_configuration (device, 1));
+  g_assert_nonnull (usbemu_device_peek_urb (device, 0x82));
+
+  /* those dropped have them cancelled. */
+  g_assert_true (usbemu_device_set_active_configuration (device, 0));
+  g_assert_null (usbemu_device_peek_urb (device, 0x82));
+}
+
+/* Wait for the status change report of an imported hub, then clear the
+ * connection change of all @n_ports ports with pipelined requests, as the
+ * host does. */
+static guint32
+_client_handle_hub_changes (GSocket *socket,
+                            guint32  seqnum,
+                            guint32  devid,
+                            guint    n_ports)
+{
+  guint8 setup[8] = { 0x23, 0x01, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  guint8 bitmap[32];
+  guint32 actual_length;
+  guint i;
+
+  _client_submit (socket, seqnum, devid, 0x81, NULL, NULL, sizeof (bitmap));
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, seqnum,
+                                        &actual_length), ==, 0);
+  /* a bit per port and one for the hub. */
+  g_assert_cmpuint (actual_length, ==, (n_ports + 8) / 8);
+  _client_receive (socket, bitmap, actual_length);
+  seqnum++;
+
+  for (i = 1; i <= n_ports; i++) {
+    setup[4] = i;
+    _client_submit (socket, seqnum + i, devid, 0x00, setup, NULL, 0);
+  }
+  for (i = 1; i <= n_ports; i++) {
+    g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT,
+                                          seqnum + i, NULL), ==, 0);
+  }
+
+  return seqnum + n_ports + 1;
+}
+
+/* Plug and unplug all ports of an imported hub, one device at a time or all
+ * at once, with the host handling the port changes after each. Returns
+ * seconds elapsed. */
+static gdouble
+_attach_storm (GSocket       *socket,
+               guint32        devid,
+               UsbemuHub     *hub,
+               UsbemuDevice **devices,
+               guint          n_devices,
+               guint          n_rounds,
+               gboolean       bulk)
+{
+  guint32 seqnum;
+  guint round, i;
+
+  g_test_timer_start ();
+  for (round = 0, seqnum = 1000; round < n_rounds; round++) {
+    if (bulk) {
+      g_assert_true (usbemu_hub_attach_devices (hub, 1, devices, n_devices,
+                                                NULL));
+    } else {
+      for (i = 0; i < n_devices; i++)
+        g_assert_true (usbemu_hub_attach_device (hub, i + 1, devices[i],
+                                                 NULL));
+    }
+    seqnum = _client_handle_hub_changes (socket, seqnum, devid, n_devices);
+
+    if (bulk) {
+      usbemu_hub_detach_devices (hub, 1, n_devices);
+    } else {
+      for (i = 0; i < n_devices; i++)
+        usbemu_hub_detach_device (hub, i + 1);
+    }
+    seqnum = _client_handle_hub_changes (socket, seqnum, devid, n_devices);
+  }
+
+  return g_test_timer_elapsed ();
+}
+
+static void
+test_perf_attach_storm_1 (void)
+{
+  const guint n_rounds = 50;
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  UsbemuHub *hub;
+  UsbemuDevice *devices[USBEMU_HUB_MAX_PORTS];
+  GSocket *socket;
+  guint32 devid;
+  gdouble single, bulk;
+  guint i;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  hub = usbemu_hub_new (USBEMU_HUB_MAX_PORTS);
+  g_test_queue_unref (hub);
+  for (i = 0; i < G_N_ELEMENTS (devices); i++) {
+    devices[i] = usbemu_device_new ();
+    g_test_queue_unref (devices[i]);
+  }
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (hub), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (hub), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  for (i = 1; i <= USBEMU_HUB_MAX_PORTS; i++)
+    _client_port_feature (socket, i, devid, 0x03, 8, i);
+
+  single = _attach_storm (socket, devid, hub, devices, G_N_ELEMENTS (devices),
+                          n_rounds, FALSE);
+  bulk = _attach_storm (socket, devid, hub, devices, G_N_ELEMENTS (devices),
+                        n_rounds, TRUE);
+
+  g_test_maximized_result (n_rounds * G_N_ELEMENTS (devices) / single,
+                           "attach and detach one by one: %.0f devices/s",
+                           n_rounds * G_N_ELEMENTS (devices) / single);
+  g_test_maximized_result (n_rounds * G_N_ELEMENTS (devices) / bulk,
+                           "attach and detach in bulk: %.0f devices/s",
+                           n_rounds * G_N_ELEMENTS (devices) / bulk);
+}
+
+/* Seconds to run @n_rounds rounds of @window bulk OUT transfers through
+ * the loopback device, with or without io_uring. */
+static gdouble
+_loopback_storm (gboolean          io_uring,
+                 guint             n_rounds,
+                 guint             window,
+                 UsbemuUsbipStats *stats)
+{
+  const guint8 data[64] = { 0, };
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  GSocket *socket;
+  guint32 devid, seqnum;
+  gdouble elapsed;
+  guint round, i;
+
+  server = _start_server (&address);
+  g_object_set (server, USBEMU_USBIP_SERVER_PROP_IO_URING, io_uring, NULL);
+
+  device = _new_loopback_device ();
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  devid = _client_import (socket, "1-1", 0);
+
+  seqnum = 1;
+  g_test_timer_start ();
+  for (round = 0; round < n_rounds; round++) {
+    for (i = 0; i < window; i++)
+      _client_submit (socket, seqnum + i, devid, 0x01, NULL, data,
+                      sizeof (data));
+    for (i = 0; i < window; i++)
+      g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT,
+                                            seqnum + i, NULL), ==, 0);
+    seqnum += window;
+  }
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_true (usbemu_usbip_server_get_stats (server,
+                                                USBEMU_DEVICE (device),
+                                                stats));
+
+  g_object_unref (socket);
+  g_object_unref (server);
+  g_object_unref (device);
+  g_object_unref (address);
+
+  return elapsed;
+}
+
+static void
+test_perf_io_uring_1 (void)
+{
+  const guint n_rounds = 2000;
+  const guint window = 64;
+  UsbemuUsbipStats stats;
+  gdouble elapsed;
+
+  elapsed = _loopback_storm (FALSE, n_rounds, window, &stats);
+  g_test_maximized_result (n_rounds * window / elapsed,
+                           "polling sockets: %.0f URBs/s, %.2f writes/URB",
+                           n_rounds * window / elapsed,
+                           (gdouble) stats.n_send_calls / stats.n_replies);
+
+  if (!usbemu_usbip_server_io_uring_available ()) {
+    g_test_skip ("io_uring not available");
+    return;
+  }
+
+  elapsed = _loopback_storm (TRUE, n_rounds, window, &stats);
+  g_test_maximized_result (n_rounds * window / elapsed,
+                           "io_uring: %.0f URBs/s, %.2f writes/URB",
+                           n_rounds * window / elapsed,
+                           (gdouble) stats.n_send_calls / stats.n_replies);
+}
+
+static void
+test_unlink_1 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  GSocket *socket;
+  guint32 devid;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* pending URB is answered by RET_UNLINK only. */
+  _client_submit (socket, 1, devid, 0x82, NULL, NULL, 8);
+  _client_unlink (socket, 2, devid, 1);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_UNLINK, 2, NULL),
+                   ==, -104);
+  g_assert_null (usbemu_device_peek_urb (USBEMU_DEVICE (device), 0x82));
+
+  /* unknown or completed URB. */
+  _client_unlink (socket, 3, devid, 1);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_UNLINK, 3, NULL),
+                   ==, 0);
+
+  /* disconnecting cancels pending URBs. */
+  _client_submit (socket, 4, devid, 0x82, NULL, NULL, 8);
+  while (usbemu_device_peek_urb (USBEMU_DEVICE (device), 0x82) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  g_socket_close (socket, NULL);
+  while (usbemu_device_get_attached (USBEMU_DEVICE (device)))
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_null (usbemu_device_peek_urb (USBEMU_DEVICE (device), 0x82));
+}
+
+static void
+test_unlink_2 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  GSocket *socket;
+  UsbemuUrb *urb;
+  guint32 devid, seqnum;
+  guint n;
+
+  server = _start_server (&address);
+  g_test_queue_unref (server);
+  g_test_queue_unref (address);
+
+  device = _new_loopback_device ();
+  g_test_queue_unref (device);
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* enough to grow the in-flight table several times. */
+  for (seqnum = 1; seqnum <= 200; seqnum++)
+    _client_submit (socket, seqnum, devid, 0x82, NULL, NULL, 8);
+  while (usbemu_device_lookup_urb (USBEMU_DEVICE (device), 200) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  /* queued in submission order. */
+  n = 0;
+  for (urb = usbemu_device_peek_urb (USBEMU_DEVICE (device), 0x82);
+       urb != NULL; urb = usbemu_urb_next (urb))
+    g_assert_cmpuint (urb->seqnum, ==, ++n);
+  g_assert_cmpuint (n, ==, 200);
+
+  /* out of order cancellation: odd ones, then even ones backwards. */
+  for (seqnum = 1; seqnum <= 200; seqnum += 2)
+    _client_unlink (socket, 1000 + seqnum, devid, seqnum);
+  for (seqnum = 1; seqnum <= 200; seqnum += 2)
+    g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_UNLINK,
+                                          1000 + seqnum, NULL), ==, -104);
+  for (seqnum = 2; seqnum <= 200; seqnum += 2) {
+    urb = usbemu_device_lookup_urb (USBEMU_DEVICE (device), seqnum);
+    g_assert_nonnull (urb);
+    g_assert_cmpuint (urb->seqnum, ==, seqnum);
+    g_assert_null (usbemu_device_lookup_urb (USBEMU_DEVICE (device),
+                                             seqnum - 1));
+  }
+
+  for (seqnum = 200; seqnum >= 2; seqnum -= 2)
+    _client_unlink (socket, 1000 + seqnum, devid, seqnum);
+  for (seqnum = 200; seqnum >= 2; seqnum -= 2)
+    g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_UNLINK,
+                                          1000 + seqnum, NULL), ==, -104);
+  g_assert_null (usbemu_device_peek_urb (USBEMU_DEVICE (device), 0x82));
+}
+
+static void
+test_runtime_1 (void)
+{
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  UsbemuRuntime *runtime;
+  GSocket *socket;
+  guint32 devid, actual_length;
+  gchar data[5];
+
+  server = _start_server (&address);
+  g_test_queue_unref (address);
+
+  runtime = usbemu_runtime_new (2);
+  device = _new_loopback_device ();
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (device), 1);
+  usbemu_runtime_assign_device (runtime, USBEMU_DEVICE (device));
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (device), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* The worker serves the connection from now on, not this thread. */
+  g_socket_set_blocking (socket, TRUE);
+
+  _client_submit (socket, 1, devid, 0x01, NULL, "hello", 5);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 1,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 5);
+
+  _client_submit (socket, 2, devid, 0x81, NULL, NULL, 64);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 2,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 5);
+  _client_receive (socket, data, sizeof (data));
+  g_assert_cmpmem (data, sizeof (data), "hello", 5);
+
+  g_assert_nonnull (device->thread);
+  g_assert_true (device->thread != g_thread_self ());
+  g_assert_true (usbemu_device_get_attached (USBEMU_DEVICE (device)));
+
+  /* Closes the connection in the worker. */
+  g_assert_true (usbemu_usbip_server_unexport_device (server,
+                                                      USBEMU_DEVICE (device)));
+  g_assert_false (usbemu_device_get_attached (USBEMU_DEVICE (device)));
+
+  g_object_unref (server);
+  g_object_unref (device);
+  g_object_unref (runtime);
+}
+
+static void
+test_runtime_2 (void)
+{
+  const guint8 configuration_setup[8] = { 0x00, 0x09, 0x01, 0x00,
+                                          0x00, 0x00, 0x00, 0x00 };
+  UsbemuUsbipServer *server;
+  GSocketAddress *address;
+  TestLoopbackDevice *device;
+  UsbemuEndpointQueue *queue;
+  UsbemuRuntime *runtime;
+  UsbemuHub *hub;
+  GThread *worker;
+  GSocket *socket;
+  guint32 devid, bus, actual_length;
+
+  server = _start_server (&address);
+  g_test_queue_unref (address);
+
+  runtime = usbemu_runtime_new (2);
+  hub = usbemu_hub_new (1);
+  device = _new_loopback_device ();
+  g_assert_true (usbemu_hub_attach_device (hub, 1, USBEMU_DEVICE (device),
+                                           NULL));
+  usbemu_device_set_active_configuration (USBEMU_DEVICE (hub), 1);
+
+  /* devices behind the hub follow it to its worker. */
+  usbemu_runtime_assign_device (runtime, USBEMU_DEVICE (hub));
+  g_assert_nonnull (usbemu_device_get_context (USBEMU_DEVICE (hub)));
+  g_assert_true (usbemu_device_get_context (USBEMU_DEVICE (device)) ==
+                 usbemu_device_get_context (USBEMU_DEVICE (hub)));
+
+  queue = usbemu_endpoint_queue_new (8, NULL);
+  usbemu_device_set_endpoint_queue (USBEMU_DEVICE (device), 0x01, queue);
+  worker = g_thread_new ("endpoint-queue", _queue_worker, queue);
+  usbemu_usbip_server_export_device (server, USBEMU_DEVICE (hub), "1-1",
+                                     NULL);
+
+  socket = _client_connect (address);
+  g_test_queue_unref (socket);
+  devid = _client_import (socket, "1-1", 0);
+
+  /* Nothing completes in this thread from now on, so that completions
+   * bound to it would time out. */
+  g_socket_set_blocking (socket, TRUE);
+  g_socket_set_timeout (socket, 10);
+
+  _client_port_feature (socket, 1, devid, 0x03, 8, 1);
+  _client_port_feature (socket, 2, devid, 0x03, 4, 1);
+  bus = devid & 0xFFFF0000;
+  _client_submit (socket, 3, bus, 0x00, configuration_setup, NULL, 0);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 3, NULL),
+                   ==, 0);
+
+  _client_submit (socket, 4, bus, 0x01, NULL, "hello", 5);
+  g_assert_cmpint (_client_receive_ret (socket, USBIP_RET_SUBMIT, 4,
+                                        &actual_length), ==, 0);
+  g_assert_cmpuint (actual_length, ==, 5);
+  /* handled by the queue worker, not by the device class. */
+  g_assert_cmpuint (device->data->len, ==, 0);
+
+  g_assert_true (usbemu_usbip_server_unexport_device (server,
+                                                      USBEMU_DEVICE (hub)));
+  usbemu_endpoint_queue_close (queue);
+  g_thread_join (worker);
+
+  /* and leave it once unplugged. */
+  g_assert_true (usbemu_hub_detach_device (hub, 1));
+  g_assert_null (usbemu_device_get_context (USBEMU_DEVICE (device)));
+
+  usbemu_device_set_endpoint_queue (USBEMU_DEVICE (device), 0x01, NULL);
+  usbemu_endpoint_queue_unref (queue);
+  g_object_unref (server);
+  g_object_unref (device);
+  g_object_unref (hub);
+  g_object_unref (runtime);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, NULL);
+  g_test_bug_base (PACKAGE_BUGREPORT);
+
+  g_test_add_func ("/UsbemuUsbipServer/devlist", test_devlist_1);
+  g_test_add_func ("/UsbemuUsbipServer/import", test_import_1);
+  g_test_add_func ("/UsbemuUsbipServer/submit", test_submit_1);
+  g_test_add_func ("/UsbemuUsbipServer/submit/poll", test_submit_2);
+  g_test_add_func ("/UsbemuUsbipServer/enumeration", test_enumeration_1);
+  g_test_add_func ("/UsbemuUsbipServer/enumeration/cancel",
+                   test_enumeration_2);
+  g_test_add_func ("/UsbemuUsbipServer/class-requests", test_class_requests_1);
+  g_test_add_func ("/UsbemuUsbipServer/batching", test_batching_1);
+  g_test_add_func ("/UsbemuUsbipServer/endpoint-queue",
+                   test_endpoint_queue_1);
+  g_test_add_func ("/UsbemuUsbipServer/endpoint-queue/no-fd",
+                   test_endpoint_queue_2);
+  g_test_add_func ("/UsbemuUsbipServer/endpoint-queue/deferred",
+                   test_endpoint_queue_3);
+  g_test_add_func ("/UsbemuUsbipServer/iso-stream", test_iso_stream_1);
+  g_test_add_func ("/UsbemuUsbipServer/iso-stream/cancel", test_iso_stream_2);
+  g_test_add_func ("/UsbemuUsbipServer/interrupt-poll",
+                   test_interrupt_poll_1);
+  g_test_add_func ("/UsbemuUsbipServer/hub", test_hub_1);
+  g_test_add_func ("/UsbemuUsbipServer/hub/cancel", test_hub_2);
+  g_test_add_func ("/UsbemuUsbipServer/runtime", test_runtime_1);
+  g_test_add_func ("/UsbemuUsbipServer/runtime/hub", test_runtime_2);
+  g_test_add_func ("/UsbemuUsbipServer/unlink", test_unlink_1);
+  g_test_add_func ("/UsbemuUsbipServer/unlink-storm", test_unlink_2);
+
+  /* benchmarks, run with -m perf */
+
+  if (g_test_perf ()) {
+    g_test_add_func ("/UsbemuUsbipServer/perf/attach-storm",
+                     test_perf_attach_storm_1);
+    g_test_add_func ("/UsbemuUsbipServer/perf/io-uring",
+                     test_perf_io_uring_1);
+  }
+
+  return g_test_run ();
+}
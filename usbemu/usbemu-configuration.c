@@ -51,11 +51,24 @@ struct _UsbemuConfiguration {
 
   guint bConfigurationValue;
   gchar *name;
+  guint8 iConfiguration;
   guint bmAttributes;
   guint bMaxPower;
 
   UsbemuDevice *device;
-  GSList *interfaces;
+  /* Set once shared by devices created from a template. The configuration,
+   * its interfaces and their cached descriptors are read-only from then on,
+   * see usbemu_device_new_from_template(). */
+  gboolean shared;
+  /* Array of alternate settings arrays, indexed by bInterfaceNumber and then
+   * bAlternateSetting. */
+  GPtrArray *interfaces;
+  /* Class or vendor specific descriptors following the configuration
+   * descriptor, e.g. interface association descriptors. */
+  GBytes *extra_descriptors;
+
+  /* Cached configuration, interface and endpoint descriptors bundle. */
+  GBytes *descriptors;
 };
 
 G_DEFINE_TYPE (UsbemuConfiguration, usbemu_configuration, G_TYPE_OBJECT)
@@ -87,7 +100,8 @@ static void gobject_class_finalize (GObject *object);
 /* virtual methods for UsbemuConfigurationClass */
 static void usbemu_configuration_class_init (UsbemuConfigurationClass *configuration_class);
 /* helper functions */
-static void _free_interfaces_slist_inner (GSList *slist);
+static GBytes* _build_descriptors (UsbemuConfiguration *configuration);
+static void _intern_strings (UsbemuConfiguration *configuration);
 
 static void
 gobject_class_set_property (GObject      *object,
@@ -97,11 +111,15 @@ gobject_class_set_property (GObject      *object,
 {
   UsbemuConfiguration *configuration = USBEMU_CONFIGURATION (object);
 
+  g_return_if_fail (!configuration->shared);
+
   switch (prop_id) {
     case PROP_NAME:
       if (configuration->name)
         g_free (configuration->name);
       configuration->name = g_value_dup_string (value);
+      if (configuration->device != NULL)
+        _intern_strings (configuration);
       break;
     case PROP_ATTRIBUTES:
       configuration->bmAttributes = g_value_get_flags (value);
@@ -111,8 +129,10 @@ gobject_class_set_property (GObject      *object,
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-      break;
+      return;
   }
+
+  _usbemu_configuration_invalidate_descriptors (configuration);
 }
 
 static void
@@ -139,22 +159,12 @@ gobject_class_get_property (GObject    *object,
   }
 }
 
-static void
-_free_interfaces_slist_inner (GSList *slist)
-{
-  g_slist_free_full (slist, (GDestroyNotify) g_object_unref);
-}
-
 static void
 gobject_class_dispose (GObject *object)
 {
   UsbemuConfiguration *configuration = USBEMU_CONFIGURATION (object);
 
-  if (configuration->interfaces != NULL) {
-    g_slist_free_full (configuration->interfaces,
-                       (GDestroyNotify) _free_interfaces_slist_inner);
-    configuration->interfaces = NULL;
-  }
+  g_ptr_array_set_size (configuration->interfaces, 0);
 
   g_clear_object (&configuration->device);
 }
@@ -166,6 +176,10 @@ gobject_class_finalize (GObject *object)
 
   if (configuration->name)
     g_free (configuration->name);
+  _usbemu_configuration_invalidate_descriptors (configuration);
+  g_ptr_array_unref (configuration->interfaces);
+  if (configuration->extra_descriptors != NULL)
+    g_bytes_unref (configuration->extra_descriptors);
 }
 
 static void
@@ -222,10 +236,15 @@ usbemu_configuration_init (UsbemuConfiguration *configuration)
 {
   configuration->bConfigurationValue = 0;
   configuration->name = USBEMU_CONFIGURATION_PROP_NAME__DEFAULT;
+  configuration->iConfiguration = 0;
   configuration->bmAttributes = USBEMU_CONFIGURATION_PROP_ATTRIBUTES__DEFAULT;
   configuration->bMaxPower = USBEMU_CONFIGURATION_PROP_MAX_POWER__DEFAULT;
   configuration->device = NULL;
-  configuration->interfaces = NULL;
+  configuration->shared = FALSE;
+  configuration->interfaces =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+  configuration->extra_descriptors = NULL;
+  configuration->descriptors = NULL;
 }
 
 /**
@@ -310,6 +329,7 @@ usbemu_configuration_set_name (UsbemuConfiguration *configuration,
                                const gchar         *name)
 {
   g_return_if_fail (USBEMU_IS_CONFIGURATION (configuration));
+  g_return_if_fail (!configuration->shared);
 
   g_object_set ((GObject*) configuration,
                 USBEMU_CONFIGURATION_PROP_NAME, name,
@@ -344,6 +364,7 @@ usbemu_configuration_set_attributes (UsbemuConfiguration *configuration,
                                      guint                attributes)
 {
   g_return_if_fail (USBEMU_IS_CONFIGURATION (configuration));
+  g_return_if_fail (!configuration->shared);
 
   g_object_set ((GObject*) configuration,
                 USBEMU_CONFIGURATION_PROP_ATTRIBUTES, attributes,
@@ -379,6 +400,7 @@ usbemu_configuration_set_max_power (UsbemuConfiguration *configuration,
                                     guint                max_power)
 {
   g_return_if_fail (USBEMU_IS_CONFIGURATION (configuration));
+  g_return_if_fail (!configuration->shared);
 
   g_object_set ((GObject*) configuration,
                 USBEMU_CONFIGURATION_PROP_MAX_POWER, max_power,
@@ -391,16 +413,61 @@ usbemu_configuration_set_max_power (UsbemuConfiguration *configuration,
  *
  * Get the bonded #UsbemuDevice of this configuration.
  *
- * Returns: (transfer full) (type UsbemuDevice): a #UsbemuDevice.
+ * Returns: (transfer full) (type UsbemuDevice): a #UsbemuDevice or %NULL if
+ *          not added to any yet, or a copy shared by devices created from a
+ *          template, see usbemu_device_new_from_template().
  */
 UsbemuDevice*
 usbemu_configuration_get_device (UsbemuConfiguration *configuration)
 {
   g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), NULL);
 
+  if ((configuration->device == NULL) || configuration->shared)
+    return NULL;
+
   return g_object_ref (configuration->device);
 }
 
+/**
+ * usbemu_configuration_set_extra_descriptors:
+ * @configuration: (in): the #UsbemuConfiguration object.
+ * @extra: (in) (nullable): concatenated descriptors, or %NULL to remove them.
+ *
+ * Set class or vendor specific descriptors to be emitted verbatim right after
+ * the configuration descriptor, before the first interface descriptor.
+ */
+void
+usbemu_configuration_set_extra_descriptors (UsbemuConfiguration *configuration,
+                                            GBytes              *extra)
+{
+  g_return_if_fail (USBEMU_IS_CONFIGURATION (configuration));
+  g_return_if_fail (!configuration->shared);
+
+  if (extra != NULL)
+    g_bytes_ref (extra);
+  if (configuration->extra_descriptors != NULL)
+    g_bytes_unref (configuration->extra_descriptors);
+  configuration->extra_descriptors = extra;
+
+  _usbemu_configuration_invalidate_descriptors (configuration);
+}
+
+/**
+ * usbemu_configuration_get_extra_descriptors:
+ * @configuration: (in): the #UsbemuConfiguration object.
+ *
+ * Get descriptors set with usbemu_configuration_set_extra_descriptors().
+ *
+ * Returns: (transfer none) (nullable): a #GBytes or %NULL if none.
+ */
+GBytes*
+usbemu_configuration_get_extra_descriptors (UsbemuConfiguration *configuration)
+{
+  g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), NULL);
+
+  return configuration->extra_descriptors;
+}
+
 /**
  * usbemu_configuration_add_alternate_interfaces:
  * @configuration: (in): the #UsbemuConfiguration object.
@@ -419,30 +486,39 @@ usbemu_configuration_add_alternate_interfaces (UsbemuConfiguration  *configurati
 {
   UsbemuInterface **interface;
   guint interface_number, alternate_setting;
-  GSList *slist;
+  GPtrArray *alternates;
 
   g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), -1);
+  g_return_val_if_fail (!configuration->shared, -1);
   g_return_val_if_fail ((interfaces != NULL), -1);
 
   for (interface = interfaces; *interface != NULL; ++interface) {
-    if (usbemu_interface_get_configuration (*interface) != NULL)
+    UsbemuConfiguration *owner;
+
+    owner = usbemu_interface_get_configuration (*interface);
+    if (owner != NULL) {
+      g_object_unref (owner);
       return -1;
+    }
   }
 
-  interface_number = g_slist_length (configuration->interfaces);
-  slist = NULL;
+  interface_number = configuration->interfaces->len;
+  alternates = g_ptr_array_new_with_free_func (g_object_unref);
   for (interface = interfaces; *interface != NULL; ++interface) {
-    slist = g_slist_append (slist, g_object_ref (*interface));
+    g_ptr_array_add (alternates, g_object_ref (*interface));
   }
-  configuration->interfaces = g_slist_append (configuration->interfaces, slist);
+  g_ptr_array_add (configuration->interfaces, alternates);
 
   alternate_setting = 0;
   for (interface = interfaces; *interface != NULL;
        ++interface, ++alternate_setting) {
     _usbemu_interface_set_configuration (*interface, configuration,
                                          interface_number, alternate_setting);
+    _usbemu_interface_intern_strings (*interface);
   }
 
+  _usbemu_configuration_invalidate_descriptors (configuration);
+
   return interface_number;
 }
 
@@ -460,13 +536,19 @@ GSList*
 usbemu_configuration_get_alternate_interfaces (UsbemuConfiguration *configuration,
                                                guint                interface_number)
 {
-  GSList *slist;
+  GPtrArray *alternates;
+  GSList *slist = NULL;
+  guint i;
 
   g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), NULL);
 
-  slist = g_slist_nth_data (configuration->interfaces, interface_number);
-  if (slist != NULL)
-    slist = g_slist_copy_deep (slist, (GCopyFunc) g_object_ref, NULL);
+  if (interface_number >= configuration->interfaces->len)
+    return NULL;
+
+  alternates = g_ptr_array_index (configuration->interfaces, interface_number);
+  for (i = alternates->len; i > 0; i--)
+    slist = g_slist_prepend (slist,
+                             g_object_ref (g_ptr_array_index (alternates, i - 1)));
 
   return slist;
 }
@@ -484,7 +566,100 @@ usbemu_configuration_get_n_alternate_interfaces (UsbemuConfiguration *configurat
 {
   g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), 0);
 
-  return g_slist_length (configuration->interfaces);
+  return configuration->interfaces->len;
+}
+
+/**
+ * usbemu_configuration_peek_alternate_interfaces:
+ * @configuration: (in): the #UsbemuConfiguration object.
+ * @interface_number: a interface number.
+ * @n_alternate_settings: (out) (optional): return location for the number of
+ *     alternate settings, or %NULL.
+ *
+ * Get all interfaces with specified interface number in this configuration
+ * without copying them or taking references. The interface with
+ * bAlternateSetting n is at index n. The returned array is owned by
+ * @configuration and is only valid until @configuration is disposed.
+ *
+ * Returns: (transfer none) (nullable) (array length=n_alternate_settings):
+ *          borrowed #UsbemuInterface objects or %NULL if not found.
+ */
+UsbemuInterface* const*
+usbemu_configuration_peek_alternate_interfaces (UsbemuConfiguration *configuration,
+                                                guint                interface_number,
+                                                guint               *n_alternate_settings)
+{
+  GPtrArray *alternates;
+
+  if (n_alternate_settings != NULL)
+    *n_alternate_settings = 0;
+
+  g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), NULL);
+
+  if (interface_number >= configuration->interfaces->len)
+    return NULL;
+
+  alternates = g_ptr_array_index (configuration->interfaces, interface_number);
+  if (n_alternate_settings != NULL)
+    *n_alternate_settings = alternates->len;
+
+  return (UsbemuInterface* const*) alternates->pdata;
+}
+
+/**
+ * usbemu_configuration_get_n_alternate_settings:
+ * @configuration: (in): the #UsbemuConfiguration object.
+ * @interface_number: a interface number.
+ *
+ * Get the number of alternate settings available for an interface number.
+ *
+ * Returns: number of alternate settings, or 0 if no such interface.
+ */
+guint
+usbemu_configuration_get_n_alternate_settings (UsbemuConfiguration *configuration,
+                                               guint                interface_number)
+{
+  GPtrArray *alternates;
+
+  g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), 0);
+
+  if (interface_number >= configuration->interfaces->len)
+    return 0;
+
+  alternates = g_ptr_array_index (configuration->interfaces, interface_number);
+  return alternates->len;
+}
+
+/**
+ * usbemu_configuration_get_interface:
+ * @configuration: (in): the #UsbemuConfiguration object.
+ * @interface_number: a interface number.
+ * @alternate_setting: an alternate setting number.
+ *
+ * Get the #UsbemuInterface identified by an interface number and an alternate
+ * setting, as selected by a SET_INTERFACE request. This is a constant time
+ * lookup.
+ *
+ * Returns: (transfer none) (nullable): a #UsbemuInterface if available, or
+ *          %NULL otherwise.
+ */
+UsbemuInterface*
+usbemu_configuration_get_interface (UsbemuConfiguration *configuration,
+                                    guint                interface_number,
+                                    guint                alternate_setting)
+{
+  GPtrArray *alternates;
+
+  g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), NULL);
+
+  if (interface_number >= configuration->interfaces->len)
+    return NULL;
+
+  alternates = g_ptr_array_index (configuration->interfaces, interface_number);
+  if (alternate_setting >= alternates->len)
+    return NULL;
+
+  return g_ptr_array_index (alternates, alternate_setting);
 }
 
 void
@@ -492,6 +667,239 @@ _usbemu_configuration_set_device (UsbemuConfiguration *configuration,
                                   UsbemuDevice        *device,
                                   guint                configuration_value)
 {
+  GPtrArray *alternates;
+  guint i, j;
+
   configuration->device = g_object_ref (device);
   configuration->bConfigurationValue = configuration_value;
+
+  _intern_strings (configuration);
+  for (i = 0; i < configuration->interfaces->len; i++) {
+    alternates = g_ptr_array_index (configuration->interfaces, i);
+    for (j = 0; j < alternates->len; j++)
+      _usbemu_interface_intern_strings (g_ptr_array_index (alternates, j));
+  }
+
+  _usbemu_configuration_invalidate_descriptors (configuration);
+}
+
+UsbemuDevice*
+_usbemu_configuration_peek_device (UsbemuConfiguration *configuration)
+{
+  return configuration->device;
+}
+
+/* Freeze @configuration and its interfaces. Caches are filled right away, as
+ * they are never invalidated from now on and must not be filled later by
+ * concurrent readers. */
+void
+_usbemu_configuration_set_shared (UsbemuConfiguration *configuration)
+{
+  GPtrArray *alternates;
+  guint i, j;
+
+  if (configuration->shared)
+    return;
+
+  /* Built first, as shared configurations no longer build it on demand. */
+  usbemu_configuration_get_descriptor_bytes (configuration);
+  configuration->shared = TRUE;
+  for (i = 0; i < configuration->interfaces->len; i++) {
+    alternates = g_ptr_array_index (configuration->interfaces, i);
+    for (j = 0; j < alternates->len; j++)
+      usbemu_interface_get_endpoint_entries (g_ptr_array_index (alternates, j));
+  }
+}
+
+gboolean
+_usbemu_configuration_is_shared (UsbemuConfiguration *configuration)
+{
+  return configuration->shared;
+}
+
+/*
+ * Returns: (transfer full): a deep copy of @configuration not yet added to any
+ *     device.
+ */
+UsbemuConfiguration*
+_usbemu_configuration_copy (UsbemuConfiguration *configuration)
+{
+  UsbemuConfiguration *copy;
+  UsbemuInterface **interfaces;
+  GPtrArray *alternates;
+  guint i, j;
+
+  copy = usbemu_configuration_new_full (configuration->name,
+                                        configuration->bmAttributes,
+                                        configuration->bMaxPower);
+  if (configuration->extra_descriptors != NULL)
+    copy->extra_descriptors = g_bytes_ref (configuration->extra_descriptors);
+
+  for (i = 0; i < configuration->interfaces->len; i++) {
+    alternates = g_ptr_array_index (configuration->interfaces, i);
+
+    interfaces = g_new0 (UsbemuInterface*, alternates->len + 1);
+    for (j = 0; j < alternates->len; j++)
+      interfaces[j] = _usbemu_interface_copy (g_ptr_array_index (alternates, j));
+
+    usbemu_configuration_add_alternate_interfaces (copy, interfaces);
+
+    for (j = 0; j < alternates->len; j++)
+      g_object_unref (interfaces[j]);
+    g_free (interfaces);
+  }
+
+  return copy;
+}
+
+/* Drop references to string indexes held by @configuration in the string
+ * table of @device, which may differ from the owning device. */
+void
+_usbemu_configuration_release_strings (UsbemuConfiguration *configuration,
+                                       UsbemuDevice        *device)
+{
+  GPtrArray *alternates;
+  guint i, j;
+
+  _usbemu_device_unref_string (device, configuration->iConfiguration);
+  for (i = 0; i < configuration->interfaces->len; i++) {
+    alternates = g_ptr_array_index (configuration->interfaces, i);
+    for (j = 0; j < alternates->len; j++) {
+      _usbemu_device_unref_string (device,
+                                   _usbemu_interface_get_string_index (g_ptr_array_index (alternates, j)));
+    }
+  }
+}
+
+static void
+_intern_strings (UsbemuConfiguration *configuration)
+{
+  guint8 old_index = configuration->iConfiguration;
+
+  configuration->iConfiguration =
+      _usbemu_device_ref_string (configuration->device, configuration->name);
+  _usbemu_device_unref_string (configuration->device, old_index);
+}
+
+void
+_usbemu_configuration_invalidate_descriptors (UsbemuConfiguration *configuration)
+{
+  /* Copies shared with devices created from the owner are stale now. */
+  if ((configuration->device != NULL) && !configuration->shared)
+    _usbemu_device_invalidate_template (configuration->device);
+
+  if (configuration->descriptors != NULL) {
+    g_bytes_unref (configuration->descriptors);
+    configuration->descriptors = NULL;
+  }
+}
+
+static GBytes*
+_build_descriptors (UsbemuConfiguration *configuration)
+{
+  GByteArray *array;
+  GPtrArray *alternates;
+  UsbemuSpeeds speed;
+  guint i, j;
+  guint8 *header;
+
+  speed = USBEMU_SPEED_FULL;
+  if (configuration->device != NULL)
+    speed = usbemu_device_get_speed (configuration->device);
+
+  array = g_byte_array_sized_new (USBEMU_CONFIGURATION_DESCRIPTOR_SIZE);
+  g_byte_array_set_size (array, USBEMU_CONFIGURATION_DESCRIPTOR_SIZE);
+  if (configuration->extra_descriptors != NULL) {
+    g_byte_array_append (array,
+                         g_bytes_get_data (configuration->extra_descriptors, NULL),
+                         g_bytes_get_size (configuration->extra_descriptors));
+  }
+
+  for (i = 0; i < configuration->interfaces->len; i++) {
+    alternates = g_ptr_array_index (configuration->interfaces, i);
+    for (j = 0; j < alternates->len; j++) {
+      _usbemu_interface_append_descriptors (g_ptr_array_index (alternates, j),
+                                            array, speed);
+    }
+  }
+
+  /* wTotalLength would wrap around. */
+  if (array->len > G_MAXUINT16) {
+    g_byte_array_unref (array);
+    return NULL;
+  }
+
+  /* Fill the header last for wTotalLength. */
+  header = array->data;
+  header[0] = USBEMU_CONFIGURATION_DESCRIPTOR_SIZE;
+  header[1] = USBEMU_DESCRIPTOR_TYPE_CONFIGURATION;
+  header[2] = array->len & 0xFF;
+  header[3] = (array->len >> 8) & 0xFF;
+  header[4] = configuration->interfaces->len;
+  header[5] = configuration->bConfigurationValue;
+  header[6] = configuration->iConfiguration;
+  header[7] = configuration->bmAttributes;
+  /* bMaxPower is expressed in 2 mA units. */
+  header[8] = MIN (configuration->bMaxPower / 2, G_MAXUINT8);
+
+  return g_byte_array_free_to_bytes (array);
+}
+
+/**
+ * usbemu_configuration_get_descriptor_bytes:
+ * @configuration: (in): the #UsbemuConfiguration object.
+ *
+ * Get the full configuration descriptor bundle in USB wire format, i.e. the
+ * configuration descriptor immediately followed by all interface and endpoint
+ * descriptors of every alternate setting, as returned for a
+ * GET_DESCRIPTOR(CONFIGURATION) request. The bundle is assembled once and
+ * cached until this configuration or any of its interfaces is modified.
+ *
+ * Returns: (transfer none) (nullable): a #GBytes of wTotalLength bytes owned
+ *          by the configuration, or %NULL if the bundle exceeds the 65535
+ *          bytes wTotalLength can express. It stays valid until the next
+ *          modification, use g_bytes_ref() to keep it longer.
+ */
+GBytes*
+usbemu_configuration_get_descriptor_bytes (UsbemuConfiguration *configuration)
+{
+  g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), NULL);
+
+  /* Shared configurations were built in _usbemu_configuration_set_shared()
+   * and may be read by several workers, so a bundle too large is not retried
+   * here. */
+  if ((configuration->descriptors == NULL) && !configuration->shared)
+    configuration->descriptors = _build_descriptors (configuration);
+
+  return configuration->descriptors;
+}
+
+/**
+ * usbemu_configuration_get_descriptor_bytes_slice:
+ * @configuration: (in): the #UsbemuConfiguration object.
+ * @length: maximum number of bytes requested, i.e. wLength of the request.
+ *
+ * Get at most @length leading bytes of the descriptor bundle returned by
+ * usbemu_configuration_get_descriptor_bytes(). This serves truncated requests,
+ * e.g. the host reading the 9-byte header first to learn wTotalLength. The
+ * returned #GBytes shares the cached buffer and no descriptor data is copied.
+ *
+ * Returns: (transfer full) (nullable): a #GBytes, or %NULL if the bundle is
+ *          too large. Free with g_bytes_unref().
+ */
+GBytes*
+usbemu_configuration_get_descriptor_bytes_slice (UsbemuConfiguration *configuration,
+                                                 gsize                length)
+{
+  GBytes *bytes;
+
+  g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), NULL);
+
+  bytes = usbemu_configuration_get_descriptor_bytes (configuration);
+  if (bytes == NULL)
+    return NULL;
+  if (length >= g_bytes_get_size (bytes))
+    return g_bytes_ref (bytes);
+
+  return g_bytes_new_from_bytes (bytes, 0, length);
 }
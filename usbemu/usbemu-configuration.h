@@ -58,6 +58,14 @@ G_DECLARE_FINAL_TYPE (UsbemuConfiguration, usbemu_configuration,
 
 struct _UsbemuInterface;
 
+/**
+ * USBEMU_CONFIGURATION_DESCRIPTOR_SIZE:
+ *
+ * Size in bytes of a standard configuration descriptor, exclusive of the
+ * interface and endpoint descriptors following it.
+ */
+#define USBEMU_CONFIGURATION_DESCRIPTOR_SIZE 9
+
 /**
  * UsbemuConfigurationAttributes:
  * @USBEMU_CONFIGURATION_ATTR_RESERVED_0: Reserved.
@@ -107,10 +115,27 @@ void         usbemu_configuration_set_max_power           (UsbemuConfiguration *
 
 UsbemuDevice* usbemu_configuration_get_device (UsbemuConfiguration *configuration);
 
+void    usbemu_configuration_set_extra_descriptors (UsbemuConfiguration *configuration,
+                                                    GBytes              *extra);
+GBytes* usbemu_configuration_get_extra_descriptors (UsbemuConfiguration *configuration);
+
 gint    usbemu_configuration_add_alternate_interfaces   (UsbemuConfiguration      *configuration,
                                                          struct _UsbemuInterface **interfaces);
 GSList* usbemu_configuration_get_alternate_interfaces   (UsbemuConfiguration      *configuration,
                                                          guint                     interface_number);
 guint   usbemu_configuration_get_n_alternate_interfaces (UsbemuConfiguration      *configuration);
+guint   usbemu_configuration_get_n_alternate_settings   (UsbemuConfiguration      *configuration,
+                                                         guint                     interface_number);
+
+struct _UsbemuInterface* usbemu_configuration_get_interface (UsbemuConfiguration *configuration,
+                                                             guint                interface_number,
+                                                             guint                alternate_setting);
+struct _UsbemuInterface* const* usbemu_configuration_peek_alternate_interfaces (UsbemuConfiguration *configuration,
+                                                                                guint                interface_number,
+                                                                                guint               *n_alternate_settings);
+
+GBytes* usbemu_configuration_get_descriptor_bytes       (UsbemuConfiguration *configuration);
+GBytes* usbemu_configuration_get_descriptor_bytes_slice (UsbemuConfiguration *configuration,
+                                                         gsize                length);
 
 G_END_DECLS
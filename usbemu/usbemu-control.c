@@ -0,0 +1,499 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "usbemu/usbemu-control.h"
+#include "usbemu/usbemu-internal.h"
+
+/**
+ * SECTION:usbemu-control
+ * @title: Control requests
+ * @short_description: Standard requests on the default control pipe
+ * @include: usbemu/usbemu.h
+ *
+ * Standard requests submitted to the default control endpoint of a
+ * #UsbemuDevice are answered by the library itself, from the state of the
+ * device and its #UsbemuConfiguration and #UsbemuInterface objects, so that
+ * a device built from descriptors enumerates without any code of its own.
+ * Requests are dispatched through a static table indexed by bRequest and
+ * the recipient in bmRequestType, and descriptors are handed to the
+ * transport as the cached #GBytes of the device tree, so no memory is
+ * allocated per request.
+ *
+ * Requests the library does not answer, e.g. GET_DESCRIPTOR for class
+ * descriptors of an interface or class and vendor requests, are routed by
+ * their recipient: those addressed to an interface or endpoint of the active
+ * configuration through wIndex are delivered to
+ * #UsbemuInterfaceClass.control_request of the selected alternate setting
+ * owning it, found in constant time, and others to
+ * #UsbemuDeviceClass.control_request. By default both end up in
+ * #UsbemuDeviceClass.submit_urb as any other transfer.
+ */
+
+/* Returns the completion status of the request, or %USBEMU_URB_STATUS_PENDING
+ * to pass it on to the device class. */
+typedef UsbemuUrbStatus (*UsbemuControlHandler) (UsbemuDevice             *device,
+                                                 UsbemuUrb                *urb,
+                                                 const UsbemuControlSetup *setup);
+
+typedef struct {
+  /* Expected direction bit of bmRequestType. */
+  guint8 direction;
+  UsbemuControlHandler handler;
+} UsbemuControlEntry;
+
+#define N_STANDARD_REQUESTS (USBEMU_REQUEST_SYNCH_FRAME + 1)
+#define N_STANDARD_RECIPIENTS (USBEMU_REQUEST_RECIPIENT_ENDPOINT + 1)
+
+#define DEVICE_QUALIFIER_SIZE 10
+
+/* helper functions */
+static UsbemuUrbStatus _reply (UsbemuUrb *urb, const guint8 *data, gsize size);
+static gboolean _lookup_endpoint (UsbemuDevice *device, guint16 endpoint_address);
+static guint _active_attributes (UsbemuDevice *device);
+
+/* request handlers */
+static UsbemuUrbStatus _get_device_status (UsbemuDevice *device, UsbemuUrb *urb,
+                                           const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _get_interface_status (UsbemuDevice *device, UsbemuUrb *urb,
+                                              const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _get_endpoint_status (UsbemuDevice *device, UsbemuUrb *urb,
+                                             const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _clear_device_feature (UsbemuDevice *device, UsbemuUrb *urb,
+                                              const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _set_device_feature (UsbemuDevice *device, UsbemuUrb *urb,
+                                            const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _clear_endpoint_feature (UsbemuDevice *device, UsbemuUrb *urb,
+                                                const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _set_endpoint_feature (UsbemuDevice *device, UsbemuUrb *urb,
+                                              const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _set_address (UsbemuDevice *device, UsbemuUrb *urb,
+                                     const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _get_descriptor (UsbemuDevice *device, UsbemuUrb *urb,
+                                        const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _get_configuration (UsbemuDevice *device, UsbemuUrb *urb,
+                                           const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _set_configuration (UsbemuDevice *device, UsbemuUrb *urb,
+                                           const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _get_interface (UsbemuDevice *device, UsbemuUrb *urb,
+                                       const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _set_interface (UsbemuDevice *device, UsbemuUrb *urb,
+                                       const UsbemuControlSetup *setup);
+
+#define IN USBEMU_REQUEST_DIRECTION_IN
+#define OUT 0
+
+static const UsbemuControlEntry standard_requests[N_STANDARD_REQUESTS][N_STANDARD_RECIPIENTS] = {
+  [USBEMU_REQUEST_GET_STATUS] = {
+    [USBEMU_REQUEST_RECIPIENT_DEVICE] = { IN, _get_device_status },
+    [USBEMU_REQUEST_RECIPIENT_INTERFACE] = { IN, _get_interface_status },
+    [USBEMU_REQUEST_RECIPIENT_ENDPOINT] = { IN, _get_endpoint_status },
+  },
+  [USBEMU_REQUEST_CLEAR_FEATURE] = {
+    [USBEMU_REQUEST_RECIPIENT_DEVICE] = { OUT, _clear_device_feature },
+    [USBEMU_REQUEST_RECIPIENT_ENDPOINT] = { OUT, _clear_endpoint_feature },
+  },
+  [USBEMU_REQUEST_SET_FEATURE] = {
+    [USBEMU_REQUEST_RECIPIENT_DEVICE] = { OUT, _set_device_feature },
+    [USBEMU_REQUEST_RECIPIENT_ENDPOINT] = { OUT, _set_endpoint_feature },
+  },
+  [USBEMU_REQUEST_SET_ADDRESS] = {
+    [USBEMU_REQUEST_RECIPIENT_DEVICE] = { OUT, _set_address },
+  },
+  [USBEMU_REQUEST_GET_DESCRIPTOR] = {
+    [USBEMU_REQUEST_RECIPIENT_DEVICE] = { IN, _get_descriptor },
+  },
+  [USBEMU_REQUEST_GET_CONFIGURATION] = {
+    [USBEMU_REQUEST_RECIPIENT_DEVICE] = { IN, _get_configuration },
+  },
+  [USBEMU_REQUEST_SET_CONFIGURATION] = {
+    [USBEMU_REQUEST_RECIPIENT_DEVICE] = { OUT, _set_configuration },
+  },
+  [USBEMU_REQUEST_GET_INTERFACE] = {
+    [USBEMU_REQUEST_RECIPIENT_INTERFACE] = { IN, _get_interface },
+  },
+  [USBEMU_REQUEST_SET_INTERFACE] = {
+    [USBEMU_REQUEST_RECIPIENT_INTERFACE] = { OUT, _set_interface },
+  },
+};
+
+#undef IN
+#undef OUT
+
+static UsbemuUrbStatus
+_reply (UsbemuUrb    *urb,
+        const guint8 *data,
+        gsize         size)
+{
+  urb->actual_length = MIN (size, urb->buffer_length);
+  memcpy (urb->buffer, data, urb->actual_length);
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static gboolean
+_lookup_endpoint (UsbemuDevice *device,
+                  guint16       endpoint_address)
+{
+  if ((endpoint_address & ~(guint16) (USBEMU_ENDPOINT_DIRECTION_IN | 0x0F)) != 0)
+    return FALSE;
+
+  return ((endpoint_address & 0x0F) == USBEMU_EP_CTL) ||
+         (usbemu_device_lookup_endpoint (device, endpoint_address, NULL) != NULL);
+}
+
+/* bmAttributes of the active configuration, 0 if not configured. Peeked, so
+ * that configurations shared with a template are not copied. */
+static guint
+_active_attributes (UsbemuDevice *device)
+{
+  guint configuration_value;
+
+  configuration_value = usbemu_device_get_active_configuration (device);
+  if (configuration_value == 0)
+    return 0;
+
+  return usbemu_configuration_get_attributes (
+      usbemu_device_peek_configurations (device, NULL)[configuration_value - 1]);
+}
+
+static UsbemuUrbStatus
+_get_device_status (UsbemuDevice             *device,
+                    UsbemuUrb                *urb,
+                    const UsbemuControlSetup *setup)
+{
+  guint8 status[2] = { 0, 0 };
+
+  if (_active_attributes (device) & USBEMU_CONFIGURATION_ATTR_SELF_POWER)
+    status[0] |= 0x01;
+  if (usbemu_device_get_remote_wakeup (device))
+    status[0] |= 0x02;
+
+  return _reply (urb, status, sizeof (status));
+}
+
+static UsbemuUrbStatus
+_get_interface_status (UsbemuDevice             *device,
+                       UsbemuUrb                *urb,
+                       const UsbemuControlSetup *setup)
+{
+  static const guint8 status[2] = { 0, 0 };
+
+  if (usbemu_device_lookup_interface (device, setup->wIndex) == NULL)
+    return USBEMU_URB_STATUS_STALL;
+
+  return _reply (urb, status, sizeof (status));
+}
+
+static UsbemuUrbStatus
+_get_endpoint_status (UsbemuDevice             *device,
+                      UsbemuUrb                *urb,
+                      const UsbemuControlSetup *setup)
+{
+  guint8 status[2] = { 0, 0 };
+
+  if (!_lookup_endpoint (device, setup->wIndex))
+    return USBEMU_URB_STATUS_STALL;
+
+  if (usbemu_device_get_endpoint_halt (device, setup->wIndex))
+    status[0] |= 0x01;
+
+  return _reply (urb, status, sizeof (status));
+}
+
+static UsbemuUrbStatus
+_clear_device_feature (UsbemuDevice             *device,
+                       UsbemuUrb                *urb,
+                       const UsbemuControlSetup *setup)
+{
+  if (setup->wValue != USBEMU_FEATURE_DEVICE_REMOTE_WAKEUP)
+    return USBEMU_URB_STATUS_STALL;
+
+  _usbemu_device_set_remote_wakeup (device, FALSE);
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static UsbemuUrbStatus
+_set_device_feature (UsbemuDevice             *device,
+                     UsbemuUrb                *urb,
+                     const UsbemuControlSetup *setup)
+{
+  /* TEST_MODE makes no sense without an electrical interface. */
+  if (setup->wValue != USBEMU_FEATURE_DEVICE_REMOTE_WAKEUP)
+    return USBEMU_URB_STATUS_STALL;
+
+  if (!(_active_attributes (device) & USBEMU_CONFIGURATION_ATTR_REMOTE_WAKEUP))
+    return USBEMU_URB_STATUS_STALL;
+
+  _usbemu_device_set_remote_wakeup (device, TRUE);
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static UsbemuUrbStatus
+_clear_endpoint_feature (UsbemuDevice             *device,
+                         UsbemuUrb                *urb,
+                         const UsbemuControlSetup *setup)
+{
+  if ((setup->wValue != USBEMU_FEATURE_ENDPOINT_HALT) ||
+      !_lookup_endpoint (device, setup->wIndex))
+    return USBEMU_URB_STATUS_STALL;
+
+  /* The default control endpoint is never halted. */
+  if ((setup->wIndex & 0x0F) != USBEMU_EP_CTL)
+    usbemu_device_set_endpoint_halt (device, setup->wIndex, FALSE);
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static UsbemuUrbStatus
+_set_endpoint_feature (UsbemuDevice             *device,
+                       UsbemuUrb                *urb,
+                       const UsbemuControlSetup *setup)
+{
+  if ((setup->wValue != USBEMU_FEATURE_ENDPOINT_HALT) ||
+      !_lookup_endpoint (device, setup->wIndex))
+    return USBEMU_URB_STATUS_STALL;
+
+  if ((setup->wIndex & 0x0F) != USBEMU_EP_CTL)
+    usbemu_device_set_endpoint_halt (device, setup->wIndex, TRUE);
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static UsbemuUrbStatus
+_set_address (UsbemuDevice             *device,
+              UsbemuUrb                *urb,
+              const UsbemuControlSetup *setup)
+{
+  if ((setup->wValue > 127) || (setup->wIndex != 0) ||
+      (usbemu_device_get_active_configuration (device) != 0))
+    return USBEMU_URB_STATUS_STALL;
+
+  _usbemu_device_set_address (device, setup->wValue);
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static UsbemuUrbStatus
+_get_descriptor (UsbemuDevice             *device,
+                 UsbemuUrb                *urb,
+                 const UsbemuControlSetup *setup)
+{
+  guint8 qualifier[DEVICE_QUALIFIER_SIZE];
+  UsbemuConfiguration * const *configurations;
+  const guint8 *descriptor;
+  GBytes *bytes;
+  guint8 index;
+  guint n_configurations;
+
+  index = setup->wValue & 0xFF;
+  switch (setup->wValue >> 8) {
+    case USBEMU_DESCRIPTOR_TYPE_DEVICE:
+      bytes = usbemu_device_get_descriptor_bytes (device);
+      break;
+
+    case USBEMU_DESCRIPTOR_TYPE_CONFIGURATION:
+      /* The index is a position, not a bConfigurationValue. */
+      configurations = usbemu_device_peek_configurations (device,
+                                                          &n_configurations);
+      if (index >= n_configurations)
+        return USBEMU_URB_STATUS_STALL;
+      bytes = usbemu_configuration_get_descriptor_bytes (configurations[index]);
+      if (bytes == NULL)
+        return USBEMU_URB_STATUS_STALL;
+      break;
+
+    case USBEMU_DESCRIPTOR_TYPE_STRING:
+      bytes = usbemu_device_get_string_descriptor_bytes (device, index,
+                                                         setup->wIndex);
+      if (bytes == NULL)
+        return USBEMU_URB_STATUS_STALL;
+      break;
+
+    case USBEMU_DESCRIPTOR_TYPE_DEVICE_QUALIFIER:
+      /* Only devices that may operate at high speed have one. */
+      if (usbemu_device_get_speed (device) < USBEMU_SPEED_HIGH)
+        return USBEMU_URB_STATUS_STALL;
+
+      descriptor = g_bytes_get_data (usbemu_device_get_descriptor_bytes (device),
+                                     NULL);
+
+      qualifier[0] = DEVICE_QUALIFIER_SIZE;
+      qualifier[1] = USBEMU_DESCRIPTOR_TYPE_DEVICE_QUALIFIER;
+      /* bcdUSB, bDeviceClass, bDeviceSubClass, bDeviceProtocol and
+       * bMaxPacketSize0 */
+      memcpy (&qualifier[2], &descriptor[2], 6);
+      /* bNumConfigurations */
+      qualifier[8] = descriptor[17];
+      qualifier[9] = 0;
+      return _reply (urb, qualifier, sizeof (qualifier));
+
+    default:
+      return USBEMU_URB_STATUS_PENDING;
+  }
+
+  /* Handed to the transport as is, actual_length is clamped to wLength. */
+  usbemu_urb_set_payload (urb, bytes);
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static UsbemuUrbStatus
+_get_configuration (UsbemuDevice             *device,
+                    UsbemuUrb                *urb,
+                    const UsbemuControlSetup *setup)
+{
+  guint8 value;
+
+  value = usbemu_device_get_active_configuration (device);
+
+  return _reply (urb, &value, sizeof (value));
+}
+
+static UsbemuUrbStatus
+_set_configuration (UsbemuDevice             *device,
+                    UsbemuUrb                *urb,
+                    const UsbemuControlSetup *setup)
+{
+  if (((setup->wValue >> 8) != 0) ||
+      !usbemu_device_set_active_configuration (device, setup->wValue))
+    return USBEMU_URB_STATUS_STALL;
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static UsbemuUrbStatus
+_get_interface (UsbemuDevice             *device,
+                UsbemuUrb                *urb,
+                const UsbemuControlSetup *setup)
+{
+  guint8 value;
+
+  if (usbemu_device_lookup_interface (device, setup->wIndex) == NULL)
+    return USBEMU_URB_STATUS_STALL;
+
+  value = usbemu_device_get_alternate_setting (device, setup->wIndex);
+
+  return _reply (urb, &value, sizeof (value));
+}
+
+static UsbemuUrbStatus
+_set_interface (UsbemuDevice             *device,
+                UsbemuUrb                *urb,
+                const UsbemuControlSetup *setup)
+{
+  if (!usbemu_device_set_alternate_setting (device, setup->wIndex,
+                                            setup->wValue))
+    return USBEMU_URB_STATUS_STALL;
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+/**
+ * usbemu_control_parse_setup:
+ * @data: (in) (array fixed-size=8): a SETUP packet, e.g. #UsbemuUrb.setup.
+ * @setup: (out caller-allocates): return location for the decoded packet.
+ *
+ * Decode the little-endian fields of a SETUP packet.
+ */
+void
+usbemu_control_parse_setup (const guint8       *data,
+                            UsbemuControlSetup *setup)
+{
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (setup != NULL);
+
+  setup->bmRequestType = data[0];
+  setup->bRequest = data[1];
+  setup->wValue = data[2] | (data[3] << 8);
+  setup->wIndex = data[4] | (data[5] << 8);
+  setup->wLength = data[6] | (data[7] << 8);
+}
+
+gboolean
+_usbemu_control_handle_standard (UsbemuDevice             *device,
+                                 UsbemuUrb                *urb,
+                                 const UsbemuControlSetup *setup)
+{
+  const UsbemuControlEntry *entry;
+  UsbemuUrbStatus status;
+  guint recipient;
+
+  if ((setup->bmRequestType & USBEMU_REQUEST_TYPE_MASK) !=
+      USBEMU_REQUEST_TYPE_STANDARD)
+    return FALSE;
+
+  recipient = setup->bmRequestType & USBEMU_REQUEST_RECIPIENT_MASK;
+  if ((setup->bRequest >= N_STANDARD_REQUESTS) ||
+      (recipient >= N_STANDARD_RECIPIENTS))
+    return FALSE;
+
+  entry = &standard_requests[setup->bRequest][recipient];
+  if (entry->handler == NULL)
+    return FALSE;
+
+  if (((setup->bmRequestType & USBEMU_REQUEST_DIRECTION_IN) != entry->direction) ||
+      ((entry->direction != 0) &&
+       ((urb->endpoint_address & USBEMU_ENDPOINT_DIRECTION_IN) == 0))) {
+    /* Request error. Never write IN data to a read-only OUT payload. */
+    status = USBEMU_URB_STATUS_STALL;
+  } else {
+    status = entry->handler (device, urb, setup);
+    if (status == USBEMU_URB_STATUS_PENDING)
+      return FALSE;
+  }
+
+  usbemu_device_complete_urb (device, urb, status);
+
+  return TRUE;
+}
+
+void
+_usbemu_control_route (UsbemuDevice             *device,
+                       UsbemuUrb                *urb,
+                       const UsbemuControlSetup *setup)
+{
+  UsbemuInterface *interface;
+
+  switch (setup->bmRequestType & USBEMU_REQUEST_RECIPIENT_MASK) {
+    case USBEMU_REQUEST_RECIPIENT_INTERFACE:
+      interface = usbemu_device_lookup_interface (device, setup->wIndex & 0xFF);
+      break;
+
+    case USBEMU_REQUEST_RECIPIENT_ENDPOINT:
+      interface = usbemu_device_lookup_endpoint (device, setup->wIndex & 0xFF,
+                                                 NULL);
+      break;
+
+    default:
+      interface = NULL;
+      break;
+  }
+
+  if (interface != NULL)
+    USBEMU_INTERFACE_GET_CLASS (interface)->control_request (interface, device,
+                                                             urb, setup);
+  else
+    USBEMU_DEVICE_GET_CLASS (device)->control_request (device, urb, setup);
+}
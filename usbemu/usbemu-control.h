@@ -0,0 +1,150 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#if !defined (__USBEMU_USBEMU_H_INSIDE__) && !defined (LIBUSBEMU_COMPILATION)
+#error "Only <usbemu/usbemu.h> can be included directly."
+#endif
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/**
+ * UsbemuStandardRequests:
+ * @USBEMU_REQUEST_GET_STATUS: GET_STATUS.
+ * @USBEMU_REQUEST_CLEAR_FEATURE: CLEAR_FEATURE.
+ * @USBEMU_REQUEST_SET_FEATURE: SET_FEATURE.
+ * @USBEMU_REQUEST_SET_ADDRESS: SET_ADDRESS.
+ * @USBEMU_REQUEST_GET_DESCRIPTOR: GET_DESCRIPTOR.
+ * @USBEMU_REQUEST_SET_DESCRIPTOR: SET_DESCRIPTOR.
+ * @USBEMU_REQUEST_GET_CONFIGURATION: GET_CONFIGURATION.
+ * @USBEMU_REQUEST_SET_CONFIGURATION: SET_CONFIGURATION.
+ * @USBEMU_REQUEST_GET_INTERFACE: GET_INTERFACE.
+ * @USBEMU_REQUEST_SET_INTERFACE: SET_INTERFACE.
+ * @USBEMU_REQUEST_SYNCH_FRAME: SYNCH_FRAME.
+ *
+ * Standard request codes as used in the bRequest field.
+ */
+typedef enum /*< enum,prefix=USBEMU >*/
+{
+  USBEMU_REQUEST_GET_STATUS = 0x00, /*< nick=get-status >*/
+  USBEMU_REQUEST_CLEAR_FEATURE = 0x01, /*< nick=clear-feature >*/
+  USBEMU_REQUEST_SET_FEATURE = 0x03, /*< nick=set-feature >*/
+  USBEMU_REQUEST_SET_ADDRESS = 0x05, /*< nick=set-address >*/
+  USBEMU_REQUEST_GET_DESCRIPTOR = 0x06, /*< nick=get-descriptor >*/
+  USBEMU_REQUEST_SET_DESCRIPTOR = 0x07, /*< nick=set-descriptor >*/
+  USBEMU_REQUEST_GET_CONFIGURATION = 0x08, /*< nick=get-configuration >*/
+  USBEMU_REQUEST_SET_CONFIGURATION = 0x09, /*< nick=set-configuration >*/
+  USBEMU_REQUEST_GET_INTERFACE = 0x0A, /*< nick=get-interface >*/
+  USBEMU_REQUEST_SET_INTERFACE = 0x0B, /*< nick=set-interface >*/
+  USBEMU_REQUEST_SYNCH_FRAME = 0x0C, /*< nick=synch-frame >*/
+} UsbemuStandardRequests;
+
+/**
+ * UsbemuRequestTypes:
+ * @USBEMU_REQUEST_TYPE_STANDARD: standard request.
+ * @USBEMU_REQUEST_TYPE_CLASS: class specific request.
+ * @USBEMU_REQUEST_TYPE_VENDOR: vendor specific request.
+ *
+ * Type field of bmRequestType, see %USBEMU_REQUEST_TYPE_MASK.
+ */
+typedef enum /*< enum,prefix=USBEMU >*/
+{
+  USBEMU_REQUEST_TYPE_STANDARD = (0x00 << 5), /*< nick=standard >*/
+  USBEMU_REQUEST_TYPE_CLASS = (0x01 << 5), /*< nick=class >*/
+  USBEMU_REQUEST_TYPE_VENDOR = (0x02 << 5), /*< nick=vendor >*/
+} UsbemuRequestTypes;
+
+/**
+ * UsbemuRequestRecipients:
+ * @USBEMU_REQUEST_RECIPIENT_DEVICE: the device.
+ * @USBEMU_REQUEST_RECIPIENT_INTERFACE: the interface numbered by wIndex.
+ * @USBEMU_REQUEST_RECIPIENT_ENDPOINT: the endpoint addressed by wIndex.
+ * @USBEMU_REQUEST_RECIPIENT_OTHER: other.
+ *
+ * Recipient field of bmRequestType, see %USBEMU_REQUEST_RECIPIENT_MASK.
+ */
+typedef enum /*< enum,prefix=USBEMU >*/
+{
+  USBEMU_REQUEST_RECIPIENT_DEVICE = 0x00, /*< nick=device >*/
+  USBEMU_REQUEST_RECIPIENT_INTERFACE = 0x01, /*< nick=interface >*/
+  USBEMU_REQUEST_RECIPIENT_ENDPOINT = 0x02, /*< nick=endpoint >*/
+  USBEMU_REQUEST_RECIPIENT_OTHER = 0x03, /*< nick=other >*/
+} UsbemuRequestRecipients;
+
+/**
+ * USBEMU_REQUEST_DIRECTION_IN:
+ *
+ * Direction bit of bmRequestType for device-to-host requests.
+ */
+#define USBEMU_REQUEST_DIRECTION_IN 0x80
+/**
+ * USBEMU_REQUEST_TYPE_MASK:
+ *
+ * Mask of the #UsbemuRequestTypes field of bmRequestType.
+ */
+#define USBEMU_REQUEST_TYPE_MASK 0x60
+/**
+ * USBEMU_REQUEST_RECIPIENT_MASK:
+ *
+ * Mask of the #UsbemuRequestRecipients field of bmRequestType.
+ */
+#define USBEMU_REQUEST_RECIPIENT_MASK 0x1F
+
+/**
+ * USBEMU_FEATURE_ENDPOINT_HALT:
+ *
+ * ENDPOINT_HALT feature selector.
+ */
+#define USBEMU_FEATURE_ENDPOINT_HALT 0
+/**
+ * USBEMU_FEATURE_DEVICE_REMOTE_WAKEUP:
+ *
+ * DEVICE_REMOTE_WAKEUP feature selector.
+ */
+#define USBEMU_FEATURE_DEVICE_REMOTE_WAKEUP 1
+/**
+ * USBEMU_FEATURE_TEST_MODE:
+ *
+ * TEST_MODE feature selector.
+ */
+#define USBEMU_FEATURE_TEST_MODE 2
+
+/**
+ * UsbemuControlSetup:
+ * @bmRequestType: characteristics of the request.
+ * @bRequest: specific request.
+ * @wValue: request specific value.
+ * @wIndex: request specific index or offset.
+ * @wLength: number of bytes of the data stage.
+ *
+ * SETUP packet of a control transfer, decoded by usbemu_control_parse_setup().
+ */
+typedef struct {
+  guint8 bmRequestType;
+  guint8 bRequest;
+  guint16 wValue;
+  guint16 wIndex;
+  guint16 wLength;
+} UsbemuControlSetup;
+
+void usbemu_control_parse_setup (const guint8       *data,
+                                 UsbemuControlSetup *setup);
+
+G_END_DECLS
@@ -21,6 +21,8 @@
 
 #include "usbemu/usbemu-device.h"
 #include "usbemu/usbemu-configuration.h"
+#include "usbemu/usbemu-enums.h"
+#include "usbemu/usbemu-errors.h"
 #include "usbemu/usbemu-internal.h"
 
 /**
@@ -51,14 +53,95 @@
  * @parent_class: The parent class.
  * @attached: attached signal hook.
  * @detached: detached signal hook.
+ * @submit_urb: handle a #UsbemuUrb submitted by usbemu_device_submit_urb().
+ *     The URB has been checked to target the control endpoint or an endpoint
+ *     of the active configuration. Must eventually call
+ *     usbemu_device_complete_urb(). Default implementation completes with
+ *     %USBEMU_URB_STATUS_STALL.
+ * @cancel_urb: cancel a pending #UsbemuUrb, see usbemu_device_cancel_urb().
+ *     Implementations that keep URBs pending should complete it with
+ *     %USBEMU_URB_STATUS_CANCELLED. Default implementation does nothing.
+ * @control_request: handle a request on the default control endpoint that
+ *     the library does not answer itself and that is not addressed to an
+ *     interface or endpoint of the active configuration, e.g. a class or
+ *     vendor request to the device, see #UsbemuInterfaceClass.control_request.
+ *     Must eventually call usbemu_device_complete_urb(). Default
+ *     implementation passes @urb to @submit_urb.
+ * @complete_urb: (nullable): called by usbemu_device_complete_urb() for every
+ *     #UsbemuUrb, after its status is set and before its
+ *     #UsbemuUrbCompleteFunc runs, e.g. to account transfers. Default is
+ *     %NULL.
+ * @reset: (nullable): called by usbemu_device_reset() once the device is
+ *     back in the default state, to reset state of the implementation.
+ *     Default is %NULL.
  *
  * Class structure for UsbemuDevice.
+ *
+ * Only lifecycle events, i.e. attaching and detaching, are signals. Per
+ * transfer events go through the @submit_urb, @complete_urb, @cancel_urb and
+ * @reset hooks, which are plain function pointers called directly, as
+ * marshalling a signal emission would cost more than handling most
+ * transfers.
  */
 
+/* Owner of an endpoint in the active configuration and alternate settings. */
+typedef struct {
+  UsbemuInterface *interface;
+  guint index;
+} UsbemuEndpointRoute;
+
+/* One slot per endpoint number and direction, control endpoint included. */
+#define N_ENDPOINT_ROUTES 32
+#define ENDPOINT_ROUTE_SLOT(address) \
+  (((address) & 0x0F) | (((address) & USBEMU_ENDPOINT_DIRECTION_IN) >> 3))
+
+/* Doubly linked through UsbemuUrb.prev/next, in submission order. */
+typedef struct {
+  UsbemuUrb *head;
+  UsbemuUrb *tail;
+} UsbemuUrbQueue;
+
+/* Interrupt IN endpoint polled on the timer wheel of its thread. */
+typedef struct {
+  UsbemuWheelTimer timer;
+  /* That of the thread serving the device, taken when first scheduled. */
+  UsbemuTimerWheel *wheel;
+  UsbemuDevice *device;
+  guint8 endpoint_address;
+  /* Monotonic time of the last poll. */
+  gint64 last_poll;
+  /* Set by usbemu_device_wake_interrupt() until the next poll. */
+  gboolean woken;
+  UsbemuInterruptPollFunc func;
+  gpointer user_data;
+  GDestroyNotify destroy;
+} UsbemuInterruptPoll;
+
+/* Per endpoint state, indexed like routes. */
+typedef struct {
+  /* Pending URBs. */
+  UsbemuUrbQueue queues[N_ENDPOINT_ROUTES];
+  /* Hand-over to other threads. */
+  UsbemuEndpointQueue *endpoint_queues[N_ENDPOINT_ROUTES];
+  /* Paced isochronous endpoints. */
+  UsbemuIsoStream *iso_streams[N_ENDPOINT_ROUTES];
+  /* Polled interrupt IN endpoints. */
+  UsbemuInterruptPoll *interrupt_polls[N_ENDPOINT_ROUTES];
+} UsbemuEndpointState;
+
+#define MIN_IN_FLIGHT_BITS 4
+
 typedef struct  _UsbemuDevicePrivate {
   gboolean attached;
+  /* Owner set by a UsbemuRuntime, NULL if served by the caller's thread. */
+  GMainContext *context;
+  /* Set by SET_ADDRESS and SET_FEATURE(DEVICE_REMOTE_WAKEUP) requests. */
+  guint8 address;
+  gboolean remote_wakeup;
 
   guint16 bcdUSB;
+  /* USBEMU_SPEED_UNKNOWN to derive it from bcdUSB. */
+  UsbemuSpeeds speed;
   UsbemuClasses bDeviceClass;
   guint8 bDeviceSubClass;
   guint8 bDeviceProtocol;
@@ -69,7 +152,42 @@ typedef struct  _UsbemuDevicePrivate {
   gchar *manufacturer;
   gchar *product;
   gchar *serial;
-  GSList *configurations;
+  /* Configuration with bConfigurationValue n is at n - 1. Shared with
+   * devices created from a template, see _shares_configurations(). */
+  GPtrArray *configurations;
+  /* Frozen copies of configurations to share with devices created from this
+   * one, made on demand and dropped once configurations change. */
+  GPtrArray *template_configurations;
+
+  /* bConfigurationValue of the active configuration, 0 if not configured. */
+  guint active_configuration;
+  /* Selected alternate setting per interface of the active configuration,
+   * sized when it was activated. */
+  guint8 *alternate_settings;
+  guint n_alternate_settings;
+  /* Selected alternate setting per interface, by bInterfaceNumber. */
+  UsbemuInterface **interfaces;
+  /* Allocated while configured. Rebuilt by _rebuild_routes(). */
+  UsbemuEndpointRoute *routes;
+  /* Halted endpoints, one bit per slot of routes. */
+  guint32 halted;
+
+  /* Pending URBs in an open addressing table keyed by seqnum, with linear
+   * probing, 1 << in_flight_bits slots and at most half of them used. */
+  UsbemuUrb **in_flight;
+  guint in_flight_bits;
+  guint n_in_flight;
+  /* Allocated by _endpoint_state() on first use, so that idle devices, e.g.
+   * many created from one template, do not pay for it. */
+  UsbemuEndpointState *endpoint_state;
+
+  /* Cached wire-format device descriptor. See _invalidate_descriptor(). */
+  GBytes *descriptor;
+
+  UsbemuStringTable *strings;
+  guint8 iManufacturer;
+  guint8 iProduct;
+  guint8 iSerialNumber;
 } UsbemuDevicePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (UsbemuDevice, usbemu_device, G_TYPE_OBJECT)
@@ -81,11 +199,14 @@ enum
 {
   PROP_0,
   PROP_ATTACHED,
+  PROP_SPEED,
   N_PROPERTIES
 };
 
 static GParamSpec *props[N_PROPERTIES] = { NULL, };
 
+#define USBEMU_DEVICE_PROP_SPEED__DEFAULT USBEMU_SPEED_UNKNOWN
+
 enum
 {
   SIGNAL_ATTACHED,
@@ -104,6 +225,63 @@ static void gobject_class_dispose (GObject *object);
 static void gobject_class_finalize (GObject *object);
 /* virtual methods for UsbemuDeviceClass */
 static void usbemu_device_class_init (UsbemuDeviceClass *device_class);
+/* virtual methods for UsbemuDeviceClass */
+static void device_class_submit_urb (UsbemuDevice *device, UsbemuUrb *urb);
+static void device_class_cancel_urb (UsbemuDevice *device, UsbemuUrb *urb);
+static void device_class_control_request (UsbemuDevice *device, UsbemuUrb *urb,
+                                          const UsbemuControlSetup *setup);
+/* helper functions */
+static void _invalidate_descriptor (UsbemuDevicePrivate *priv);
+static GBytes* _build_descriptor (UsbemuDevicePrivate *priv);
+static void _update_string_index (UsbemuDevicePrivate *priv, guint8 *index,
+                                  const gchar *string);
+static UsbemuStringTable* _writable_strings (UsbemuDevicePrivate *priv);
+static gboolean _shares_configurations (UsbemuDevicePrivate *priv);
+static GPtrArray* _template_configurations (UsbemuDevice *device);
+static void _invalidate_speed (UsbemuDevice *device, UsbemuSpeeds old_speed);
+static void _rebuild_routes (UsbemuDevicePrivate *priv);
+static void _cancel_unrouted_urbs (UsbemuDevice *device);
+static void _clear_interface_halts (UsbemuDevicePrivate *priv,
+                                    guint interface_number);
+static guint _in_flight_slot (UsbemuDevicePrivate *priv, guint32 seqnum);
+static void _in_flight_resize (UsbemuDevicePrivate *priv, guint bits);
+static UsbemuEndpointState* _endpoint_state (UsbemuDevicePrivate *priv);
+static gboolean _in_flight_add (UsbemuDevicePrivate *priv, UsbemuUrb *urb);
+static gboolean _in_flight_remove (UsbemuDevicePrivate *priv, UsbemuUrb *urb);
+static void _interrupt_poll_free (UsbemuInterruptPoll *poll);
+static void _interrupt_poll_schedule (UsbemuInterruptPoll *poll);
+static void _interrupt_poll_fire (UsbemuWheelTimer *timer);
+
+/* State of parsing one configuration descriptor bundle. */
+typedef struct {
+  UsbemuConfiguration *configuration;
+  UsbemuSpeeds speed;
+  /* Alternate settings of the interface number being parsed. */
+  GPtrArray *alternates;
+  guint n_interfaces;
+  /* The alternate setting being parsed and its bNumEndpoints. */
+  UsbemuInterface *interface;
+  guint n_endpoints;
+  /* The last endpoint parsed in the alternate setting, if any. */
+  UsbemuEndpointEntry *endpoint;
+  UsbemuEndpointEntry endpoint_entries[2];
+  /* Descriptors not understood since the last standard one. */
+  const guint8 *extra;
+  gsize extra_size;
+} UsbemuParseContext;
+
+static UsbemuConfiguration* _parse_configuration (const guint8 *data,
+                                                  gsize size,
+                                                  UsbemuSpeeds speed,
+                                                  GError **error);
+static gboolean _parse_interface (UsbemuParseContext *context,
+                                  const guint8 *descriptor, GError **error);
+static gboolean _parse_endpoint (UsbemuParseContext *context,
+                                 const guint8 *descriptor, GError **error);
+static void _flush_extra (UsbemuParseContext *context);
+static gboolean _finish_interface (UsbemuParseContext *context,
+                                   GError **error);
+static void _finish_alternates (UsbemuParseContext *context);
 
 static void
 gobject_class_set_property (GObject      *object,
@@ -112,9 +290,11 @@ gobject_class_set_property (GObject      *object,
                             GParamSpec   *pspec)
 {
   UsbemuDevice *device = USBEMU_DEVICE (object);
-  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
 
   switch (prop_id) {
+    case PROP_SPEED:
+      usbemu_device_set_speed (device, g_value_get_enum (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -134,6 +314,9 @@ gobject_class_get_property (GObject    *object,
     case PROP_ATTACHED:
       g_value_set_boolean (value, priv->attached);
       break;
+    case PROP_SPEED:
+      g_value_set_enum (value, usbemu_device_get_speed (device));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -146,10 +329,37 @@ gobject_class_dispose (GObject *object)
   UsbemuDevice *device = USBEMU_DEVICE (object);
   UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
 
-  if (priv->configurations != NULL) {
-    g_slist_free_full (priv->configurations, (GDestroyNotify) g_object_unref);
-    priv->configurations = NULL;
+  UsbemuEndpointState *state = priv->endpoint_state;
+  GPtrArray *configurations;
+  guint i;
+
+  for (i = 0; (state != NULL) && (i < N_ENDPOINT_ROUTES); i++) {
+    if (state->endpoint_queues[i] == NULL)
+      continue;
+    _usbemu_endpoint_queue_unbind (state->endpoint_queues[i]);
+    g_clear_pointer (&state->endpoint_queues[i], usbemu_endpoint_queue_unref);
   }
+
+  for (i = 0; (state != NULL) && (i < N_ENDPOINT_ROUTES); i++) {
+    if (state->iso_streams[i] == NULL)
+      continue;
+    _usbemu_iso_stream_unbind (state->iso_streams[i]);
+    g_clear_pointer (&state->iso_streams[i], usbemu_iso_stream_unref);
+  }
+
+  for (i = 0; (state != NULL) && (i < N_ENDPOINT_ROUTES); i++)
+    g_clear_pointer (&state->interrupt_polls[i], _interrupt_poll_free);
+
+  _usbemu_device_invalidate_template (device);
+
+  /* The array may be shared with devices created from a template, so only
+   * drop our reference to it. */
+  configurations = priv->configurations;
+  priv->configurations = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_unref (configurations);
+
+  priv->active_configuration = 0;
+  _rebuild_routes (priv);
 }
 
 static void
@@ -164,6 +374,13 @@ gobject_class_finalize (GObject *object)
     g_free (priv->product);
   if (priv->serial != NULL)
     g_free (priv->serial);
+  _invalidate_descriptor (priv);
+  _usbemu_string_table_unref (priv->strings);
+  if (priv->context != NULL)
+    g_main_context_unref (priv->context);
+  g_ptr_array_unref (priv->configurations);
+  g_free (priv->in_flight);
+  g_free (priv->endpoint_state);
 }
 
 static void
@@ -178,6 +395,10 @@ usbemu_device_class_init (UsbemuDeviceClass *device_class)
   object_class->dispose = gobject_class_dispose;
   object_class->finalize = gobject_class_finalize;
 
+  device_class->submit_urb = device_class_submit_urb;
+  device_class->cancel_urb = device_class_cancel_urb;
+  device_class->control_request = device_class_control_request;
+
   /* signals */
 
   /**
@@ -219,16 +440,55 @@ usbemu_device_class_init (UsbemuDeviceClass *device_class)
                           FALSE,
                           G_PARAM_READABLE);
 
+  /**
+   * UsbemuDevice:speed:
+   *
+   * Bus speed of the device, which selects the limits and encoding of its
+   * endpoints. Reads the effective speed, i.e. never
+   * %USBEMU_SPEED_UNKNOWN.
+   */
+  props[PROP_SPEED] =
+    g_param_spec_enum (USBEMU_DEVICE_PROP_SPEED,
+                       "Speed", "Speed",
+                       USBEMU_TYPE_SPEEDS,
+                       USBEMU_DEVICE_PROP_SPEED__DEFAULT,
+                       G_PARAM_READWRITE);
+
   g_object_class_install_properties (object_class, N_PROPERTIES, props);
 }
 
+static void
+device_class_submit_urb (UsbemuDevice *device,
+                         UsbemuUrb    *urb)
+{
+  usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_STALL);
+}
+
+static void
+device_class_cancel_urb (UsbemuDevice *device,
+                         UsbemuUrb    *urb)
+{
+}
+
+static void
+device_class_control_request (UsbemuDevice             *device,
+                              UsbemuUrb                *urb,
+                              const UsbemuControlSetup *setup)
+{
+  USBEMU_DEVICE_GET_CLASS (device)->submit_urb (device, urb);
+}
+
 static void
 usbemu_device_init (UsbemuDevice *device)
 {
   UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
 
   priv->attached = FALSE;
+  priv->context = NULL;
+  priv->address = 0;
+  priv->remote_wakeup = FALSE;
   priv->bcdUSB = 0x100;
+  priv->speed = USBEMU_DEVICE_PROP_SPEED__DEFAULT;
   priv->bDeviceClass = USBEMU_CLASS_USE_INTERFACE_DESCRIPTOR;
   priv->bDeviceSubClass = USBEMU_SUB_CLASS_USE_INTERFACE_DESCRIPTOR;
   priv->bDeviceProtocol = USBEMU_PROTOCOL_USE_INTERFACE_DESCRIPTOR;
@@ -240,6 +500,415 @@ usbemu_device_init (UsbemuDevice *device)
   priv->product = g_strdup ("emulated device");
   /* `echo -n dead:beef | md5sum` */
   priv->serial = g_strdup ("9641c4a0c0d26686a3fcdc92711f8f42");
+  priv->configurations = g_ptr_array_new_with_free_func (g_object_unref);
+  priv->active_configuration = 0;
+  priv->alternate_settings = NULL;
+  priv->n_alternate_settings = 0;
+  priv->interfaces = NULL;
+  priv->routes = NULL;
+  priv->halted = 0;
+  priv->in_flight = g_new0 (UsbemuUrb*, 1 << MIN_IN_FLIGHT_BITS);
+  priv->in_flight_bits = MIN_IN_FLIGHT_BITS;
+  priv->n_in_flight = 0;
+  priv->endpoint_state = NULL;
+  priv->descriptor = NULL;
+
+  priv->strings = _usbemu_string_table_new ();
+  priv->iManufacturer =
+      _usbemu_string_table_ref_string (priv->strings, priv->manufacturer);
+  priv->iProduct = _usbemu_string_table_ref_string (priv->strings, priv->product);
+  priv->iSerialNumber =
+      _usbemu_string_table_ref_string (priv->strings, priv->serial);
+}
+
+static void
+_invalidate_descriptor (UsbemuDevicePrivate *priv)
+{
+  if (priv->descriptor != NULL) {
+    g_bytes_unref (priv->descriptor);
+    priv->descriptor = NULL;
+  }
+}
+
+static void
+_update_string_index (UsbemuDevicePrivate *priv,
+                      guint8              *index,
+                      const gchar         *string)
+{
+  guint8 old_index = *index;
+
+  /* Reference the new string first so that an unchanged string keeps its
+   * index. */
+  *index = _usbemu_string_table_ref_string (_writable_strings (priv), string);
+  _usbemu_string_table_unref_string (priv->strings, old_index);
+}
+
+static void
+_rebuild_routes (UsbemuDevicePrivate *priv)
+{
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interface;
+  UsbemuEndpointEntry entry;
+  guint i, j;
+
+  if (priv->active_configuration == 0) {
+    g_clear_pointer (&priv->alternate_settings, g_free);
+    priv->n_alternate_settings = 0;
+    g_clear_pointer (&priv->interfaces, g_free);
+    g_clear_pointer (&priv->routes, g_free);
+    return;
+  }
+
+  configuration = g_ptr_array_index (priv->configurations,
+                                     priv->active_configuration - 1);
+  /* Interfaces added after activation stay unrouted until the configuration
+   * is selected again, as their alternate settings are not tracked yet. */
+  if (priv->alternate_settings == NULL) {
+    priv->n_alternate_settings =
+        usbemu_configuration_get_n_alternate_interfaces (configuration);
+    priv->alternate_settings = g_new0 (guint8,
+                                       MAX (priv->n_alternate_settings, 1));
+    g_free (priv->interfaces);
+    priv->interfaces = g_new0 (UsbemuInterface*,
+                               MAX (priv->n_alternate_settings, 1));
+  }
+
+  if (priv->routes == NULL)
+    priv->routes = g_new0 (UsbemuEndpointRoute, N_ENDPOINT_ROUTES);
+  else
+    memset (priv->routes, 0, N_ENDPOINT_ROUTES * sizeof (priv->routes[0]));
+
+  for (i = 0; i < priv->n_alternate_settings; i++) {
+    interface = usbemu_configuration_get_interface (configuration, i,
+                                                    priv->alternate_settings[i]);
+    priv->interfaces[i] = interface;
+    for (j = 0; usbemu_interface_get_endpoint_entry (interface, j, &entry); j++) {
+      UsbemuEndpointRoute *route =
+          &priv->routes[ENDPOINT_ROUTE_SLOT (entry.endpoint_number |
+                                             entry.direction)];
+
+      route->interface = interface;
+      route->index = j;
+    }
+  }
+}
+
+/* Request cancellation of URBs pending on endpoints that lost their route,
+ * e.g. to a configuration or an alternate setting no longer selected. */
+static void
+_cancel_unrouted_urbs (UsbemuDevice *device)
+{
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  GPtrArray *urbs;
+  UsbemuUrb *urb;
+  guint i;
+
+  if (priv->n_in_flight == 0)
+    return;
+
+  /* As in usbemu_device_cancel_all_urbs(), work from a snapshot. */
+  urbs = g_ptr_array_new_with_free_func ((GDestroyNotify) usbemu_urb_unref);
+  for (i = 0; i < N_ENDPOINT_ROUTES; i++) {
+    /* The default control pipe has no route and is never dropped. */
+    if ((i & 0x0F) == USBEMU_EP_CTL)
+      continue;
+    if ((priv->routes != NULL) && (priv->routes[i].interface != NULL))
+      continue;
+    for (urb = priv->endpoint_state->queues[i].head; urb != NULL;
+         urb = urb->next)
+      g_ptr_array_add (urbs, usbemu_urb_ref (urb));
+  }
+  for (i = 0; i < urbs->len; i++)
+    usbemu_device_cancel_urb (device, g_ptr_array_index (urbs, i));
+  g_ptr_array_unref (urbs);
+}
+
+static void
+_clear_interface_halts (UsbemuDevicePrivate *priv,
+                        guint                interface_number)
+{
+  guint i;
+
+  if (priv->routes == NULL)
+    return;
+
+  for (i = 0; i < N_ENDPOINT_ROUTES; i++) {
+    if ((priv->routes[i].interface != NULL) &&
+        (usbemu_interface_get_interface_number (priv->routes[i].interface) ==
+         interface_number))
+      priv->halted &= ~(1u << i);
+  }
+}
+
+/* Home slot of @seqnum, by Fibonacci hashing. */
+static inline guint
+_in_flight_slot (UsbemuDevicePrivate *priv,
+                 guint32              seqnum)
+{
+  return (guint32) (seqnum * 0x9E3779B1U) >> (32 - priv->in_flight_bits);
+}
+
+static void
+_in_flight_resize (UsbemuDevicePrivate *priv,
+                   guint                bits)
+{
+  UsbemuUrb **old = priv->in_flight;
+  guint n_old = 1 << priv->in_flight_bits, mask, i, slot;
+
+  priv->in_flight = g_new0 (UsbemuUrb*, 1 << bits);
+  priv->in_flight_bits = bits;
+  mask = (1 << bits) - 1;
+
+  for (i = 0; i < n_old; i++) {
+    if (old[i] == NULL)
+      continue;
+
+    slot = _in_flight_slot (priv, old[i]->seqnum);
+    while (priv->in_flight[slot] != NULL)
+      slot = (slot + 1) & mask;
+    priv->in_flight[slot] = old[i];
+  }
+
+  g_free (old);
+}
+
+static UsbemuEndpointState*
+_endpoint_state (UsbemuDevicePrivate *priv)
+{
+  if (priv->endpoint_state == NULL)
+    priv->endpoint_state = g_new0 (UsbemuEndpointState, 1);
+
+  return priv->endpoint_state;
+}
+
+/* Track a pending @urb. Fails if its seqnum is already in flight. */
+static gboolean
+_in_flight_add (UsbemuDevicePrivate *priv,
+                UsbemuUrb           *urb)
+{
+  UsbemuUrbQueue *queue;
+  guint mask, slot;
+
+  if (2 * (priv->n_in_flight + 1) > (1U << priv->in_flight_bits))
+    _in_flight_resize (priv, priv->in_flight_bits + 1);
+
+  mask = (1 << priv->in_flight_bits) - 1;
+  for (slot = _in_flight_slot (priv, urb->seqnum);
+       priv->in_flight[slot] != NULL; slot = (slot + 1) & mask) {
+    if (priv->in_flight[slot]->seqnum == urb->seqnum)
+      return FALSE;
+  }
+  priv->in_flight[slot] = urb;
+  priv->n_in_flight++;
+
+  queue = &_endpoint_state (priv)->queues[ENDPOINT_ROUTE_SLOT (urb->endpoint_address)];
+  urb->next = NULL;
+  urb->prev = queue->tail;
+  if (queue->tail != NULL)
+    queue->tail->next = urb;
+  else
+    queue->head = urb;
+  queue->tail = urb;
+
+  return TRUE;
+}
+
+/* Stop tracking @urb, if it is tracked. */
+static gboolean
+_in_flight_remove (UsbemuDevicePrivate *priv,
+                   UsbemuUrb           *urb)
+{
+  UsbemuUrbQueue *queue;
+  guint mask, slot, hole, home;
+
+  mask = (1 << priv->in_flight_bits) - 1;
+  for (slot = _in_flight_slot (priv, urb->seqnum);
+       priv->in_flight[slot] != urb; slot = (slot + 1) & mask) {
+    if (priv->in_flight[slot] == NULL)
+      return FALSE;
+  }
+
+  /* Backward shift deletion: move later entries of the probe sequence into
+   * the hole unless that would put them before their home slot, so that
+   * lookups never need tombstones. */
+  hole = slot;
+  for (slot = (slot + 1) & mask; priv->in_flight[slot] != NULL;
+       slot = (slot + 1) & mask) {
+    home = _in_flight_slot (priv, priv->in_flight[slot]->seqnum);
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      priv->in_flight[hole] = priv->in_flight[slot];
+      hole = slot;
+    }
+  }
+  priv->in_flight[hole] = NULL;
+  priv->n_in_flight--;
+
+  queue = &priv->endpoint_state->queues[ENDPOINT_ROUTE_SLOT (urb->endpoint_address)];
+  if (urb->prev != NULL)
+    urb->prev->next = urb->next;
+  else
+    queue->head = urb->next;
+  if (urb->next != NULL)
+    urb->next->prev = urb->prev;
+  else
+    queue->tail = urb->prev;
+  urb->prev = urb->next = NULL;
+
+  return TRUE;
+}
+
+static void
+_interrupt_poll_free (UsbemuInterruptPoll *poll)
+{
+  if (poll->wheel != NULL) {
+    _usbemu_timer_wheel_remove (poll->wheel, &poll->timer);
+    _usbemu_timer_wheel_unref (poll->wheel);
+  }
+  if (poll->destroy != NULL)
+    poll->destroy (poll->user_data);
+  g_free (poll);
+}
+
+/* Arm the timer of @poll, right away if woken up, or an interval of the
+ * endpoint after the last poll. */
+static void
+_interrupt_poll_schedule (UsbemuInterruptPoll *poll)
+{
+  UsbemuEndpointEntry entry;
+  gint64 time = 0;
+
+  if (!poll->woken &&
+      (usbemu_device_lookup_endpoint (poll->device, poll->endpoint_address,
+                                      &entry) != NULL))
+    time = poll->last_poll + entry.interval;
+
+  if (poll->wheel == NULL)
+    poll->wheel = _usbemu_timer_wheel_ref_default ();
+  _usbemu_timer_wheel_add (poll->wheel, &poll->timer, time);
+}
+
+static void
+_interrupt_poll_fire (UsbemuWheelTimer *timer)
+{
+  UsbemuInterruptPoll *poll = (UsbemuInterruptPoll*) timer;
+  UsbemuDevice *device = poll->device;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  UsbemuUrbQueue *queue;
+  UsbemuUrb *urb;
+  guint slot;
+
+  slot = ENDPOINT_ROUTE_SLOT (poll->endpoint_address);
+  queue = &priv->endpoint_state->queues[slot];
+  if ((urb = queue->head) == NULL)
+    return;
+
+  poll->last_poll = g_get_monotonic_time ();
+  poll->woken = FALSE;
+
+  g_object_ref (device);
+  if (poll->func (device, urb, poll->user_data))
+    usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_COMPLETED);
+
+  /* The poll may have been unset or rearmed meanwhile. */
+  poll = priv->endpoint_state->interrupt_polls[slot];
+  if ((poll != NULL) && (queue->head != NULL) && (poll->timer.pprev == NULL))
+    _interrupt_poll_schedule (poll);
+  g_object_unref (device);
+}
+
+/* Configurations are shared as a whole, so checking the first one will do. */
+static gboolean
+_shares_configurations (UsbemuDevicePrivate *priv)
+{
+  return (priv->configurations->len > 0) &&
+         _usbemu_configuration_is_shared (g_ptr_array_index (priv->configurations, 0));
+}
+
+/* Configurations to share with devices created from @device: those it
+ * shares itself, or frozen copies of its own so that it may still modify
+ * them. */
+static GPtrArray*
+_template_configurations (UsbemuDevice *device)
+{
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  UsbemuConfiguration *copy;
+  GPtrArray *configurations;
+  guint i;
+
+  if (_shares_configurations (priv))
+    return priv->configurations;
+
+  if (priv->template_configurations == NULL) {
+    configurations = g_ptr_array_new_full (priv->configurations->len,
+                                           g_object_unref);
+    for (i = 0; i < priv->configurations->len; i++) {
+      copy = _usbemu_configuration_copy (g_ptr_array_index (priv->configurations,
+                                                            i));
+      /* Strings are interned in the table shared along. */
+      _usbemu_configuration_set_device (copy, device, i + 1);
+      _usbemu_configuration_set_shared (copy);
+      g_ptr_array_add (configurations, copy);
+    }
+    priv->template_configurations = configurations;
+  }
+
+  return priv->template_configurations;
+}
+
+/* Called whenever a configuration of @device changes. Devices already
+ * created from @device keep the copies they share. */
+void
+_usbemu_device_invalidate_template (UsbemuDevice *device)
+{
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  GPtrArray *configurations;
+  guint i;
+
+  configurations = priv->template_configurations;
+  if (configurations == NULL)
+    return;
+
+  priv->template_configurations = NULL;
+  for (i = 0; i < configurations->len; i++)
+    _usbemu_configuration_release_strings (g_ptr_array_index (configurations,
+                                                              i),
+                                           device);
+  g_ptr_array_unref (configurations);
+}
+
+static UsbemuStringTable*
+_writable_strings (UsbemuDevicePrivate *priv)
+{
+  priv->strings = _usbemu_string_table_make_writable (priv->strings);
+  return priv->strings;
+}
+
+static GBytes*
+_build_descriptor (UsbemuDevicePrivate *priv)
+{
+  guint8 *data;
+
+  data = g_malloc (USBEMU_DEVICE_DESCRIPTOR_SIZE);
+  data[0] = USBEMU_DEVICE_DESCRIPTOR_SIZE;
+  data[1] = USBEMU_DESCRIPTOR_TYPE_DEVICE;
+  data[2] = priv->bcdUSB & 0xFF;
+  data[3] = priv->bcdUSB >> 8;
+  data[4] = priv->bDeviceClass;
+  data[5] = priv->bDeviceSubClass;
+  data[6] = priv->bDeviceProtocol;
+  data[7] = priv->bMaxPacketSize;
+  data[8] = priv->idVendor & 0xFF;
+  data[9] = priv->idVendor >> 8;
+  data[10] = priv->idProduct & 0xFF;
+  data[11] = priv->idProduct >> 8;
+  data[12] = priv->bcdDevice & 0xFF;
+  data[13] = priv->bcdDevice >> 8;
+  data[14] = priv->iManufacturer;
+  data[15] = priv->iProduct;
+  data[16] = priv->iSerialNumber;
+  data[17] = priv->configurations->len;
+
+  return g_bytes_new_take (data, USBEMU_DEVICE_DESCRIPTOR_SIZE);
 }
 
 /**
@@ -272,21 +941,159 @@ usbemu_device_get_attached (UsbemuDevice *device)
   return USBEMU_DEVICE_GET_PRIVATE (device)->attached;
 }
 
-void
-_usbemu_device_set_attached (UsbemuDevice *device,
-                             gboolean      attached)
+static gboolean
+_update_attached (UsbemuDevice *device,
+                  gboolean      attached)
 {
   UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
 
   if (attached == priv->attached)
-    return;
+    return FALSE;
 
   priv->attached = attached;
+  if (!attached) {
+    usbemu_device_set_active_configuration (device, 0);
+    priv->address = 0;
+    priv->remote_wakeup = FALSE;
+  }
+
+  return TRUE;
+}
+
+void
+_usbemu_device_set_attached (UsbemuDevice *device,
+                             gboolean      attached)
+{
+  if (!_update_attached (device, attached))
+    return;
+
   g_object_notify_by_pspec ((GObject*) device, props[PROP_ATTACHED]);
   g_signal_emit (device,
                  signals[attached ? SIGNAL_ATTACHED : SIGNAL_DETACHED], 0);
 }
 
+/* Same as _usbemu_device_set_attached() on each of @devices, NULL ones
+ * skipped, but without emissions nobody listens to: when no handler is
+ * connected, the notification is dropped and the class handler of the
+ * signal called directly, so that plugging hundreds of devices at once does
+ * not go through the signal machinery twice per device. Emission hooks are
+ * not run in that case. */
+void
+_usbemu_device_set_attached_many (UsbemuDevice * const *devices,
+                                  guint                 n_devices,
+                                  gboolean              attached)
+{
+  UsbemuDeviceClass *device_class;
+  UsbemuDevice *device;
+  GQuark detail;
+  guint notify_id, signal_id, i;
+
+  notify_id = g_signal_lookup ("notify", G_TYPE_OBJECT);
+  detail = g_quark_from_static_string (USBEMU_DEVICE_PROP_ATTACHED);
+  signal_id = signals[attached ? SIGNAL_ATTACHED : SIGNAL_DETACHED];
+
+  for (i = 0; i < n_devices; i++) {
+    device = devices[i];
+    if ((device == NULL) || !_update_attached (device, attached))
+      continue;
+
+    if (g_signal_has_handler_pending (device, notify_id, detail, FALSE))
+      g_object_notify_by_pspec ((GObject*) device, props[PROP_ATTACHED]);
+
+    if (g_signal_has_handler_pending (device, signal_id, 0, FALSE)) {
+      g_signal_emit (device, signal_id, 0);
+      continue;
+    }
+
+    device_class = USBEMU_DEVICE_GET_CLASS (device);
+    if (attached && (device_class->attached != NULL))
+      device_class->attached (device);
+    else if (!attached && (device_class->detached != NULL))
+      device_class->detached (device);
+  }
+}
+
+/**
+ * usbemu_device_get_context:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Get the #GMainContext serving @device, as assigned by
+ * usbemu_runtime_assign_device(). Transfers, completions and signals of
+ * @device are dispatched there, and other threads should reach it with
+ * usbemu_device_invoke().
+ *
+ * Returns: (transfer none) (nullable): the #GMainContext, or %NULL if
+ *          @device is served by the threads calling it.
+ */
+GMainContext*
+usbemu_device_get_context (UsbemuDevice *device)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  return USBEMU_DEVICE_GET_PRIVATE (device)->context;
+}
+
+/**
+ * usbemu_device_invoke:
+ * @device: (in): a #UsbemuDevice object.
+ * @func: function to call.
+ * @user_data: data to pass to @func.
+ * @notify: (nullable): a function to call when @user_data is no longer in
+ *     use, or %NULL.
+ *
+ * Call @func in the thread serving @device, as g_main_context_invoke_full()
+ * does with the #GMainContext of usbemu_device_get_context(): right away if
+ * the calling thread is the one, or from that context otherwise. Devices
+ * not assigned to a #UsbemuRuntime use the thread-default #GMainContext of
+ * the calling thread.
+ */
+void
+usbemu_device_invoke (UsbemuDevice   *device,
+                      GSourceFunc     func,
+                      gpointer        user_data,
+                      GDestroyNotify  notify)
+{
+  GMainContext *context;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail (func != NULL);
+
+  context = USBEMU_DEVICE_GET_PRIVATE (device)->context;
+  if (context == NULL)
+    context = g_main_context_get_thread_default ();
+
+  g_main_context_invoke_full (context, G_PRIORITY_DEFAULT, func, user_data,
+                              notify);
+}
+
+void
+_usbemu_device_set_context (UsbemuDevice *device,
+                            GMainContext *context)
+{
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  guint i;
+
+  if (context != NULL)
+    g_main_context_ref (context);
+  if (priv->context != NULL)
+    g_main_context_unref (priv->context);
+  priv->context = context;
+
+  /* Move completion sources over. Timer wheels and isochronous schedulers
+   * are per thread, and only taken by the serving thread once it submits
+   * URBs. */
+  for (i = 0; (priv->endpoint_state != NULL) && (i < N_ENDPOINT_ROUTES); i++) {
+    if (priv->endpoint_state->endpoint_queues[i] == NULL)
+      continue;
+    _usbemu_endpoint_queue_unbind (priv->endpoint_state->endpoint_queues[i]);
+    _usbemu_endpoint_queue_bind (priv->endpoint_state->endpoint_queues[i],
+                                 device);
+  }
+
+  if (USBEMU_IS_HUB (device))
+    _usbemu_hub_set_context (USBEMU_HUB (device), context);
+}
+
 /**
  * usbemu_device_get_specification_num:
  * @device: (in): a #UsbemuDevice object.
@@ -319,7 +1126,96 @@ usbemu_device_set_specification_num (UsbemuDevice *device,
 {
   g_return_if_fail (USBEMU_IS_DEVICE (device));
 
-  USBEMU_DEVICE_GET_PRIVATE (device)->bcdUSB = spec;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  UsbemuSpeeds old_speed;
+
+  old_speed = usbemu_device_get_speed (device);
+  priv->bcdUSB = spec;
+  _invalidate_descriptor (priv);
+  _invalidate_speed (device, old_speed);
+}
+
+/**
+ * usbemu_device_get_speed:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Get the bus speed @device operates at. Unless set with
+ * usbemu_device_set_speed(), it is derived from the specification number as
+ * described for %USBEMU_SPEED_UNKNOWN.
+ *
+ * Returns: a #UsbemuSpeeds other than %USBEMU_SPEED_UNKNOWN.
+ */
+UsbemuSpeeds
+usbemu_device_get_speed (UsbemuDevice *device)
+{
+  UsbemuDevicePrivate *priv;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), USBEMU_SPEED_UNKNOWN);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (priv->speed != USBEMU_SPEED_UNKNOWN)
+    return priv->speed;
+
+  return _usbemu_speed_from_spec (priv->bcdUSB);
+}
+
+/**
+ * usbemu_device_set_speed:
+ * @device: (in): a #UsbemuDevice object.
+ * @speed: a #UsbemuSpeeds, or %USBEMU_SPEED_UNKNOWN to derive it from the
+ *     specification number.
+ *
+ * Set the bus speed @device operates at. It selects the limits checked by
+ * usbemu_device_validate(), the unit of bInterval in endpoint descriptors,
+ * and the speed reported by hubs and transports, e.g. a full-speed device
+ * compliant with USB 2.0.
+ */
+void
+usbemu_device_set_speed (UsbemuDevice *device,
+                         UsbemuSpeeds  speed)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuSpeeds old_speed;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail (speed <= USBEMU_SPEED_SUPER);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (speed == priv->speed)
+    return;
+
+  old_speed = usbemu_device_get_speed (device);
+  priv->speed = speed;
+  _invalidate_speed (device, old_speed);
+  g_object_notify_by_pspec ((GObject*) device, props[PROP_SPEED]);
+}
+
+UsbemuSpeeds
+_usbemu_speed_from_spec (guint16 spec)
+{
+  if (spec < 0x200)
+    return USBEMU_SPEED_FULL;
+  if (spec < 0x300)
+    return USBEMU_SPEED_HIGH;
+  return USBEMU_SPEED_SUPER;
+}
+
+/* Endpoint polling intervals are encoded differently per speed. */
+static void
+_invalidate_speed (UsbemuDevice *device,
+                   UsbemuSpeeds  old_speed)
+{
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  guint i;
+
+  if (usbemu_device_get_speed (device) == old_speed)
+    return;
+
+  /* Cached descriptors of shared configurations use the old speed. */
+  usbemu_device_unshare_configurations (device);
+
+  for (i = 0; i < priv->configurations->len; i++)
+    _usbemu_configuration_invalidate_descriptors (g_ptr_array_index (priv->configurations, i));
 }
 
 /**
@@ -365,7 +1261,9 @@ usbemu_device_set_class (UsbemuDevice  *device,
 {
   g_return_if_fail (USBEMU_IS_DEVICE (device));
 
-  USBEMU_DEVICE_GET_PRIVATE (device)->bDeviceClass = klass;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  priv->bDeviceClass = klass;
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -404,7 +1302,9 @@ usbemu_device_set_sub_class (UsbemuDevice *device,
 {
   g_return_if_fail (USBEMU_IS_DEVICE (device));
 
-  USBEMU_DEVICE_GET_PRIVATE (device)->bDeviceSubClass = sub_class;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  priv->bDeviceSubClass = sub_class;
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -449,7 +1349,9 @@ usbemu_device_set_protocol (UsbemuDevice *device,
 {
   g_return_if_fail (USBEMU_IS_DEVICE (device));
 
-  USBEMU_DEVICE_GET_PRIVATE (device)->bDeviceProtocol = protocol;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  priv->bDeviceProtocol = protocol;
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -482,7 +1384,9 @@ usbemu_device_set_max_packet_size (UsbemuDevice *device,
 {
   g_return_if_fail (USBEMU_IS_DEVICE (device));
 
-  USBEMU_DEVICE_GET_PRIVATE (device)->bMaxPacketSize = max_packet_size;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  priv->bMaxPacketSize = max_packet_size;
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -515,7 +1419,9 @@ usbemu_device_set_vendor_id (UsbemuDevice *device,
 {
   g_return_if_fail (USBEMU_IS_DEVICE (device));
 
-  USBEMU_DEVICE_GET_PRIVATE (device)->idVendor = vendor_id;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  priv->idVendor = vendor_id;
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -547,7 +1453,9 @@ usbemu_device_set_product_id (UsbemuDevice *device,
 {
   g_return_if_fail (USBEMU_IS_DEVICE (device));
 
-  USBEMU_DEVICE_GET_PRIVATE (device)->idProduct = product_id;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  priv->idProduct = product_id;
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -579,7 +1487,9 @@ usbemu_device_set_release_number (UsbemuDevice *device,
 {
   g_return_if_fail (USBEMU_IS_DEVICE (device));
 
-  USBEMU_DEVICE_GET_PRIVATE (device)->bcdDevice = release_number;
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  priv->bcdDevice = release_number;
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -616,6 +1526,8 @@ usbemu_device_set_manufacturer_name (UsbemuDevice *device,
   if (priv->manufacturer != NULL)
     g_free (priv->manufacturer);
   priv->manufacturer = g_strdup (name);
+  _update_string_index (priv, &priv->iManufacturer, name);
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -652,6 +1564,8 @@ usbemu_device_set_product_name (UsbemuDevice *device,
   if (priv->product != NULL)
     g_free (priv->product);
   priv->product = g_strdup (name);
+  _update_string_index (priv, &priv->iProduct, name);
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -688,6 +1602,8 @@ usbemu_device_set_serial (UsbemuDevice *device,
   if (priv->serial != NULL)
     g_free (priv->serial);
   priv->serial = g_strdup (serial);
+  _update_string_index (priv, &priv->iSerialNumber, serial);
+  _invalidate_descriptor (priv);
 }
 
 /**
@@ -708,15 +1624,20 @@ usbemu_device_add_configuration (UsbemuDevice        *device,
   g_return_val_if_fail (USBEMU_IS_CONFIGURATION (configuration), FALSE);
 
   UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  UsbemuDevice *owner;
   guint bConfigurationValue;
 
-  if (usbemu_configuration_get_device (configuration) != NULL)
+  /* Shared configurations report no device but have one. */
+  owner = _usbemu_configuration_peek_device (configuration);
+  if (owner != NULL)
     return FALSE;
 
-  priv->configurations = g_slist_append (priv->configurations,
-                                         g_object_ref (configuration));
-  bConfigurationValue = g_slist_length (priv->configurations);
+  usbemu_device_unshare_configurations (device);
+
+  g_ptr_array_add (priv->configurations, g_object_ref (configuration));
+  bConfigurationValue = priv->configurations->len;
   _usbemu_configuration_set_device (configuration, device, bConfigurationValue);
+  _invalidate_descriptor (priv);
 
   return TRUE;
 }
@@ -728,6 +1649,9 @@ usbemu_device_add_configuration (UsbemuDevice        *device,
  *                       object.
  *
  * Get the #UsbemuConfiguration of a device with specified configuration value.
+ * Configurations shared with a template are replaced by private copies
+ * first, see usbemu_device_unshare_configurations(), so that the returned
+ * one may be modified.
  *
  * Returns: (transfer none): a #UsbemuConfiguration if available, or %NULL
  *          otherwise.
@@ -743,15 +1667,20 @@ usbemu_device_get_configuration (UsbemuDevice *device,
     return NULL;
 
   UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
-  return (UsbemuConfiguration*) g_slist_nth_data (priv->configurations,
-                                                  configuration_value - 1);
+  if (configuration_value > priv->configurations->len)
+    return NULL;
+
+  usbemu_device_unshare_configurations (device);
+
+  return g_ptr_array_index (priv->configurations, configuration_value - 1);
 }
 
 /**
  * usbemu_device_get_configurations:
  * @device: (in): a #UsbemuDevice object.
  *
- * Get all available configurations of a device.
+ * Get all available configurations of a device. Configurations shared with a
+ * template are copied first, as usbemu_device_get_configuration() does.
  *
  * Returns: (transfer full) (type GSList(UsbemuConfiguration)): A list of
  *          #UsbemuConfiguration objects added to the device. Free with:
@@ -762,13 +1691,21 @@ usbemu_device_get_configuration (UsbemuDevice *device,
 GSList*
 usbemu_device_get_configurations (UsbemuDevice *device)
 {
-  GSList *slist;
+  GPtrArray *configurations;
+  GSList *slist = NULL;
+  guint i;
 
   g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
 
-  slist = USBEMU_DEVICE_GET_PRIVATE (device)->configurations;
-  if (slist != NULL)
-    slist = g_slist_copy_deep (slist, (GCopyFunc) g_object_ref, NULL);
+  /* As usbemu_device_get_configuration() does. */
+  usbemu_device_unshare_configurations (device);
+
+  configurations = USBEMU_DEVICE_GET_PRIVATE (device)->configurations;
+  for (i = configurations->len; i > 0; i--) {
+    slist = g_slist_prepend (slist,
+                             g_object_ref (g_ptr_array_index (configurations,
+                                                              i - 1)));
+  }
 
   return slist;
 }
@@ -786,5 +1723,1564 @@ usbemu_device_get_n_configurations (UsbemuDevice *device)
 {
   g_return_val_if_fail (USBEMU_IS_DEVICE (device), 0);
 
-  return g_slist_length (USBEMU_DEVICE_GET_PRIVATE (device)->configurations);
+  return USBEMU_DEVICE_GET_PRIVATE (device)->configurations->len;
+}
+
+/**
+ * usbemu_device_peek_configurations:
+ * @device: (in): the #UsbemuDevice object.
+ * @n_configurations: (out) (optional): return location for the number of
+ *     configurations, or %NULL.
+ *
+ * Get all configurations of this device without copying them or taking
+ * references. The configuration with bConfigurationValue n is at index n - 1.
+ * The returned array is owned by @device and is only valid until the next
+ * configuration is added, configurations are unshared or @device is
+ * disposed. Configurations shared with a template are returned as is and
+ * must not be modified, see usbemu_device_new_from_template().
+ *
+ * Returns: (transfer none) (array length=n_configurations): borrowed
+ *          #UsbemuConfiguration objects.
+ */
+UsbemuConfiguration* const*
+usbemu_device_peek_configurations (UsbemuDevice *device,
+                                   guint        *n_configurations)
+{
+  GPtrArray *configurations;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  configurations = USBEMU_DEVICE_GET_PRIVATE (device)->configurations;
+  if (n_configurations != NULL)
+    *n_configurations = configurations->len;
+
+  return (UsbemuConfiguration* const*) configurations->pdata;
+}
+
+/**
+ * usbemu_device_set_active_configuration:
+ * @device: (in): a #UsbemuDevice object.
+ * @configuration_value: bConfigurationValue of the configuration to activate,
+ *     or 0 to return to the address state.
+ *
+ * Select the active configuration, as a SET_CONFIGURATION request does. All
+ * interfaces are reset to alternate setting zero, all endpoint halts are
+ * cleared and the endpoint routing table used by
+ * usbemu_device_lookup_endpoint() is rebuilt. URBs pending on endpoints no
+ * longer routed are cancelled, as usbemu_device_cancel_urb() does.
+ *
+ * Returns: %TRUE if succeeded. %FALSE if no such configuration.
+ */
+gboolean
+usbemu_device_set_active_configuration (UsbemuDevice *device,
+                                        guint         configuration_value)
+{
+  UsbemuDevicePrivate *priv;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (configuration_value > priv->configurations->len)
+    return FALSE;
+
+  priv->active_configuration = configuration_value;
+  priv->halted = 0;
+  g_clear_pointer (&priv->alternate_settings, g_free);
+  _rebuild_routes (priv);
+  _cancel_unrouted_urbs (device);
+
+  return TRUE;
+}
+
+/**
+ * usbemu_device_get_active_configuration:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Get the active configuration, as a GET_CONFIGURATION request does.
+ *
+ * Returns: bConfigurationValue of the active configuration, or 0 if not
+ *          configured.
+ */
+guint
+usbemu_device_get_active_configuration (UsbemuDevice *device)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), 0);
+
+  return USBEMU_DEVICE_GET_PRIVATE (device)->active_configuration;
+}
+
+/**
+ * usbemu_device_set_alternate_setting:
+ * @device: (in): a #UsbemuDevice object.
+ * @interface_number: an interface number of the active configuration.
+ * @alternate_setting: the alternate setting to select.
+ *
+ * Select an alternate setting of an interface in the active configuration, as
+ * a SET_INTERFACE request does. Halts of the endpoints of that interface are
+ * cleared and the endpoint routing table used by
+ * usbemu_device_lookup_endpoint() is rebuilt. URBs pending on endpoints no
+ * longer routed are cancelled.
+ *
+ * Returns: %TRUE if succeeded. %FALSE if not configured or no such interface
+ *          or alternate setting.
+ */
+gboolean
+usbemu_device_set_alternate_setting (UsbemuDevice *device,
+                                     guint         interface_number,
+                                     guint         alternate_setting)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuConfiguration *configuration;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (priv->active_configuration == 0)
+    return FALSE;
+
+  if (interface_number >= priv->n_alternate_settings)
+    return FALSE;
+
+  configuration = g_ptr_array_index (priv->configurations,
+                                     priv->active_configuration - 1);
+  if (usbemu_configuration_get_interface (configuration, interface_number,
+                                          alternate_setting) == NULL)
+    return FALSE;
+
+  _clear_interface_halts (priv, interface_number);
+  priv->alternate_settings[interface_number] = alternate_setting;
+  _rebuild_routes (priv);
+  _clear_interface_halts (priv, interface_number);
+  _cancel_unrouted_urbs (device);
+
+  return TRUE;
+}
+
+/**
+ * usbemu_device_get_alternate_setting:
+ * @device: (in): a #UsbemuDevice object.
+ * @interface_number: an interface number of the active configuration.
+ *
+ * Get the selected alternate setting of an interface in the active
+ * configuration, as a GET_INTERFACE request does.
+ *
+ * Returns: the alternate setting, or 0 if not configured or no such
+ *          interface.
+ */
+guint
+usbemu_device_get_alternate_setting (UsbemuDevice *device,
+                                     guint         interface_number)
+{
+  UsbemuDevicePrivate *priv;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), 0);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (interface_number >= priv->n_alternate_settings)
+    return 0;
+
+  return priv->alternate_settings[interface_number];
+}
+
+/**
+ * usbemu_device_lookup_endpoint:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress, i.e. the endpoint number OR-ed with a
+ *     #UsbemuEndpointDirections.
+ * @entry: (out caller-allocates) (optional): return location for the
+ *     #UsbemuEndpointEntry, or %NULL.
+ *
+ * Find the endpoint with address @endpoint_address in the active
+ * configuration and alternate settings. This is a constant time lookup in a
+ * table rebuilt only when the active configuration or an alternate setting
+ * changes.
+ *
+ * Returns: (transfer none) (nullable): the #UsbemuInterface owning the
+ *          endpoint, or %NULL if not configured or no such endpoint. The
+ *          default control endpoint is never found.
+ */
+UsbemuInterface*
+usbemu_device_lookup_endpoint (UsbemuDevice        *device,
+                               guint8               endpoint_address,
+                               UsbemuEndpointEntry *entry)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuEndpointRoute *route;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (priv->routes == NULL)
+    return NULL;
+
+  route = &priv->routes[ENDPOINT_ROUTE_SLOT (endpoint_address)];
+  if ((route->interface != NULL) && (entry != NULL))
+    usbemu_interface_get_endpoint_entry (route->interface, route->index, entry);
+
+  return route->interface;
+}
+
+/**
+ * usbemu_device_lookup_interface:
+ * @device: (in): a #UsbemuDevice object.
+ * @interface_number: bInterfaceNumber of an interface.
+ *
+ * Find the selected alternate setting of an interface in the active
+ * configuration. Like usbemu_device_lookup_endpoint(), this is a constant
+ * time lookup in a table rebuilt only when the active configuration or an
+ * alternate setting changes.
+ *
+ * Returns: (transfer none) (nullable): the #UsbemuInterface, or %NULL if not
+ *          configured or no such interface.
+ */
+UsbemuInterface*
+usbemu_device_lookup_interface (UsbemuDevice *device,
+                                guint         interface_number)
+{
+  UsbemuDevicePrivate *priv;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (interface_number >= priv->n_alternate_settings)
+    return NULL;
+
+  return priv->interfaces[interface_number];
+}
+
+/**
+ * usbemu_device_get_address:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Get the address assigned by the last SET_ADDRESS request.
+ *
+ * Returns: the device address, or 0 for the default address.
+ */
+guint
+usbemu_device_get_address (UsbemuDevice *device)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), 0);
+
+  return USBEMU_DEVICE_GET_PRIVATE (device)->address;
+}
+
+void
+_usbemu_device_set_address (UsbemuDevice *device,
+                            guint8        address)
+{
+  USBEMU_DEVICE_GET_PRIVATE (device)->address = address;
+}
+
+/**
+ * usbemu_device_get_remote_wakeup:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Get whether the host enabled remote wakeup with a
+ * SET_FEATURE(DEVICE_REMOTE_WAKEUP) request.
+ *
+ * Returns: %TRUE if remote wakeup is enabled.
+ */
+gboolean
+usbemu_device_get_remote_wakeup (UsbemuDevice *device)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+
+  return USBEMU_DEVICE_GET_PRIVATE (device)->remote_wakeup;
+}
+
+void
+_usbemu_device_set_remote_wakeup (UsbemuDevice *device,
+                                  gboolean      remote_wakeup)
+{
+  USBEMU_DEVICE_GET_PRIVATE (device)->remote_wakeup = remote_wakeup;
+}
+
+/**
+ * usbemu_device_set_endpoint_halt:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of an endpoint in the active
+ *     configuration and alternate settings.
+ * @halt: whether the endpoint is halted.
+ *
+ * Halt an endpoint, as a SET_FEATURE(ENDPOINT_HALT) request does, or clear
+ * its halt. URBs submitted to a halted endpoint complete with
+ * %USBEMU_URB_STATUS_STALL until the halt is cleared, by this function, a
+ * CLEAR_FEATURE(ENDPOINT_HALT) request, or by selecting a configuration or
+ * an alternate setting. Devices may use it to report a functional stall.
+ *
+ * Returns: %TRUE if succeeded. %FALSE if no such endpoint.
+ */
+gboolean
+usbemu_device_set_endpoint_halt (UsbemuDevice *device,
+                                 guint8        endpoint_address,
+                                 gboolean      halt)
+{
+  UsbemuDevicePrivate *priv;
+  guint32 bit;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if ((priv->routes == NULL) ||
+      (priv->routes[ENDPOINT_ROUTE_SLOT (endpoint_address)].interface == NULL))
+    return FALSE;
+
+  bit = 1u << ENDPOINT_ROUTE_SLOT (endpoint_address);
+  if (halt)
+    priv->halted |= bit;
+  else
+    priv->halted &= ~bit;
+
+  return TRUE;
+}
+
+/**
+ * usbemu_device_get_endpoint_halt:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of an endpoint.
+ *
+ * Get whether an endpoint is halted, see usbemu_device_set_endpoint_halt().
+ *
+ * Returns: %TRUE if the endpoint is halted.
+ */
+gboolean
+usbemu_device_get_endpoint_halt (UsbemuDevice *device,
+                                 guint8        endpoint_address)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+
+  return (USBEMU_DEVICE_GET_PRIVATE (device)->halted &
+          (1u << ENDPOINT_ROUTE_SLOT (endpoint_address))) != 0;
+}
+
+/**
+ * usbemu_device_reset:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Reset @device as a USB bus reset does: every pending #UsbemuUrb is
+ * cancelled, the device returns to the default state, unconfigured with
+ * the default address and remote wakeup disabled, and
+ * #UsbemuDeviceClass.reset is called. The device stays attached.
+ */
+void
+usbemu_device_reset (UsbemuDevice *device)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuDeviceClass *device_class;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  usbemu_device_cancel_all_urbs (device);
+  usbemu_device_set_active_configuration (device, 0);
+  priv->address = 0;
+  priv->remote_wakeup = FALSE;
+
+  device_class = USBEMU_DEVICE_GET_CLASS (device);
+  if (device_class->reset != NULL)
+    device_class->reset (device);
+}
+
+/**
+ * usbemu_device_submit_urb:
+ * @device: (in): a #UsbemuDevice object.
+ * @urb: (in): a #UsbemuUrb to submit.
+ * @complete_func: (scope async): function called when @urb completes.
+ * @user_data: user data for @complete_func.
+ *
+ * Submit @urb to @device. @complete_func is called exactly once, possibly
+ * before this function returns. URBs submitted to a detached device complete
+ * with %USBEMU_URB_STATUS_SHUTDOWN, and those targeting a halted endpoint or
+ * an endpoint not in the active configuration complete with
+ * %USBEMU_URB_STATUS_STALL. Others are tracked by their seqnum, which must
+ * be unique among URBs pending on @device. A duplicated seqnum completes
+ * with %USBEMU_URB_STATUS_ERROR.
+ *
+ * Standard requests on the default control endpoint are answered by the
+ * library, see usbemu-control. Other requests on the default control endpoint
+ * are passed to its #UsbemuEndpointQueue if any, or routed by the recipient
+ * in bmRequestType and wIndex to #UsbemuInterfaceClass.control_request of
+ * the interface or endpoint owner, or to #UsbemuDeviceClass.control_request.
+ *
+ * URBs on other endpoints are passed to the #UsbemuIsoStream or
+ * #UsbemuEndpointQueue of the endpoint if any, or left pending for the
+ * #UsbemuInterruptPollFunc of the endpoint to answer. Otherwise they are
+ * passed to #UsbemuDeviceClass.submit_urb.
+ */
+void
+usbemu_device_submit_urb (UsbemuDevice          *device,
+                          UsbemuUrb             *urb,
+                          UsbemuUrbCompleteFunc  complete_func,
+                          gpointer               user_data)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuEndpointState *state;
+  UsbemuEndpointQueue *queue;
+  UsbemuIsoStream *stream;
+  UsbemuInterruptPoll *poll;
+  UsbemuControlSetup setup;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail (urb != NULL);
+  g_return_if_fail (urb->status != USBEMU_URB_STATUS_PENDING);
+
+  usbemu_urb_ref (urb);
+  urb->complete_func = complete_func;
+  urb->complete_data = user_data;
+  urb->status = USBEMU_URB_STATUS_PENDING;
+  urb->actual_length = 0;
+  urb->error_count = 0;
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (!priv->attached) {
+    usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_SHUTDOWN);
+    return;
+  }
+
+  if (((urb->endpoint_address & 0x0F) != USBEMU_EP_CTL) &&
+      ((priv->routes == NULL) ||
+       (priv->routes[ENDPOINT_ROUTE_SLOT (urb->endpoint_address)].interface == NULL) ||
+       (priv->halted & (1u << ENDPOINT_ROUTE_SLOT (urb->endpoint_address))))) {
+    usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_STALL);
+    return;
+  }
+
+  if (!_in_flight_add (priv, urb)) {
+    usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_ERROR);
+    return;
+  }
+
+  /* Allocated by _in_flight_add(). */
+  state = priv->endpoint_state;
+  queue = state->endpoint_queues[ENDPOINT_ROUTE_SLOT (urb->endpoint_address)];
+  if ((urb->endpoint_address & 0x0F) == USBEMU_EP_CTL) {
+    usbemu_control_parse_setup (urb->setup, &setup);
+    if (_usbemu_control_handle_standard (device, urb, &setup))
+      return;
+    if (queue == NULL) {
+      _usbemu_control_route (device, urb, &setup);
+      return;
+    }
+  }
+
+  stream = state->iso_streams[ENDPOINT_ROUTE_SLOT (urb->endpoint_address)];
+  poll = state->interrupt_polls[ENDPOINT_ROUTE_SLOT (urb->endpoint_address)];
+  if (stream != NULL) {
+    _usbemu_iso_stream_push (stream, urb);
+  } else if (queue != NULL) {
+    _usbemu_endpoint_queue_push (queue, urb);
+  } else if (poll != NULL) {
+    /* Already queued on the endpoint, answered at the next poll. */
+    if (poll->timer.pprev == NULL)
+      _interrupt_poll_schedule (poll);
+  } else {
+    USBEMU_DEVICE_GET_CLASS (device)->submit_urb (device, urb);
+  }
+}
+
+/**
+ * usbemu_device_cancel_urb:
+ * @device: (in): a #UsbemuDevice object.
+ * @urb: (in): a #UsbemuUrb submitted to @device.
+ *
+ * Request cancellation of a pending @urb. Cancellation is asynchronous: the
+ * URB still completes through its #UsbemuUrbCompleteFunc, with
+ * %USBEMU_URB_STATUS_CANCELLED if the device gave it up, or with its
+ * regular status if it had already finished. Does nothing if @urb is not
+ * pending.
+ */
+void
+usbemu_device_cancel_urb (UsbemuDevice *device,
+                          UsbemuUrb    *urb)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuEndpointQueue *queue;
+  UsbemuIsoStream *stream;
+  UsbemuInterruptPoll *poll;
+  guint slot;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail (urb != NULL);
+
+  if (urb->status != USBEMU_URB_STATUS_PENDING)
+    return;
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  stream = NULL;
+  queue = NULL;
+  poll = NULL;
+  if (priv->endpoint_state != NULL) {
+    slot = ENDPOINT_ROUTE_SLOT (urb->endpoint_address);
+    stream = priv->endpoint_state->iso_streams[slot];
+    queue = priv->endpoint_state->endpoint_queues[slot];
+    poll = priv->endpoint_state->interrupt_polls[slot];
+  }
+  if (stream != NULL)
+    _usbemu_iso_stream_cancel (stream, urb);
+  else if (queue != NULL)
+    _usbemu_endpoint_queue_cancel (queue, urb);
+  else if (poll != NULL)
+    usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_CANCELLED);
+  else
+    USBEMU_DEVICE_GET_CLASS (device)->cancel_urb (device, urb);
+}
+
+/**
+ * usbemu_device_complete_urb:
+ * @device: (in): a #UsbemuDevice object.
+ * @urb: (in): a pending #UsbemuUrb submitted to @device.
+ * @status: completion status.
+ *
+ * Complete @urb with @status and invoke its #UsbemuUrbCompleteFunc. For IN
+ * transfers, @urb's actual_length and buffer must have been filled before.
+ * The reference taken by usbemu_device_submit_urb() is dropped.
+ */
+void
+usbemu_device_complete_urb (UsbemuDevice    *device,
+                            UsbemuUrb       *urb,
+                            UsbemuUrbStatus  status)
+{
+  UsbemuDeviceClass *device_class;
+  UsbemuUrbCompleteFunc complete_func;
+  gpointer complete_data;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail (urb != NULL);
+  g_return_if_fail (urb->status == USBEMU_URB_STATUS_PENDING);
+  g_return_if_fail (status != USBEMU_URB_STATUS_PENDING);
+
+  /* Completions may come in any order, even within an endpoint. */
+  _in_flight_remove (USBEMU_DEVICE_GET_PRIVATE (device), urb);
+
+  if (urb->actual_length > urb->buffer_length)
+    urb->actual_length = urb->buffer_length;
+  urb->status = status;
+
+  device_class = USBEMU_DEVICE_GET_CLASS (device);
+  if (device_class->complete_urb != NULL)
+    device_class->complete_urb (device, urb);
+
+  complete_func = urb->complete_func;
+  complete_data = urb->complete_data;
+  urb->complete_func = NULL;
+  urb->complete_data = NULL;
+  if (complete_func != NULL)
+    complete_func (urb, complete_data);
+
+  usbemu_urb_unref (urb);
+}
+
+/**
+ * usbemu_device_lookup_urb:
+ * @device: (in): a #UsbemuDevice object.
+ * @seqnum: seqnum of a submitted #UsbemuUrb.
+ *
+ * Find the pending #UsbemuUrb submitted to @device with @seqnum, in constant
+ * time.
+ *
+ * Returns: (transfer none) (nullable): the #UsbemuUrb, or %NULL if none is
+ *          pending with that seqnum.
+ */
+UsbemuUrb*
+usbemu_device_lookup_urb (UsbemuDevice *device,
+                          guint32       seqnum)
+{
+  UsbemuDevicePrivate *priv;
+  guint mask, slot;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  mask = (1 << priv->in_flight_bits) - 1;
+  for (slot = _in_flight_slot (priv, seqnum); priv->in_flight[slot] != NULL;
+       slot = (slot + 1) & mask) {
+    if (priv->in_flight[slot]->seqnum == seqnum)
+      return priv->in_flight[slot];
+  }
+
+  return NULL;
+}
+
+/**
+ * usbemu_device_unlink_urb:
+ * @device: (in): a #UsbemuDevice object.
+ * @seqnum: seqnum of a submitted #UsbemuUrb.
+ *
+ * Request cancellation of the pending #UsbemuUrb with @seqnum, as
+ * usbemu_device_cancel_urb() does.
+ *
+ * Returns: %TRUE if a URB with @seqnum was pending, %FALSE otherwise.
+ */
+gboolean
+usbemu_device_unlink_urb (UsbemuDevice *device,
+                          guint32       seqnum)
+{
+  UsbemuUrb *urb;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+
+  urb = usbemu_device_lookup_urb (device, seqnum);
+  if (urb == NULL)
+    return FALSE;
+
+  usbemu_device_cancel_urb (device, urb);
+  return TRUE;
+}
+
+/**
+ * usbemu_device_peek_urb:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of the endpoint.
+ *
+ * Get the oldest pending #UsbemuUrb submitted to an endpoint. Later ones are
+ * chained in submission order and can be walked with usbemu_urb_next().
+ *
+ * Returns: (transfer none) (nullable): the #UsbemuUrb, or %NULL if none is
+ *          pending on the endpoint.
+ */
+UsbemuUrb*
+usbemu_device_peek_urb (UsbemuDevice *device,
+                        guint8        endpoint_address)
+{
+  UsbemuDevicePrivate *priv;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (priv->endpoint_state == NULL)
+    return NULL;
+
+  return priv->endpoint_state->queues[ENDPOINT_ROUTE_SLOT (endpoint_address)].head;
+}
+
+/**
+ * usbemu_device_cancel_all_urbs:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Request cancellation of every pending #UsbemuUrb of @device, as
+ * usbemu_device_cancel_urb() does.
+ */
+void
+usbemu_device_cancel_all_urbs (UsbemuDevice *device)
+{
+  UsbemuDevicePrivate *priv;
+  GPtrArray *urbs;
+  UsbemuUrb *urb;
+  guint i;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (priv->n_in_flight == 0)
+    return;
+
+  /* Cancellations may complete synchronously and relink the queues, so work
+   * from a snapshot. */
+  urbs = g_ptr_array_new_full (priv->n_in_flight,
+                               (GDestroyNotify) usbemu_urb_unref);
+  for (i = 0; i < N_ENDPOINT_ROUTES; i++) {
+    for (urb = priv->endpoint_state->queues[i].head; urb != NULL;
+         urb = urb->next)
+      g_ptr_array_add (urbs, usbemu_urb_ref (urb));
+  }
+  for (i = 0; i < urbs->len; i++)
+    usbemu_device_cancel_urb (device, g_ptr_array_index (urbs, i));
+  g_ptr_array_unref (urbs);
+}
+
+/**
+ * usbemu_device_set_endpoint_queue:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of the endpoint.
+ * @queue: (in) (nullable): a #UsbemuEndpointQueue, or %NULL.
+ *
+ * Hand URBs routed to an endpoint over to @queue instead of
+ * #UsbemuDeviceClass.submit_urb, or restore the default with %NULL. URBs
+ * taken from @queue are completed in the thread-default #GMainContext of
+ * the caller, which should be the one the transport of @device runs in. No
+ * URB may be pending on the endpoint, and @queue may be set on one endpoint
+ * only.
+ */
+void
+usbemu_device_set_endpoint_queue (UsbemuDevice        *device,
+                                  guint8               endpoint_address,
+                                  UsbemuEndpointQueue *queue)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuEndpointState *state;
+  UsbemuEndpointQueue **slot;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  state = _endpoint_state (priv);
+  g_return_if_fail (state->queues[ENDPOINT_ROUTE_SLOT (endpoint_address)].head == NULL);
+
+  slot = &state->endpoint_queues[ENDPOINT_ROUTE_SLOT (endpoint_address)];
+  if (*slot == queue)
+    return;
+
+  if (*slot != NULL) {
+    _usbemu_endpoint_queue_unbind (*slot);
+    g_clear_pointer (slot, usbemu_endpoint_queue_unref);
+  }
+
+  if (queue != NULL) {
+    _usbemu_endpoint_queue_bind (queue, device);
+    *slot = usbemu_endpoint_queue_ref (queue);
+  }
+}
+
+/**
+ * usbemu_device_get_endpoint_queue:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of the endpoint.
+ *
+ * Get the #UsbemuEndpointQueue set on an endpoint.
+ *
+ * Returns: (transfer none) (nullable): the #UsbemuEndpointQueue, or %NULL.
+ */
+UsbemuEndpointQueue*
+usbemu_device_get_endpoint_queue (UsbemuDevice *device,
+                                  guint8        endpoint_address)
+{
+  UsbemuDevicePrivate *priv;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (priv->endpoint_state == NULL)
+    return NULL;
+
+  return priv->endpoint_state->endpoint_queues[ENDPOINT_ROUTE_SLOT (endpoint_address)];
+}
+
+/**
+ * usbemu_device_set_iso_stream:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of an isochronous endpoint.
+ * @stream: (in) (nullable): a #UsbemuIsoStream, or %NULL.
+ *
+ * Serve URBs routed to an isochronous endpoint with @stream instead of
+ * #UsbemuDeviceClass.submit_urb, or restore the default with %NULL. The
+ * stream is paced in the thread-default #GMainContext of the caller, which
+ * should be the one the transport of @device runs in. No URB may be pending
+ * on the endpoint, and @stream may be set on one endpoint only.
+ */
+void
+usbemu_device_set_iso_stream (UsbemuDevice    *device,
+                              guint8           endpoint_address,
+                              UsbemuIsoStream *stream)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuEndpointState *state;
+  UsbemuIsoStream **slot;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail ((endpoint_address & 0x0F) != USBEMU_EP_CTL);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  state = _endpoint_state (priv);
+  g_return_if_fail (state->queues[ENDPOINT_ROUTE_SLOT (endpoint_address)].head == NULL);
+
+  slot = &state->iso_streams[ENDPOINT_ROUTE_SLOT (endpoint_address)];
+  if (*slot == stream)
+    return;
+
+  if (*slot != NULL) {
+    _usbemu_iso_stream_unbind (*slot);
+    g_clear_pointer (slot, usbemu_iso_stream_unref);
+  }
+
+  if (stream != NULL) {
+    _usbemu_iso_stream_bind (stream, device);
+    *slot = usbemu_iso_stream_ref (stream);
+  }
+}
+
+/**
+ * usbemu_device_get_iso_stream:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of the endpoint.
+ *
+ * Get the #UsbemuIsoStream set on an endpoint.
+ *
+ * Returns: (transfer none) (nullable): the #UsbemuIsoStream, or %NULL.
+ */
+UsbemuIsoStream*
+usbemu_device_get_iso_stream (UsbemuDevice *device,
+                              guint8        endpoint_address)
+{
+  UsbemuDevicePrivate *priv;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (priv->endpoint_state == NULL)
+    return NULL;
+
+  return priv->endpoint_state->iso_streams[ENDPOINT_ROUTE_SLOT (endpoint_address)];
+}
+
+/**
+ * usbemu_device_set_interrupt_poll:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of an interrupt IN endpoint.
+ * @func: (nullable) (scope notified): function polling the endpoint, or
+ *     %NULL.
+ * @user_data: user data for @func.
+ * @destroy: (nullable): destroy notifier for @user_data.
+ *
+ * Poll an interrupt IN endpoint the way the host does: while URBs are
+ * pending on it, @func is called for the first of them once per interval
+ * of its #UsbemuEndpointEntry, instead of passing them to
+ * #UsbemuDeviceClass.submit_urb. Call usbemu_device_wake_interrupt() when
+ * data becomes available to be polled right away. %NULL restores the
+ * default. No URB may be pending on the endpoint.
+ *
+ * Endpoints served by one thread share a hierarchical timer wheel
+ * dispatched in the thread-default #GMainContext of that thread, so that
+ * thousands of polled endpoints cost a single #GSource. An endpoint joins
+ * the wheel of the thread its first URB is submitted from.
+ */
+void
+usbemu_device_set_interrupt_poll (UsbemuDevice            *device,
+                                  guint8                   endpoint_address,
+                                  UsbemuInterruptPollFunc  func,
+                                  gpointer                 user_data,
+                                  GDestroyNotify           destroy)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuEndpointState *state;
+  UsbemuInterruptPoll **slot, *poll;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail ((endpoint_address & 0x0F) != USBEMU_EP_CTL);
+  g_return_if_fail (endpoint_address & USBEMU_ENDPOINT_DIRECTION_IN);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  state = _endpoint_state (priv);
+  g_return_if_fail (state->queues[ENDPOINT_ROUTE_SLOT (endpoint_address)].head == NULL);
+
+  slot = &state->interrupt_polls[ENDPOINT_ROUTE_SLOT (endpoint_address)];
+  g_clear_pointer (slot, _interrupt_poll_free);
+  if (func == NULL)
+    return;
+
+  poll = g_new0 (UsbemuInterruptPoll, 1);
+  poll->timer.func = _interrupt_poll_fire;
+  poll->wheel = NULL;
+  poll->device = device;
+  poll->endpoint_address = endpoint_address;
+  poll->func = func;
+  poll->user_data = user_data;
+  poll->destroy = destroy;
+  *slot = poll;
+}
+
+/**
+ * usbemu_device_wake_interrupt:
+ * @device: (in): a #UsbemuDevice object.
+ * @endpoint_address: bEndpointAddress of an endpoint polled with
+ *     usbemu_device_set_interrupt_poll().
+ *
+ * Tell that data was queued for an interrupt IN endpoint, so that it is
+ * polled in the next main loop iteration instead of at its next interval,
+ * or as soon as a URB is submitted if none is pending.
+ */
+void
+usbemu_device_wake_interrupt (UsbemuDevice *device,
+                              guint8        endpoint_address)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuInterruptPoll *poll;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  g_return_if_fail (priv->endpoint_state != NULL);
+  poll = priv->endpoint_state->interrupt_polls[ENDPOINT_ROUTE_SLOT (endpoint_address)];
+  g_return_if_fail (poll != NULL);
+
+  poll->woken = TRUE;
+  if (priv->endpoint_state->queues[ENDPOINT_ROUTE_SLOT (endpoint_address)].head == NULL)
+    return;
+
+  if (poll->wheel != NULL)
+    _usbemu_timer_wheel_remove (poll->wheel, &poll->timer);
+  _interrupt_poll_schedule (poll);
+}
+
+/**
+ * usbemu_device_get_descriptor_bytes:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Get the standard device descriptor of this device in USB wire format. The
+ * descriptor is encoded once and cached until any of its fields is modified,
+ * so serving a GET_DESCRIPTOR(DEVICE) request is only a memcpy.
+ *
+ * Returns: (transfer none): a #GBytes of %USBEMU_DEVICE_DESCRIPTOR_SIZE bytes
+ *          owned by the device. It stays valid until the next modification of
+ *          the device, use g_bytes_ref() to keep it longer.
+ */
+GBytes*
+usbemu_device_get_descriptor_bytes (UsbemuDevice *device)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  UsbemuDevicePrivate *priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (priv->descriptor == NULL)
+    priv->descriptor = _build_descriptor (priv);
+
+  return priv->descriptor;
+}
+
+guint8
+_usbemu_device_ref_string (UsbemuDevice *device,
+                           const gchar  *string)
+{
+  return _usbemu_string_table_ref_string (_writable_strings (USBEMU_DEVICE_GET_PRIVATE (device)),
+                                          string);
+}
+
+void
+_usbemu_device_unref_string (UsbemuDevice *device,
+                             guint8        index)
+{
+  _usbemu_string_table_unref_string (_writable_strings (USBEMU_DEVICE_GET_PRIVATE (device)),
+                                     index);
+}
+
+/**
+ * usbemu_device_set_languages:
+ * @device: (in): a #UsbemuDevice object.
+ * @langids: (in) (array length=n_langids): LANGIDs supported by the device,
+ *     the first one being the default.
+ * @n_langids: number of elements in @langids.
+ *
+ * Set the languages reported in string descriptor zero. All strings are
+ * re-encoded for each language so that string descriptor requests remain a
+ * table lookup. Defaults to #USBEMU_LANGID_ENGLISH_US only.
+ */
+void
+usbemu_device_set_languages (UsbemuDevice  *device,
+                             const guint16 *langids,
+                             gsize          n_langids)
+{
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail ((langids != NULL) || (n_langids == 0));
+
+  _usbemu_string_table_set_languages (_writable_strings (USBEMU_DEVICE_GET_PRIVATE (device)),
+                                      langids, n_langids);
+}
+
+/**
+ * usbemu_device_get_languages:
+ * @device: (in): a #UsbemuDevice object.
+ * @n_langids: (out) (optional): return location for the number of LANGIDs.
+ *
+ * Get the languages reported in string descriptor zero.
+ *
+ * Returns: (transfer none) (array length=n_langids): LANGIDs supported by the
+ *          device. The returned array is owned by USBEmu and should not be
+ *          modified or freed.
+ */
+const guint16*
+usbemu_device_get_languages (UsbemuDevice *device,
+                             gsize        *n_langids)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  return _usbemu_string_table_get_languages (USBEMU_DEVICE_GET_PRIVATE (device)->strings,
+                                             n_langids);
+}
+
+/**
+ * usbemu_device_set_string_translation:
+ * @device: (in): a #UsbemuDevice object.
+ * @langid: a LANGID previously passed to usbemu_device_set_languages().
+ * @string: (in): a %NULL-terminated string as set on the device, one of its
+ *     configurations or interfaces.
+ * @translation: (in) (nullable): the translation of @string in @langid, or
+ *     %NULL to remove it.
+ *
+ * Set the translation of a string for a given language. Strings without a
+ * translation are reported as is in every language.
+ */
+void
+usbemu_device_set_string_translation (UsbemuDevice *device,
+                                      guint16       langid,
+                                      const gchar  *string,
+                                      const gchar  *translation)
+{
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+  g_return_if_fail (string != NULL);
+
+  _usbemu_string_table_set_translation (_writable_strings (USBEMU_DEVICE_GET_PRIVATE (device)),
+                                        langid, string, translation);
+}
+
+/**
+ * usbemu_device_get_string_descriptor_bytes:
+ * @device: (in): a #UsbemuDevice object.
+ * @index: string descriptor index. Zero for the supported LANGID array.
+ * @langid: the requested LANGID.
+ *
+ * Get a string descriptor in USB wire format as returned for a
+ * GET_DESCRIPTOR(STRING) request. Indexes are assigned automatically to the
+ * manufacturer, product and serial strings of the device and to the names of
+ * its configurations and interfaces. Descriptors are pre-encoded in UTF-16LE,
+ * so this is a table lookup. An unsupported @langid falls back to the default
+ * language.
+ *
+ * Returns: (transfer none) (nullable): a #GBytes owned by the device, or
+ *          %NULL if there is no string at @index. It stays valid until the
+ *          string or the languages are modified, use g_bytes_ref() to keep it
+ *          longer.
+ */
+GBytes*
+usbemu_device_get_string_descriptor_bytes (UsbemuDevice *device,
+                                           guint8        index,
+                                           guint16       langid)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), NULL);
+
+  return _usbemu_string_table_lookup (USBEMU_DEVICE_GET_PRIVATE (device)->strings,
+                                      index, langid);
+}
+
+/**
+ * usbemu_device_new_from_template:
+ * @template_device: (in): a #UsbemuDevice object to be used as template.
+ *
+ * Create a new #UsbemuDevice instance with the same device descriptor fields
+ * and names as @template_device. Configurations, interfaces and string
+ * descriptors of @template_device are shared instead of copied, so that
+ * spawning many identical devices costs little more than the #UsbemuDevice
+ * instance itself. Per device state, e.g. the serial number, may be set freely
+ * on the new device, and only strings added that way are stored per device.
+ *
+ * The new device shares frozen copies of the configurations of
+ * @template_device, made once and reused for further devices until
+ * @template_device modifies its own, which it remains free to do. The new
+ * device gets private copies of them, owned by and reported by
+ * usbemu_configuration_get_device() as the new device, on first access
+ * through usbemu_device_get_configuration() or
+ * usbemu_device_get_configurations(), when a configuration is added or when
+ * the speed returned by usbemu_device_get_speed() changes. Only the shared
+ * copies themselves, as returned by usbemu_device_peek_configurations() or
+ * reached from a route, are read-only: their setters fail with a critical
+ * warning, and usbemu_configuration_get_device() returns %NULL for them.
+ *
+ * Devices created from one template may be assigned to different workers of
+ * a #UsbemuRuntime. Shared configurations have their descriptors built here
+ * and string tables are only read while shared, so serving them concurrently
+ * needs no lock. Create all devices from a template before the template
+ * itself is used by a worker, or from the thread serving it.
+ *
+ * Returns: (transfer full) (type UsbemuDevice): The constructed device object
+ *          or %NULL.
+ */
+UsbemuDevice*
+usbemu_device_new_from_template (UsbemuDevice *template_device)
+{
+  UsbemuDevice *device;
+  UsbemuDevicePrivate *priv, *template_priv;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (template_device), NULL);
+
+  device = usbemu_device_new ();
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  template_priv = USBEMU_DEVICE_GET_PRIVATE (template_device);
+
+  priv->bcdUSB = template_priv->bcdUSB;
+  priv->speed = template_priv->speed;
+  priv->bDeviceClass = template_priv->bDeviceClass;
+  priv->bDeviceSubClass = template_priv->bDeviceSubClass;
+  priv->bDeviceProtocol = template_priv->bDeviceProtocol;
+  priv->bMaxPacketSize = template_priv->bMaxPacketSize;
+  priv->idVendor = template_priv->idVendor;
+  priv->idProduct = template_priv->idProduct;
+  priv->bcdDevice = template_priv->bcdDevice;
+
+  g_free (priv->manufacturer);
+  priv->manufacturer = g_strdup (template_priv->manufacturer);
+  g_free (priv->product);
+  priv->product = g_strdup (template_priv->product);
+  g_free (priv->serial);
+  priv->serial = g_strdup (template_priv->serial);
+
+  /* Before sharing the string table, which copies intern their strings in. */
+  if (template_priv->configurations->len > 0) {
+    g_ptr_array_unref (priv->configurations);
+    priv->configurations =
+        g_ptr_array_ref (_template_configurations (template_device));
+  }
+
+  _usbemu_string_table_unref (priv->strings);
+  priv->strings = _usbemu_string_table_ref (template_priv->strings);
+  priv->iManufacturer = template_priv->iManufacturer;
+  priv->iProduct = template_priv->iProduct;
+  priv->iSerialNumber = template_priv->iSerialNumber;
+
+  return device;
+}
+
+/**
+ * usbemu_device_unshare_configurations:
+ * @device: (in): a #UsbemuDevice object.
+ *
+ * Replace configurations shared with the template @device was created from
+ * by private copies, so that they can be modified without affecting other
+ * devices. Does nothing if @device shares no configurations. This happens on
+ * demand, see usbemu_device_new_from_template().
+ */
+void
+usbemu_device_unshare_configurations (UsbemuDevice *device)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuConfiguration *configuration;
+  GPtrArray *shared;
+  guint i;
+
+  g_return_if_fail (USBEMU_IS_DEVICE (device));
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  if (!_shares_configurations (priv))
+    return;
+
+  shared = priv->configurations;
+  priv->configurations = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (i = 0; i < shared->len; i++) {
+    configuration = _usbemu_configuration_copy (g_ptr_array_index (shared, i));
+    usbemu_device_add_configuration (device, configuration);
+    g_object_unref (configuration);
+  }
+
+  /* The string table was inherited with the references held by the shared
+   * configurations. Drop them now that the copies hold their own. */
+  for (i = 0; i < shared->len; i++)
+    _usbemu_configuration_release_strings (g_ptr_array_index (shared, i),
+                                           device);
+
+  g_ptr_array_unref (shared);
+  _invalidate_descriptor (priv);
+
+  /* Routes point to the shared interfaces. */
+  _rebuild_routes (priv);
+}
+
+/**
+ * usbemu_device_validate:
+ * @device: (in): a #UsbemuDevice object.
+ * @error: (out) (optional): return location for a #GError, or %NULL.
+ *
+ * Check every endpoint of every configuration and alternate setting against
+ * the limits of the transfer type at the speed returned by
+ * usbemu_device_get_speed(), i.e. maximum packet size, additional transactions and polling
+ * interval, and the size of every configuration descriptor bundle against
+ * the 65535 bytes wTotalLength can express. This is meant to be called once
+ * the device is completely built, so that transfers may rely on a valid tree
+ * later on.
+ *
+ * Returns: %TRUE if valid. %FALSE with @error set otherwise.
+ */
+gboolean
+usbemu_device_validate (UsbemuDevice  *device,
+                        GError       **error)
+{
+  UsbemuDevicePrivate *priv;
+  UsbemuConfiguration *configuration;
+  UsbemuInterface * const *alternates;
+  UsbemuSpeeds speed;
+  guint i, j, k, n_interfaces, n_alternates;
+
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+  g_return_val_if_fail ((error == NULL) || (*error == NULL), FALSE);
+
+  priv = USBEMU_DEVICE_GET_PRIVATE (device);
+  speed = usbemu_device_get_speed (device);
+  for (i = 0; i < priv->configurations->len; i++) {
+    configuration = g_ptr_array_index (priv->configurations, i);
+    if (usbemu_configuration_get_descriptor_bytes (configuration) == NULL) {
+      g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                   "Configuration %u: descriptors exceed 65535 bytes", i + 1);
+      return FALSE;
+    }
+
+    n_interfaces = usbemu_configuration_get_n_alternate_interfaces (configuration);
+    for (j = 0; j < n_interfaces; j++) {
+      alternates =
+          usbemu_configuration_peek_alternate_interfaces (configuration, j,
+                                                          &n_alternates);
+      for (k = 0; k < n_alternates; k++) {
+        if (!_usbemu_interface_validate (alternates[k], speed, error)) {
+          g_prefix_error (error, "Configuration %u: ", i + 1);
+          return FALSE;
+        }
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+ * usbemu_device_new_from_descriptors:
+ * @data: (in) (array length=size): a device descriptor immediately followed by
+ *     the full configuration descriptor bundle of every configuration.
+ * @size: size of @data in bytes.
+ * @error: (out) (optional): return location for a #GError, or %NULL.
+ *
+ * Create a new #UsbemuDevice with all its configurations, interfaces and
+ * endpoints from raw descriptors in USB wire format, i.e. the format of the
+ * `descriptors` file of a USB device in Linux sysfs. Every descriptor is
+ * bounds checked before use.
+ *
+ * Descriptors not understood by usbemu, e.g. class specific ones, are kept as
+ * extra descriptors of the preceding configuration, interface or endpoint
+ * descriptor and are emitted verbatim in
+ * usbemu_configuration_get_descriptor_bytes(). Standard interface and
+ * endpoint descriptors longer than their standard size, e.g. audio class 1.0
+ * endpoints, keep their bLength and trailing fields unchanged.
+ *
+ * The bus speed is not part of the input either, so endpoint intervals are
+ * decoded for the speed derived from bcdUSB as for %USBEMU_SPEED_UNKNOWN.
+ *
+ * String descriptors are not part of the input, so all names are left unset.
+ * Configuration values are reassigned in order of appearance. Interfaces must
+ * be numbered from zero with alternate settings in increasing order.
+ *
+ * Returns: (transfer full) (nullable): The constructed device object or %NULL
+ *          with @error set.
+ */
+UsbemuDevice*
+usbemu_device_new_from_descriptors (gconstpointer   data,
+                                    gsize           size,
+                                    GError        **error)
+{
+  const guint8 *descriptor = data;
+  UsbemuDevice *device;
+  UsbemuConfiguration *configuration;
+  guint16 spec, total_length;
+  gsize offset;
+  guint i;
+
+  g_return_val_if_fail ((data != NULL) || (size == 0), NULL);
+  g_return_val_if_fail ((error == NULL) || (*error == NULL), NULL);
+
+  if ((size < USBEMU_DEVICE_DESCRIPTOR_SIZE) ||
+      (descriptor[0] != USBEMU_DEVICE_DESCRIPTOR_SIZE) ||
+      (descriptor[1] != USBEMU_DESCRIPTOR_TYPE_DEVICE)) {
+    g_set_error_literal (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                         "Invalid device descriptor");
+    return NULL;
+  }
+
+  spec = descriptor[2] | (descriptor[3] << 8);
+
+  device = usbemu_device_new ();
+  usbemu_device_set_specification_num (device, spec);
+  usbemu_device_set_class (device, descriptor[4]);
+  usbemu_device_set_sub_class (device, descriptor[5]);
+  usbemu_device_set_protocol (device, descriptor[6]);
+  usbemu_device_set_max_packet_size (device, descriptor[7]);
+  usbemu_device_set_vendor_id (device, descriptor[8] | (descriptor[9] << 8));
+  usbemu_device_set_product_id (device, descriptor[10] | (descriptor[11] << 8));
+  usbemu_device_set_release_number (device,
+                                    descriptor[12] | (descriptor[13] << 8));
+  usbemu_device_set_manufacturer_name (device, NULL);
+  usbemu_device_set_product_name (device, NULL);
+  usbemu_device_set_serial (device, NULL);
+
+  offset = USBEMU_DEVICE_DESCRIPTOR_SIZE;
+  for (i = 0; i < descriptor[17]; i++) {
+    if ((size - offset) < USBEMU_CONFIGURATION_DESCRIPTOR_SIZE) {
+      g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                   "Missing configuration descriptor %u", i + 1);
+      goto error;
+    }
+
+    total_length = descriptor[offset + 2] | (descriptor[offset + 3] << 8);
+    if (total_length > (size - offset)) {
+      g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                   "Configuration descriptor %u truncated", i + 1);
+      goto error;
+    }
+
+    configuration = _parse_configuration (descriptor + offset, total_length,
+                                          usbemu_device_get_speed (device),
+                                          error);
+    if (configuration == NULL)
+      goto error;
+
+    usbemu_device_add_configuration (device, configuration);
+    g_object_unref (configuration);
+    offset += total_length;
+  }
+
+  if (offset != size) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                 "%" G_GSIZE_FORMAT " trailing bytes after configuration %u",
+                 size - offset, i);
+    goto error;
+  }
+
+  return device;
+
+error:
+  /* Break the reference cycles between the device and its children. */
+  g_object_run_dispose (G_OBJECT (device));
+  g_object_unref (device);
+  return NULL;
+}
+
+static UsbemuConfiguration*
+_parse_configuration (const guint8  *data,
+                      gsize          size,
+                      UsbemuSpeeds   speed,
+                      GError       **error)
+{
+  UsbemuParseContext context = { NULL, };
+  const guint8 *descriptor;
+  gsize offset;
+
+  if ((data[0] < USBEMU_CONFIGURATION_DESCRIPTOR_SIZE) || (data[0] > size) ||
+      (data[1] != USBEMU_DESCRIPTOR_TYPE_CONFIGURATION)) {
+    g_set_error_literal (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                         "Invalid configuration descriptor");
+    return NULL;
+  }
+
+  /* bMaxPower is expressed in 2 mA units. */
+  context.configuration = usbemu_configuration_new_full (NULL, data[7],
+                                                         data[8] * 2);
+  context.speed = speed;
+  context.alternates = g_ptr_array_new ();
+
+  for (offset = data[0]; offset < size; offset += descriptor[0]) {
+    descriptor = data + offset;
+    if (((size - offset) < 2) || (descriptor[0] < 2) ||
+        (descriptor[0] > (size - offset))) {
+      g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                   "Invalid descriptor length at offset %" G_GSIZE_FORMAT,
+                   offset);
+      goto error;
+    }
+
+    switch (descriptor[1]) {
+      case USBEMU_DESCRIPTOR_TYPE_DEVICE:
+      case USBEMU_DESCRIPTOR_TYPE_CONFIGURATION:
+        g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                     "Unexpected descriptor type %u at offset %" G_GSIZE_FORMAT,
+                     descriptor[1], offset);
+        goto error;
+      case USBEMU_DESCRIPTOR_TYPE_INTERFACE:
+        if (!_parse_interface (&context, descriptor, error))
+          goto error;
+        break;
+      case USBEMU_DESCRIPTOR_TYPE_ENDPOINT:
+        if (!_parse_endpoint (&context, descriptor, error))
+          goto error;
+        break;
+      default:
+        if (context.extra == NULL)
+          context.extra = descriptor;
+        context.extra_size += descriptor[0];
+        break;
+    }
+  }
+
+  _flush_extra (&context);
+  if (!_finish_interface (&context, error))
+    goto error;
+  _finish_alternates (&context);
+
+  if (context.n_interfaces != data[4]) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                 "Expected %u interfaces, found %u", data[4],
+                 context.n_interfaces);
+    goto error;
+  }
+
+  g_ptr_array_unref (context.alternates);
+  return context.configuration;
+
+error:
+  _finish_alternates (&context);
+  g_ptr_array_unref (context.alternates);
+  /* Break the reference cycles between the configuration and interfaces. */
+  g_object_run_dispose (G_OBJECT (context.configuration));
+  g_object_unref (context.configuration);
+  return NULL;
+}
+
+static gboolean
+_parse_interface (UsbemuParseContext  *context,
+                  const guint8        *descriptor,
+                  GError             **error)
+{
+  guint interface_number, alternate_setting;
+  GBytes *tail;
+
+  if (descriptor[0] < USBEMU_INTERFACE_DESCRIPTOR_SIZE) {
+    g_set_error_literal (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                         "Interface descriptor too short");
+    return FALSE;
+  }
+
+  _flush_extra (context);
+  if (!_finish_interface (context, error))
+    return FALSE;
+
+  interface_number = descriptor[2];
+  alternate_setting = descriptor[3];
+  if (alternate_setting == 0)
+    _finish_alternates (context);
+
+  if ((interface_number != context->n_interfaces) ||
+      (alternate_setting != context->alternates->len)) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                 "Interface %u alternate setting %u out of order",
+                 interface_number, alternate_setting);
+    return FALSE;
+  }
+
+  /* Use setters as class codes may be missing from UsbemuClasses. */
+  context->interface = usbemu_interface_new ();
+  usbemu_interface_set_class (context->interface, descriptor[5]);
+  usbemu_interface_set_sub_class (context->interface, descriptor[6]);
+  usbemu_interface_set_protocol (context->interface, descriptor[7]);
+  if (descriptor[0] > USBEMU_INTERFACE_DESCRIPTOR_SIZE) {
+    tail = g_bytes_new (descriptor + USBEMU_INTERFACE_DESCRIPTOR_SIZE,
+                        descriptor[0] - USBEMU_INTERFACE_DESCRIPTOR_SIZE);
+    _usbemu_interface_set_descriptor_tail (context->interface, tail);
+    g_bytes_unref (tail);
+  }
+  g_ptr_array_add (context->alternates, context->interface);
+  context->n_endpoints = descriptor[4];
+  context->endpoint = NULL;
+
+  return TRUE;
+}
+
+static gboolean
+_parse_endpoint (UsbemuParseContext  *context,
+                 const guint8        *descriptor,
+                 GError             **error)
+{
+  UsbemuEndpointEntry *entry = &context->endpoint_entries[0];
+  guint max_packet_size;
+  GBytes *tail;
+
+  if ((descriptor[0] < USBEMU_ENDPOINT_DESCRIPTOR_SIZE) ||
+      ((descriptor[2] & 0x0F) == USBEMU_EP_CTL)) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                 "Invalid endpoint descriptor 0x%02x", descriptor[2]);
+    return FALSE;
+  }
+  if (context->interface == NULL) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                 "Endpoint 0x%02x outside of interface", descriptor[2]);
+    return FALSE;
+  }
+
+  _flush_extra (context);
+
+  max_packet_size = descriptor[4] | (descriptor[5] << 8);
+
+  entry->endpoint_number = descriptor[2] & 0x0F;
+  entry->direction = descriptor[2] & USBEMU_ENDPOINT_DIRECTION_IN;
+  entry->transfer = descriptor[3] & 0x03;
+  entry->attributes = 0;
+  if (entry->transfer == USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS)
+    entry->attributes = descriptor[3] & 0x3C;
+  entry->max_packet_size = max_packet_size & 0x7FF;
+  entry->additional_transactions = (max_packet_size >> 11) & 0x3;
+  entry->interval = _usbemu_interface_decode_interval (entry->transfer,
+                                                       descriptor[6],
+                                                       context->speed);
+
+  if (!usbemu_interface_add_endpoint_entries (context->interface,
+                                              context->endpoint_entries,
+                                              error))
+    return FALSE;
+  context->endpoint = entry;
+
+  if (descriptor[0] > USBEMU_ENDPOINT_DESCRIPTOR_SIZE) {
+    tail = g_bytes_new (descriptor + USBEMU_ENDPOINT_DESCRIPTOR_SIZE,
+                        descriptor[0] - USBEMU_ENDPOINT_DESCRIPTOR_SIZE);
+    _usbemu_interface_set_endpoint_descriptor_tail (context->interface,
+                                                    entry->endpoint_number,
+                                                    entry->direction, tail);
+    g_bytes_unref (tail);
+  }
+
+  return TRUE;
+}
+
+static void
+_flush_extra (UsbemuParseContext *context)
+{
+  GBytes *extra;
+
+  if (context->extra == NULL)
+    return;
+
+  extra = g_bytes_new (context->extra, context->extra_size);
+  if (context->interface == NULL)
+    usbemu_configuration_set_extra_descriptors (context->configuration, extra);
+  else if (context->endpoint == NULL)
+    usbemu_interface_set_extra_descriptors (context->interface, extra);
+  else
+    usbemu_interface_set_endpoint_extra_descriptors (context->interface,
+                                                     context->endpoint->endpoint_number,
+                                                     context->endpoint->direction,
+                                                     extra);
+  g_bytes_unref (extra);
+
+  context->extra = NULL;
+  context->extra_size = 0;
+}
+
+static gboolean
+_finish_interface (UsbemuParseContext  *context,
+                   GError             **error)
+{
+  guint n_endpoints;
+
+  if (context->interface == NULL)
+    return TRUE;
+
+  n_endpoints = usbemu_interface_get_n_endpoints (context->interface);
+
+  if (n_endpoints != context->n_endpoints) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                 "Expected %u endpoints, found %u", context->n_endpoints,
+                 n_endpoints);
+    return FALSE;
+  }
+
+  context->interface = NULL;
+  context->endpoint = NULL;
+  return TRUE;
+}
+
+static void
+_finish_alternates (UsbemuParseContext *context)
+{
+  guint i;
+
+  if (context->alternates->len == 0)
+    return;
+
+  g_ptr_array_add (context->alternates, NULL);
+  usbemu_configuration_add_alternate_interfaces (context->configuration,
+                                                 (UsbemuInterface**) context->alternates->pdata);
+  context->n_interfaces++;
+
+  for (i = 0; i < (context->alternates->len - 1); i++)
+    g_object_unref (g_ptr_array_index (context->alternates, i));
+  g_ptr_array_set_size (context->alternates, 0);
 }
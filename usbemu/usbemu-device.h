@@ -23,6 +23,11 @@
 
 #include <glib-object.h>
 
+#include <usbemu/usbemu-control.h>
+#include <usbemu/usbemu-endpoint-queue.h>
+#include <usbemu/usbemu-iso-stream.h>
+#include <usbemu/usbemu-urb.h>
+
 G_BEGIN_DECLS
 
 /**
@@ -41,6 +46,12 @@ G_DECLARE_DERIVABLE_TYPE (UsbemuDevice, usbemu_device, USBEMU, DEVICE,
  * "attached" property name.
  */
 #define USBEMU_DEVICE_PROP_ATTACHED "attached"
+/**
+ * USBEMU_DEVICE_PROP_SPEED:
+ *
+ * "speed" property name.
+ */
+#define USBEMU_DEVICE_PROP_SPEED "speed"
 
 /**
  * USBEMU_DEVICE_SIGNAL_ATTACHED:
@@ -56,19 +67,34 @@ G_DECLARE_DERIVABLE_TYPE (UsbemuDevice, usbemu_device, USBEMU, DEVICE,
 #define USBEMU_DEVICE_SIGNAL_DETACHED "detached"
 
 struct _UsbemuConfiguration;
+struct _UsbemuInterface;
+struct _UsbemuEndpointEntry;
 
 struct _UsbemuDeviceClass {
   GObjectClass parent_class;
 
-  /* signal callbacks */
+  /* signal callbacks, for lifecycle events only */
 
   void (*attached) (UsbemuDevice *device);
   void (*detached) (UsbemuDevice *device);
 
+  /* transfers */
+
+  void (*submit_urb) (UsbemuDevice *device,
+                      UsbemuUrb    *urb);
+  void (*cancel_urb) (UsbemuDevice *device,
+                      UsbemuUrb    *urb);
+  void (*control_request) (UsbemuDevice             *device,
+                           UsbemuUrb                *urb,
+                           const UsbemuControlSetup *setup);
+  void (*complete_urb) (UsbemuDevice *device,
+                        UsbemuUrb    *urb);
+  void (*reset) (UsbemuDevice *device);
+
   /*< private >*/
 
   /* Reserved slots for furture extension. */
-  gpointer padding[12];
+  gpointer padding[7];
 };
 
 /**
@@ -168,6 +194,69 @@ typedef enum /*< enum,prefix=USBEMU >*/
   USBEMU_CLASS_VENDOR_SPECIFIC = 0xFF, /*< nick=VendorSpecific >*/
 } UsbemuClasses;
 
+/**
+ * UsbemuDescriptorTypes:
+ * @USBEMU_DESCRIPTOR_TYPE_DEVICE: Device descriptor.
+ * @USBEMU_DESCRIPTOR_TYPE_CONFIGURATION: Configuration descriptor.
+ * @USBEMU_DESCRIPTOR_TYPE_STRING: String descriptor.
+ * @USBEMU_DESCRIPTOR_TYPE_INTERFACE: Interface descriptor.
+ * @USBEMU_DESCRIPTOR_TYPE_ENDPOINT: Endpoint descriptor.
+ * @USBEMU_DESCRIPTOR_TYPE_DEVICE_QUALIFIER: Device qualifier descriptor.
+ * @USBEMU_DESCRIPTOR_TYPE_OTHER_SPEED_CONFIGURATION: Other speed configuration
+ *     descriptor.
+ * @USBEMU_DESCRIPTOR_TYPE_INTERFACE_POWER: Interface power descriptor.
+ *
+ * Standard descriptor types as used in the bDescriptorType field.
+ */
+typedef enum /*< enum,prefix=USBEMU >*/
+{
+  USBEMU_DESCRIPTOR_TYPE_DEVICE = 0x01, /*< nick=Device >*/
+  USBEMU_DESCRIPTOR_TYPE_CONFIGURATION = 0x02, /*< nick=Configuration >*/
+  USBEMU_DESCRIPTOR_TYPE_STRING = 0x03, /*< nick=String >*/
+  USBEMU_DESCRIPTOR_TYPE_INTERFACE = 0x04, /*< nick=Interface >*/
+  USBEMU_DESCRIPTOR_TYPE_ENDPOINT = 0x05, /*< nick=Endpoint >*/
+  USBEMU_DESCRIPTOR_TYPE_DEVICE_QUALIFIER = 0x06, /*< nick=DeviceQualifier >*/
+  USBEMU_DESCRIPTOR_TYPE_OTHER_SPEED_CONFIGURATION = 0x07, /*< nick=OtherSpeedConfiguration >*/
+  USBEMU_DESCRIPTOR_TYPE_INTERFACE_POWER = 0x08, /*< nick=InterfacePower >*/
+} UsbemuDescriptorTypes;
+
+/**
+ * UsbemuSpeeds:
+ * @USBEMU_SPEED_UNKNOWN: Not set, derived from the specification number:
+ *     full-speed before USB 2.0, high-speed before USB 3.0 and SuperSpeed
+ *     otherwise.
+ * @USBEMU_SPEED_LOW: Low-speed, 1.5 Mb/s.
+ * @USBEMU_SPEED_FULL: Full-speed, 12 Mb/s.
+ * @USBEMU_SPEED_HIGH: High-speed, 480 Mb/s.
+ * @USBEMU_SPEED_SUPER: SuperSpeed, 5 Gb/s.
+ *
+ * Bus speed a device operates at. A device compliant with USB 2.0 may run
+ * at any speed up to high-speed.
+ */
+typedef enum /*< enum,prefix=USBEMU >*/
+{
+  USBEMU_SPEED_UNKNOWN = 0, /*< nick=Unknown >*/
+  USBEMU_SPEED_LOW = 1, /*< nick=Low >*/
+  USBEMU_SPEED_FULL = 2, /*< nick=Full >*/
+  USBEMU_SPEED_HIGH = 3, /*< nick=High >*/
+  USBEMU_SPEED_SUPER = 4, /*< nick=Super >*/
+} UsbemuSpeeds;
+
+/**
+ * USBEMU_DEVICE_DESCRIPTOR_SIZE:
+ *
+ * Size in bytes of a standard device descriptor.
+ */
+#define USBEMU_DEVICE_DESCRIPTOR_SIZE 18
+
+/**
+ * USBEMU_LANGID_ENGLISH_US:
+ *
+ * LANGID of English (United States), the default language of string
+ * descriptors. See usbemu_device_set_languages().
+ */
+#define USBEMU_LANGID_ENGLISH_US 0x0409
+
 /**
  * USBEMU_SUB_CLASS_USE_INTERFACE_DESCRIPTOR:
  *
@@ -189,13 +278,39 @@ typedef enum /*< enum,prefix=USBEMU >*/
  */
 #define USBEMU_PROTOCOL_VENDOR_SPECIFIC 0xFF
 
+/**
+ * UsbemuInterruptPollFunc:
+ * @device: the #UsbemuDevice.
+ * @urb: the first pending #UsbemuUrb of the endpoint.
+ * @user_data: user data passed to usbemu_device_set_interrupt_poll().
+ *
+ * Poll an interrupt IN endpoint on behalf of the host. Fill @urb and set its
+ * actual_length to answer it, or leave it pending to NAK until the next
+ * poll. @urb may also be completed with another status, e.g.
+ * %USBEMU_URB_STATUS_STALL, in which case %FALSE must be returned.
+ *
+ * Returns: %TRUE to complete @urb with %USBEMU_URB_STATUS_COMPLETED.
+ */
+typedef gboolean (*UsbemuInterruptPollFunc) (UsbemuDevice *device,
+                                             UsbemuUrb    *urb,
+                                             gpointer      user_data);
+
 UsbemuDevice* usbemu_device_new ();
 
 gboolean usbemu_device_get_attached (UsbemuDevice *device);
 
+GMainContext* usbemu_device_get_context (UsbemuDevice   *device);
+void          usbemu_device_invoke      (UsbemuDevice   *device,
+                                         GSourceFunc     func,
+                                         gpointer        user_data,
+                                         GDestroyNotify  notify);
+
 guint16       usbemu_device_get_specification_num (UsbemuDevice  *device);
 void          usbemu_device_set_specification_num (UsbemuDevice  *device,
                                                    guint16        spec);
+UsbemuSpeeds  usbemu_device_get_speed             (UsbemuDevice  *device);
+void          usbemu_device_set_speed             (UsbemuDevice  *device,
+                                                   UsbemuSpeeds   speed);
 UsbemuClasses usbemu_device_get_class             (UsbemuDevice  *device);
 void          usbemu_device_set_class             (UsbemuDevice  *device,
                                                    UsbemuClasses  klass);
@@ -233,5 +348,96 @@ struct _UsbemuConfiguration* usbemu_device_get_configuration    (UsbemuDevice
                                                                  guint                        configuration_value);
 GSList*                      usbemu_device_get_configurations   (UsbemuDevice                *device);
 guint                        usbemu_device_get_n_configurations (UsbemuDevice                *device);
+struct _UsbemuConfiguration* const* usbemu_device_peek_configurations (UsbemuDevice *device,
+                                                                       guint        *n_configurations);
+
+gboolean usbemu_device_set_active_configuration (UsbemuDevice *device,
+                                                 guint         configuration_value);
+guint    usbemu_device_get_active_configuration (UsbemuDevice *device);
+gboolean usbemu_device_set_alternate_setting    (UsbemuDevice *device,
+                                                 guint         interface_number,
+                                                 guint         alternate_setting);
+guint    usbemu_device_get_alternate_setting    (UsbemuDevice *device,
+                                                 guint         interface_number);
+
+struct _UsbemuInterface* usbemu_device_lookup_endpoint (UsbemuDevice                *device,
+                                                        guint8                       endpoint_address,
+                                                        struct _UsbemuEndpointEntry *entry);
+
+struct _UsbemuInterface* usbemu_device_lookup_interface (UsbemuDevice *device,
+                                                         guint         interface_number);
+
+guint    usbemu_device_get_address       (UsbemuDevice *device);
+gboolean usbemu_device_get_remote_wakeup (UsbemuDevice *device);
+gboolean usbemu_device_set_endpoint_halt (UsbemuDevice *device,
+                                          guint8        endpoint_address,
+                                          gboolean      halt);
+gboolean usbemu_device_get_endpoint_halt (UsbemuDevice *device,
+                                          guint8        endpoint_address);
+
+void usbemu_device_reset (UsbemuDevice *device);
+
+void usbemu_device_submit_urb   (UsbemuDevice          *device,
+                                 UsbemuUrb             *urb,
+                                 UsbemuUrbCompleteFunc  complete_func,
+                                 gpointer               user_data);
+void usbemu_device_cancel_urb   (UsbemuDevice          *device,
+                                 UsbemuUrb             *urb);
+void usbemu_device_complete_urb (UsbemuDevice          *device,
+                                 UsbemuUrb             *urb,
+                                 UsbemuUrbStatus        status);
+
+UsbemuUrb* usbemu_device_lookup_urb      (UsbemuDevice *device,
+                                          guint32       seqnum);
+gboolean   usbemu_device_unlink_urb      (UsbemuDevice *device,
+                                          guint32       seqnum);
+UsbemuUrb* usbemu_device_peek_urb        (UsbemuDevice *device,
+                                          guint8        endpoint_address);
+void       usbemu_device_cancel_all_urbs (UsbemuDevice *device);
+
+void                 usbemu_device_set_endpoint_queue (UsbemuDevice        *device,
+                                                       guint8               endpoint_address,
+                                                       UsbemuEndpointQueue *queue);
+UsbemuEndpointQueue* usbemu_device_get_endpoint_queue (UsbemuDevice        *device,
+                                                       guint8               endpoint_address);
+
+void             usbemu_device_set_iso_stream (UsbemuDevice    *device,
+                                               guint8           endpoint_address,
+                                               UsbemuIsoStream *stream);
+UsbemuIsoStream* usbemu_device_get_iso_stream (UsbemuDevice    *device,
+                                               guint8           endpoint_address);
+
+void usbemu_device_set_interrupt_poll (UsbemuDevice            *device,
+                                       guint8                   endpoint_address,
+                                       UsbemuInterruptPollFunc  func,
+                                       gpointer                 user_data,
+                                       GDestroyNotify           destroy);
+void usbemu_device_wake_interrupt     (UsbemuDevice            *device,
+                                       guint8                   endpoint_address);
+
+GBytes* usbemu_device_get_descriptor_bytes (UsbemuDevice *device);
+
+UsbemuDevice* usbemu_device_new_from_descriptors (gconstpointer   data,
+                                                  gsize           size,
+                                                  GError        **error);
+
+UsbemuDevice* usbemu_device_new_from_template       (UsbemuDevice *template_device);
+void          usbemu_device_unshare_configurations  (UsbemuDevice *device);
+
+gboolean usbemu_device_validate (UsbemuDevice  *device,
+                                 GError       **error);
+
+void           usbemu_device_set_languages               (UsbemuDevice  *device,
+                                                          const guint16 *langids,
+                                                          gsize          n_langids);
+const guint16* usbemu_device_get_languages               (UsbemuDevice  *device,
+                                                          gsize         *n_langids);
+void           usbemu_device_set_string_translation      (UsbemuDevice  *device,
+                                                          guint16        langid,
+                                                          const gchar   *string,
+                                                          const gchar   *translation);
+GBytes*        usbemu_device_get_string_descriptor_bytes (UsbemuDevice  *device,
+                                                          guint8         index,
+                                                          guint16        langid);
 
 G_END_DECLS
@@ -0,0 +1,550 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <glib-unix.h>
+#if defined (HAVE_SYS_EVENTFD_H)
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
+
+#include "usbemu/usbemu-endpoint-queue.h"
+#include "usbemu/usbemu-errors.h"
+#include "usbemu/usbemu-internal.h"
+
+/**
+ * SECTION:usbemu-endpoint-queue
+ * @title: UsbemuEndpointQueue
+ * @short_description: Lock-free URB hand-over between threads
+ * @include: usbemu/usbemu.h
+ *
+ * By default a #UsbemuDevice handles URBs in the thread its transport runs
+ * in. Setting a #UsbemuEndpointQueue on an endpoint with
+ * usbemu_device_set_endpoint_queue() moves that work to any other thread:
+ * URBs submitted to the endpoint are pushed onto a single-producer,
+ * single-consumer ring, the consumer takes them with
+ * usbemu_endpoint_queue_pop() and hands them back with
+ * usbemu_endpoint_queue_complete(), and the transport thread completes
+ * them with usbemu_device_complete_urb(). No lock is taken per transfer.
+ *
+ * The consumer is woken through a file descriptor, an eventfd where
+ * available, only when the ring goes from empty to non-empty. It may poll
+ * usbemu_endpoint_queue_get_fd() in its own loop, or simply block in
+ * usbemu_endpoint_queue_pop_wait(). Completions travel back through a
+ * lock-free stack that wakes the transport thread the same way.
+ *
+ * |[<!-- language="C" -->
+ * static gpointer
+ * worker (gpointer user_data)
+ * {
+ *   UsbemuEndpointQueue *queue = user_data;
+ *   UsbemuUrb *urb;
+ *
+ *   while ((urb = usbemu_endpoint_queue_pop_wait (queue)) != NULL) {
+ *     urb->actual_length = handle_transfer (urb);
+ *     usbemu_endpoint_queue_complete (queue, urb,
+ *                                     USBEMU_URB_STATUS_COMPLETED);
+ *   }
+ *
+ *   return NULL;
+ * }
+ * ]|
+ */
+
+/* Keeps fields written by different threads on different cache lines. */
+#define CACHE_LINE_SIZE 64
+
+/* An eventfd, or both ends of a pipe where eventfd is missing. */
+typedef struct {
+  gint fds[2];
+} UsbemuWakeup;
+
+struct _UsbemuEndpointQueue {
+  gint ref_count;
+  UsbemuUrb **slots;
+  guint mask;
+
+  /* Written by the producer only. */
+  gint tail;
+  /* Set while @overflow holds URBs the ring had no room for. */
+  gint producer_waiting;
+  GQueue overflow;
+  gchar producer_padding[CACHE_LINE_SIZE];
+
+  /* Written by the consumer only. */
+  gint head;
+  gchar consumer_padding[CACHE_LINE_SIZE];
+
+  /* Completed URBs, linked through UsbemuUrb.link, newest first. */
+  gpointer completed;
+  gint closed;
+
+  UsbemuWakeup submit_wakeup;
+  UsbemuWakeup complete_wakeup;
+
+  /* The device this queue is set on, and the source completing URBs in the
+   * context it was set from. */
+  UsbemuDevice *device;
+  GSource *complete_source;
+};
+
+G_DEFINE_BOXED_TYPE (UsbemuEndpointQueue, usbemu_endpoint_queue,
+                     usbemu_endpoint_queue_ref, usbemu_endpoint_queue_unref)
+
+/* helper functions */
+static gboolean _wakeup_init (UsbemuWakeup *wakeup, GError **error);
+static void _wakeup_clear (UsbemuWakeup *wakeup);
+static void _wakeup_signal (UsbemuWakeup *wakeup);
+static void _wakeup_acknowledge (UsbemuWakeup *wakeup);
+static void _wakeup_wait (UsbemuWakeup *wakeup);
+static gboolean _ring_push (UsbemuEndpointQueue *queue, UsbemuUrb *urb);
+static void _refill (UsbemuEndpointQueue *queue);
+static gboolean _on_completed (gint fd, GIOCondition condition,
+                               gpointer user_data);
+
+static gboolean
+_wakeup_init (UsbemuWakeup  *wakeup,
+              GError       **error)
+{
+#if defined (HAVE_SYS_EVENTFD_H)
+  wakeup->fds[0] = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakeup->fds[0] < 0) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_FAILED,
+                 "Cannot create eventfd: %s", g_strerror (errno));
+    return FALSE;
+  }
+  wakeup->fds[1] = wakeup->fds[0];
+#else
+  if (!g_unix_open_pipe (wakeup->fds, FD_CLOEXEC, error))
+    return FALSE;
+  g_unix_set_fd_nonblocking (wakeup->fds[0], TRUE, NULL);
+  g_unix_set_fd_nonblocking (wakeup->fds[1], TRUE, NULL);
+#endif
+
+  return TRUE;
+}
+
+static void
+_wakeup_clear (UsbemuWakeup *wakeup)
+{
+  close (wakeup->fds[0]);
+  if (wakeup->fds[1] != wakeup->fds[0])
+    close (wakeup->fds[1]);
+}
+
+static void
+_wakeup_signal (UsbemuWakeup *wakeup)
+{
+#if defined (HAVE_SYS_EVENTFD_H)
+  const guint64 one = 1;
+#else
+  const guint8 one = 1;
+#endif
+  gssize ret;
+
+  /* A full pipe or counter is signalled already. */
+  do {
+    ret = write (wakeup->fds[1], &one, sizeof (one));
+  } while ((ret < 0) && (errno == EINTR));
+}
+
+static void
+_wakeup_acknowledge (UsbemuWakeup *wakeup)
+{
+  guint64 buffer;
+  gssize ret;
+
+  do {
+    ret = read (wakeup->fds[0], &buffer, sizeof (buffer));
+  } while ((ret > 0) || ((ret < 0) && (errno == EINTR)));
+}
+
+static void
+_wakeup_wait (UsbemuWakeup *wakeup)
+{
+  struct pollfd pfd = { wakeup->fds[0], POLLIN, 0 };
+
+  while ((poll (&pfd, 1, -1) < 0) && (errno == EINTR))
+    ;
+  _wakeup_acknowledge (wakeup);
+}
+
+/**
+ * usbemu_endpoint_queue_new:
+ * @capacity: number of URBs the ring holds, rounded up to a power of two.
+ * @error: (out) (optional): return location for a #GError, or %NULL.
+ *
+ * Create a new #UsbemuEndpointQueue. URBs submitted while the ring is full
+ * wait in the transport thread until the consumer makes room. This fails if
+ * the file descriptors waking up both threads cannot be created, e.g. when
+ * the process runs out of them.
+ *
+ * Returns: (transfer full) (nullable): a new #UsbemuEndpointQueue, or %NULL
+ *          with @error set. Free with usbemu_endpoint_queue_unref().
+ */
+UsbemuEndpointQueue*
+usbemu_endpoint_queue_new (guint    capacity,
+                           GError **error)
+{
+  UsbemuEndpointQueue *queue;
+  guint size;
+
+  g_return_val_if_fail ((capacity != 0) && (capacity <= G_MAXINT / 2), NULL);
+  g_return_val_if_fail ((error == NULL) || (*error == NULL), NULL);
+
+  for (size = 1; size < capacity; size <<= 1)
+    ;
+
+  queue = g_new0 (UsbemuEndpointQueue, 1);
+  if (!_wakeup_init (&queue->submit_wakeup, error)) {
+    g_free (queue);
+    return NULL;
+  }
+  if (!_wakeup_init (&queue->complete_wakeup, error)) {
+    _wakeup_clear (&queue->submit_wakeup);
+    g_free (queue);
+    return NULL;
+  }
+
+  queue->ref_count = 1;
+  queue->slots = g_new0 (UsbemuUrb*, size);
+  queue->mask = size - 1;
+  g_queue_init (&queue->overflow);
+
+  return queue;
+}
+
+/**
+ * usbemu_endpoint_queue_ref:
+ * @queue: (in): a #UsbemuEndpointQueue.
+ *
+ * Increase reference count of @queue.
+ *
+ * Returns: (transfer full): @queue.
+ */
+UsbemuEndpointQueue*
+usbemu_endpoint_queue_ref (UsbemuEndpointQueue *queue)
+{
+  g_return_val_if_fail (queue != NULL, NULL);
+
+  g_atomic_int_inc (&queue->ref_count);
+
+  return queue;
+}
+
+/**
+ * usbemu_endpoint_queue_unref:
+ * @queue: (in) (transfer full): a #UsbemuEndpointQueue.
+ *
+ * Decrease reference count of @queue, and free it when it drops to zero.
+ */
+void
+usbemu_endpoint_queue_unref (UsbemuEndpointQueue *queue)
+{
+  g_return_if_fail (queue != NULL);
+
+  if (!g_atomic_int_dec_and_test (&queue->ref_count))
+    return;
+
+  g_assert (queue->device == NULL);
+
+  _wakeup_clear (&queue->submit_wakeup);
+  _wakeup_clear (&queue->complete_wakeup);
+  g_free (queue->slots);
+  g_free (queue);
+}
+
+/* Producer side. Fails if the ring is full. */
+static gboolean
+_ring_push (UsbemuEndpointQueue *queue,
+            UsbemuUrb           *urb)
+{
+  guint tail = queue->tail;
+
+  if (tail - (guint) g_atomic_int_get (&queue->head) > queue->mask)
+    return FALSE;
+
+  queue->slots[tail & queue->mask] = urb;
+  /* Publishes the slot before re-reading head, see pop. */
+  g_atomic_int_set (&queue->tail, tail + 1);
+  if ((guint) g_atomic_int_get (&queue->head) == tail)
+    _wakeup_signal (&queue->submit_wakeup);
+
+  return TRUE;
+}
+
+/* Move waiting URBs into the ring while it has room. */
+static void
+_refill (UsbemuEndpointQueue *queue)
+{
+  UsbemuUrb *urb;
+
+  while ((urb = g_queue_peek_head (&queue->overflow)) != NULL) {
+    if (!_ring_push (queue, urb))
+      return;
+    g_queue_pop_head (&queue->overflow);
+  }
+
+  g_atomic_int_set (&queue->producer_waiting, FALSE);
+}
+
+void
+_usbemu_endpoint_queue_push (UsbemuEndpointQueue *queue,
+                             UsbemuUrb           *urb)
+{
+  g_atomic_int_set (&urb->cancelled, FALSE);
+
+  if (g_queue_is_empty (&queue->overflow) && _ring_push (queue, urb))
+    return;
+
+  g_queue_push_tail (&queue->overflow, urb);
+  g_atomic_int_set (&queue->producer_waiting, TRUE);
+  /* The consumer may have made room before it could see the flag. */
+  _refill (queue);
+}
+
+void
+_usbemu_endpoint_queue_cancel (UsbemuEndpointQueue *queue,
+                               UsbemuUrb           *urb)
+{
+  if (g_queue_remove (&queue->overflow, urb)) {
+    usbemu_device_complete_urb (queue->device, urb,
+                                USBEMU_URB_STATUS_CANCELLED);
+    return;
+  }
+
+  /* Dropped by pop if still in the ring. The consumer finishes those it
+   * already took as usual. */
+  g_atomic_int_set (&urb->cancelled, TRUE);
+}
+
+static gboolean
+_on_completed (gint         fd,
+               GIOCondition condition,
+               gpointer     user_data)
+{
+  UsbemuEndpointQueue *queue = user_data;
+  UsbemuUrb *urb, *list, *next;
+
+  _wakeup_acknowledge (&queue->complete_wakeup);
+  /* Completion callbacks may drop the device's reference. */
+  usbemu_endpoint_queue_ref (queue);
+
+  do {
+    list = g_atomic_pointer_get (&queue->completed);
+  } while (!g_atomic_pointer_compare_and_exchange (&queue->completed, list,
+                                                   NULL));
+
+  /* Restore completion order. */
+  for (urb = list, list = NULL; urb != NULL; urb = next) {
+    next = urb->link;
+    urb->link = list;
+    list = urb;
+  }
+
+  for (urb = list; urb != NULL; urb = next) {
+    next = urb->link;
+    urb->link = NULL;
+    usbemu_device_complete_urb (queue->device, urb, urb->queued_status);
+  }
+
+  if (g_atomic_int_get (&queue->producer_waiting))
+    _refill (queue);
+
+  usbemu_endpoint_queue_unref (queue);
+  return G_SOURCE_CONTINUE;
+}
+
+void
+_usbemu_endpoint_queue_bind (UsbemuEndpointQueue *queue,
+                             UsbemuDevice        *device)
+{
+  GMainContext *context;
+
+  g_assert (queue->device == NULL);
+
+  queue->device = device;
+  queue->complete_source =
+      g_unix_fd_source_new (queue->complete_wakeup.fds[0], G_IO_IN);
+  g_source_set_callback (queue->complete_source, (GSourceFunc) _on_completed,
+                         queue, NULL);
+  context = usbemu_device_get_context (device);
+  if (context == NULL)
+    context = g_main_context_get_thread_default ();
+  g_source_attach (queue->complete_source, context);
+}
+
+void
+_usbemu_endpoint_queue_unbind (UsbemuEndpointQueue *queue)
+{
+  g_source_destroy (queue->complete_source);
+  g_clear_pointer (&queue->complete_source, g_source_unref);
+  queue->device = NULL;
+}
+
+/**
+ * usbemu_endpoint_queue_pop:
+ * @queue: (in): a #UsbemuEndpointQueue.
+ *
+ * Take the oldest URB submitted to the endpoint, without blocking. Only one
+ * thread at a time may consume from @queue. URBs cancelled before being
+ * taken are completed with %USBEMU_URB_STATUS_CANCELLED and skipped.
+ *
+ * Returns: (transfer none) (nullable): a #UsbemuUrb to finish with
+ *          usbemu_endpoint_queue_complete(), or %NULL if the ring is empty.
+ */
+UsbemuUrb*
+usbemu_endpoint_queue_pop (UsbemuEndpointQueue *queue)
+{
+  UsbemuUrb *urb;
+  guint head;
+
+  g_return_val_if_fail (queue != NULL, NULL);
+
+  for (;;) {
+    head = queue->head;
+    if ((guint) g_atomic_int_get (&queue->tail) == head)
+      return NULL;
+
+    urb = queue->slots[head & queue->mask];
+    g_atomic_int_set (&queue->head, head + 1);
+    if (g_atomic_int_get (&queue->producer_waiting))
+      _wakeup_signal (&queue->complete_wakeup);
+
+    if (!g_atomic_int_get (&urb->cancelled))
+      return urb;
+
+    usbemu_endpoint_queue_complete (queue, urb, USBEMU_URB_STATUS_CANCELLED);
+  }
+}
+
+/**
+ * usbemu_endpoint_queue_pop_wait:
+ * @queue: (in): a #UsbemuEndpointQueue.
+ *
+ * Take the oldest URB submitted to the endpoint, blocking until there is
+ * one or @queue is closed.
+ *
+ * Returns: (transfer none) (nullable): a #UsbemuUrb to finish with
+ *          usbemu_endpoint_queue_complete(), or %NULL once @queue is closed
+ *          and drained.
+ */
+UsbemuUrb*
+usbemu_endpoint_queue_pop_wait (UsbemuEndpointQueue *queue)
+{
+  UsbemuUrb *urb;
+
+  g_return_val_if_fail (queue != NULL, NULL);
+
+  for (;;) {
+    urb = usbemu_endpoint_queue_pop (queue);
+    if ((urb != NULL) || g_atomic_int_get (&queue->closed))
+      return urb;
+
+    _wakeup_wait (&queue->submit_wakeup);
+  }
+}
+
+/**
+ * usbemu_endpoint_queue_get_fd:
+ * @queue: (in): a #UsbemuEndpointQueue.
+ *
+ * Get the file descriptor that becomes readable when URBs are pushed onto an
+ * empty ring, or when @queue is closed. Call
+ * usbemu_endpoint_queue_acknowledge() before draining the ring with
+ * usbemu_endpoint_queue_pop().
+ *
+ * Returns: a file descriptor owned by @queue.
+ */
+gint
+usbemu_endpoint_queue_get_fd (UsbemuEndpointQueue *queue)
+{
+  g_return_val_if_fail (queue != NULL, -1);
+
+  return queue->submit_wakeup.fds[0];
+}
+
+/**
+ * usbemu_endpoint_queue_acknowledge:
+ * @queue: (in): a #UsbemuEndpointQueue.
+ *
+ * Reset the readiness of usbemu_endpoint_queue_get_fd().
+ */
+void
+usbemu_endpoint_queue_acknowledge (UsbemuEndpointQueue *queue)
+{
+  g_return_if_fail (queue != NULL);
+
+  _wakeup_acknowledge (&queue->submit_wakeup);
+}
+
+/**
+ * usbemu_endpoint_queue_complete:
+ * @queue: (in): a #UsbemuEndpointQueue.
+ * @urb: (in): a #UsbemuUrb taken from @queue.
+ * @status: completion status.
+ *
+ * Hand @urb back to the transport thread, which completes it with @status as
+ * usbemu_device_complete_urb() does. May be called from any thread, in any
+ * order. For IN transfers, @urb's actual_length and buffer must have been
+ * filled before.
+ */
+void
+usbemu_endpoint_queue_complete (UsbemuEndpointQueue *queue,
+                                UsbemuUrb           *urb,
+                                UsbemuUrbStatus      status)
+{
+  UsbemuUrb *old;
+
+  g_return_if_fail (queue != NULL);
+  g_return_if_fail (urb != NULL);
+  g_return_if_fail (status != USBEMU_URB_STATUS_PENDING);
+
+  urb->queued_status = status;
+  do {
+    old = g_atomic_pointer_get (&queue->completed);
+    urb->link = old;
+  } while (!g_atomic_pointer_compare_and_exchange (&queue->completed, old,
+                                                   urb));
+
+  if (old == NULL)
+    _wakeup_signal (&queue->complete_wakeup);
+}
+
+/**
+ * usbemu_endpoint_queue_close:
+ * @queue: (in): a #UsbemuEndpointQueue.
+ *
+ * Make usbemu_endpoint_queue_pop_wait() return %NULL once the ring is
+ * drained, so that the consumer thread can exit.
+ */
+void
+usbemu_endpoint_queue_close (UsbemuEndpointQueue *queue)
+{
+  g_return_if_fail (queue != NULL);
+
+  g_atomic_int_set (&queue->closed, TRUE);
+  _wakeup_signal (&queue->submit_wakeup);
+}
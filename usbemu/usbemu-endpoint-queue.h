@@ -0,0 +1,61 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#if !defined (__USBEMU_USBEMU_H_INSIDE__) && !defined (LIBUSBEMU_COMPILATION)
+#error "Only <usbemu/usbemu.h> can be included directly."
+#endif
+
+#include <glib-object.h>
+
+#include <usbemu/usbemu-urb.h>
+
+G_BEGIN_DECLS
+
+/**
+ * USBEMU_TYPE_ENDPOINT_QUEUE:
+ *
+ * Convenient macro for usbemu_endpoint_queue_get_type().
+ */
+#define USBEMU_TYPE_ENDPOINT_QUEUE  (usbemu_endpoint_queue_get_type ())
+
+/**
+ * UsbemuEndpointQueue:
+ *
+ * An opaque structure handing the URBs of one endpoint over to another
+ * thread.
+ */
+typedef struct _UsbemuEndpointQueue UsbemuEndpointQueue;
+
+GType                usbemu_endpoint_queue_get_type (void) G_GNUC_CONST;
+
+UsbemuEndpointQueue* usbemu_endpoint_queue_new      (guint                capacity,
+                                                     GError             **error);
+UsbemuEndpointQueue* usbemu_endpoint_queue_ref      (UsbemuEndpointQueue *queue);
+void                 usbemu_endpoint_queue_unref    (UsbemuEndpointQueue *queue);
+
+UsbemuUrb* usbemu_endpoint_queue_pop         (UsbemuEndpointQueue *queue);
+UsbemuUrb* usbemu_endpoint_queue_pop_wait    (UsbemuEndpointQueue *queue);
+gint       usbemu_endpoint_queue_get_fd      (UsbemuEndpointQueue *queue);
+void       usbemu_endpoint_queue_acknowledge (UsbemuEndpointQueue *queue);
+void       usbemu_endpoint_queue_complete    (UsbemuEndpointQueue *queue,
+                                              UsbemuUrb           *urb,
+                                              UsbemuUrbStatus      status);
+void       usbemu_endpoint_queue_close       (UsbemuEndpointQueue *queue);
+
+G_END_DECLS
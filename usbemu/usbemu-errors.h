@@ -29,12 +29,14 @@ G_BEGIN_DECLS
  * UsbemuError:
  * @USBEMU_ERROR_FAILED: unknown or unclassified failure.
  * @USBEMU_ERROR_DEVICE_UNAVAILABLE: device unavailable.
+ * @USBEMU_ERROR_INVALID_DESCRIPTOR: malformed or unsupported USB descriptor.
  *
  * Errors used in usbemu library.
  */
 typedef enum { /*< underscore_name=usbemu_error >*/
   USBEMU_ERROR_FAILED = 0, /*< nick=Failed >*/
   USBEMU_ERROR_DEVICE_UNAVAILABLE, /*< nick=DeviceUnavailable >*/
+  USBEMU_ERROR_INVALID_DESCRIPTOR, /*< nick=InvalidDescriptor >*/
 } UsbemuError;
 
 /**
@@ -0,0 +1,1033 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "usbemu/usbemu-hub.h"
+#include "usbemu/usbemu-configuration.h"
+#include "usbemu/usbemu-errors.h"
+#include "usbemu/usbemu-interface.h"
+#include "usbemu/usbemu-internal.h"
+
+/**
+ * SECTION:usbemu-hub
+ * @title: UsbemuHub
+ * @short_description: USB 2.0 hub with downstream ports
+ * @include: usbemu/usbemu.h
+ *
+ * #UsbemuHub is a #UsbemuDevice of the hub class with up to
+ * #USBEMU_HUB_MAX_PORTS downstream ports, so that many devices can be
+ * exposed through one exported root, and hubs plugged into hubs, up to the
+ * depth the host allows.
+ *
+ * Devices are plugged into ports with usbemu_hub_attach_device(), or many at
+ * once with usbemu_hub_attach_devices(). They are attached while the hub
+ * is, and show up as connected once the host powers their port. The hub
+ * class requests of chapter 11 of USB 2.0 are answered from the state of
+ * the ports: GET_STATUS, SET_FEATURE and CLEAR_FEATURE on the hub and its
+ * ports, and GET_DESCRIPTOR for the hub descriptor. A port reset resets the
+ * device plugged into it with usbemu_device_reset(). URBs pending on devices
+ * behind the hub are cancelled once they lose their link to the host: when
+ * they are unplugged, their port is powered off, or the hub is reset or
+ * detached.
+ *
+ * The status change endpoint is polled with
+ * usbemu_device_set_interrupt_poll(). The first change on any port wakes
+ * it up, and changes on other ports until the host polls it are reported
+ * in the same bitmap, so that plugging devices into every port at once
+ * costs a single interrupt transfer.
+ *
+ * Transports address the devices behind a hub by the USB address the host
+ * assigned to them, see usbemu_hub_lookup_address().
+ */
+
+/**
+ * UsbemuHub:
+ *
+ * USB hub device object.
+ */
+
+/**
+ * UsbemuHubClass:
+ * @parent_class: The parent class.
+ *
+ * Class structure for UsbemuHub.
+ */
+
+#define HUB_DESCRIPTOR_TYPE 0x29
+#define HUB_DESCRIPTOR_MIN_SIZE 7
+/* Protocol of high-speed hubs with a single transaction translator. */
+#define HUB_PROTOCOL_SINGLE_TT 0x01
+/* Individual port power switching and over-current protection. */
+#define HUB_CHARACTERISTICS 0x0009
+/* In units of 2 ms. */
+#define HUB_POWER_ON_TO_POWER_GOOD 50
+
+/* Hub class requests addressed to ports, see table 11-16 of USB 2.0. */
+#define HUB_REQUEST_CLEAR_TT_BUFFER 0x08
+#define HUB_REQUEST_RESET_TT 0x09
+
+#define STATUS_ENDPOINT (USBEMU_EP_1 | USBEMU_ENDPOINT_DIRECTION_IN)
+/* bInterval 12 at high speed. */
+#define STATUS_INTERVAL 256000
+
+/* Port feature selectors, see table 11-17 of USB 2.0. Those from
+ * C_PORT_CONNECTION to C_PORT_RESET select the change bit of their value
+ * minus C_PORT_CONNECTION. */
+enum {
+  PORT_ENABLE = 1,
+  PORT_SUSPEND = 2,
+  PORT_RESET = 4,
+  PORT_POWER = 8,
+  C_PORT_CONNECTION = 16,
+  C_PORT_RESET = 20,
+  PORT_TEST = 21,
+  PORT_INDICATOR = 22,
+};
+
+#define PORT_STATUS_SPEED \
+  (USBEMU_HUB_PORT_STATUS_LOW_SPEED | USBEMU_HUB_PORT_STATUS_HIGH_SPEED)
+#define PORT_STATUS_LINK \
+  (USBEMU_HUB_PORT_STATUS_CONNECTION | USBEMU_HUB_PORT_STATUS_ENABLE | \
+   USBEMU_HUB_PORT_STATUS_SUSPEND | PORT_STATUS_SPEED)
+
+/* Bytes of a bitmap with one bit for the hub and one per port. */
+#define BITMAP_SIZE(n_ports) (((n_ports) + 8) / 8)
+
+typedef struct {
+  UsbemuDevice *device;
+  guint16 status;
+  guint16 change;
+} UsbemuHubPort;
+
+struct _UsbemuHub {
+  UsbemuDevice parent_instance;
+
+  guint n_ports;
+  /* Port n is at n - 1. */
+  UsbemuHubPort *ports;
+  /* Number of ports with change bits set. */
+  guint n_changed;
+};
+
+G_DEFINE_TYPE (UsbemuHub, usbemu_hub, USBEMU_TYPE_DEVICE)
+
+enum
+{
+  PROP_0,
+  PROP_N_PORTS,
+  N_PROPERTIES
+};
+
+static GParamSpec *props[N_PROPERTIES] = { NULL, };
+
+enum
+{
+  SIGNAL_PORTS_CHANGED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS] = { 0 };
+
+#define USBEMU_HUB_PROP_N_PORTS__DEFAULT 4
+
+/* Set on devices plugged into a hub, to that hub. */
+static GQuark parent_quark;
+
+/* virtual methods for GObjectClass */
+static void gobject_class_set_property (GObject *object, guint prop_id,
+                                        const GValue *value, GParamSpec *pspec);
+static void gobject_class_get_property (GObject *object, guint prop_id,
+                                        GValue *value, GParamSpec *pspec);
+static void gobject_class_constructed (GObject *object);
+static void gobject_class_dispose (GObject *object);
+static void gobject_class_finalize (GObject *object);
+/* virtual methods for UsbemuDeviceClass */
+static void usbemu_hub_class_init (UsbemuHubClass *hub_class);
+static void device_class_attached (UsbemuDevice *device);
+static void device_class_detached (UsbemuDevice *device);
+static void device_class_control_request (UsbemuDevice *device, UsbemuUrb *urb,
+                                          const UsbemuControlSetup *setup);
+static void device_class_reset (UsbemuDevice *device);
+/* helper functions */
+static UsbemuUrbStatus _reply (UsbemuUrb *urb, const guint8 *data, gsize size);
+static void _reset_ports (UsbemuHub *hub);
+static void _cancel_all_urbs (UsbemuDevice *device);
+static void _set_change (UsbemuHub *hub, UsbemuHubPort *port, guint16 change);
+static void _clear_change (UsbemuHub *hub, UsbemuHubPort *port,
+                           guint16 change);
+static void _connect (UsbemuHub *hub, UsbemuHubPort *port);
+static void _disconnect (UsbemuHub *hub, UsbemuHubPort *port);
+static UsbemuUrbStatus _hub_request (UsbemuHub *hub, UsbemuUrb *urb,
+                                     const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _port_request (UsbemuHub *hub, UsbemuUrb *urb,
+                                      const UsbemuControlSetup *setup);
+static UsbemuUrbStatus _set_port_feature (UsbemuHub *hub, UsbemuHubPort *port,
+                                          guint16 feature);
+static UsbemuUrbStatus _clear_port_feature (UsbemuHub *hub,
+                                            UsbemuHubPort *port,
+                                            guint16 feature);
+static gboolean _poll_status (UsbemuDevice *device, UsbemuUrb *urb,
+                              gpointer user_data);
+
+static void
+gobject_class_set_property (GObject      *object,
+                            guint         prop_id,
+                            const GValue *value,
+                            GParamSpec   *pspec)
+{
+  UsbemuHub *hub = USBEMU_HUB (object);
+
+  switch (prop_id) {
+    case PROP_N_PORTS:
+      hub->n_ports = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gobject_class_get_property (GObject    *object,
+                            guint       prop_id,
+                            GValue     *value,
+                            GParamSpec *pspec)
+{
+  UsbemuHub *hub = USBEMU_HUB (object);
+
+  switch (prop_id) {
+    case PROP_N_PORTS:
+      g_value_set_uint (value, hub->n_ports);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gobject_class_constructed (GObject *object)
+{
+  UsbemuHub *hub = USBEMU_HUB (object);
+  UsbemuDevice *device = USBEMU_DEVICE (object);
+  UsbemuEndpointEntry entries[] = {
+    { USBEMU_EP_1, USBEMU_ENDPOINT_DIRECTION_IN,
+      USBEMU_ENDPOINT_TRANSFER_INTERRUPT, 0, 0, 0, STATUS_INTERVAL },
+    { 0, },
+  };
+  UsbemuConfiguration *configuration;
+  UsbemuInterface *interfaces[2];
+
+  G_OBJECT_CLASS (usbemu_hub_parent_class)->constructed (object);
+
+  hub->ports = g_new0 (UsbemuHubPort, hub->n_ports);
+
+  usbemu_device_set_specification_num (device, 0x200);
+  usbemu_device_set_class (device, USBEMU_CLASS_HUB);
+  usbemu_device_set_protocol (device, HUB_PROTOCOL_SINGLE_TT);
+
+  entries[0].max_packet_size = BITMAP_SIZE (hub->n_ports);
+  configuration = usbemu_configuration_new ();
+  interfaces[0] = usbemu_interface_new_full (NULL, USBEMU_CLASS_HUB, 0, 0);
+  interfaces[1] = NULL;
+  usbemu_interface_add_endpoint_entries (interfaces[0], entries, NULL);
+  usbemu_configuration_add_alternate_interfaces (configuration, interfaces);
+  usbemu_device_add_configuration (device, configuration);
+  g_object_unref (interfaces[0]);
+  g_object_unref (configuration);
+
+  usbemu_device_set_interrupt_poll (device, STATUS_ENDPOINT, _poll_status,
+                                    hub, NULL);
+}
+
+static void
+gobject_class_dispose (GObject *object)
+{
+  UsbemuHub *hub = USBEMU_HUB (object);
+
+  if (hub->ports != NULL)
+    usbemu_hub_detach_devices (hub, 1, hub->n_ports);
+
+  G_OBJECT_CLASS (usbemu_hub_parent_class)->dispose (object);
+}
+
+static void
+gobject_class_finalize (GObject *object)
+{
+  UsbemuHub *hub = USBEMU_HUB (object);
+
+  g_free (hub->ports);
+
+  G_OBJECT_CLASS (usbemu_hub_parent_class)->finalize (object);
+}
+
+static void
+usbemu_hub_class_init (UsbemuHubClass *hub_class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (hub_class);
+  UsbemuDeviceClass *device_class = USBEMU_DEVICE_CLASS (hub_class);
+
+  /* virtual methods */
+
+  object_class->set_property = gobject_class_set_property;
+  object_class->get_property = gobject_class_get_property;
+  object_class->constructed = gobject_class_constructed;
+  object_class->dispose = gobject_class_dispose;
+  object_class->finalize = gobject_class_finalize;
+
+  device_class->attached = device_class_attached;
+  device_class->detached = device_class_detached;
+  device_class->control_request = device_class_control_request;
+  device_class->reset = device_class_reset;
+
+  /* properties */
+
+  /**
+   * UsbemuHub:n-ports:
+   *
+   * Number of downstream ports, from 1 to #USBEMU_HUB_MAX_PORTS.
+   */
+  props[PROP_N_PORTS] =
+        g_param_spec_uint (USBEMU_HUB_PROP_N_PORTS,
+                           "Number of Ports", "Number of Ports",
+                           1, USBEMU_HUB_MAX_PORTS,
+                           USBEMU_HUB_PROP_N_PORTS__DEFAULT,
+                           G_PARAM_READWRITE | \
+                             G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+
+  /* signals */
+
+  /**
+   * UsbemuHub::ports-changed
+   * @hub: the hub that emitted the signal
+   * @first_port: first port number of the range.
+   * @n_ports: number of ports in the range.
+   *
+   * Signals that devices were plugged into or unplugged from ports in the
+   * range, once per call of usbemu_hub_attach_devices() or
+   * usbemu_hub_detach_devices() however many devices it involves.
+   */
+  signals[SIGNAL_PORTS_CHANGED] =
+        g_signal_new (USBEMU_HUB_SIGNAL_PORTS_CHANGED,
+                      G_TYPE_FROM_CLASS (hub_class),
+                      G_SIGNAL_RUN_LAST,
+                      0,
+                      NULL, NULL,
+                      NULL, G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_UINT);
+
+  parent_quark = g_quark_from_static_string ("usbemu-hub-parent");
+}
+
+static void
+usbemu_hub_init (UsbemuHub *hub)
+{
+  hub->n_ports = USBEMU_HUB_PROP_N_PORTS__DEFAULT;
+  hub->ports = NULL;
+  hub->n_changed = 0;
+}
+
+static void
+device_class_attached (UsbemuDevice *device)
+{
+  UsbemuHub *hub = USBEMU_HUB (device);
+  UsbemuDevice *devices[USBEMU_HUB_MAX_PORTS];
+  guint i;
+
+  for (i = 0; i < hub->n_ports; i++)
+    devices[i] = hub->ports[i].device;
+  _usbemu_device_set_attached_many (devices, hub->n_ports, TRUE);
+}
+
+static void
+device_class_detached (UsbemuDevice *device)
+{
+  UsbemuHub *hub = USBEMU_HUB (device);
+  UsbemuDevice *devices[USBEMU_HUB_MAX_PORTS];
+  guint i;
+
+  _reset_ports (hub);
+  for (i = 0; i < hub->n_ports; i++)
+    devices[i] = hub->ports[i].device;
+  _usbemu_device_set_attached_many (devices, hub->n_ports, FALSE);
+}
+
+static void
+device_class_control_request (UsbemuDevice             *device,
+                              UsbemuUrb                *urb,
+                              const UsbemuControlSetup *setup)
+{
+  UsbemuHub *hub = USBEMU_HUB (device);
+  UsbemuUrbStatus status;
+
+  if ((setup->bmRequestType & USBEMU_REQUEST_TYPE_MASK) !=
+          USBEMU_REQUEST_TYPE_CLASS) {
+    USBEMU_DEVICE_CLASS (usbemu_hub_parent_class)->control_request (device,
+                                                                    urb,
+                                                                    setup);
+    return;
+  }
+
+  switch (setup->bmRequestType & USBEMU_REQUEST_RECIPIENT_MASK) {
+    case USBEMU_REQUEST_RECIPIENT_DEVICE:
+      status = _hub_request (hub, urb, setup);
+      break;
+    case USBEMU_REQUEST_RECIPIENT_OTHER:
+      status = _port_request (hub, urb, setup);
+      break;
+    default:
+      status = USBEMU_URB_STATUS_STALL;
+      break;
+  }
+
+  usbemu_device_complete_urb (device, urb, status);
+}
+
+/* Ports lose power with a reset of the hub itself. */
+static void
+device_class_reset (UsbemuDevice *device)
+{
+  _reset_ports (USBEMU_HUB (device));
+}
+
+static UsbemuUrbStatus
+_reply (UsbemuUrb    *urb,
+        const guint8 *data,
+        gsize         size)
+{
+  urb->actual_length = MIN (size, urb->buffer_length);
+  memcpy (urb->buffer, data, urb->actual_length);
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+/* Ports lose power, and their devices the link to the host. */
+static void
+_reset_ports (UsbemuHub *hub)
+{
+  guint i;
+
+  for (i = 0; i < hub->n_ports; i++) {
+    hub->ports[i].status = 0;
+    hub->ports[i].change = 0;
+  }
+  hub->n_changed = 0;
+
+  for (i = 0; i < hub->n_ports; i++) {
+    if (hub->ports[i].device != NULL)
+      _cancel_all_urbs (hub->ports[i].device);
+  }
+}
+
+/* Cancel URBs pending on @device and on every device behind it, once they
+ * can't reach the host anymore. Their transports would otherwise keep
+ * waiting for them. */
+static void
+_cancel_all_urbs (UsbemuDevice *device)
+{
+  UsbemuHub *hub;
+  guint i;
+
+  /* Completions may unplug it. */
+  g_object_ref (device);
+  usbemu_device_cancel_all_urbs (device);
+  if (USBEMU_IS_HUB (device)) {
+    hub = USBEMU_HUB (device);
+    for (i = 0; i < hub->n_ports; i++) {
+      if (hub->ports[i].device != NULL)
+        _cancel_all_urbs (hub->ports[i].device);
+    }
+  }
+  g_object_unref (device);
+}
+
+/* Only the first change among all ports wakes up the status change
+ * endpoint, later ones are reported along with it. */
+static void
+_set_change (UsbemuHub     *hub,
+             UsbemuHubPort *port,
+             guint16        change)
+{
+  if ((port->change == 0) && (hub->n_changed++ == 0))
+    usbemu_device_wake_interrupt (USBEMU_DEVICE (hub), STATUS_ENDPOINT);
+
+  port->change |= change;
+}
+
+static void
+_clear_change (UsbemuHub     *hub,
+               UsbemuHubPort *port,
+               guint16        change)
+{
+  if (port->change == 0)
+    return;
+
+  port->change &= ~change;
+  if (port->change == 0)
+    hub->n_changed--;
+}
+
+static void
+_connect (UsbemuHub     *hub,
+          UsbemuHubPort *port)
+{
+  if ((port->device == NULL) ||
+      !(port->status & USBEMU_HUB_PORT_STATUS_POWER) ||
+      (port->status & USBEMU_HUB_PORT_STATUS_CONNECTION))
+    return;
+
+  port->status |= USBEMU_HUB_PORT_STATUS_CONNECTION;
+  /* SuperSpeed devices fall back to high-speed on a USB 2.0 hub. */
+  switch (usbemu_device_get_speed (port->device)) {
+    case USBEMU_SPEED_LOW:
+      port->status |= USBEMU_HUB_PORT_STATUS_LOW_SPEED;
+      break;
+    case USBEMU_SPEED_HIGH:
+    case USBEMU_SPEED_SUPER:
+      port->status |= USBEMU_HUB_PORT_STATUS_HIGH_SPEED;
+      break;
+    default:
+      break;
+  }
+  _set_change (hub, port, USBEMU_HUB_PORT_CHANGE_CONNECTION);
+}
+
+static void
+_disconnect (UsbemuHub     *hub,
+             UsbemuHubPort *port)
+{
+  if (!(port->status & USBEMU_HUB_PORT_STATUS_CONNECTION))
+    return;
+
+  port->status &= ~PORT_STATUS_LINK;
+  _set_change (hub, port, USBEMU_HUB_PORT_CHANGE_CONNECTION);
+}
+
+static UsbemuUrbStatus
+_hub_request (UsbemuHub                *hub,
+              UsbemuUrb                *urb,
+              const UsbemuControlSetup *setup)
+{
+  guint8 data[HUB_DESCRIPTOR_MIN_SIZE + 2 * BITMAP_SIZE (USBEMU_HUB_MAX_PORTS)];
+  gboolean in;
+  guint n_bytes;
+
+  in = (setup->bmRequestType & USBEMU_REQUEST_DIRECTION_IN) != 0;
+  switch (setup->bRequest) {
+    case USBEMU_REQUEST_GET_STATUS:
+      if (!in)
+        break;
+      /* Local power supply good, no over-current, nothing changed. */
+      memset (data, 0, 4);
+      return _reply (urb, data, 4);
+    case USBEMU_REQUEST_CLEAR_FEATURE:
+    case USBEMU_REQUEST_SET_FEATURE:
+      /* C_HUB_LOCAL_POWER and C_HUB_OVER_CURRENT, never set. */
+      if (in || (setup->wValue > 1))
+        break;
+      return USBEMU_URB_STATUS_COMPLETED;
+    case USBEMU_REQUEST_GET_DESCRIPTOR:
+      if (!in || ((setup->wValue >> 8) != HUB_DESCRIPTOR_TYPE))
+        break;
+      n_bytes = BITMAP_SIZE (hub->n_ports);
+      data[0] = HUB_DESCRIPTOR_MIN_SIZE + 2 * n_bytes;
+      data[1] = HUB_DESCRIPTOR_TYPE;
+      data[2] = hub->n_ports;
+      data[3] = HUB_CHARACTERISTICS & 0xFF;
+      data[4] = HUB_CHARACTERISTICS >> 8;
+      data[5] = HUB_POWER_ON_TO_POWER_GOOD;
+      data[6] = 0;
+      /* DeviceRemovable, then the legacy PortPwrCtrlMask. */
+      memset (data + HUB_DESCRIPTOR_MIN_SIZE, 0x00, n_bytes);
+      memset (data + HUB_DESCRIPTOR_MIN_SIZE + n_bytes, 0xFF, n_bytes);
+      return _reply (urb, data, data[0]);
+    default:
+      break;
+  }
+
+  return USBEMU_URB_STATUS_STALL;
+}
+
+static UsbemuUrbStatus
+_port_request (UsbemuHub                *hub,
+               UsbemuUrb                *urb,
+               const UsbemuControlSetup *setup)
+{
+  UsbemuHubPort *port;
+  guint8 data[4];
+  gboolean in;
+  guint index;
+
+  index = setup->wIndex & 0xFF;
+  if ((index == 0) || (index > hub->n_ports))
+    return USBEMU_URB_STATUS_STALL;
+  port = &hub->ports[index - 1];
+
+  in = (setup->bmRequestType & USBEMU_REQUEST_DIRECTION_IN) != 0;
+  switch (setup->bRequest) {
+    case USBEMU_REQUEST_GET_STATUS:
+      if (!in)
+        break;
+      data[0] = port->status & 0xFF;
+      data[1] = port->status >> 8;
+      data[2] = port->change & 0xFF;
+      data[3] = port->change >> 8;
+      return _reply (urb, data, 4);
+    case USBEMU_REQUEST_SET_FEATURE:
+      if (in)
+        break;
+      return _set_port_feature (hub, port, setup->wValue);
+    case USBEMU_REQUEST_CLEAR_FEATURE:
+      if (in)
+        break;
+      return _clear_port_feature (hub, port, setup->wValue);
+    case HUB_REQUEST_CLEAR_TT_BUFFER:
+    case HUB_REQUEST_RESET_TT:
+      /* Nothing is buffered in transaction translators. */
+      return in ? USBEMU_URB_STATUS_STALL : USBEMU_URB_STATUS_COMPLETED;
+    default:
+      break;
+  }
+
+  return USBEMU_URB_STATUS_STALL;
+}
+
+static UsbemuUrbStatus
+_set_port_feature (UsbemuHub     *hub,
+                   UsbemuHubPort *port,
+                   guint16        feature)
+{
+  switch (feature) {
+    case PORT_SUSPEND:
+      if (port->status & USBEMU_HUB_PORT_STATUS_ENABLE)
+        port->status |= USBEMU_HUB_PORT_STATUS_SUSPEND;
+      break;
+    case PORT_RESET:
+      /* Completes at once, with the port enabled. */
+      if (!(port->status & USBEMU_HUB_PORT_STATUS_CONNECTION))
+        break;
+      usbemu_device_reset (port->device);
+      port->status |= USBEMU_HUB_PORT_STATUS_ENABLE;
+      port->status &= ~USBEMU_HUB_PORT_STATUS_SUSPEND;
+      _set_change (hub, port, USBEMU_HUB_PORT_CHANGE_RESET);
+      break;
+    case PORT_POWER:
+      port->status |= USBEMU_HUB_PORT_STATUS_POWER;
+      _connect (hub, port);
+      break;
+    case PORT_TEST:
+      port->status |= USBEMU_HUB_PORT_STATUS_TEST;
+      break;
+    case PORT_INDICATOR:
+      port->status |= USBEMU_HUB_PORT_STATUS_INDICATOR;
+      break;
+    default:
+      return USBEMU_URB_STATUS_STALL;
+  }
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+static UsbemuUrbStatus
+_clear_port_feature (UsbemuHub     *hub,
+                     UsbemuHubPort *port,
+                     guint16        feature)
+{
+  if ((feature >= C_PORT_CONNECTION) && (feature <= C_PORT_RESET)) {
+    _clear_change (hub, port, 1 << (feature - C_PORT_CONNECTION));
+    return USBEMU_URB_STATUS_COMPLETED;
+  }
+
+  switch (feature) {
+    case PORT_ENABLE:
+      port->status &= ~(USBEMU_HUB_PORT_STATUS_ENABLE |
+                        USBEMU_HUB_PORT_STATUS_SUSPEND);
+      break;
+    case PORT_SUSPEND:
+      if (!(port->status & USBEMU_HUB_PORT_STATUS_SUSPEND))
+        break;
+      port->status &= ~USBEMU_HUB_PORT_STATUS_SUSPEND;
+      _set_change (hub, port, USBEMU_HUB_PORT_CHANGE_SUSPEND);
+      break;
+    case PORT_POWER:
+      port->status &= ~(PORT_STATUS_LINK | USBEMU_HUB_PORT_STATUS_POWER);
+      if (port->device != NULL)
+        _cancel_all_urbs (port->device);
+      break;
+    case PORT_INDICATOR:
+      port->status &= ~USBEMU_HUB_PORT_STATUS_INDICATOR;
+      break;
+    default:
+      return USBEMU_URB_STATUS_STALL;
+  }
+
+  return USBEMU_URB_STATUS_COMPLETED;
+}
+
+/* Answers the status change endpoint with a bitmap of ports with change
+ * bits set, bit 0 standing for the hub, or NAKs if there is none. */
+static gboolean
+_poll_status (UsbemuDevice *device,
+              UsbemuUrb    *urb,
+              gpointer      user_data)
+{
+  UsbemuHub *hub = user_data;
+  gsize size;
+  guint i;
+
+  if (hub->n_changed == 0)
+    return FALSE;
+
+  size = MIN (BITMAP_SIZE (hub->n_ports), urb->buffer_length);
+  memset (urb->buffer, 0, size);
+  for (i = 1; i <= hub->n_ports; i++) {
+    if ((hub->ports[i - 1].change != 0) && (i / 8 < size))
+      urb->buffer[i / 8] |= 1 << (i % 8);
+  }
+  urb->actual_length = size;
+
+  return TRUE;
+}
+
+/* Devices behind a hub are served in the context of the hub, see
+ * usbemu_runtime_assign_device(). Nested hubs pass it on in turn. */
+void
+_usbemu_hub_set_context (UsbemuHub    *hub,
+                         GMainContext *context)
+{
+  guint i;
+
+  for (i = 0; (hub->ports != NULL) && (i < hub->n_ports); i++) {
+    if (hub->ports[i].device != NULL)
+      _usbemu_device_set_context (hub->ports[i].device, context);
+  }
+}
+
+/**
+ * usbemu_hub_new:
+ * @n_ports: number of downstream ports, from 1 to #USBEMU_HUB_MAX_PORTS.
+ *
+ * Create a new #UsbemuHub, with its configuration and status change
+ * endpoint already set up.
+ *
+ * Returns: (transfer full): The constructed hub object.
+ */
+UsbemuHub*
+usbemu_hub_new (guint n_ports)
+{
+  g_return_val_if_fail ((n_ports >= 1) && (n_ports <= USBEMU_HUB_MAX_PORTS),
+                        NULL);
+
+  return g_object_new (USBEMU_TYPE_HUB,
+                       USBEMU_HUB_PROP_N_PORTS, n_ports,
+                       NULL);
+}
+
+/**
+ * usbemu_hub_get_n_ports:
+ * @hub: (in): a #UsbemuHub object.
+ *
+ * Get the number of downstream ports of @hub.
+ *
+ * Returns: the number of ports.
+ */
+guint
+usbemu_hub_get_n_ports (UsbemuHub *hub)
+{
+  g_return_val_if_fail (USBEMU_IS_HUB (hub), 0);
+
+  return hub->n_ports;
+}
+
+/**
+ * usbemu_hub_attach_device:
+ * @hub: (in): a #UsbemuHub object.
+ * @port: port number, from 1 to the number of ports.
+ * @device: (in): a #UsbemuDevice to plug into @port.
+ * @error: return location for a #GError, or %NULL.
+ *
+ * Plug @device into @port. @device is attached along with @hub, and the
+ * host is notified of the connection once @port is powered. It is served
+ * in the #GMainContext of @hub, see usbemu_device_get_context(), until
+ * unplugged.
+ *
+ * Returns: %TRUE if succeeded. %FALSE if @port is in use, or if @device is
+ *          already attached or plugged into a hub.
+ */
+gboolean
+usbemu_hub_attach_device (UsbemuHub     *hub,
+                          guint          port,
+                          UsbemuDevice  *device,
+                          GError       **error)
+{
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+
+  return usbemu_hub_attach_devices (hub, port, &device, 1, error);
+}
+
+/**
+ * usbemu_hub_attach_devices:
+ * @hub: (in): a #UsbemuHub object.
+ * @first_port: port number to plug the first device into.
+ * @devices: (in) (array length=n_devices): #UsbemuDevice objects to plug
+ *     into ports from @first_port on. %NULL elements leave their port as is.
+ * @n_devices: number of elements in @devices.
+ * @error: return location for a #GError, or %NULL.
+ *
+ * Plug many devices at once, as with usbemu_hub_attach_device() on each, but
+ * with a single #UsbemuHub::ports-changed emission, and without emitting the
+ * #UsbemuDevice:attached notification and #UsbemuDevice::attached signal of
+ * devices that have no handler connected for them. The connections reach
+ * the host in one status change report.
+ *
+ * Either all devices are plugged in, or none is.
+ *
+ * Returns: %TRUE if succeeded. %FALSE if a port is in use, or if a device is
+ *          already attached or plugged into a hub.
+ */
+gboolean
+usbemu_hub_attach_devices (UsbemuHub            *hub,
+                           guint                 first_port,
+                           UsbemuDevice * const *devices,
+                           guint                 n_devices,
+                           GError              **error)
+{
+  UsbemuHubPort *ports;
+  GObject *object;
+  guint i;
+
+  g_return_val_if_fail (USBEMU_IS_HUB (hub), FALSE);
+  g_return_val_if_fail ((first_port >= 1) && (first_port <= hub->n_ports),
+                        FALSE);
+  g_return_val_if_fail ((n_devices >= 1) &&
+                        (n_devices <= hub->n_ports - first_port + 1), FALSE);
+  g_return_val_if_fail (devices != NULL, FALSE);
+  for (i = 0; i < n_devices; i++) {
+    g_return_val_if_fail ((devices[i] == NULL) ||
+                          USBEMU_IS_DEVICE (devices[i]), FALSE);
+    g_return_val_if_fail (devices[i] != USBEMU_DEVICE (hub), FALSE);
+  }
+
+  ports = &hub->ports[first_port - 1];
+
+  /* Claim all devices first, so that a device given twice is caught. */
+  for (i = 0; i < n_devices; i++) {
+    if (devices[i] == NULL)
+      continue;
+
+    object = G_OBJECT (devices[i]);
+    if (ports[i].device != NULL) {
+      g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_DEVICE_UNAVAILABLE,
+                   "Port %u in use", first_port + i);
+      break;
+    }
+    if (usbemu_device_get_attached (devices[i]) ||
+        (g_object_get_qdata (object, parent_quark) != NULL)) {
+      g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_DEVICE_UNAVAILABLE,
+                   "Device already attached");
+      break;
+    }
+    g_object_set_qdata (object, parent_quark, hub);
+  }
+
+  if (i < n_devices) {
+    while (i-- > 0) {
+      if (devices[i] != NULL)
+        g_object_set_qdata (G_OBJECT (devices[i]), parent_quark, NULL);
+    }
+    return FALSE;
+  }
+
+  for (i = 0; i < n_devices; i++) {
+    if (devices[i] == NULL)
+      continue;
+    ports[i].device = g_object_ref (devices[i]);
+    _usbemu_device_set_context (devices[i],
+                                usbemu_device_get_context (USBEMU_DEVICE (hub)));
+  }
+  if (usbemu_device_get_attached (USBEMU_DEVICE (hub)))
+    _usbemu_device_set_attached_many (devices, n_devices, TRUE);
+  for (i = 0; i < n_devices; i++)
+    _connect (hub, &ports[i]);
+
+  g_signal_emit (hub, signals[SIGNAL_PORTS_CHANGED], 0,
+                 first_port, n_devices);
+
+  return TRUE;
+}
+
+/**
+ * usbemu_hub_detach_device:
+ * @hub: (in): a #UsbemuHub object.
+ * @port: port number, from 1 to the number of ports.
+ *
+ * Unplug the device in @port, which becomes detached. URBs pending on it,
+ * or on devices behind it if it is a hub, are cancelled.
+ *
+ * Returns: %TRUE if succeeded. %FALSE if @port is empty.
+ */
+gboolean
+usbemu_hub_detach_device (UsbemuHub *hub,
+                          guint      port)
+{
+  return usbemu_hub_detach_devices (hub, port, 1) == 1;
+}
+
+/**
+ * usbemu_hub_detach_devices:
+ * @hub: (in): a #UsbemuHub object.
+ * @first_port: first port number of the range.
+ * @n_ports: number of ports in the range.
+ *
+ * Unplug the devices in a range of ports, as with usbemu_hub_detach_device()
+ * on each, but with a single #UsbemuHub::ports-changed emission. See
+ * usbemu_hub_attach_devices().
+ *
+ * Returns: the number of devices unplugged.
+ */
+guint
+usbemu_hub_detach_devices (UsbemuHub *hub,
+                           guint      first_port,
+                           guint      n_ports)
+{
+  UsbemuDevice *devices[USBEMU_HUB_MAX_PORTS];
+  UsbemuHubPort *ports;
+  guint i, n_devices;
+
+  g_return_val_if_fail (USBEMU_IS_HUB (hub), 0);
+  g_return_val_if_fail ((first_port >= 1) && (first_port <= hub->n_ports), 0);
+  g_return_val_if_fail ((n_ports >= 1) &&
+                        (n_ports <= hub->n_ports - first_port + 1), 0);
+
+  ports = &hub->ports[first_port - 1];
+  n_devices = 0;
+  for (i = 0; i < n_ports; i++) {
+    devices[i] = ports[i].device;
+    if (devices[i] == NULL)
+      continue;
+
+    _disconnect (hub, &ports[i]);
+    ports[i].device = NULL;
+    g_object_set_qdata (G_OBJECT (devices[i]), parent_quark, NULL);
+    n_devices++;
+  }
+  if (n_devices == 0)
+    return 0;
+
+  for (i = 0; i < n_ports; i++) {
+    if (devices[i] != NULL)
+      _cancel_all_urbs (devices[i]);
+  }
+  _usbemu_device_set_attached_many (devices, n_ports, FALSE);
+  for (i = 0; i < n_ports; i++) {
+    if (devices[i] == NULL)
+      continue;
+    _usbemu_device_set_context (devices[i], NULL);
+    g_object_unref (devices[i]);
+  }
+
+  g_signal_emit (hub, signals[SIGNAL_PORTS_CHANGED], 0, first_port, n_ports);
+
+  return n_devices;
+}
+
+/**
+ * usbemu_hub_get_device:
+ * @hub: (in): a #UsbemuHub object.
+ * @port: port number, from 1 to the number of ports.
+ *
+ * Get the device plugged into @port.
+ *
+ * Returns: (transfer none) (nullable): the #UsbemuDevice, or %NULL.
+ */
+UsbemuDevice*
+usbemu_hub_get_device (UsbemuHub *hub,
+                       guint      port)
+{
+  g_return_val_if_fail (USBEMU_IS_HUB (hub), NULL);
+  g_return_val_if_fail ((port >= 1) && (port <= hub->n_ports), NULL);
+
+  return hub->ports[port - 1].device;
+}
+
+/**
+ * usbemu_hub_get_port_status:
+ * @hub: (in): a #UsbemuHub object.
+ * @port: port number, from 1 to the number of ports.
+ * @status: (out) (optional): return location for the port status.
+ * @change: (out) (optional): return location for the port change bits.
+ *
+ * Get the status of @port as reported to the host.
+ */
+void
+usbemu_hub_get_port_status (UsbemuHub           *hub,
+                            guint                port,
+                            UsbemuHubPortStatus *status,
+                            UsbemuHubPortChange *change)
+{
+  g_return_if_fail (USBEMU_IS_HUB (hub));
+  g_return_if_fail ((port >= 1) && (port <= hub->n_ports));
+
+  if (status != NULL)
+    *status = hub->ports[port - 1].status;
+  if (change != NULL)
+    *change = hub->ports[port - 1].change;
+}
+
+/**
+ * usbemu_hub_lookup_address:
+ * @hub: (in): a #UsbemuHub object.
+ * @address: USB address assigned by the host, or 0 for the default address.
+ *
+ * Find the device behind @hub, directly or through other hubs, that answers
+ * @address, i.e. plugged into an enabled port and given @address with
+ * SET_ADDRESS. The host enables one port at a time and addresses its device
+ * before the next, so at most one device answers the default address. If
+ * several do anyway, the one on the lowest port, searched depth first, is
+ * returned.
+ *
+ * Returns: (transfer none) (nullable): the #UsbemuDevice, or %NULL.
+ */
+UsbemuDevice*
+usbemu_hub_lookup_address (UsbemuHub *hub,
+                           guint8     address)
+{
+  UsbemuHubPort *port;
+  UsbemuDevice *device;
+  guint i;
+
+  g_return_val_if_fail (USBEMU_IS_HUB (hub), NULL);
+
+  for (i = 0, port = hub->ports; i < hub->n_ports; i++, port++) {
+    if (!(port->status & USBEMU_HUB_PORT_STATUS_ENABLE))
+      continue;
+    if (usbemu_device_get_address (port->device) == address)
+      return port->device;
+    if (USBEMU_IS_HUB (port->device) &&
+        ((device = usbemu_hub_lookup_address (USBEMU_HUB (port->device),
+                                              address)) != NULL))
+      return device;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,143 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#if !defined (__USBEMU_USBEMU_H_INSIDE__) && !defined (LIBUSBEMU_COMPILATION)
+#error "Only <usbemu/usbemu.h> can be included directly."
+#endif
+
+#include <glib-object.h>
+
+#include <usbemu/usbemu-device.h>
+
+G_BEGIN_DECLS
+
+/**
+ * USBEMU_TYPE_HUB:
+ *
+ * Convenient macro for usbemu_hub_get_type().
+ */
+#define USBEMU_TYPE_HUB  (usbemu_hub_get_type ())
+
+G_DECLARE_FINAL_TYPE (UsbemuHub, usbemu_hub, USBEMU, HUB, UsbemuDevice)
+
+/**
+ * USBEMU_HUB_PROP_N_PORTS:
+ *
+ * "n-ports" property name.
+ */
+#define USBEMU_HUB_PROP_N_PORTS "n-ports"
+
+/**
+ * USBEMU_HUB_SIGNAL_PORTS_CHANGED:
+ *
+ * "ports-changed" signal name.
+ */
+#define USBEMU_HUB_SIGNAL_PORTS_CHANGED "ports-changed"
+
+/**
+ * USBEMU_HUB_MAX_PORTS:
+ *
+ * Maximum number of downstream ports of a hub. bNbrPorts of the hub
+ * descriptor could express 255, but hosts such as Linux reject hubs with
+ * more than 31 ports.
+ */
+#define USBEMU_HUB_MAX_PORTS 31
+
+/**
+ * UsbemuHubPortStatus:
+ * @USBEMU_HUB_PORT_STATUS_NONE: no bit set.
+ * @USBEMU_HUB_PORT_STATUS_CONNECTION: a device is present on the port.
+ * @USBEMU_HUB_PORT_STATUS_ENABLE: the port is enabled.
+ * @USBEMU_HUB_PORT_STATUS_SUSPEND: the port is suspended.
+ * @USBEMU_HUB_PORT_STATUS_OVER_CURRENT: over-current condition.
+ * @USBEMU_HUB_PORT_STATUS_RESET: reset signaling asserted.
+ * @USBEMU_HUB_PORT_STATUS_POWER: the port is powered.
+ * @USBEMU_HUB_PORT_STATUS_LOW_SPEED: a low-speed device is attached.
+ * @USBEMU_HUB_PORT_STATUS_HIGH_SPEED: a high-speed device is attached.
+ * @USBEMU_HUB_PORT_STATUS_TEST: the port is in test mode.
+ * @USBEMU_HUB_PORT_STATUS_INDICATOR: the port indicator is under software
+ *     control.
+ *
+ * Bits of wPortStatus, see table 11-21 of USB 2.0.
+ */
+typedef enum /*< flags,prefix=USBEMU >*/
+{
+  USBEMU_HUB_PORT_STATUS_NONE = 0, /*< nick=none >*/
+  USBEMU_HUB_PORT_STATUS_CONNECTION = (1 << 0), /*< nick=connection >*/
+  USBEMU_HUB_PORT_STATUS_ENABLE = (1 << 1), /*< nick=enable >*/
+  USBEMU_HUB_PORT_STATUS_SUSPEND = (1 << 2), /*< nick=suspend >*/
+  USBEMU_HUB_PORT_STATUS_OVER_CURRENT = (1 << 3), /*< nick=over-current >*/
+  USBEMU_HUB_PORT_STATUS_RESET = (1 << 4), /*< nick=reset >*/
+  USBEMU_HUB_PORT_STATUS_POWER = (1 << 8), /*< nick=power >*/
+  USBEMU_HUB_PORT_STATUS_LOW_SPEED = (1 << 9), /*< nick=low-speed >*/
+  USBEMU_HUB_PORT_STATUS_HIGH_SPEED = (1 << 10), /*< nick=high-speed >*/
+  USBEMU_HUB_PORT_STATUS_TEST = (1 << 11), /*< nick=test >*/
+  USBEMU_HUB_PORT_STATUS_INDICATOR = (1 << 12), /*< nick=indicator >*/
+} UsbemuHubPortStatus;
+
+/**
+ * UsbemuHubPortChange:
+ * @USBEMU_HUB_PORT_CHANGE_NONE: no bit set.
+ * @USBEMU_HUB_PORT_CHANGE_CONNECTION: connect status changed.
+ * @USBEMU_HUB_PORT_CHANGE_ENABLE: the port was disabled by an error.
+ * @USBEMU_HUB_PORT_CHANGE_SUSPEND: resume completed.
+ * @USBEMU_HUB_PORT_CHANGE_OVER_CURRENT: over-current indicator changed.
+ * @USBEMU_HUB_PORT_CHANGE_RESET: reset completed.
+ *
+ * Bits of wPortChange, see table 11-22 of USB 2.0.
+ */
+typedef enum /*< flags,prefix=USBEMU >*/
+{
+  USBEMU_HUB_PORT_CHANGE_NONE = 0, /*< nick=none >*/
+  USBEMU_HUB_PORT_CHANGE_CONNECTION = (1 << 0), /*< nick=connection >*/
+  USBEMU_HUB_PORT_CHANGE_ENABLE = (1 << 1), /*< nick=enable >*/
+  USBEMU_HUB_PORT_CHANGE_SUSPEND = (1 << 2), /*< nick=suspend >*/
+  USBEMU_HUB_PORT_CHANGE_OVER_CURRENT = (1 << 3), /*< nick=over-current >*/
+  USBEMU_HUB_PORT_CHANGE_RESET = (1 << 4), /*< nick=reset >*/
+} UsbemuHubPortChange;
+
+UsbemuHub* usbemu_hub_new (guint n_ports);
+
+guint usbemu_hub_get_n_ports (UsbemuHub *hub);
+
+gboolean      usbemu_hub_attach_device (UsbemuHub     *hub,
+                                        guint          port,
+                                        UsbemuDevice  *device,
+                                        GError       **error);
+gboolean      usbemu_hub_detach_device (UsbemuHub     *hub,
+                                        guint          port);
+gboolean      usbemu_hub_attach_devices (UsbemuHub            *hub,
+                                         guint                 first_port,
+                                         UsbemuDevice * const *devices,
+                                         guint                 n_devices,
+                                         GError              **error);
+guint         usbemu_hub_detach_devices (UsbemuHub            *hub,
+                                         guint                 first_port,
+                                         guint                 n_ports);
+UsbemuDevice* usbemu_hub_get_device    (UsbemuHub     *hub,
+                                        guint          port);
+void          usbemu_hub_get_port_status (UsbemuHub           *hub,
+                                          guint                port,
+                                          UsbemuHubPortStatus *status,
+                                          UsbemuHubPortChange *change);
+
+UsbemuDevice* usbemu_hub_lookup_address (UsbemuHub *hub,
+                                         guint8     address);
+
+G_END_DECLS
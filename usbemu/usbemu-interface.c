@@ -24,7 +24,9 @@
 #include "usbemu/usbemu-configuration.h"
 #include "usbemu/usbemu-device.h"
 #include "usbemu/usbemu-enums.h"
+#include "usbemu/usbemu-errors.h"
 #include "usbemu/usbemu-interface.h"
+#include "usbemu/usbemu-internal.h"
 
 /**
  * SECTION:usbemu-interface
@@ -44,21 +46,59 @@
 /**
  * UsbemuInterfaceClass:
  * @parent_class: The parent class.
+ * @control_request: handle a request on the default control endpoint of
+ *     @device addressed to this interface, i.e. with an interface recipient
+ *     and this bInterfaceNumber in wIndex, or with an endpoint recipient and
+ *     one of its endpoints in wIndex, that the library does not answer
+ *     itself. Class and vendor requests, e.g. HID GET_REPORT, and class
+ *     descriptors land here. Must eventually call
+ *     usbemu_device_complete_urb() on @device, as interfaces may be shared
+ *     between devices created from a template. Default implementation passes
+ *     the request on to #UsbemuDeviceClass.control_request.
  *
  * Class structure for UsbemuInterface.
  */
 
+/* Endpoint entry packed close to the endpoint descriptor wire format. */
+typedef struct {
+  guint8 bEndpointAddress;
+  guint8 bmAttributes;
+  /* Including additional transactions in bits 12..11. */
+  guint16 wMaxPacketSize;
+  /* In µs, as UsbemuEndpointEntry.interval. */
+  guint32 interval;
+} UsbemuPackedEndpoint;
+
+/* Endpoints per interface, except the default control endpoint. */
+#define MAX_ENDPOINTS ((USBEMU_NUM_ENDPOINTS - 1) * 2)
+
 typedef struct  _UsbemuDevicePrivate {
   UsbemuConfiguration *configuration;
   guint bInterfaceNumber;
   guint bAlternateSetting;
 
   gchar *name;
+  guint8 iInterface;
   UsbemuClasses bInterfaceClass;
   guint bInterfaceSubClass;
   guint bInterfaceProtocol;
-  UsbemuEndpointEntry endpoints[(USBEMU_NUM_ENDPOINTS - 1) * 2 + 1];
+  UsbemuPackedEndpoint *endpoints;
   gsize n_endpoints;
+  /* Zero-terminated unpacked view for usbemu_interface_get_endpoint_entries(),
+   * built on demand. */
+  UsbemuEndpointEntry *entries;
+
+  /* Class or vendor specific descriptors following the interface descriptor
+   * and each endpoint descriptor, e.g. HID or SuperSpeed companion. The latter
+   * is allocated along with endpoints only once any is set. */
+  GBytes *extra_descriptors;
+  GBytes **endpoint_extra_descriptors;
+
+  /* Fields past the standard interface and endpoint descriptor sizes kept
+   * from imported descriptors, e.g. bRefresh and bSynchAddress of audio 1.0
+   * endpoints. Allocated like endpoint_extra_descriptors. */
+  GBytes *descriptor_tail;
+  GBytes **endpoint_descriptor_tails;
 } UsbemuInterfacePrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (UsbemuInterface, usbemu_interface, G_TYPE_OBJECT)
@@ -96,6 +136,79 @@ static void gobject_class_dispose (GObject *object);
 static void gobject_class_finalize (GObject *object);
 /* virtual methods for UsbemuInterfaceClass */
 static void usbemu_interface_class_init (UsbemuInterfaceClass *interface_class);
+/* virtual methods for UsbemuInterfaceClass */
+static void interface_class_control_request (UsbemuInterface *interface,
+                                             UsbemuDevice *device,
+                                             UsbemuUrb *urb,
+                                             const UsbemuControlSetup *setup);
+/* helper functions */
+static void _invalidate_configuration (UsbemuInterfacePrivate *priv);
+static guint8 _encode_interval (const UsbemuEndpointEntry *entry, UsbemuSpeeds speed);
+static gint _find_endpoint (UsbemuInterfacePrivate *priv,
+                            UsbemuEndpoints endpoint_number,
+                            UsbemuEndpointDirections direction);
+static gboolean _is_shared (UsbemuInterface *interface);
+static void _append_bytes (GByteArray *array, GBytes *bytes);
+static void _append_descriptor (GByteArray *array, guint8 *descriptor,
+                                guint8 size, GBytes *tail);
+static void _free_endpoint_bytes (GBytes **bytes, gsize n_endpoints);
+static GBytes** _copy_endpoint_bytes (GBytes **bytes, gsize n_endpoints);
+static void _pack_entry (UsbemuPackedEndpoint *packed,
+                         const UsbemuEndpointEntry *entry);
+static void _unpack_entry (const UsbemuPackedEndpoint *packed,
+                           UsbemuEndpointEntry *entry);
+static gboolean _check_entry (UsbemuInterfacePrivate *priv,
+                              const UsbemuEndpointEntry *entries,
+                              gsize index, GError **error);
+
+/* Limits of endpoint entries per speed and transfer type, see sections 5.6 to
+ * 5.8 of USB 2.0 and section 9.6.6 of USB 3.2, indexed by #UsbemuSpeeds.
+ * Intervals are in µs. A maximum packet size of 0 marks transfer types the
+ * speed does not support. */
+typedef struct {
+  guint min_packet_size;
+  guint max_packet_size;
+  gboolean power_of_two;
+  guint max_additional_transactions;
+  guint min_interval;
+  guint max_interval;
+} UsbemuEndpointLimits;
+
+#define N_SPEEDS (USBEMU_SPEED_SUPER + 1)
+
+static const gchar * const speed_names[N_SPEEDS] = {
+  [USBEMU_SPEED_LOW] = "low-speed",
+  [USBEMU_SPEED_FULL] = "full-speed",
+  [USBEMU_SPEED_HIGH] = "high-speed",
+  [USBEMU_SPEED_SUPER] = "SuperSpeed",
+};
+
+static const gchar * const transfer_names[] = {
+  "control", "isochronous", "bulk", "interrupt"
+};
+
+static const UsbemuEndpointLimits endpoint_limits[N_SPEEDS][4] = {
+  [USBEMU_SPEED_LOW] = {
+    [USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS] = { 0, 0, FALSE, 0, 0, 0 },
+    [USBEMU_ENDPOINT_TRANSFER_BULK] = { 0, 0, FALSE, 0, 0, 0 },
+    [USBEMU_ENDPOINT_TRANSFER_INTERRUPT] = { 0, 8, FALSE, 0, 10000, 255000 },
+  },
+  [USBEMU_SPEED_FULL] = {
+    [USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS] = { 0, 1023, FALSE, 0, 1000, 1000 << 15 },
+    [USBEMU_ENDPOINT_TRANSFER_BULK] = { 8, 64, TRUE, 0, 0, G_MAXUINT },
+    [USBEMU_ENDPOINT_TRANSFER_INTERRUPT] = { 0, 64, FALSE, 0, 1000, 255000 },
+  },
+  [USBEMU_SPEED_HIGH] = {
+    [USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS] = { 0, 1024, FALSE, 2, 125, 125 << 15 },
+    [USBEMU_ENDPOINT_TRANSFER_BULK] = { 512, 512, FALSE, 0, 0, G_MAXUINT },
+    [USBEMU_ENDPOINT_TRANSFER_INTERRUPT] = { 0, 1024, FALSE, 2, 125, 125 << 15 },
+  },
+  [USBEMU_SPEED_SUPER] = {
+    [USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS] = { 0, 1024, FALSE, 0, 125, 125 << 15 },
+    [USBEMU_ENDPOINT_TRANSFER_BULK] = { 1024, 1024, FALSE, 0, 0, G_MAXUINT },
+    [USBEMU_ENDPOINT_TRANSFER_INTERRUPT] = { 0, 1024, FALSE, 0, 125, 125 << 15 },
+  },
+};
 
 static void
 gobject_class_set_property (GObject      *object,
@@ -106,11 +219,14 @@ gobject_class_set_property (GObject      *object,
   UsbemuInterface *interface = USBEMU_INTERFACE (object);
   UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
 
+  g_return_if_fail (!_is_shared (interface));
+
   switch (prop_id) {
     case PROP_NAME:
       if (priv->name)
         g_free (priv->name);
       priv->name = g_value_dup_string (value);
+      _usbemu_interface_intern_strings (interface);
       break;
     case PROP_CLASS:
       priv->bInterfaceClass = g_value_get_enum (value);
@@ -123,8 +239,10 @@ gobject_class_set_property (GObject      *object,
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
-      break;
+      return;
   }
+
+  _invalidate_configuration (priv);
 }
 
 static void
@@ -178,6 +296,14 @@ gobject_class_finalize (GObject *object)
 
   if (priv->name)
     g_free (priv->name);
+  if (priv->extra_descriptors != NULL)
+    g_bytes_unref (priv->extra_descriptors);
+  _free_endpoint_bytes (priv->endpoint_extra_descriptors, priv->n_endpoints);
+  if (priv->descriptor_tail != NULL)
+    g_bytes_unref (priv->descriptor_tail);
+  _free_endpoint_bytes (priv->endpoint_descriptor_tails, priv->n_endpoints);
+  g_free (priv->endpoints);
+  g_free (priv->entries);
 }
 
 static void
@@ -192,6 +318,8 @@ usbemu_interface_class_init (UsbemuInterfaceClass *interface_class)
   object_class->dispose = gobject_class_dispose;
   object_class->finalize = gobject_class_finalize;
 
+  interface_class->control_request = interface_class_control_request;
+
   /* properties */
 
   /**
@@ -300,6 +428,15 @@ usbemu_interface_class_init (UsbemuInterfaceClass *interface_class)
   g_object_class_install_properties (object_class, N_PROPERTIES, props);
 }
 
+static void
+interface_class_control_request (UsbemuInterface          *interface,
+                                 UsbemuDevice             *device,
+                                 UsbemuUrb                *urb,
+                                 const UsbemuControlSetup *setup)
+{
+  USBEMU_DEVICE_GET_CLASS (device)->control_request (device, urb, setup);
+}
+
 static void
 usbemu_interface_init (UsbemuInterface *interface)
 {
@@ -308,12 +445,18 @@ usbemu_interface_init (UsbemuInterface *interface)
   priv->bInterfaceNumber = USBEMU_INTERFACE_PROP_INTERFACE_NUMBER__DEFAULT;
   priv->bAlternateSetting = USBEMU_INTERFACE_PROP_ALTERNATE_SETTING__DEFAULT;
   priv->name = USBEMU_INTERFACE_PROP_NAME__DEFAULT;
+  priv->iInterface = 0;
   priv->bInterfaceClass = USBEMU_INTERFACE_PROP_CLASS__DEFAULT;
   priv->bInterfaceSubClass = USBEMU_INTERFACE_PROP_SUB_CLASS__DEFAULT;
   priv->bInterfaceProtocol = USBEMU_INTERFACE_PROP_PROTOCOL__DEFAULT;
   priv->configuration = NULL;
-  memset (priv->endpoints, 0, sizeof (priv->endpoints));
+  priv->endpoints = NULL;
   priv->n_endpoints = 0;
+  priv->entries = NULL;
+  priv->extra_descriptors = NULL;
+  priv->endpoint_extra_descriptors = NULL;
+  priv->descriptor_tail = NULL;
+  priv->endpoint_descriptor_tails = NULL;
 }
 
 /**
@@ -416,11 +559,14 @@ usbemu_interface_set_name (UsbemuInterface *interface,
                            const gchar     *name)
 {
   g_return_if_fail (USBEMU_IS_INTERFACE (interface));
+  g_return_if_fail (!_is_shared (interface));
 
   UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
   if (priv->name != NULL)
     g_free (priv->name);
   priv->name = g_strdup (name);
+  _usbemu_interface_intern_strings (interface);
+  _invalidate_configuration (priv);
 }
 
 /**
@@ -452,8 +598,11 @@ usbemu_interface_set_class (UsbemuInterface *interface,
                             UsbemuClasses    klass)
 {
   g_return_if_fail (USBEMU_IS_INTERFACE (interface));
+  g_return_if_fail (!_is_shared (interface));
 
-  USBEMU_INTERFACE_GET_PRIVATE (interface)->bInterfaceClass = klass;
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  priv->bInterfaceClass = klass;
+  _invalidate_configuration (priv);
 }
 
 /**
@@ -485,8 +634,11 @@ usbemu_interface_set_sub_class (UsbemuInterface *interface,
                                 guint            sub_class)
 {
   g_return_if_fail (USBEMU_IS_INTERFACE (interface));
+  g_return_if_fail (!_is_shared (interface));
 
-  USBEMU_INTERFACE_GET_PRIVATE (interface)->bInterfaceSubClass = sub_class;
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  priv->bInterfaceSubClass = sub_class;
+  _invalidate_configuration (priv);
 }
 
 /**
@@ -518,8 +670,11 @@ usbemu_interface_set_protocol (UsbemuInterface *interface,
                                guint            protocol)
 {
   g_return_if_fail (USBEMU_IS_INTERFACE (interface));
+  g_return_if_fail (!_is_shared (interface));
 
-  USBEMU_INTERFACE_GET_PRIVATE (interface)->bInterfaceProtocol = protocol;
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  priv->bInterfaceProtocol = protocol;
+  _invalidate_configuration (priv);
 }
 
 /**
@@ -536,60 +691,312 @@ usbemu_interface_get_configuration (UsbemuInterface *interface)
 {
   g_return_val_if_fail (USBEMU_IS_INTERFACE (interface), NULL);
 
-  return g_object_ref (USBEMU_INTERFACE_GET_PRIVATE (interface)->configuration);
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  if (priv->configuration == NULL)
+    return NULL;
+
+  return g_object_ref (priv->configuration);
 }
 
 /**
  * usbemu_interface_add_endpoint_entries:
  * @interface: a #UsbemuInterface object.
  * @entries: a %NULL-terminated array of #UsbemuEndpointEntry.
+ * @error: (out) (optional): return location for a #GError, or %NULL.
  *
- * Add endpoints to interface.
+ * Add endpoints to interface. Entries are checked against rules that do not
+ * depend on the device speed, e.g. duplicated endpoint addresses or
+ * attributes on non-isochronous endpoints. Limits that depend on the speed
+ * are checked by usbemu_device_validate() once the device is complete. Either
+ * all or none of @entries are added.
+ *
+ * Returns: %TRUE if succeeded. %FALSE with @error set otherwise.
  */
-void
+gboolean
 usbemu_interface_add_endpoint_entries (UsbemuInterface           *interface,
-                                       const UsbemuEndpointEntry *entries)
+                                       const UsbemuEndpointEntry *entries,
+                                       GError                   **error)
 {
-  gsize n_entries;
+  gsize n_entries, i;
   UsbemuInterfacePrivate *priv;
-  gboolean valid = TRUE;
 
-  g_return_if_fail (USBEMU_IS_INTERFACE (interface));
-  g_return_if_fail (entries != NULL);
-
-  for (n_entries = 0; entries[n_entries].endpoint_number; n_entries++);
+  g_return_val_if_fail (USBEMU_IS_INTERFACE (interface), FALSE);
+  g_return_val_if_fail (!_is_shared (interface), FALSE);
+  g_return_val_if_fail (entries != NULL, FALSE);
+  g_return_val_if_fail ((error == NULL) || (*error == NULL), FALSE);
 
   priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
-  if ((n_entries + priv->n_endpoints) >= G_N_ELEMENTS (priv->endpoints))
-    return;
+  for (n_entries = 0; entries[n_entries].endpoint_number; n_entries++) {
+    if ((priv->n_endpoints + n_entries) >= MAX_ENDPOINTS) {
+      g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                   "Too many endpoints, at most %d allowed", MAX_ENDPOINTS);
+      return FALSE;
+    }
+
+    if (!_check_entry (priv, entries, n_entries, error))
+      return FALSE;
+  }
 
-  memcpy (&priv->endpoints[priv->n_endpoints], entries,
-          n_entries * sizeof (priv->endpoints[0]));
-  n_entries += priv->n_endpoints;
+  if (n_entries == 0)
+    return TRUE;
+
+  /* Sized exactly, as endpoints are usually added once. */
+  priv->endpoints = g_renew (UsbemuPackedEndpoint, priv->endpoints,
+                             priv->n_endpoints + n_entries);
+  for (i = 0; i < n_entries; i++)
+    _pack_entry (&priv->endpoints[priv->n_endpoints + i], &entries[i]);
+
+  if (priv->endpoint_extra_descriptors != NULL) {
+    priv->endpoint_extra_descriptors =
+        g_renew (GBytes*, priv->endpoint_extra_descriptors,
+                 priv->n_endpoints + n_entries);
+    memset (&priv->endpoint_extra_descriptors[priv->n_endpoints], 0,
+            n_entries * sizeof (GBytes*));
+  }
+  if (priv->endpoint_descriptor_tails != NULL) {
+    priv->endpoint_descriptor_tails =
+        g_renew (GBytes*, priv->endpoint_descriptor_tails,
+                 priv->n_endpoints + n_entries);
+    memset (&priv->endpoint_descriptor_tails[priv->n_endpoints], 0,
+            n_entries * sizeof (GBytes*));
+  }
 
-  /* FIXME: checks here */
+  priv->n_endpoints += n_entries;
+  g_clear_pointer (&priv->entries, g_free);
+  _invalidate_configuration (priv);
 
-  if (valid)
-    priv->n_endpoints = n_entries;
-  else
-    priv->endpoints[priv->n_endpoints].endpoint_number = 0;
+  return TRUE;
+}
+
+/**
+ * usbemu_interface_get_n_endpoints:
+ * @interface: a #UsbemuInterface object.
+ *
+ * Get the number of endpoints added to this interface, i.e. bNumEndpoints.
+ *
+ * Returns: number of endpoints.
+ */
+guint
+usbemu_interface_get_n_endpoints (UsbemuInterface *interface)
+{
+  g_return_val_if_fail (USBEMU_IS_INTERFACE (interface), 0);
+
+  return USBEMU_INTERFACE_GET_PRIVATE (interface)->n_endpoints;
+}
+
+/**
+ * usbemu_interface_get_endpoint_entry:
+ * @interface: a #UsbemuInterface object.
+ * @index: index of the endpoint, in order of addition.
+ * @entry: (out caller-allocates): return location for the
+ *     #UsbemuEndpointEntry.
+ *
+ * Get an endpoint added to this interface without allocating memory.
+ *
+ * Returns: %TRUE if @entry was filled, %FALSE if @index is out of range.
+ */
+gboolean
+usbemu_interface_get_endpoint_entry (UsbemuInterface     *interface,
+                                     guint                index,
+                                     UsbemuEndpointEntry *entry)
+{
+  UsbemuInterfacePrivate *priv;
+
+  g_return_val_if_fail (USBEMU_IS_INTERFACE (interface), FALSE);
+  g_return_val_if_fail (entry != NULL, FALSE);
+
+  priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  if (index >= priv->n_endpoints)
+    return FALSE;
+
+  _unpack_entry (&priv->endpoints[index], entry);
+  return TRUE;
 }
 
 /**
  * usbemu_interface_get_endpoint_entries:
  * @interface: a #UsbemuInterface object.
  *
- * Get all #UsbemuEndpointEntry entries added to this interface.
+ * Get all #UsbemuEndpointEntry entries added to this interface. Endpoints are
+ * stored packed, so the returned array is built on first call and kept until
+ * endpoints are added again. Prefer usbemu_interface_get_endpoint_entry() to
+ * avoid the allocation.
  *
  * Returns: (transfer none) (array zero-terminated=1): %NULL-terminated array of
  *          #UsbemuEndpointEntry added to this interface.
  */
 const UsbemuEndpointEntry*
 usbemu_interface_get_endpoint_entries (UsbemuInterface *interface)
+{
+  UsbemuInterfacePrivate *priv;
+  gsize i;
+
+  g_return_val_if_fail (USBEMU_IS_INTERFACE (interface), NULL);
+
+  priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  if (priv->entries == NULL) {
+    priv->entries = g_new0 (UsbemuEndpointEntry, priv->n_endpoints + 1);
+    for (i = 0; i < priv->n_endpoints; i++)
+      _unpack_entry (&priv->endpoints[i], &priv->entries[i]);
+  }
+
+  return priv->entries;
+}
+
+/**
+ * usbemu_interface_set_extra_descriptors:
+ * @interface: a #UsbemuInterface object.
+ * @extra: (in) (nullable): concatenated descriptors, or %NULL to remove them.
+ *
+ * Set class or vendor specific descriptors, e.g. a HID descriptor, to be
+ * emitted verbatim right after the interface descriptor, before the first
+ * endpoint descriptor.
+ */
+void
+usbemu_interface_set_extra_descriptors (UsbemuInterface *interface,
+                                        GBytes          *extra)
+{
+  UsbemuInterfacePrivate *priv;
+
+  g_return_if_fail (USBEMU_IS_INTERFACE (interface));
+  g_return_if_fail (!_is_shared (interface));
+
+  priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  if (extra != NULL)
+    g_bytes_ref (extra);
+  if (priv->extra_descriptors != NULL)
+    g_bytes_unref (priv->extra_descriptors);
+  priv->extra_descriptors = extra;
+
+  _invalidate_configuration (priv);
+}
+
+/**
+ * usbemu_interface_get_extra_descriptors:
+ * @interface: a #UsbemuInterface object.
+ *
+ * Get descriptors set with usbemu_interface_set_extra_descriptors().
+ *
+ * Returns: (transfer none) (nullable): a #GBytes or %NULL if none.
+ */
+GBytes*
+usbemu_interface_get_extra_descriptors (UsbemuInterface *interface)
 {
   g_return_val_if_fail (USBEMU_IS_INTERFACE (interface), NULL);
 
-  return USBEMU_INTERFACE_GET_PRIVATE (interface)->endpoints;
+  return USBEMU_INTERFACE_GET_PRIVATE (interface)->extra_descriptors;
+}
+
+/**
+ * usbemu_interface_set_endpoint_extra_descriptors:
+ * @interface: a #UsbemuInterface object.
+ * @endpoint_number: a #UsbemuEndpoints of an endpoint added to @interface.
+ * @direction: a #UsbemuEndpointDirections.
+ * @extra: (in) (nullable): concatenated descriptors, or %NULL to remove them.
+ *
+ * Set class or vendor specific descriptors, e.g. a SuperSpeed endpoint
+ * companion descriptor, to be emitted verbatim right after the descriptor of
+ * the specified endpoint.
+ */
+void
+usbemu_interface_set_endpoint_extra_descriptors (UsbemuInterface          *interface,
+                                                 UsbemuEndpoints           endpoint_number,
+                                                 UsbemuEndpointDirections  direction,
+                                                 GBytes                   *extra)
+{
+  UsbemuInterfacePrivate *priv;
+  gint index;
+
+  g_return_if_fail (USBEMU_IS_INTERFACE (interface));
+  g_return_if_fail (!_is_shared (interface));
+
+  priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  index = _find_endpoint (priv, endpoint_number, direction);
+  g_return_if_fail (index >= 0);
+
+  if (priv->endpoint_extra_descriptors == NULL) {
+    if (extra == NULL)
+      return;
+    priv->endpoint_extra_descriptors = g_new0 (GBytes*, priv->n_endpoints);
+  }
+
+  if (extra != NULL)
+    g_bytes_ref (extra);
+  if (priv->endpoint_extra_descriptors[index] != NULL)
+    g_bytes_unref (priv->endpoint_extra_descriptors[index]);
+  priv->endpoint_extra_descriptors[index] = extra;
+
+  _invalidate_configuration (priv);
+}
+
+/**
+ * usbemu_interface_get_endpoint_extra_descriptors:
+ * @interface: a #UsbemuInterface object.
+ * @endpoint_number: a #UsbemuEndpoints.
+ * @direction: a #UsbemuEndpointDirections.
+ *
+ * Get descriptors set with usbemu_interface_set_endpoint_extra_descriptors().
+ *
+ * Returns: (transfer none) (nullable): a #GBytes or %NULL if none.
+ */
+GBytes*
+usbemu_interface_get_endpoint_extra_descriptors (UsbemuInterface          *interface,
+                                                 UsbemuEndpoints           endpoint_number,
+                                                 UsbemuEndpointDirections  direction)
+{
+  UsbemuInterfacePrivate *priv;
+  gint index;
+
+  g_return_val_if_fail (USBEMU_IS_INTERFACE (interface), NULL);
+
+  priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  index = _find_endpoint (priv, endpoint_number, direction);
+  if ((index < 0) || (priv->endpoint_extra_descriptors == NULL))
+    return NULL;
+
+  return priv->endpoint_extra_descriptors[index];
+}
+
+void
+_usbemu_interface_set_descriptor_tail (UsbemuInterface *interface,
+                                       GBytes          *tail)
+{
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+
+  if (tail != NULL)
+    g_bytes_ref (tail);
+  if (priv->descriptor_tail != NULL)
+    g_bytes_unref (priv->descriptor_tail);
+  priv->descriptor_tail = tail;
+
+  _invalidate_configuration (priv);
+}
+
+void
+_usbemu_interface_set_endpoint_descriptor_tail (UsbemuInterface          *interface,
+                                                UsbemuEndpoints           endpoint_number,
+                                                UsbemuEndpointDirections  direction,
+                                                GBytes                   *tail)
+{
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  gint index;
+
+  index = _find_endpoint (priv, endpoint_number, direction);
+  g_return_if_fail (index >= 0);
+
+  if (priv->endpoint_descriptor_tails == NULL) {
+    if (tail == NULL)
+      return;
+    priv->endpoint_descriptor_tails = g_new0 (GBytes*, priv->n_endpoints);
+  }
+
+  if (tail != NULL)
+    g_bytes_ref (tail);
+  if (priv->endpoint_descriptor_tails[index] != NULL)
+    g_bytes_unref (priv->endpoint_descriptor_tails[index]);
+  priv->endpoint_descriptor_tails[index] = tail;
+
+  _invalidate_configuration (priv);
 }
 
 void
@@ -604,3 +1011,371 @@ _usbemu_interface_set_configuration (UsbemuInterface     *interface,
   priv->bInterfaceNumber = interface_number;
   priv->bAlternateSetting = alternate_setting;
 }
+
+void
+_usbemu_interface_intern_strings (UsbemuInterface *interface)
+{
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  UsbemuDevice *device;
+  guint8 old_index;
+
+  if (priv->configuration == NULL)
+    return;
+
+  device = _usbemu_configuration_peek_device (priv->configuration);
+  if (device == NULL)
+    return;
+
+  old_index = priv->iInterface;
+  priv->iInterface = _usbemu_device_ref_string (device, priv->name);
+  _usbemu_device_unref_string (device, old_index);
+}
+
+guint8
+_usbemu_interface_get_string_index (UsbemuInterface *interface)
+{
+  return USBEMU_INTERFACE_GET_PRIVATE (interface)->iInterface;
+}
+
+/*
+ * Returns: (transfer full): a copy of @interface not yet added to any
+ *     configuration.
+ */
+UsbemuInterface*
+_usbemu_interface_copy (UsbemuInterface *interface)
+{
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  UsbemuInterfacePrivate *copy_priv;
+  UsbemuInterface *copy;
+
+  /* Keep the type, so that class request handlers carry over. Use setters
+   * as class codes may be missing from UsbemuClasses. */
+  copy = g_object_new (G_OBJECT_TYPE (interface), NULL);
+  usbemu_interface_set_name (copy, priv->name);
+  usbemu_interface_set_class (copy, priv->bInterfaceClass);
+  usbemu_interface_set_sub_class (copy, priv->bInterfaceSubClass);
+  usbemu_interface_set_protocol (copy, priv->bInterfaceProtocol);
+
+  copy_priv = USBEMU_INTERFACE_GET_PRIVATE (copy);
+  copy_priv->endpoints = g_new (UsbemuPackedEndpoint, priv->n_endpoints);
+  memcpy (copy_priv->endpoints, priv->endpoints,
+          priv->n_endpoints * sizeof (priv->endpoints[0]));
+  copy_priv->n_endpoints = priv->n_endpoints;
+  if (priv->extra_descriptors != NULL)
+    copy_priv->extra_descriptors = g_bytes_ref (priv->extra_descriptors);
+  copy_priv->endpoint_extra_descriptors =
+      _copy_endpoint_bytes (priv->endpoint_extra_descriptors,
+                            priv->n_endpoints);
+  if (priv->descriptor_tail != NULL)
+    copy_priv->descriptor_tail = g_bytes_ref (priv->descriptor_tail);
+  copy_priv->endpoint_descriptor_tails =
+      _copy_endpoint_bytes (priv->endpoint_descriptor_tails, priv->n_endpoints);
+
+  return copy;
+}
+
+/* Interfaces of a configuration shared by devices created from a template
+ * are read-only. */
+static gboolean
+_is_shared (UsbemuInterface *interface)
+{
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+
+  return (priv->configuration != NULL) &&
+         _usbemu_configuration_is_shared (priv->configuration);
+}
+
+static void
+_invalidate_configuration (UsbemuInterfacePrivate *priv)
+{
+  if (priv->configuration != NULL)
+    _usbemu_configuration_invalidate_descriptors (priv->configuration);
+}
+
+static guint8
+_encode_interval (const UsbemuEndpointEntry *entry,
+                  UsbemuSpeeds               speed)
+{
+  guint unit, interval, exponent;
+
+  switch (entry->transfer) {
+    case USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS:
+    case USBEMU_ENDPOINT_TRANSFER_INTERRUPT:
+      break;
+    default:
+      return 0;
+  }
+
+  /* High-speed and faster endpoints count in 125 µs microframes, slower ones
+   * in 1 ms frames. */
+  unit = (speed >= USBEMU_SPEED_HIGH) ? 125 : 1000;
+  interval = MAX (entry->interval / unit, 1);
+
+  if ((unit == 1000) && (entry->transfer == USBEMU_ENDPOINT_TRANSFER_INTERRUPT))
+    return MIN (interval, G_MAXUINT8);
+
+  /* Otherwise the period is 2^(bInterval-1) units. */
+  for (exponent = 0; (exponent < 15) && ((2U << exponent) <= interval);
+       exponent++);
+
+  return exponent + 1;
+}
+
+static gint
+_find_endpoint (UsbemuInterfacePrivate   *priv,
+                UsbemuEndpoints           endpoint_number,
+                UsbemuEndpointDirections  direction)
+{
+  guint8 address = endpoint_number | direction;
+  gsize i;
+
+  for (i = 0; i < priv->n_endpoints; i++) {
+    if (priv->endpoints[i].bEndpointAddress == address)
+      return i;
+  }
+
+  return -1;
+}
+
+static void
+_pack_entry (UsbemuPackedEndpoint      *packed,
+             const UsbemuEndpointEntry *entry)
+{
+  packed->bEndpointAddress = entry->endpoint_number | entry->direction;
+  packed->bmAttributes = entry->transfer | entry->attributes;
+  packed->wMaxPacketSize = (entry->max_packet_size & 0x7FF) |
+                           ((entry->additional_transactions & 0x3) << 11);
+  packed->interval = entry->interval;
+}
+
+static void
+_unpack_entry (const UsbemuPackedEndpoint *packed,
+               UsbemuEndpointEntry        *entry)
+{
+  entry->endpoint_number = packed->bEndpointAddress & 0x0F;
+  entry->direction = packed->bEndpointAddress & USBEMU_ENDPOINT_DIRECTION_IN;
+  entry->transfer = packed->bmAttributes & 0x03;
+  entry->attributes = packed->bmAttributes & ~0x03;
+  entry->max_packet_size = packed->wMaxPacketSize & 0x7FF;
+  entry->additional_transactions = (packed->wMaxPacketSize >> 11) & 0x3;
+  entry->interval = packed->interval;
+}
+
+static void
+_free_endpoint_bytes (GBytes **bytes,
+                      gsize    n_endpoints)
+{
+  gsize i;
+
+  if (bytes == NULL)
+    return;
+
+  for (i = 0; i < n_endpoints; i++) {
+    if (bytes[i] != NULL)
+      g_bytes_unref (bytes[i]);
+  }
+  g_free (bytes);
+}
+
+static GBytes**
+_copy_endpoint_bytes (GBytes **bytes,
+                      gsize    n_endpoints)
+{
+  GBytes **copy;
+  gsize i;
+
+  if (bytes == NULL)
+    return NULL;
+
+  copy = g_new0 (GBytes*, n_endpoints);
+  for (i = 0; i < n_endpoints; i++) {
+    if (bytes[i] != NULL)
+      copy[i] = g_bytes_ref (bytes[i]);
+  }
+  return copy;
+}
+
+/* Emit the @size leading bytes of @descriptor, extended with @tail and with
+ * bLength updated to match. */
+static void
+_append_descriptor (GByteArray *array,
+                    guint8     *descriptor,
+                    guint8      size,
+                    GBytes     *tail)
+{
+  descriptor[0] = size;
+  if (tail != NULL)
+    descriptor[0] += g_bytes_get_size (tail);
+  g_byte_array_append (array, descriptor, size);
+  _append_bytes (array, tail);
+}
+
+static void
+_append_bytes (GByteArray *array,
+               GBytes     *bytes)
+{
+  if (bytes != NULL)
+    g_byte_array_append (array, g_bytes_get_data (bytes, NULL),
+                         g_bytes_get_size (bytes));
+}
+
+static gboolean
+_check_entry (UsbemuInterfacePrivate     *priv,
+              const UsbemuEndpointEntry  *entries,
+              gsize                       index,
+              GError                    **error)
+{
+  const UsbemuEndpointEntry *entry = &entries[index];
+  guint address = entry->endpoint_number | entry->direction;
+  const gchar *message = NULL;
+  gsize i;
+
+  if (entry->endpoint_number > USBEMU_EP_15)
+    message = "invalid endpoint number";
+  else if ((entry->direction != USBEMU_ENDPOINT_DIRECTION_OUT) &&
+           (entry->direction != USBEMU_ENDPOINT_DIRECTION_IN))
+    message = "invalid direction";
+  else if ((entry->transfer != USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS) &&
+           (entry->transfer != USBEMU_ENDPOINT_TRANSFER_BULK) &&
+           (entry->transfer != USBEMU_ENDPOINT_TRANSFER_INTERRUPT))
+    message = "invalid transfer type";
+  else if ((entry->transfer == USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS) ?
+           ((entry->attributes & ~0x3C) != 0) : (entry->attributes != 0))
+    message = "invalid attributes";
+  else if (entry->max_packet_size > 0x7FF)
+    message = "invalid max packet size";
+  else if (entry->additional_transactions > 2)
+    message = "invalid additional transactions";
+  else if ((entry->transfer == USBEMU_ENDPOINT_TRANSFER_BULK) &&
+           (entry->additional_transactions != 0))
+    message = "additional transactions on non-periodic endpoint";
+  else if (_find_endpoint (priv, entry->endpoint_number, entry->direction) >= 0)
+    message = "duplicated endpoint address";
+
+  for (i = 0; (message == NULL) && (i < index); i++) {
+    if ((entries[i].endpoint_number == entry->endpoint_number) &&
+        (entries[i].direction == entry->direction))
+      message = "duplicated endpoint address";
+  }
+
+  if (message != NULL) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                 "Endpoint 0x%02x: %s", address, message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+gboolean
+_usbemu_interface_validate (UsbemuInterface  *interface,
+                            UsbemuSpeeds      speed,
+                            GError          **error)
+{
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  const UsbemuEndpointLimits *limits;
+  UsbemuEndpointEntry unpacked, *entry = &unpacked;
+  const gchar *message;
+  gsize i;
+
+  g_return_val_if_fail ((speed > USBEMU_SPEED_UNKNOWN) && (speed < N_SPEEDS),
+                        FALSE);
+
+  for (i = 0; i < priv->n_endpoints; i++) {
+    _unpack_entry (&priv->endpoints[i], entry);
+    limits = &endpoint_limits[speed][entry->transfer];
+
+    message = NULL;
+    if (limits->max_packet_size == 0)
+      message = "transfer type not supported";
+    else if ((entry->max_packet_size < limits->min_packet_size) ||
+        (entry->max_packet_size > limits->max_packet_size) ||
+        (limits->power_of_two &&
+         ((entry->max_packet_size & (entry->max_packet_size - 1)) != 0)))
+      message = "invalid max packet size";
+    else if (entry->additional_transactions >
+             limits->max_additional_transactions)
+      message = "invalid additional transactions";
+    else if ((entry->interval < limits->min_interval) ||
+             (entry->interval > limits->max_interval))
+      message = "interval out of range";
+
+    if (message != NULL) {
+      g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_INVALID_DESCRIPTOR,
+                   "Interface %u alternate setting %u endpoint 0x%02x: %s for "
+                   "%s %s endpoint", priv->bInterfaceNumber,
+                   priv->bAlternateSetting,
+                   entry->endpoint_number | entry->direction, message,
+                   speed_names[speed], transfer_names[entry->transfer]);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Inverse of _encode_interval(). */
+guint
+_usbemu_interface_decode_interval (UsbemuEndpointTransfers transfer,
+                                   guint8                  bInterval,
+                                   UsbemuSpeeds            speed)
+{
+  guint unit;
+
+  switch (transfer) {
+    case USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS:
+    case USBEMU_ENDPOINT_TRANSFER_INTERRUPT:
+      break;
+    default:
+      return 0;
+  }
+
+  unit = (speed >= USBEMU_SPEED_HIGH) ? 125 : 1000;
+  bInterval = MAX (bInterval, 1);
+
+  if ((unit == 1000) && (transfer == USBEMU_ENDPOINT_TRANSFER_INTERRUPT))
+    return bInterval * unit;
+
+  return unit << (MIN (bInterval, 16) - 1);
+}
+
+void
+_usbemu_interface_append_descriptors (UsbemuInterface *interface,
+                                      GByteArray      *array,
+                                      UsbemuSpeeds     speed)
+{
+  UsbemuInterfacePrivate *priv = USBEMU_INTERFACE_GET_PRIVATE (interface);
+  const UsbemuPackedEndpoint *packed;
+  UsbemuEndpointEntry entry;
+  guint8 descriptor[USBEMU_INTERFACE_DESCRIPTOR_SIZE];
+  gsize i;
+
+  descriptor[1] = USBEMU_DESCRIPTOR_TYPE_INTERFACE;
+  descriptor[2] = priv->bInterfaceNumber;
+  descriptor[3] = priv->bAlternateSetting;
+  descriptor[4] = priv->n_endpoints;
+  descriptor[5] = priv->bInterfaceClass;
+  descriptor[6] = priv->bInterfaceSubClass;
+  descriptor[7] = priv->bInterfaceProtocol;
+  descriptor[8] = priv->iInterface;
+  _append_descriptor (array, descriptor, USBEMU_INTERFACE_DESCRIPTOR_SIZE,
+                      priv->descriptor_tail);
+  _append_bytes (array, priv->extra_descriptors);
+
+  for (i = 0; i < priv->n_endpoints; i++) {
+    packed = &priv->endpoints[i];
+    _unpack_entry (packed, &entry);
+
+    descriptor[1] = USBEMU_DESCRIPTOR_TYPE_ENDPOINT;
+    descriptor[2] = packed->bEndpointAddress;
+    descriptor[3] = packed->bmAttributes;
+    descriptor[4] = packed->wMaxPacketSize & 0xFF;
+    descriptor[5] = packed->wMaxPacketSize >> 8;
+    descriptor[6] = _encode_interval (&entry, speed);
+    _append_descriptor (array, descriptor, USBEMU_ENDPOINT_DESCRIPTOR_SIZE,
+                        (priv->endpoint_descriptor_tails != NULL) ?
+                            priv->endpoint_descriptor_tails[i] : NULL);
+    if (priv->endpoint_extra_descriptors != NULL)
+      _append_bytes (array, priv->endpoint_extra_descriptors[i]);
+  }
+}
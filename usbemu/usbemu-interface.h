@@ -77,10 +77,17 @@ G_DECLARE_DERIVABLE_TYPE (UsbemuInterface, usbemu_interface, USBEMU, INTERFACE,
 struct _UsbemuInterfaceClass {
   GObjectClass parent_class;
 
+  /* transfers */
+
+  void (*control_request) (UsbemuInterface          *interface,
+                           UsbemuDevice             *device,
+                           UsbemuUrb                *urb,
+                           const UsbemuControlSetup *setup);
+
   /*< private >*/
 
   /* Reserved slots for furture extension. */
-  gpointer padding[12];
+  gpointer padding[11];
 };
 
 /**
@@ -233,7 +240,20 @@ typedef enum /*< enum,prefix=USBEMU >*/
  * Per endpoint definition entry for #UsbemuInterface. See
  * usbemu_interface_add_endpoint_entries().
  */
-typedef struct {
+/**
+ * USBEMU_INTERFACE_DESCRIPTOR_SIZE:
+ *
+ * Size in bytes of a standard interface descriptor.
+ */
+#define USBEMU_INTERFACE_DESCRIPTOR_SIZE 9
+/**
+ * USBEMU_ENDPOINT_DESCRIPTOR_SIZE:
+ *
+ * Size in bytes of a standard endpoint descriptor.
+ */
+#define USBEMU_ENDPOINT_DESCRIPTOR_SIZE 7
+
+typedef struct _UsbemuEndpointEntry {
   UsbemuEndpoints endpoint_number;
   UsbemuEndpointDirections direction;
   UsbemuEndpointTransfers transfer;
@@ -264,9 +284,25 @@ guint         usbemu_interface_get_protocol          (UsbemuInterface *interface
 void          usbemu_interface_set_protocol          (UsbemuInterface *interface,
                                                       guint            protocol);
 
-void                       usbemu_interface_add_endpoint_entries (UsbemuInterface           *interface,
-                                                                  const UsbemuEndpointEntry *entries);
+gboolean                   usbemu_interface_add_endpoint_entries (UsbemuInterface           *interface,
+                                                                  const UsbemuEndpointEntry *entries,
+                                                                  GError                   **error);
 const UsbemuEndpointEntry* usbemu_interface_get_endpoint_entries (UsbemuInterface           *interface);
+guint                      usbemu_interface_get_n_endpoints      (UsbemuInterface           *interface);
+gboolean                   usbemu_interface_get_endpoint_entry   (UsbemuInterface           *interface,
+                                                                  guint                      index,
+                                                                  UsbemuEndpointEntry       *entry);
+
+void    usbemu_interface_set_extra_descriptors          (UsbemuInterface          *interface,
+                                                         GBytes                   *extra);
+GBytes* usbemu_interface_get_extra_descriptors          (UsbemuInterface          *interface);
+void    usbemu_interface_set_endpoint_extra_descriptors (UsbemuInterface          *interface,
+                                                         UsbemuEndpoints           endpoint_number,
+                                                         UsbemuEndpointDirections  direction,
+                                                         GBytes                   *extra);
+GBytes* usbemu_interface_get_endpoint_extra_descriptors (UsbemuInterface          *interface,
+                                                         UsbemuEndpoints           endpoint_number,
+                                                         UsbemuEndpointDirections  direction);
 
 UsbemuConfiguration* usbemu_interface_get_configuration (UsbemuInterface *interface);
 
@@ -23,7 +23,10 @@
 
 #include "usbemu/usbemu-configuration.h"
 #include "usbemu/usbemu-device.h"
+#include "usbemu/usbemu-endpoint-queue.h"
+#include "usbemu/usbemu-hub.h"
 #include "usbemu/usbemu-interface.h"
+#include "usbemu/usbemu-iso-stream.h"
 
 /**
  * SECTION:usbemu-internal
@@ -35,16 +38,167 @@
 
 G_BEGIN_DECLS
 
-void _usbemu_device_set_attached (UsbemuDevice *device,
-                                  gboolean      attached);
+typedef struct _UsbemuStringTable UsbemuStringTable;
+
+UsbemuStringTable* _usbemu_string_table_new             (void);
+UsbemuStringTable* _usbemu_string_table_ref             (UsbemuStringTable *table);
+void               _usbemu_string_table_unref           (UsbemuStringTable *table);
+UsbemuStringTable* _usbemu_string_table_make_writable   (UsbemuStringTable *table);
+guint8             _usbemu_string_table_ref_string      (UsbemuStringTable *table,
+                                                         const gchar       *string);
+void               _usbemu_string_table_unref_string    (UsbemuStringTable *table,
+                                                         guint8             index);
+void               _usbemu_string_table_set_languages   (UsbemuStringTable *table,
+                                                         const guint16     *langids,
+                                                         gsize              n_langids);
+const guint16*     _usbemu_string_table_get_languages   (UsbemuStringTable *table,
+                                                         gsize             *n_langids);
+void               _usbemu_string_table_set_translation (UsbemuStringTable *table,
+                                                         guint16            langid,
+                                                         const gchar       *string,
+                                                         const gchar       *translation);
+GBytes*            _usbemu_string_table_lookup          (UsbemuStringTable *table,
+                                                         guint8             index,
+                                                         guint16            langid);
+
+void   _usbemu_device_set_attached (UsbemuDevice *device,
+                                    gboolean      attached);
+void   _usbemu_device_set_attached_many (UsbemuDevice * const *devices,
+                                         guint                 n_devices,
+                                         gboolean              attached);
+void   _usbemu_device_set_context  (UsbemuDevice *device,
+                                    GMainContext *context);
+void   _usbemu_hub_set_context     (UsbemuHub    *hub,
+                                    GMainContext *context);
+guint8 _usbemu_device_ref_string   (UsbemuDevice *device,
+                                    const gchar  *string);
+void   _usbemu_device_unref_string (UsbemuDevice *device,
+                                    guint8        index);
+void   _usbemu_device_invalidate_template (UsbemuDevice *device);
+void   _usbemu_device_set_address  (UsbemuDevice *device,
+                                    guint8        address);
+void   _usbemu_device_set_remote_wakeup (UsbemuDevice *device,
+                                         gboolean      remote_wakeup);
+UsbemuSpeeds _usbemu_speed_from_spec (guint16 spec);
+
+gboolean _usbemu_control_handle_standard (UsbemuDevice             *device,
+                                          UsbemuUrb                *urb,
+                                          const UsbemuControlSetup *setup);
+void     _usbemu_control_route           (UsbemuDevice             *device,
+                                          UsbemuUrb                *urb,
+                                          const UsbemuControlSetup *setup);
 
 void _usbemu_configuration_set_device (UsbemuConfiguration *configuration,
                                        UsbemuDevice        *device,
                                        guint                configuration_value);
+void _usbemu_configuration_invalidate_descriptors (UsbemuConfiguration *configuration);
+UsbemuDevice* _usbemu_configuration_peek_device (UsbemuConfiguration *configuration);
+void _usbemu_configuration_set_shared (UsbemuConfiguration *configuration);
+gboolean _usbemu_configuration_is_shared (UsbemuConfiguration *configuration);
+UsbemuConfiguration* _usbemu_configuration_copy (UsbemuConfiguration *configuration);
+void _usbemu_configuration_release_strings (UsbemuConfiguration *configuration,
+                                            UsbemuDevice        *device);
+
+gpointer _usbemu_urb_pool_alloc (gsize     size,
+                                 guint    *index);
+void     _usbemu_urb_pool_free  (gpointer  block,
+                                 guint     index);
+
+void _usbemu_endpoint_queue_bind   (UsbemuEndpointQueue *queue,
+                                    UsbemuDevice        *device);
+void _usbemu_endpoint_queue_unbind (UsbemuEndpointQueue *queue);
+void _usbemu_endpoint_queue_push   (UsbemuEndpointQueue *queue,
+                                    UsbemuUrb           *urb);
+void _usbemu_endpoint_queue_cancel (UsbemuEndpointQueue *queue,
+                                    UsbemuUrb           *urb);
+
+void _usbemu_iso_stream_bind   (UsbemuIsoStream *stream,
+                                UsbemuDevice    *device);
+void _usbemu_iso_stream_unbind (UsbemuIsoStream *stream);
+void _usbemu_iso_stream_push   (UsbemuIsoStream *stream,
+                                UsbemuUrb       *urb);
+void _usbemu_iso_stream_cancel (UsbemuIsoStream *stream,
+                                UsbemuUrb       *urb);
+
+typedef struct _UsbemuTimerWheel UsbemuTimerWheel;
+typedef struct _UsbemuWheelTimer UsbemuWheelTimer;
+
+typedef void (*UsbemuWheelTimerFunc) (UsbemuWheelTimer *timer);
+
+/* Embedded in the owner of the timer. Zero-initialized, it is not pending. */
+struct _UsbemuWheelTimer {
+  UsbemuWheelTimer *next;
+  /* NULL when not pending. */
+  UsbemuWheelTimer **pprev;
+  guint64 expires;
+  guint level;
+  guint slot;
+  UsbemuWheelTimerFunc func;
+};
+
+UsbemuTimerWheel* _usbemu_timer_wheel_ref_default (void);
+void              _usbemu_timer_wheel_unref       (UsbemuTimerWheel *wheel);
+void              _usbemu_timer_wheel_add         (UsbemuTimerWheel *wheel,
+                                                   UsbemuWheelTimer *timer,
+                                                   gint64            time);
+void              _usbemu_timer_wheel_remove      (UsbemuTimerWheel *wheel,
+                                                   UsbemuWheelTimer *timer);
+
+void _usbemu_context_invoke_sync (GMainContext *context,
+                                  GSourceFunc   func,
+                                  gpointer      user_data);
+
+typedef struct _UsbemuIoRing UsbemuIoRing;
+typedef struct _UsbemuIoRingOp UsbemuIoRingOp;
+
+struct msghdr;
+
+/* @result is a byte count or a negative errno value, and @bytes the bytes
+ * received, or %NULL. Take a reference to keep them past the call; the
+ * buffer is given back to the kernel once it is released. */
+typedef void (*UsbemuIoRingFunc) (UsbemuIoRingOp *op,
+                                  gint            result,
+                                  GBytes         *bytes,
+                                  gboolean        more,
+                                  gpointer        user_data);
+
+UsbemuIoRing*   _usbemu_io_ring_ref_default  (void);
+void            _usbemu_io_ring_unref        (UsbemuIoRing        *ring);
+UsbemuIoRingOp* _usbemu_io_ring_receive      (UsbemuIoRing        *ring,
+                                              gint                 fd,
+                                              UsbemuIoRingFunc     func,
+                                              gpointer             user_data,
+                                              GDestroyNotify       notify);
+UsbemuIoRingOp* _usbemu_io_ring_send_message (UsbemuIoRing        *ring,
+                                              gint                 fd,
+                                              const struct msghdr *message,
+                                              UsbemuIoRingFunc     func,
+                                              gpointer             user_data,
+                                              GDestroyNotify       notify);
+void            _usbemu_io_ring_cancel       (UsbemuIoRing        *ring,
+                                              UsbemuIoRingOp      *op);
 
 void _usbemu_interface_set_configuration (UsbemuInterface     *interface,
                                           UsbemuConfiguration *configuration,
                                           guint                interface_number,
                                           guint                alternate_setting);
+void _usbemu_interface_intern_strings (UsbemuInterface *interface);
+void _usbemu_interface_set_descriptor_tail (UsbemuInterface *interface,
+                                            GBytes          *tail);
+void _usbemu_interface_set_endpoint_descriptor_tail (UsbemuInterface          *interface,
+                                                     UsbemuEndpoints           endpoint_number,
+                                                     UsbemuEndpointDirections  direction,
+                                                     GBytes                   *tail);
+guint8 _usbemu_interface_get_string_index (UsbemuInterface *interface);
+gboolean _usbemu_interface_validate (UsbemuInterface  *interface,
+                                     UsbemuSpeeds      speed,
+                                     GError          **error);
+UsbemuInterface* _usbemu_interface_copy (UsbemuInterface *interface);
+void _usbemu_interface_append_descriptors (UsbemuInterface *interface,
+                                           GByteArray      *array,
+                                           UsbemuSpeeds     speed);
+guint _usbemu_interface_decode_interval (UsbemuEndpointTransfers transfer,
+                                         guint8                  bInterval,
+                                         UsbemuSpeeds            speed);
 
 G_END_DECLS
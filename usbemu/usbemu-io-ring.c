@@ -0,0 +1,569 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#if defined (HAVE_LIBURING)
+#include <errno.h>
+#include <liburing.h>
+#endif
+
+#include "usbemu/usbemu-internal.h"
+
+#if defined (HAVE_LIBURING)
+
+/* One io_uring per thread, dispatched in its thread-default main context.
+ * Operations queued while dispatching go to the kernel with one
+ * io_uring_submit() right before the context polls, and completions are
+ * reaped without any syscall. Sockets receive with multishot requests into
+ * a provided buffer ring, i.e. buffers from the URB pool the kernel picks
+ * from as data arrives. These are not registered (fixed) buffers, and sends
+ * don't use them. A received buffer is lent to the receive function as a
+ * #GBytes and goes back to the kernel once that is released, from whatever
+ * thread. */
+#define RING_ENTRIES 256
+/* A power of two, as the buffer ring requires. */
+#define N_RECEIVE_BUFFERS 128
+#define RECEIVE_BUFFER_SIZE 16384
+#define RECEIVE_BUFFER_GROUP 0
+/* Completions handled per dispatch, so that other sources get a turn. */
+#define MAX_COMPLETIONS RING_ENTRIES
+
+typedef struct _UsbemuIoRingPool UsbemuIoRingPool;
+
+typedef struct {
+  UsbemuIoRingPool *pool;
+  guint index;
+} UsbemuIoRingLoan;
+
+/* Receive buffers, referenced by the ring and by every buffer lent out, so
+ * that they outlive the ring while in use. */
+struct _UsbemuIoRingPool {
+  gint ref_count;
+  GMainContext *context;
+  guint8 *data[N_RECEIVE_BUFFERS];
+  guint data_class[N_RECEIVE_BUFFERS];
+  UsbemuIoRingLoan loans[N_RECEIVE_BUFFERS];
+  /* Released and not given back to the kernel yet. */
+  GMutex lock;
+  guint released[N_RECEIVE_BUFFERS];
+  guint n_released;
+  /* Set while receive operations wait for buffers. */
+  gint starved;
+};
+
+struct _UsbemuIoRing {
+  guint ref_count;
+  GSource *source;
+  struct io_uring ring;
+  /* Shared by all receive operations of the ring. */
+  struct io_uring_buf_ring *buffers;
+  UsbemuIoRingPool *pool;
+  /* Buffers given to the kernel and not received into yet. */
+  guint n_provided;
+  /* Receive operations turned down for lack of buffers. */
+  GSList *starved;
+  /* Cleared once the kernel turned down a multishot receive. */
+  gboolean multishot;
+  /* Queued and not submitted yet. */
+  guint n_queued;
+};
+
+struct _UsbemuIoRingOp {
+  UsbemuIoRing *ring;
+  gint fd;
+  gboolean receive;
+  gboolean cancelled;
+  UsbemuIoRingFunc func;
+  gpointer user_data;
+  GDestroyNotify notify;
+};
+
+typedef struct {
+  GSource source;
+  UsbemuIoRing *ring;
+} UsbemuIoRingSource;
+
+static GPrivate ring_key;
+/* Set once creating a ring failed, e.g. with a kernel without io_uring. */
+static gint ring_unavailable = FALSE;
+
+/* helper functions */
+static struct io_uring_sqe* _get_sqe (UsbemuIoRing *ring);
+static void _queue_receive (UsbemuIoRing *ring, UsbemuIoRingOp *op);
+static void _provide_buffer (UsbemuIoRing *ring, guint index);
+static void _on_buffer_released (gpointer data);
+static void _pool_unref (UsbemuIoRingPool *pool);
+static void _provide_released (UsbemuIoRing *ring);
+static void _complete (UsbemuIoRing *ring, UsbemuIoRingOp *op, gint result,
+                       guint flags);
+static gboolean _prepare (GSource *source, gint *timeout);
+static gboolean _check (GSource *source);
+static gboolean _dispatch (GSource *source, GSourceFunc callback,
+                           gpointer user_data);
+
+static GSourceFuncs ring_source_funcs = {
+  _prepare,
+  _check,
+  _dispatch,
+  NULL,
+};
+
+/* Submit what is queued only when the submission queue is full, the rest
+ * goes at once before the next poll. */
+static struct io_uring_sqe*
+_get_sqe (UsbemuIoRing *ring)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = io_uring_get_sqe (&ring->ring);
+  if (sqe == NULL) {
+    io_uring_submit (&ring->ring);
+    ring->n_queued = 0;
+    sqe = io_uring_get_sqe (&ring->ring);
+  }
+  ring->n_queued++;
+
+  return sqe;
+}
+
+static void
+_queue_receive (UsbemuIoRing   *ring,
+                UsbemuIoRingOp *op)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = _get_sqe (ring);
+  if (ring->multishot)
+    io_uring_prep_recv_multishot (sqe, op->fd, NULL, 0, 0);
+  else
+    io_uring_prep_recv (sqe, op->fd, NULL, 0, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECEIVE_BUFFER_GROUP;
+  io_uring_sqe_set_data (sqe, op);
+}
+
+static void
+_provide_buffer (UsbemuIoRing *ring,
+                 guint         index)
+{
+  io_uring_buf_ring_add (ring->buffers, ring->pool->data[index],
+                         RECEIVE_BUFFER_SIZE, index,
+                         io_uring_buf_ring_mask (N_RECEIVE_BUFFERS), 0);
+  io_uring_buf_ring_advance (ring->buffers, 1);
+  ring->n_provided++;
+}
+
+static void
+_pool_unref (UsbemuIoRingPool *pool)
+{
+  guint i;
+
+  if (!g_atomic_int_dec_and_test (&pool->ref_count))
+    return;
+
+  for (i = 0; i < N_RECEIVE_BUFFERS; i++)
+    _usbemu_urb_pool_free (pool->data[i], pool->data_class[i]);
+  g_mutex_clear (&pool->lock);
+  g_main_context_unref (pool->context);
+  g_free (pool);
+}
+
+/* Lent buffers may be released from any thread. The ring gives them back to
+ * the kernel before it next polls, and is woken up for that only when
+ * receive operations wait for them. */
+static void
+_on_buffer_released (gpointer data)
+{
+  UsbemuIoRingLoan *loan = data;
+  UsbemuIoRingPool *pool = loan->pool;
+
+  g_mutex_lock (&pool->lock);
+  pool->released[pool->n_released++] = loan->index;
+  g_mutex_unlock (&pool->lock);
+
+  if (g_atomic_int_get (&pool->starved))
+    g_main_context_wakeup (pool->context);
+  _pool_unref (pool);
+}
+
+static void
+_provide_released (UsbemuIoRing *ring)
+{
+  UsbemuIoRingPool *pool = ring->pool;
+  GSList *starved;
+  guint i;
+
+  g_mutex_lock (&pool->lock);
+  for (i = 0; i < pool->n_released; i++)
+    _provide_buffer (ring, pool->released[i]);
+  pool->n_released = 0;
+  g_mutex_unlock (&pool->lock);
+
+  if ((ring->starved == NULL) || (ring->n_provided == 0))
+    return;
+
+  g_atomic_int_set (&pool->starved, FALSE);
+  starved = ring->starved;
+  ring->starved = NULL;
+  for (; starved != NULL; starved = g_slist_delete_link (starved, starved))
+    _queue_receive (ring, starved->data);
+}
+
+static void
+_complete (UsbemuIoRing   *ring,
+           UsbemuIoRingOp *op,
+           gint            result,
+           guint           flags)
+{
+  UsbemuIoRingPool *pool = ring->pool;
+  GBytes *bytes = NULL;
+  gboolean more;
+  guint index;
+
+  more = (flags & IORING_CQE_F_MORE) != 0;
+  if (flags & IORING_CQE_F_BUFFER) {
+    index = flags >> IORING_CQE_BUFFER_SHIFT;
+    ring->n_provided--;
+    if (result > 0) {
+      g_atomic_int_inc (&pool->ref_count);
+      bytes = g_bytes_new_with_free_func (pool->data[index], result,
+                                          _on_buffer_released,
+                                          &pool->loans[index]);
+    } else {
+      _provide_buffer (ring, index);
+    }
+  }
+
+  /* Running out of buffers is no failure of a cancelled receive. */
+  if (op->cancelled && (result == -ENOBUFS))
+    result = -ECANCELED;
+
+  if (op->receive && !more && !op->cancelled) {
+    if ((result == -EINVAL) && ring->multishot) {
+      /* Older kernels, receive once per request instead. */
+      ring->multishot = FALSE;
+      _queue_receive (ring, op);
+      return;
+    }
+
+    /* Out of buffers, retried once some are released. */
+    if (result == -ENOBUFS) {
+      ring->starved = g_slist_prepend (ring->starved, op);
+      g_atomic_int_set (&pool->starved, TRUE);
+      return;
+    }
+
+    /* A single shot request done. */
+    if (result > 0) {
+      _queue_receive (ring, op);
+      more = TRUE;
+    }
+  }
+
+  op->func (op, result, bytes, more, op->user_data);
+  if (bytes != NULL)
+    g_bytes_unref (bytes);
+
+  if (!more) {
+    if (op->notify != NULL)
+      op->notify (op->user_data);
+    _usbemu_io_ring_unref (op->ring);
+    g_free (op);
+  }
+}
+
+static gboolean
+_prepare (GSource *source,
+          gint    *timeout)
+{
+  UsbemuIoRing *ring = ((UsbemuIoRingSource*) source)->ring;
+
+  _provide_released (ring);
+  if (ring->n_queued != 0) {
+    io_uring_submit (&ring->ring);
+    ring->n_queued = 0;
+  }
+
+  *timeout = -1;
+  return io_uring_cq_ready (&ring->ring) != 0;
+}
+
+static gboolean
+_check (GSource *source)
+{
+  UsbemuIoRing *ring = ((UsbemuIoRingSource*) source)->ring;
+
+  return io_uring_cq_ready (&ring->ring) != 0;
+}
+
+static gboolean
+_dispatch (GSource     *source,
+           GSourceFunc  callback,
+           gpointer     user_data)
+{
+  UsbemuIoRing *ring = ((UsbemuIoRingSource*) source)->ring;
+  struct io_uring_cqe *cqe;
+  UsbemuIoRingOp *op;
+  gint result;
+  guint flags, n;
+
+  /* Completion functions may drop the last reference. */
+  ring->ref_count++;
+
+  for (n = 0; (n < MAX_COMPLETIONS) &&
+              (io_uring_peek_cqe (&ring->ring, &cqe) == 0); n++) {
+    op = io_uring_cqe_get_data (cqe);
+    result = cqe->res;
+    flags = cqe->flags;
+    io_uring_cqe_seen (&ring->ring, cqe);
+
+    /* Cancellation requests carry no operation. */
+    if (op != NULL)
+      _complete (ring, op, result, flags);
+  }
+
+  _usbemu_io_ring_unref (ring);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static UsbemuIoRing*
+_ring_new (void)
+{
+  UsbemuIoRingPool *pool;
+  UsbemuIoRing *ring;
+  gint ret;
+  guint i;
+
+  ring = g_new0 (UsbemuIoRing, 1);
+  ring->ref_count = 1;
+  ring->multishot = TRUE;
+
+  ret = io_uring_queue_init (RING_ENTRIES, &ring->ring, 0);
+  if (ret < 0) {
+    g_debug ("io_uring unavailable: %s", g_strerror (-ret));
+    g_free (ring);
+    return NULL;
+  }
+
+  ring->buffers = io_uring_setup_buf_ring (&ring->ring, N_RECEIVE_BUFFERS,
+                                           RECEIVE_BUFFER_GROUP, 0, &ret);
+  if (ring->buffers == NULL) {
+    g_debug ("io_uring buffer rings unavailable: %s", g_strerror (-ret));
+    io_uring_queue_exit (&ring->ring);
+    g_free (ring);
+    return NULL;
+  }
+
+  pool = g_new0 (UsbemuIoRingPool, 1);
+  pool->ref_count = 1;
+  pool->context = g_main_context_ref_thread_default ();
+  g_mutex_init (&pool->lock);
+  ring->pool = pool;
+  for (i = 0; i < N_RECEIVE_BUFFERS; i++) {
+    pool->data[i] = _usbemu_urb_pool_alloc (RECEIVE_BUFFER_SIZE,
+                                            &pool->data_class[i]);
+    pool->loans[i].pool = pool;
+    pool->loans[i].index = i;
+    _provide_buffer (ring, i);
+  }
+
+  ring->source = g_source_new (&ring_source_funcs,
+                               sizeof (UsbemuIoRingSource));
+  ((UsbemuIoRingSource*) ring->source)->ring = ring;
+  g_source_add_unix_fd (ring->source, ring->ring.ring_fd, G_IO_IN);
+  g_source_attach (ring->source, g_main_context_get_thread_default ());
+
+  return ring;
+}
+
+/* Get the io_uring of the calling thread, dispatched in its thread-default
+ * main context, or %NULL if io_uring is not available. */
+UsbemuIoRing*
+_usbemu_io_ring_ref_default (void)
+{
+  UsbemuIoRing *ring;
+
+  ring = g_private_get (&ring_key);
+  if (ring != NULL) {
+    ring->ref_count++;
+    return ring;
+  }
+
+  if (g_atomic_int_get (&ring_unavailable))
+    return NULL;
+
+  ring = _ring_new ();
+  if (ring == NULL) {
+    g_atomic_int_set (&ring_unavailable, TRUE);
+    return NULL;
+  }
+  g_private_set (&ring_key, ring);
+
+  return ring;
+}
+
+void
+_usbemu_io_ring_unref (UsbemuIoRing *ring)
+{
+  if (--ring->ref_count != 0)
+    return;
+
+  if (g_private_get (&ring_key) == ring)
+    g_private_set (&ring_key, NULL);
+  g_source_destroy (ring->source);
+  g_source_unref (ring->source);
+
+  io_uring_free_buf_ring (&ring->ring, ring->buffers, N_RECEIVE_BUFFERS,
+                          RECEIVE_BUFFER_GROUP);
+  io_uring_queue_exit (&ring->ring);
+  _pool_unref (ring->pool);
+  g_free (ring);
+}
+
+static UsbemuIoRingOp*
+_op_new (UsbemuIoRing     *ring,
+         gint              fd,
+         UsbemuIoRingFunc  func,
+         gpointer          user_data,
+         GDestroyNotify    notify)
+{
+  UsbemuIoRingOp *op;
+
+  op = g_new0 (UsbemuIoRingOp, 1);
+  ring->ref_count++;
+  op->ring = ring;
+  op->fd = fd;
+  op->func = func;
+  op->user_data = user_data;
+  op->notify = notify;
+
+  return op;
+}
+
+/* Receive from socket @fd until cancelled, or until the peer closes it or
+ * an error occurs. @func is called with each chunk received, and a last
+ * time with @more cleared. Each chunk is a buffer of the ring, which takes
+ * no more data until the chunk is released. */
+UsbemuIoRingOp*
+_usbemu_io_ring_receive (UsbemuIoRing     *ring,
+                         gint              fd,
+                         UsbemuIoRingFunc  func,
+                         gpointer          user_data,
+                         GDestroyNotify    notify)
+{
+  UsbemuIoRingOp *op;
+
+  op = _op_new (ring, fd, func, user_data, notify);
+  op->receive = TRUE;
+  _queue_receive (ring, op);
+
+  return op;
+}
+
+/* Send @message on socket @fd. The data it points to must stay valid until
+ * @func is called, once, with the number of bytes sent. */
+UsbemuIoRingOp*
+_usbemu_io_ring_send_message (UsbemuIoRing        *ring,
+                              gint                 fd,
+                              const struct msghdr *message,
+                              UsbemuIoRingFunc     func,
+                              gpointer             user_data,
+                              GDestroyNotify       notify)
+{
+  struct io_uring_sqe *sqe;
+  UsbemuIoRingOp *op;
+
+  op = _op_new (ring, fd, func, user_data, notify);
+  sqe = _get_sqe (ring);
+  io_uring_prep_sendmsg (sqe, fd, message, MSG_NOSIGNAL);
+  io_uring_sqe_set_data (sqe, op);
+
+  return op;
+}
+
+/* Request @op to stop. Its function is still called until it completes,
+ * with -ECANCELED if it had not otherwise. */
+void
+_usbemu_io_ring_cancel (UsbemuIoRing   *ring,
+                        UsbemuIoRingOp *op)
+{
+  struct io_uring_sqe *sqe;
+
+  if (op->cancelled)
+    return;
+
+  op->cancelled = TRUE;
+  /* Queue a receive waiting for buffers again, only for it to be
+   * cancelled, so that it completes like any other. */
+  if (g_slist_find (ring->starved, op) != NULL) {
+    ring->starved = g_slist_remove (ring->starved, op);
+    _queue_receive (ring, op);
+  }
+  sqe = _get_sqe (ring);
+  io_uring_prep_cancel (sqe, op, 0);
+  io_uring_sqe_set_data (sqe, NULL);
+}
+
+#else /* !HAVE_LIBURING */
+
+UsbemuIoRing*
+_usbemu_io_ring_ref_default (void)
+{
+  return NULL;
+}
+
+void
+_usbemu_io_ring_unref (UsbemuIoRing *ring)
+{
+  g_assert_not_reached ();
+}
+
+UsbemuIoRingOp*
+_usbemu_io_ring_receive (UsbemuIoRing     *ring,
+                         gint              fd,
+                         UsbemuIoRingFunc  func,
+                         gpointer          user_data,
+                         GDestroyNotify    notify)
+{
+  g_assert_not_reached ();
+  return NULL;
+}
+
+UsbemuIoRingOp*
+_usbemu_io_ring_send_message (UsbemuIoRing        *ring,
+                              gint                 fd,
+                              const struct msghdr *message,
+                              UsbemuIoRingFunc     func,
+                              gpointer             user_data,
+                              GDestroyNotify       notify)
+{
+  g_assert_not_reached ();
+  return NULL;
+}
+
+void
+_usbemu_io_ring_cancel (UsbemuIoRing   *ring,
+                        UsbemuIoRingOp *op)
+{
+  g_assert_not_reached ();
+}
+
+#endif /* HAVE_LIBURING */
@@ -0,0 +1,648 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#if defined (HAVE_SYS_TIMERFD_H)
+#include <sys/timerfd.h>
+#endif
+
+#include "usbemu/usbemu-iso-stream.h"
+#include "usbemu/usbemu-errors.h"
+#include "usbemu/usbemu-internal.h"
+
+/**
+ * SECTION:usbemu-iso-stream
+ * @title: UsbemuIsoStream
+ * @short_description: Paced isochronous transfers
+ * @include: usbemu/usbemu.h
+ *
+ * A #UsbemuIsoStream set on an isochronous endpoint with
+ * usbemu_device_set_iso_stream() serves the URBs submitted to it at the
+ * pace of the bus: each isochronous packet stands for one service interval
+ * of the endpoint, as given by the interval of its #UsbemuEndpointEntry,
+ * and a URB completes once the interval of its last packet has elapsed.
+ * URBs queued back to back are scheduled back to back, so a host keeping
+ * a few URBs in flight sees a steady stream.
+ *
+ * All packets of a URB are filled in one batch when it completes, by
+ * calling the #UsbemuIsoStreamFunc of the stream once per packet. For IN
+ * endpoints, packets are sized from the byte rate of the stream, carrying
+ * the fractional remainder over from packet to packet, e.g. 176 or 177
+ * bytes per millisecond for 44.1 kHz 16-bit stereo audio, and never more
+ * than wMaxPacketSize times the transactions per (micro)frame. A byte rate
+ * of 0 fills every packet up to that limit.
+ *
+ * Streams served by one thread share one timer, a timerfd where available,
+ * armed for the earliest deadline among them and dispatched in the
+ * thread-default #GMainContext, so no thread or #GSource is needed per
+ * stream. Underruns, overruns and frames the host let pass without a URB
+ * are accounted in #UsbemuIsoStreamStats.
+ */
+
+/* 11-bit USB frame number at a monotonic time in µs. */
+#define FRAME_NUMBER(time) (((time) / 1000) & 0x7FF)
+
+#define NOT_IN_HEAP G_MAXUINT
+
+typedef struct _UsbemuIsoScheduler UsbemuIsoScheduler;
+
+/* Per thread timer of all streams served by that thread. */
+struct _UsbemuIsoScheduler {
+  guint ref_count;
+  GSource *source;
+#if defined (HAVE_SYS_TIMERFD_H)
+  gint timer_fd;
+#endif
+  /* Streams with URBs queued, a binary min-heap by deadline of their
+   * first URB. */
+  GPtrArray *heap;
+  /* Deadline the timer is armed for, or -1. */
+  gint64 armed;
+  /* Re-armed once at the end of dispatching instead. */
+  gboolean dispatching;
+};
+
+typedef struct {
+  GSource source;
+  UsbemuIsoScheduler *scheduler;
+} UsbemuIsoSource;
+
+struct _UsbemuIsoStream {
+  gint ref_count;
+  guint bytes_per_second;
+  UsbemuIsoStreamFunc func;
+  gpointer user_data;
+  GDestroyNotify destroy;
+
+  /* The device and endpoint this stream is set on. */
+  UsbemuDevice *device;
+  UsbemuIsoScheduler *scheduler;
+  guint heap_index;
+
+  /* Of the endpoint, refreshed on each submission. */
+  guint interval;
+  gsize max_payload;
+
+  /* Queued URBs, linked through UsbemuUrb.link, in submission order. Each
+   * completes at its UsbemuUrb.deadline. */
+  UsbemuUrb *head;
+  UsbemuUrb *tail;
+  /* Start of the first packet of the next URB queued, 0 until then. */
+  gint64 next_frame;
+  /* Bytes due but not sent yet, in millionths of a byte. */
+  guint64 credit;
+
+  UsbemuIsoStreamStats stats;
+};
+
+G_DEFINE_BOXED_TYPE (UsbemuIsoStream, usbemu_iso_stream,
+                     usbemu_iso_stream_ref, usbemu_iso_stream_unref)
+
+static GPrivate scheduler_key;
+
+/* helper functions */
+static UsbemuIsoScheduler* _scheduler_ref (GError **error);
+static void _scheduler_unref (UsbemuIsoScheduler *scheduler);
+static void _scheduler_arm (UsbemuIsoScheduler *scheduler);
+static void _scheduler_update (UsbemuIsoScheduler *scheduler,
+                               UsbemuIsoStream *stream);
+static gboolean _scheduler_dispatch (GSource *source, GSourceFunc callback,
+                                     gpointer user_data);
+static void _heap_swap (GPtrArray *heap, guint i, guint j);
+static void _heap_up (GPtrArray *heap, guint index);
+static void _heap_down (GPtrArray *heap, guint index);
+static gsize _packet_size (UsbemuIsoStream *stream);
+static void _fill (UsbemuIsoStream *stream, UsbemuUrb *urb);
+
+static GSourceFuncs scheduler_source_funcs = {
+  NULL,
+  NULL,
+  _scheduler_dispatch,
+  NULL,
+};
+
+#define HEAP_DEADLINE(heap, index) \
+  (((UsbemuIsoStream*) g_ptr_array_index ((heap), (index)))->head->deadline)
+
+static UsbemuIsoScheduler*
+_scheduler_ref (GError **error)
+{
+  UsbemuIsoScheduler *scheduler;
+#if defined (HAVE_SYS_TIMERFD_H)
+  gint timer_fd;
+#endif
+
+  scheduler = g_private_get (&scheduler_key);
+  if (scheduler != NULL) {
+    scheduler->ref_count++;
+    return scheduler;
+  }
+
+#if defined (HAVE_SYS_TIMERFD_H)
+  timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (timer_fd < 0) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_FAILED,
+                 "Cannot create timerfd: %s", g_strerror (errno));
+    return NULL;
+  }
+#endif
+
+  scheduler = g_new0 (UsbemuIsoScheduler, 1);
+  scheduler->ref_count = 1;
+  scheduler->heap = g_ptr_array_new ();
+  scheduler->armed = -1;
+  scheduler->source = g_source_new (&scheduler_source_funcs,
+                                    sizeof (UsbemuIsoSource));
+  ((UsbemuIsoSource*) scheduler->source)->scheduler = scheduler;
+  g_source_set_priority (scheduler->source, G_PRIORITY_HIGH);
+#if defined (HAVE_SYS_TIMERFD_H)
+  scheduler->timer_fd = timer_fd;
+  g_source_add_unix_fd (scheduler->source, scheduler->timer_fd, G_IO_IN);
+#endif
+  g_source_attach (scheduler->source, g_main_context_get_thread_default ());
+  g_private_set (&scheduler_key, scheduler);
+
+  return scheduler;
+}
+
+static void
+_scheduler_unref (UsbemuIsoScheduler *scheduler)
+{
+  if (--scheduler->ref_count != 0)
+    return;
+
+  if (g_private_get (&scheduler_key) == scheduler)
+    g_private_set (&scheduler_key, NULL);
+  g_source_destroy (scheduler->source);
+  g_source_unref (scheduler->source);
+#if defined (HAVE_SYS_TIMERFD_H)
+  close (scheduler->timer_fd);
+#endif
+  g_ptr_array_unref (scheduler->heap);
+  g_free (scheduler);
+}
+
+/* Arm the timer for the earliest deadline, if it changed. */
+static void
+_scheduler_arm (UsbemuIsoScheduler *scheduler)
+{
+  gint64 deadline;
+
+  if (scheduler->dispatching)
+    return;
+
+  deadline = (scheduler->heap->len == 0) ? -1 :
+                                           HEAP_DEADLINE (scheduler->heap, 0);
+  if (deadline == scheduler->armed)
+    return;
+
+  scheduler->armed = deadline;
+#if defined (HAVE_SYS_TIMERFD_H)
+  {
+    struct itimerspec spec;
+
+    memset (&spec, 0, sizeof (spec));
+    if (deadline >= 0) {
+      /* A zero it_value would disarm the timer. */
+      deadline = MAX (deadline, 1);
+      spec.it_value.tv_sec = deadline / G_USEC_PER_SEC;
+      spec.it_value.tv_nsec = (deadline % G_USEC_PER_SEC) * 1000;
+    }
+    /* g_get_monotonic_time() reads CLOCK_MONOTONIC too. */
+    timerfd_settime (scheduler->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+  }
+#else
+  g_source_set_ready_time (scheduler->source, deadline);
+#endif
+}
+
+/* Restore the heap property after the first URB of @stream changed. */
+static void
+_scheduler_update (UsbemuIsoScheduler *scheduler,
+                   UsbemuIsoStream    *stream)
+{
+  GPtrArray *heap = scheduler->heap;
+  guint index, last;
+
+  index = stream->heap_index;
+  if (stream->head == NULL) {
+    if (index == NOT_IN_HEAP)
+      return;
+
+    stream->heap_index = NOT_IN_HEAP;
+    last = heap->len - 1;
+    if (index != last) {
+      g_ptr_array_index (heap, index) = g_ptr_array_index (heap, last);
+      ((UsbemuIsoStream*) g_ptr_array_index (heap, index))->heap_index = index;
+    }
+    g_ptr_array_set_size (heap, last);
+    if (index != last) {
+      _heap_up (heap, index);
+      _heap_down (heap, index);
+    }
+  } else if (index == NOT_IN_HEAP) {
+    stream->heap_index = heap->len;
+    g_ptr_array_add (heap, stream);
+    _heap_up (heap, stream->heap_index);
+  } else {
+    _heap_up (heap, index);
+    _heap_down (heap, stream->heap_index);
+  }
+
+  _scheduler_arm (scheduler);
+}
+
+static gboolean
+_scheduler_dispatch (GSource     *source,
+                     GSourceFunc  callback,
+                     gpointer     user_data)
+{
+  UsbemuIsoScheduler *scheduler = ((UsbemuIsoSource*) source)->scheduler;
+  UsbemuIsoStream *stream;
+  UsbemuDevice *device;
+  UsbemuUrb *urb;
+  gint64 now;
+
+#if defined (HAVE_SYS_TIMERFD_H)
+  guint64 expirations;
+
+  /* The timer is one-shot, and disarmed now. */
+  if (read (scheduler->timer_fd, &expirations, sizeof (expirations)) < 0) {
+    /* Spurious wakeup, nothing expired. */
+  }
+#else
+  g_source_set_ready_time (source, -1);
+#endif
+
+  /* Completions may unset the last stream. */
+  scheduler->ref_count++;
+  scheduler->armed = -1;
+  scheduler->dispatching = TRUE;
+
+  now = g_get_monotonic_time ();
+  while ((scheduler->heap->len != 0) &&
+         (HEAP_DEADLINE (scheduler->heap, 0) <= now)) {
+    stream = usbemu_iso_stream_ref (g_ptr_array_index (scheduler->heap, 0));
+    device = stream->device;
+
+    /* Dequeue first, completion may queue or cancel other URBs. */
+    urb = stream->head;
+    stream->head = urb->link;
+    if (stream->head == NULL)
+      stream->tail = NULL;
+    urb->link = NULL;
+    _scheduler_update (scheduler, stream);
+
+    _fill (stream, urb);
+    usbemu_device_complete_urb (device, urb, USBEMU_URB_STATUS_COMPLETED);
+    usbemu_iso_stream_unref (stream);
+  }
+
+  scheduler->dispatching = FALSE;
+  _scheduler_arm (scheduler);
+  _scheduler_unref (scheduler);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+_heap_swap (GPtrArray *heap,
+            guint      i,
+            guint      j)
+{
+  UsbemuIsoStream *stream;
+
+  stream = g_ptr_array_index (heap, i);
+  g_ptr_array_index (heap, i) = g_ptr_array_index (heap, j);
+  g_ptr_array_index (heap, j) = stream;
+  ((UsbemuIsoStream*) g_ptr_array_index (heap, i))->heap_index = i;
+  stream->heap_index = j;
+}
+
+static void
+_heap_up (GPtrArray *heap,
+          guint      index)
+{
+  guint parent;
+
+  while (index != 0) {
+    parent = (index - 1) / 2;
+    if (HEAP_DEADLINE (heap, parent) <= HEAP_DEADLINE (heap, index))
+      break;
+    _heap_swap (heap, parent, index);
+    index = parent;
+  }
+}
+
+static void
+_heap_down (GPtrArray *heap,
+            guint      index)
+{
+  guint child;
+
+  for (;;) {
+    child = 2 * index + 1;
+    if (child >= heap->len)
+      break;
+    if ((child + 1 < heap->len) &&
+        (HEAP_DEADLINE (heap, child + 1) < HEAP_DEADLINE (heap, child)))
+      child++;
+    if (HEAP_DEADLINE (heap, index) <= HEAP_DEADLINE (heap, child))
+      break;
+    _heap_swap (heap, index, child);
+    index = child;
+  }
+}
+
+/* Bytes scheduled for the next IN packet. */
+static gsize
+_packet_size (UsbemuIsoStream *stream)
+{
+  gsize size;
+
+  if (stream->bytes_per_second == 0)
+    return stream->max_payload;
+
+  stream->credit += (guint64) stream->bytes_per_second * stream->interval;
+  size = stream->credit / G_USEC_PER_SEC;
+  stream->credit -= (guint64) size * G_USEC_PER_SEC;
+
+  /* More than the endpoint carries is dropped. */
+  return MIN (size, stream->max_payload);
+}
+
+static void
+_fill (UsbemuIsoStream *stream,
+       UsbemuUrb       *urb)
+{
+  UsbemuIsoPacket *packet;
+  guint8 *data;
+  gboolean in;
+  gsize size, n;
+  guint i;
+
+  in = (urb->endpoint_address & USBEMU_ENDPOINT_DIRECTION_IN) != 0;
+  /* OUT data is only read. */
+  data = in ? urb->buffer : (guint8*) usbemu_urb_peek_data (urb);
+
+  urb->actual_length = 0;
+  for (i = 0, packet = urb->iso_packets; i < urb->n_iso_packets;
+       i++, packet++) {
+    if (in) {
+      size = MIN (_packet_size (stream), packet->length);
+      n = (size == 0) ? 0 :
+          stream->func (stream, data + packet->offset, size, stream->user_data);
+      n = MIN (n, size);
+      if (n < size)
+        stream->stats.n_underruns++;
+    } else {
+      size = packet->length;
+      n = stream->func (stream, data + packet->offset, size, stream->user_data);
+      if (n < size)
+        stream->stats.n_overruns++;
+      n = size;
+    }
+
+    packet->actual_length = n;
+    packet->status = USBEMU_URB_STATUS_COMPLETED;
+    urb->actual_length += n;
+  }
+
+  stream->stats.n_urbs++;
+  stream->stats.n_packets += urb->n_iso_packets;
+  stream->stats.n_bytes += urb->actual_length;
+}
+
+/**
+ * usbemu_iso_stream_new:
+ * @bytes_per_second: data rate of IN packets, or 0 to fill them entirely.
+ *     Ignored for OUT endpoints.
+ * @func: (scope notified): function producing or consuming packet data.
+ * @user_data: user data for @func.
+ * @destroy: (nullable): destroy notifier for @user_data.
+ *
+ * Create a new #UsbemuIsoStream. Set it on an isochronous endpoint with
+ * usbemu_device_set_iso_stream().
+ *
+ * Returns: (transfer full): a new #UsbemuIsoStream. Free with
+ *          usbemu_iso_stream_unref().
+ */
+UsbemuIsoStream*
+usbemu_iso_stream_new (guint               bytes_per_second,
+                       UsbemuIsoStreamFunc func,
+                       gpointer            user_data,
+                       GDestroyNotify      destroy)
+{
+  UsbemuIsoStream *stream;
+
+  g_return_val_if_fail (func != NULL, NULL);
+
+  stream = g_new0 (UsbemuIsoStream, 1);
+  stream->ref_count = 1;
+  stream->bytes_per_second = bytes_per_second;
+  stream->func = func;
+  stream->user_data = user_data;
+  stream->destroy = destroy;
+  stream->heap_index = NOT_IN_HEAP;
+
+  return stream;
+}
+
+/**
+ * usbemu_iso_stream_ref:
+ * @stream: (in): a #UsbemuIsoStream.
+ *
+ * Increase reference count of @stream.
+ *
+ * Returns: (transfer full): @stream.
+ */
+UsbemuIsoStream*
+usbemu_iso_stream_ref (UsbemuIsoStream *stream)
+{
+  g_return_val_if_fail (stream != NULL, NULL);
+
+  g_atomic_int_inc (&stream->ref_count);
+
+  return stream;
+}
+
+/**
+ * usbemu_iso_stream_unref:
+ * @stream: (in) (transfer full): a #UsbemuIsoStream.
+ *
+ * Decrease reference count of @stream, and free it when it drops to zero.
+ */
+void
+usbemu_iso_stream_unref (UsbemuIsoStream *stream)
+{
+  g_return_if_fail (stream != NULL);
+
+  if (!g_atomic_int_dec_and_test (&stream->ref_count))
+    return;
+
+  g_assert (stream->device == NULL);
+
+  if (stream->destroy != NULL)
+    stream->destroy (stream->user_data);
+  g_free (stream);
+}
+
+/**
+ * usbemu_iso_stream_get_stats:
+ * @stream: (in): a #UsbemuIsoStream.
+ * @stats: (out caller-allocates): return location for the counters.
+ *
+ * Get the counters of @stream since it was created.
+ */
+void
+usbemu_iso_stream_get_stats (UsbemuIsoStream      *stream,
+                             UsbemuIsoStreamStats *stats)
+{
+  g_return_if_fail (stream != NULL);
+  g_return_if_fail (stats != NULL);
+
+  *stats = stream->stats;
+}
+
+void
+_usbemu_iso_stream_bind (UsbemuIsoStream *stream,
+                         UsbemuDevice    *device)
+{
+  g_assert (stream->device == NULL);
+
+  stream->device = device;
+  /* Taken by the thread serving the device on the first push. */
+  stream->scheduler = NULL;
+  stream->next_frame = 0;
+  stream->credit = 0;
+}
+
+void
+_usbemu_iso_stream_unbind (UsbemuIsoStream *stream)
+{
+  UsbemuUrb *urb;
+
+  while ((urb = stream->head) != NULL) {
+    stream->head = urb->link;
+    urb->link = NULL;
+    usbemu_device_complete_urb (stream->device, urb,
+                                USBEMU_URB_STATUS_SHUTDOWN);
+  }
+  stream->tail = NULL;
+  if (stream->scheduler != NULL)
+    _scheduler_update (stream->scheduler, stream);
+
+  g_clear_pointer (&stream->scheduler, _scheduler_unref);
+  stream->device = NULL;
+}
+
+void
+_usbemu_iso_stream_push (UsbemuIsoStream *stream,
+                         UsbemuUrb       *urb)
+{
+  UsbemuEndpointEntry entry;
+  GError *error = NULL;
+  gint64 now;
+
+  if ((urb->n_iso_packets == 0) ||
+      (usbemu_device_lookup_endpoint (stream->device, urb->endpoint_address,
+                                      &entry) == NULL) ||
+      (entry.transfer != USBEMU_ENDPOINT_TRANSFER_ISOCHRONOUS)) {
+    usbemu_device_complete_urb (stream->device, urb, USBEMU_URB_STATUS_ERROR);
+    return;
+  }
+
+  /* Without a timer nothing would ever complete, fail the URB instead and
+   * try again on the next one. */
+  if (stream->scheduler == NULL) {
+    stream->scheduler = _scheduler_ref (&error);
+    if (stream->scheduler == NULL) {
+      g_debug ("Cannot schedule isochronous URB: %s", error->message);
+      g_error_free (error);
+      usbemu_device_complete_urb (stream->device, urb,
+                                  USBEMU_URB_STATUS_ERROR);
+      return;
+    }
+  }
+
+  stream->interval = MAX (entry.interval, 1);
+  stream->max_payload = entry.max_packet_size *
+                        (1 + entry.additional_transactions);
+
+  now = g_get_monotonic_time ();
+  if ((stream->head == NULL) && (stream->next_frame < now)) {
+    /* Nothing covered the frames since, start over from now. */
+    if (stream->next_frame != 0)
+      stream->stats.n_missed_frames += (now - stream->next_frame) /
+                                       stream->interval;
+    stream->next_frame = now;
+  }
+
+  urb->start_frame = FRAME_NUMBER (stream->next_frame);
+  urb->deadline = stream->next_frame +
+                  (gint64) urb->n_iso_packets * stream->interval;
+  stream->next_frame = urb->deadline;
+
+  urb->link = NULL;
+  if (stream->tail != NULL) {
+    stream->tail->link = urb;
+    stream->tail = urb;
+    return;
+  }
+
+  stream->head = stream->tail = urb;
+  _scheduler_update (stream->scheduler, stream);
+}
+
+void
+_usbemu_iso_stream_cancel (UsbemuIsoStream *stream,
+                           UsbemuUrb       *urb)
+{
+  UsbemuUrb **link, *prev;
+
+  prev = NULL;
+  for (link = &stream->head; *link != urb; link = &(*link)->link) {
+    if (*link == NULL)
+      return;
+    prev = *link;
+  }
+
+  *link = urb->link;
+  urb->link = NULL;
+  if (stream->tail == urb) {
+    stream->tail = prev;
+    /* Give the frames of the last URB scheduled back to the next one, but
+     * not those that elapsed already. */
+    if (prev != NULL) {
+      stream->next_frame = prev->deadline;
+    } else {
+      stream->next_frame = MAX (urb->deadline - (gint64) urb->n_iso_packets *
+                                                stream->interval,
+                                g_get_monotonic_time ());
+    }
+  }
+  if (prev == NULL)
+    _scheduler_update (stream->scheduler, stream);
+
+  usbemu_device_complete_urb (stream->device, urb, USBEMU_URB_STATUS_CANCELLED);
+}
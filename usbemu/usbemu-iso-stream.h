@@ -0,0 +1,99 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#if !defined (__USBEMU_USBEMU_H_INSIDE__) && !defined (LIBUSBEMU_COMPILATION)
+#error "Only <usbemu/usbemu.h> can be included directly."
+#endif
+
+#include <glib-object.h>
+
+#include <usbemu/usbemu-urb.h>
+
+G_BEGIN_DECLS
+
+/**
+ * USBEMU_TYPE_ISO_STREAM:
+ *
+ * Convenient macro for usbemu_iso_stream_get_type().
+ */
+#define USBEMU_TYPE_ISO_STREAM  (usbemu_iso_stream_get_type ())
+
+/**
+ * UsbemuIsoStream:
+ *
+ * An opaque structure pacing the transfers of one isochronous endpoint.
+ */
+typedef struct _UsbemuIsoStream UsbemuIsoStream;
+
+/**
+ * UsbemuIsoStreamFunc:
+ * @stream: the #UsbemuIsoStream.
+ * @data: (array length=length): packet data. For IN endpoints, the buffer
+ *     to fill. For OUT endpoints, the data received, which must not be
+ *     modified.
+ * @length: for IN endpoints, the number of bytes scheduled for the packet.
+ *     For OUT endpoints, the number of bytes received.
+ * @user_data: user data passed to usbemu_iso_stream_new().
+ *
+ * Produce or consume the data of one isochronous packet, at the time its
+ * (micro)frame ends.
+ *
+ * Returns: for IN endpoints, the number of bytes written to @data, less than
+ *          @length on underrun. For OUT endpoints, the number of bytes
+ *          accepted, less than @length on overrun.
+ */
+typedef gsize (*UsbemuIsoStreamFunc) (UsbemuIsoStream *stream,
+                                      guint8          *data,
+                                      gsize            length,
+                                      gpointer         user_data);
+
+/**
+ * UsbemuIsoStreamStats:
+ * @n_urbs: number of URBs completed.
+ * @n_packets: number of packets completed.
+ * @n_bytes: number of bytes transferred.
+ * @n_underruns: IN packets the stream function could not fill.
+ * @n_overruns: OUT packets the stream function could not accept entirely.
+ * @n_missed_frames: service intervals that elapsed without a URB queued,
+ *     i.e. the host fell behind.
+ *
+ * Counters of a #UsbemuIsoStream.
+ */
+typedef struct {
+  guint64 n_urbs;
+  guint64 n_packets;
+  guint64 n_bytes;
+  guint64 n_underruns;
+  guint64 n_overruns;
+  guint64 n_missed_frames;
+} UsbemuIsoStreamStats;
+
+GType            usbemu_iso_stream_get_type (void) G_GNUC_CONST;
+
+UsbemuIsoStream* usbemu_iso_stream_new   (guint                bytes_per_second,
+                                          UsbemuIsoStreamFunc  func,
+                                          gpointer             user_data,
+                                          GDestroyNotify       destroy);
+UsbemuIsoStream* usbemu_iso_stream_ref   (UsbemuIsoStream     *stream);
+void             usbemu_iso_stream_unref (UsbemuIsoStream     *stream);
+
+void usbemu_iso_stream_get_stats (UsbemuIsoStream      *stream,
+                                  UsbemuIsoStreamStats *stats);
+
+G_END_DECLS
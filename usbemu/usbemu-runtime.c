@@ -0,0 +1,411 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include "usbemu/usbemu-runtime.h"
+#include "usbemu/usbemu-internal.h"
+
+/**
+ * SECTION:usbemu-runtime
+ * @title: UsbemuRuntime
+ * @short_description: Worker threads serving devices
+ * @include: usbemu/usbemu.h
+ *
+ * #UsbemuRuntime runs a pool of worker threads, by default one per core,
+ * each iterating its own #GMainContext, and shards devices among them with
+ * usbemu_runtime_assign_device(). Everything about a device then happens in
+ * its worker: transports move the I/O of connections importing it there,
+ * e.g. #UsbemuUsbipServer, and its URBs are submitted, completed and timed
+ * there, so that a busy device only delays those sharing its worker, and
+ * throughput scales with the number of workers.
+ *
+ * Devices are not thread-safe. Other threads call into an assigned device
+ * with usbemu_device_invoke(), which runs the call in its worker.
+ */
+
+/**
+ * UsbemuRuntime:
+ *
+ * Worker pool object.
+ */
+
+/**
+ * UsbemuRuntimeClass:
+ * @parent_class: The parent class.
+ *
+ * Class structure for UsbemuRuntime.
+ */
+
+#define MAX_WORKERS 1024
+
+typedef struct {
+  GThread *thread;
+  GMainContext *context;
+  GMainLoop *loop;
+} UsbemuRuntimeWorker;
+
+struct _UsbemuRuntime {
+  GObject parent_instance;
+
+  guint n_workers;
+  UsbemuRuntimeWorker *workers;
+  /* Worker the next device is assigned to, modulo n_workers. */
+  gint next_worker;
+};
+
+G_DEFINE_TYPE (UsbemuRuntime, usbemu_runtime, G_TYPE_OBJECT)
+
+enum
+{
+  PROP_0,
+  PROP_N_WORKERS,
+  N_PROPERTIES
+};
+
+static GParamSpec *props[N_PROPERTIES] = { NULL, };
+
+#define USBEMU_RUNTIME_PROP_N_WORKERS__DEFAULT 0
+
+/* Waits for a call run by _usbemu_context_invoke_sync(). */
+typedef struct {
+  GMutex mutex;
+  GCond cond;
+  gboolean done;
+  GSourceFunc func;
+  gpointer user_data;
+} UsbemuSyncCall;
+
+/* virtual methods for GObjectClass */
+static void gobject_class_set_property (GObject *object, guint prop_id,
+                                        const GValue *value, GParamSpec *pspec);
+static void gobject_class_get_property (GObject *object, guint prop_id,
+                                        GValue *value, GParamSpec *pspec);
+static void gobject_class_constructed (GObject *object);
+static void gobject_class_dispose (GObject *object);
+static void gobject_class_finalize (GObject *object);
+static void usbemu_runtime_class_init (UsbemuRuntimeClass *runtime_class);
+/* helper functions */
+static gpointer _worker_main (gpointer user_data);
+static gboolean _worker_quit (gpointer user_data);
+static gboolean _sync_call_dispatch (gpointer user_data);
+
+static void
+gobject_class_set_property (GObject      *object,
+                            guint         prop_id,
+                            const GValue *value,
+                            GParamSpec   *pspec)
+{
+  UsbemuRuntime *runtime = USBEMU_RUNTIME (object);
+
+  switch (prop_id) {
+    case PROP_N_WORKERS:
+      runtime->n_workers = g_value_get_uint (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gobject_class_get_property (GObject    *object,
+                            guint       prop_id,
+                            GValue     *value,
+                            GParamSpec *pspec)
+{
+  UsbemuRuntime *runtime = USBEMU_RUNTIME (object);
+
+  switch (prop_id) {
+    case PROP_N_WORKERS:
+      g_value_set_uint (value, runtime->n_workers);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gobject_class_constructed (GObject *object)
+{
+  UsbemuRuntime *runtime = USBEMU_RUNTIME (object);
+  UsbemuRuntimeWorker *worker;
+  gchar *name;
+  guint i;
+
+  G_OBJECT_CLASS (usbemu_runtime_parent_class)->constructed (object);
+
+  if (runtime->n_workers == 0)
+    runtime->n_workers = MIN (g_get_num_processors (), MAX_WORKERS);
+
+  runtime->workers = g_new0 (UsbemuRuntimeWorker, runtime->n_workers);
+  for (i = 0; i < runtime->n_workers; i++) {
+    worker = &runtime->workers[i];
+    worker->context = g_main_context_new ();
+    worker->loop = g_main_loop_new (worker->context, FALSE);
+
+    name = g_strdup_printf ("usbemu-worker-%u", i);
+    worker->thread = g_thread_new (name, _worker_main, worker);
+    g_free (name);
+  }
+}
+
+static void
+gobject_class_dispose (GObject *object)
+{
+  UsbemuRuntime *runtime = USBEMU_RUNTIME (object);
+  UsbemuRuntimeWorker *worker;
+  GSource *source;
+  guint i;
+
+  for (i = 0; i < runtime->n_workers; i++) {
+    worker = &runtime->workers[i];
+    if (worker->thread == NULL)
+      continue;
+
+    /* Not g_main_context_invoke(), which would quit the loop from here
+     * if the worker has not started running it yet. */
+    source = g_idle_source_new ();
+    g_source_set_priority (source, G_PRIORITY_HIGH);
+    g_source_set_callback (source, _worker_quit, worker->loop, NULL);
+    g_source_attach (source, worker->context);
+    g_source_unref (source);
+
+    g_thread_join (worker->thread);
+    worker->thread = NULL;
+  }
+
+  G_OBJECT_CLASS (usbemu_runtime_parent_class)->dispose (object);
+}
+
+static void
+gobject_class_finalize (GObject *object)
+{
+  UsbemuRuntime *runtime = USBEMU_RUNTIME (object);
+  guint i;
+
+  for (i = 0; i < runtime->n_workers; i++) {
+    g_main_loop_unref (runtime->workers[i].loop);
+    g_main_context_unref (runtime->workers[i].context);
+  }
+  g_free (runtime->workers);
+
+  G_OBJECT_CLASS (usbemu_runtime_parent_class)->finalize (object);
+}
+
+static void
+usbemu_runtime_class_init (UsbemuRuntimeClass *runtime_class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (runtime_class);
+
+  /* virtual methods */
+
+  object_class->set_property = gobject_class_set_property;
+  object_class->get_property = gobject_class_get_property;
+  object_class->constructed = gobject_class_constructed;
+  object_class->dispose = gobject_class_dispose;
+  object_class->finalize = gobject_class_finalize;
+
+  /* properties */
+
+  /**
+   * UsbemuRuntime:n-workers:
+   *
+   * Number of worker threads. 0 at construction stands for the number of
+   * processors.
+   */
+  props[PROP_N_WORKERS] =
+        g_param_spec_uint (USBEMU_RUNTIME_PROP_N_WORKERS,
+                           "Number of Workers", "Number of Workers",
+                           0, MAX_WORKERS,
+                           USBEMU_RUNTIME_PROP_N_WORKERS__DEFAULT,
+                           G_PARAM_READWRITE | \
+                             G_PARAM_CONSTRUCT_ONLY);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+}
+
+static void
+usbemu_runtime_init (UsbemuRuntime *runtime)
+{
+  runtime->n_workers = USBEMU_RUNTIME_PROP_N_WORKERS__DEFAULT;
+  runtime->workers = NULL;
+  runtime->next_worker = 0;
+}
+
+/* Per thread schedulers of the library bind to the thread-default
+ * context, so make it that of the worker for everything it runs. */
+static gpointer
+_worker_main (gpointer user_data)
+{
+  UsbemuRuntimeWorker *worker = user_data;
+
+  g_main_context_push_thread_default (worker->context);
+  g_main_loop_run (worker->loop);
+  g_main_context_pop_thread_default (worker->context);
+
+  return NULL;
+}
+
+static gboolean
+_worker_quit (gpointer user_data)
+{
+  g_main_loop_quit (user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+_sync_call_dispatch (gpointer user_data)
+{
+  UsbemuSyncCall *call = user_data;
+
+  call->func (call->user_data);
+
+  g_mutex_lock (&call->mutex);
+  call->done = TRUE;
+  g_cond_signal (&call->cond);
+  g_mutex_unlock (&call->mutex);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Call @func once in @context and wait for it to return. It runs right
+ * away if @context can be acquired, i.e. is owned by this thread or by
+ * none. The thread owning @context must never wait on the caller. */
+void
+_usbemu_context_invoke_sync (GMainContext *context,
+                             GSourceFunc   func,
+                             gpointer      user_data)
+{
+  UsbemuSyncCall call;
+  GSource *source;
+
+  if (g_main_context_acquire (context)) {
+    func (user_data);
+    g_main_context_release (context);
+    return;
+  }
+
+  g_mutex_init (&call.mutex);
+  g_cond_init (&call.cond);
+  call.done = FALSE;
+  call.func = func;
+  call.user_data = user_data;
+
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_HIGH);
+  g_source_set_callback (source, _sync_call_dispatch, &call, NULL);
+  g_source_attach (source, context);
+  g_source_unref (source);
+
+  g_mutex_lock (&call.mutex);
+  while (!call.done)
+    g_cond_wait (&call.cond, &call.mutex);
+  g_mutex_unlock (&call.mutex);
+
+  g_cond_clear (&call.cond);
+  g_mutex_clear (&call.mutex);
+}
+
+/**
+ * usbemu_runtime_new:
+ * @n_workers: number of worker threads, or 0 for one per processor.
+ *
+ * Create a new #UsbemuRuntime and start its worker threads. They are
+ * stopped when it is disposed, so it must outlive the devices assigned to
+ * it.
+ *
+ * Returns: (transfer full): The constructed runtime object.
+ */
+UsbemuRuntime*
+usbemu_runtime_new (guint n_workers)
+{
+  g_return_val_if_fail (n_workers <= MAX_WORKERS, NULL);
+
+  return g_object_new (USBEMU_TYPE_RUNTIME,
+                       USBEMU_RUNTIME_PROP_N_WORKERS, n_workers,
+                       NULL);
+}
+
+/**
+ * usbemu_runtime_get_n_workers:
+ * @runtime: (in): a #UsbemuRuntime object.
+ *
+ * Get the number of worker threads of @runtime.
+ *
+ * Returns: the number of workers.
+ */
+guint
+usbemu_runtime_get_n_workers (UsbemuRuntime *runtime)
+{
+  g_return_val_if_fail (USBEMU_IS_RUNTIME (runtime), 0);
+
+  return runtime->n_workers;
+}
+
+/**
+ * usbemu_runtime_get_worker_context:
+ * @runtime: (in): a #UsbemuRuntime object.
+ * @index: index of a worker, less than usbemu_runtime_get_n_workers().
+ *
+ * Get the #GMainContext iterated by a worker thread, e.g. to attach sources
+ * of a transport to it.
+ *
+ * Returns: (transfer none): the #GMainContext of the worker.
+ */
+GMainContext*
+usbemu_runtime_get_worker_context (UsbemuRuntime *runtime,
+                                   guint          index)
+{
+  g_return_val_if_fail (USBEMU_IS_RUNTIME (runtime), NULL);
+  g_return_val_if_fail (index < runtime->n_workers, NULL);
+
+  return runtime->workers[index].context;
+}
+
+/**
+ * usbemu_runtime_assign_device:
+ * @runtime: (in): a #UsbemuRuntime object.
+ * @device: (in): a #UsbemuDevice object, never attached yet.
+ *
+ * Have @device served by one of the workers of @runtime, in turn, see
+ * usbemu_device_get_context(). Devices plugged into a #UsbemuHub are
+ * served by the worker of the hub, whether plugged in before or after it is
+ * assigned, so only the hub is to be assigned.
+ *
+ * Returns: the index of the worker.
+ */
+guint
+usbemu_runtime_assign_device (UsbemuRuntime *runtime,
+                              UsbemuDevice  *device)
+{
+  guint index;
+
+  g_return_val_if_fail (USBEMU_IS_RUNTIME (runtime), 0);
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), 0);
+  g_return_val_if_fail (!usbemu_device_get_attached (device), 0);
+
+  index = (guint) g_atomic_int_add (&runtime->next_worker, 1) %
+          runtime->n_workers;
+  _usbemu_device_set_context (device, runtime->workers[index].context);
+
+  return index;
+}
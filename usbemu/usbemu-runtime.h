@@ -0,0 +1,56 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#if !defined (__USBEMU_USBEMU_H_INSIDE__) && !defined (LIBUSBEMU_COMPILATION)
+#error "Only <usbemu/usbemu.h> can be included directly."
+#endif
+
+#include <glib-object.h>
+
+#include <usbemu/usbemu-device.h>
+
+G_BEGIN_DECLS
+
+/**
+ * USBEMU_TYPE_RUNTIME:
+ *
+ * Convenient macro for usbemu_runtime_get_type().
+ */
+#define USBEMU_TYPE_RUNTIME  (usbemu_runtime_get_type ())
+
+G_DECLARE_FINAL_TYPE (UsbemuRuntime, usbemu_runtime,
+                      USBEMU, RUNTIME, GObject)
+
+/**
+ * USBEMU_RUNTIME_PROP_N_WORKERS:
+ *
+ * "n-workers" property name.
+ */
+#define USBEMU_RUNTIME_PROP_N_WORKERS "n-workers"
+
+UsbemuRuntime* usbemu_runtime_new (guint n_workers);
+
+guint         usbemu_runtime_get_n_workers      (UsbemuRuntime *runtime);
+GMainContext* usbemu_runtime_get_worker_context (UsbemuRuntime *runtime,
+                                                 guint          index);
+
+guint usbemu_runtime_assign_device (UsbemuRuntime *runtime,
+                                    UsbemuDevice  *device);
+
+G_END_DECLS
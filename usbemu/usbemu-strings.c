@@ -0,0 +1,574 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include "usbemu/usbemu-device.h"
+#include "usbemu/usbemu-internal.h"
+
+/**
+ * UsbemuStringTable:
+ *
+ * Per device table of string descriptors. Strings are interned with a
+ * reference count and keep their index as long as they are referenced. The
+ * UTF-16LE descriptor of every string is encoded once per language when the
+ * string is interned or the languages change, so looking up a descriptor is
+ * an array access.
+ *
+ * Tables are reference counted so that devices created from a template can
+ * share them. Call _usbemu_string_table_make_writable() before modifying a
+ * table that may be shared. A shared table is not copied but overlaid: the
+ * writable table only holds the strings added after sharing, e.g. a per
+ * device serial number, and looks up all others in the shared one. Strings
+ * of the shared table stay allocated as long as the overlay exists, and
+ * references taken or dropped on them through the overlay are counted in
+ * the overlay, on top of those inherited from the shared table. Changing
+ * languages or translations re-encodes every string and merges the overlay
+ * into a full copy first.
+ *
+ * Devices created from one template may run on different workers. The table
+ * reference count is atomic, and a table referenced more than once is only
+ * read, so shared tables need no lock.
+ */
+
+typedef struct {
+  gchar *string;
+  guint ref_count;
+  /* One encoded descriptor per entry in UsbemuStringTable.languages. */
+  GBytes **descriptors;
+} UsbemuStringEntry;
+
+struct _UsbemuStringTable {
+  gint ref_count;
+  /* Shared table overlaid by this one, or NULL. It is not modified while
+   * referenced here. Languages and translations are those of the base. */
+  UsbemuStringTable *base;
+  GArray *languages;
+  GBytes *languages_descriptor;
+  /* Entry for string index i is at i - 1. A NULL string marks a free slot. */
+  GArray *entries;
+  /* UTF-8 string to index. Keys are owned by the entries. */
+  GHashTable *indexes;
+  /* Index of a string of the base to the references taken on it through
+   * this table less those dropped, or NULL if none yet. */
+  GHashTable *base_refs;
+  /* LANGID to a GHashTable of string to translation. Shared with the base
+   * while overlaid. */
+  GHashTable *translations;
+};
+
+/* String descriptors are limited by their 8-bit bLength. */
+#define MAX_STRING_DESCRIPTOR_SIZE 254
+/* Index 0 is reserved for the LANGID array. */
+#define MAX_STRING_INDEX G_MAXUINT8
+
+/* helper functions */
+static GBytes* _encode_languages (GArray *languages);
+static GBytes* _encode_string (const gchar *string);
+static void _encode_entry (UsbemuStringTable *table, UsbemuStringEntry *entry);
+static void _clear_entry (UsbemuStringTable *table, UsbemuStringEntry *entry);
+static guint _find_index (UsbemuStringTable *table, const gchar *string);
+static gboolean _index_used (UsbemuStringTable *table, guint index);
+static void _add_base_ref (UsbemuStringTable *table, guint index, gint delta);
+static gint _get_ref_count (UsbemuStringTable *table, guint index);
+static void _flatten (UsbemuStringTable *table);
+
+static GBytes*
+_encode_languages (GArray *languages)
+{
+  guint8 *data;
+  gsize size;
+  guint i;
+
+  size = MIN (2 + languages->len * 2, MAX_STRING_DESCRIPTOR_SIZE);
+  data = g_malloc (size);
+  data[0] = size;
+  data[1] = USBEMU_DESCRIPTOR_TYPE_STRING;
+  for (i = 0; (2 + i * 2) < size; i++) {
+    guint16 langid = g_array_index (languages, guint16, i);
+
+    data[2 + i * 2] = langid & 0xFF;
+    data[3 + i * 2] = langid >> 8;
+  }
+
+  return g_bytes_new_take (data, size);
+}
+
+static GBytes*
+_encode_string (const gchar *string)
+{
+  gunichar2 *utf16;
+  glong n_units, i;
+  guint8 *data;
+  gsize size;
+
+  utf16 = g_utf8_to_utf16 (string, -1, NULL, &n_units, NULL);
+  if (utf16 == NULL)
+    n_units = 0;
+
+  /* Truncate on a code point boundary, never between surrogates. */
+  if (2 + n_units * 2 > MAX_STRING_DESCRIPTOR_SIZE) {
+    n_units = (MAX_STRING_DESCRIPTOR_SIZE - 2) / 2;
+    if ((utf16[n_units - 1] & 0xFC00) == 0xD800)
+      n_units--;
+  }
+
+  size = 2 + n_units * 2;
+  data = g_malloc (size);
+  data[0] = size;
+  data[1] = USBEMU_DESCRIPTOR_TYPE_STRING;
+  for (i = 0; i < n_units; i++) {
+    data[2 + i * 2] = utf16[i] & 0xFF;
+    data[3 + i * 2] = utf16[i] >> 8;
+  }
+
+  g_free (utf16);
+
+  return g_bytes_new_take (data, size);
+}
+
+static void
+_encode_entry (UsbemuStringTable *table,
+               UsbemuStringEntry *entry)
+{
+  GHashTable *translations;
+  const gchar *string;
+  guint16 langid;
+  guint i;
+
+  if (entry->descriptors != NULL) {
+    for (i = 0; entry->descriptors[i] != NULL; i++)
+      g_bytes_unref (entry->descriptors[i]);
+    g_free (entry->descriptors);
+  }
+
+  entry->descriptors = g_new0 (GBytes*, table->languages->len + 1);
+  for (i = 0; i < table->languages->len; i++) {
+    langid = g_array_index (table->languages, guint16, i);
+
+    string = NULL;
+    translations = g_hash_table_lookup (table->translations,
+                                        GUINT_TO_POINTER (langid));
+    if (translations != NULL)
+      string = g_hash_table_lookup (translations, entry->string);
+    if (string == NULL)
+      string = entry->string;
+
+    entry->descriptors[i] = _encode_string (string);
+  }
+}
+
+static void
+_clear_entry (UsbemuStringTable *table,
+              UsbemuStringEntry *entry)
+{
+  guint i;
+
+  if (entry->string == NULL)
+    return;
+
+  g_hash_table_remove (table->indexes, entry->string);
+  g_free (entry->string);
+  entry->string = NULL;
+  entry->ref_count = 0;
+
+  for (i = 0; entry->descriptors[i] != NULL; i++)
+    g_bytes_unref (entry->descriptors[i]);
+  g_free (entry->descriptors);
+  entry->descriptors = NULL;
+}
+
+UsbemuStringTable*
+_usbemu_string_table_new (void)
+{
+  const guint16 langid = USBEMU_LANGID_ENGLISH_US;
+  UsbemuStringTable *table;
+
+  table = g_new0 (UsbemuStringTable, 1);
+  table->ref_count = 1;
+  table->languages = g_array_new (FALSE, FALSE, sizeof (guint16));
+  g_array_append_val (table->languages, langid);
+  table->languages_descriptor = _encode_languages (table->languages);
+  table->entries = g_array_new (FALSE, TRUE, sizeof (UsbemuStringEntry));
+  table->indexes = g_hash_table_new (g_str_hash, g_str_equal);
+  table->translations =
+      g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                             (GDestroyNotify) g_hash_table_unref);
+
+  return table;
+}
+
+UsbemuStringTable*
+_usbemu_string_table_ref (UsbemuStringTable *table)
+{
+  g_atomic_int_inc (&table->ref_count);
+  return table;
+}
+
+void
+_usbemu_string_table_unref (UsbemuStringTable *table)
+{
+  guint i;
+
+  if (!g_atomic_int_dec_and_test (&table->ref_count))
+    return;
+
+  for (i = 0; i < table->entries->len; i++)
+    _clear_entry (table, &g_array_index (table->entries, UsbemuStringEntry, i));
+
+  g_array_free (table->entries, TRUE);
+  g_hash_table_unref (table->indexes);
+  if (table->base_refs != NULL)
+    g_hash_table_unref (table->base_refs);
+  g_hash_table_unref (table->translations);
+  g_bytes_unref (table->languages_descriptor);
+  g_array_free (table->languages, TRUE);
+  if (table->base != NULL)
+    _usbemu_string_table_unref (table->base);
+  g_free (table);
+}
+
+/*
+ * Returns: (transfer full): @table itself if not shared, otherwise an empty
+ *     overlay of it with identical string indexes. The reference passed in is
+ *     consumed.
+ */
+UsbemuStringTable*
+_usbemu_string_table_make_writable (UsbemuStringTable *table)
+{
+  UsbemuStringTable *overlay;
+
+  if (g_atomic_int_get (&table->ref_count) == 1)
+    return table;
+
+  overlay = g_new0 (UsbemuStringTable, 1);
+  overlay->ref_count = 1;
+  overlay->base = table;
+  overlay->languages = g_array_sized_new (FALSE, FALSE, sizeof (guint16),
+                                          table->languages->len);
+  g_array_append_vals (overlay->languages, table->languages->data,
+                       table->languages->len);
+  overlay->languages_descriptor = g_bytes_ref (table->languages_descriptor);
+  overlay->entries = g_array_new (FALSE, TRUE, sizeof (UsbemuStringEntry));
+  overlay->indexes = g_hash_table_new (g_str_hash, g_str_equal);
+  overlay->translations = g_hash_table_ref (table->translations);
+
+  return overlay;
+}
+
+static guint
+_find_index (UsbemuStringTable *table,
+             const gchar       *string)
+{
+  guint index;
+
+  for (; table != NULL; table = table->base) {
+    index = GPOINTER_TO_UINT (g_hash_table_lookup (table->indexes, string));
+    if (index != 0)
+      return index;
+  }
+
+  return 0;
+}
+
+static gboolean
+_index_used (UsbemuStringTable *table,
+             guint              index)
+{
+  for (; table != NULL; table = table->base) {
+    if ((index <= table->entries->len) &&
+        (g_array_index (table->entries, UsbemuStringEntry, index - 1).string != NULL))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static void
+_add_base_ref (UsbemuStringTable *table,
+               guint              index,
+               gint               delta)
+{
+  gpointer key = GUINT_TO_POINTER (index);
+
+  if (table->base_refs == NULL)
+    table->base_refs = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  delta += GPOINTER_TO_INT (g_hash_table_lookup (table->base_refs, key));
+  g_hash_table_insert (table->base_refs, key, GINT_TO_POINTER (delta));
+}
+
+/* References held on @index through @table, including those inherited from
+ * its bases. */
+static gint
+_get_ref_count (UsbemuStringTable *table,
+                guint              index)
+{
+  UsbemuStringEntry *entry;
+  gint ref_count = 0;
+
+  for (; table != NULL; table = table->base) {
+    if (index <= table->entries->len) {
+      entry = &g_array_index (table->entries, UsbemuStringEntry, index - 1);
+      if (entry->string != NULL)
+        return ref_count + entry->ref_count;
+    }
+    if (table->base_refs != NULL)
+      ref_count += GPOINTER_TO_INT (g_hash_table_lookup (table->base_refs,
+                                                         GUINT_TO_POINTER (index)));
+  }
+
+  return 0;
+}
+
+/* Merge the strings of the bases of @table into @table itself, which then
+ * owns its translations. */
+static void
+_flatten (UsbemuStringTable *table)
+{
+  UsbemuStringTable *base;
+  UsbemuStringEntry *entry, *copy;
+  GHashTableIter iter, inner_iter;
+  GHashTable *translations, *inner, *inner_copy;
+  gpointer langid, string, translation;
+  gint ref_count;
+  guint i, j;
+
+  if (table->base == NULL)
+    return;
+
+  /* Encoded descriptors are immutable and shared by reference. Strings
+   * found in a base take the references inherited from it plus those
+   * counted here, and are dropped if none is left. */
+  for (base = table->base; base != NULL; base = base->base) {
+    for (i = 0; i < base->entries->len; i++) {
+      entry = &g_array_index (base->entries, UsbemuStringEntry, i);
+      /* Overlays only take indexes free in their bases. */
+      if ((entry->string == NULL) ||
+          ((i < table->entries->len) &&
+           (g_array_index (table->entries, UsbemuStringEntry, i).string != NULL)))
+        continue;
+
+      ref_count = _get_ref_count (table, i + 1);
+      if (ref_count <= 0)
+        continue;
+
+      if (i >= table->entries->len)
+        g_array_set_size (table->entries, i + 1);
+      copy = &g_array_index (table->entries, UsbemuStringEntry, i);
+      copy->string = g_strdup (entry->string);
+      copy->ref_count = ref_count;
+      copy->descriptors = g_new0 (GBytes*, table->languages->len + 1);
+      for (j = 0; j < table->languages->len; j++)
+        copy->descriptors[j] = g_bytes_ref (entry->descriptors[j]);
+      g_hash_table_insert (table->indexes, copy->string,
+                           GUINT_TO_POINTER (i + 1));
+    }
+  }
+
+  translations = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                        (GDestroyNotify) g_hash_table_unref);
+  g_hash_table_iter_init (&iter, table->translations);
+  while (g_hash_table_iter_next (&iter, &langid, (gpointer*) &inner)) {
+    inner_copy = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                        g_free, g_free);
+    g_hash_table_iter_init (&inner_iter, inner);
+    while (g_hash_table_iter_next (&inner_iter, &string, &translation)) {
+      g_hash_table_insert (inner_copy, g_strdup (string),
+                           g_strdup (translation));
+    }
+    g_hash_table_insert (translations, langid, inner_copy);
+  }
+  g_hash_table_unref (table->translations);
+  table->translations = translations;
+
+  g_clear_pointer (&table->base_refs, g_hash_table_unref);
+  _usbemu_string_table_unref (table->base);
+  table->base = NULL;
+}
+
+/*
+ * Returns: the index of @string, or 0 if @string is %NULL or the table is
+ *     full. Release with _usbemu_string_table_unref_string().
+ */
+guint8
+_usbemu_string_table_ref_string (UsbemuStringTable *table,
+                                 const gchar       *string)
+{
+  UsbemuStringEntry *entry;
+  guint index;
+
+  if (string == NULL)
+    return 0;
+
+  index = GPOINTER_TO_UINT (g_hash_table_lookup (table->indexes, string));
+  if (index != 0) {
+    g_array_index (table->entries, UsbemuStringEntry, index - 1).ref_count++;
+    return index;
+  }
+
+  /* Strings of the base stay allocated as long as it is overlaid, so the
+   * reference is only counted here. */
+  if (table->base != NULL) {
+    index = _find_index (table->base, string);
+    if (index != 0) {
+      _add_base_ref (table, index, 1);
+      return index;
+    }
+  }
+
+  /* Reuse the first free slot, or append a new one. */
+  for (index = 1; _index_used (table, index); index++)
+    ;
+  if (index > MAX_STRING_INDEX)
+    return 0;
+  if (index > table->entries->len)
+    g_array_set_size (table->entries, index);
+
+  entry = &g_array_index (table->entries, UsbemuStringEntry, index - 1);
+  entry->string = g_strdup (string);
+  entry->ref_count = 1;
+  _encode_entry (table, entry);
+  g_hash_table_insert (table->indexes, entry->string, GUINT_TO_POINTER (index));
+
+  return index;
+}
+
+void
+_usbemu_string_table_unref_string (UsbemuStringTable *table,
+                                   guint8             index)
+{
+  UsbemuStringEntry *entry;
+
+  if (index == 0)
+    return;
+
+  if (index <= table->entries->len) {
+    entry = &g_array_index (table->entries, UsbemuStringEntry, index - 1);
+    if (entry->string != NULL) {
+      if (--entry->ref_count == 0)
+        _clear_entry (table, entry);
+      return;
+    }
+  }
+
+  /* Strings of the base stay allocated, see above. */
+  if ((table->base != NULL) && _index_used (table->base, index))
+    _add_base_ref (table, index, -1);
+}
+
+void
+_usbemu_string_table_set_languages (UsbemuStringTable *table,
+                                    const guint16     *langids,
+                                    gsize              n_langids)
+{
+  UsbemuStringEntry *entry;
+  guint i;
+
+  _flatten (table);
+
+  g_array_set_size (table->languages, 0);
+  g_array_append_vals (table->languages, langids, n_langids);
+  g_bytes_unref (table->languages_descriptor);
+  table->languages_descriptor = _encode_languages (table->languages);
+
+  for (i = 0; i < table->entries->len; i++) {
+    entry = &g_array_index (table->entries, UsbemuStringEntry, i);
+    if (entry->string != NULL)
+      _encode_entry (table, entry);
+  }
+}
+
+const guint16*
+_usbemu_string_table_get_languages (UsbemuStringTable *table,
+                                    gsize             *n_langids)
+{
+  if (n_langids != NULL)
+    *n_langids = table->languages->len;
+
+  return (const guint16*) table->languages->data;
+}
+
+void
+_usbemu_string_table_set_translation (UsbemuStringTable *table,
+                                      guint16            langid,
+                                      const gchar       *string,
+                                      const gchar       *translation)
+{
+  GHashTable *translations;
+  guint index;
+
+  _flatten (table);
+
+  translations = g_hash_table_lookup (table->translations,
+                                      GUINT_TO_POINTER (langid));
+  if (translations == NULL) {
+    translations = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, g_free);
+    g_hash_table_insert (table->translations, GUINT_TO_POINTER (langid),
+                         translations);
+  }
+
+  if (translation != NULL)
+    g_hash_table_insert (translations, g_strdup (string),
+                         g_strdup (translation));
+  else
+    g_hash_table_remove (translations, string);
+
+  index = GPOINTER_TO_UINT (g_hash_table_lookup (table->indexes, string));
+  if (index != 0)
+    _encode_entry (table,
+                   &g_array_index (table->entries, UsbemuStringEntry, index - 1));
+}
+
+/*
+ * Returns: (transfer none): the encoded string descriptor of @index in
+ *     language @langid, or in the first language if @langid is not supported.
+ *     %NULL if no such string.
+ */
+GBytes*
+_usbemu_string_table_lookup (UsbemuStringTable *table,
+                             guint8             index,
+                             guint16            langid)
+{
+  UsbemuStringEntry *entry;
+  guint i;
+
+  if (index == 0)
+    return table->languages_descriptor;
+
+  if (table->languages->len == 0)
+    return NULL;
+
+  entry = NULL;
+  if (index <= table->entries->len)
+    entry = &g_array_index (table->entries, UsbemuStringEntry, index - 1);
+  if ((entry == NULL) || (entry->string == NULL)) {
+    if (table->base != NULL)
+      return _usbemu_string_table_lookup (table->base, index, langid);
+    return NULL;
+  }
+
+  for (i = 0; i < table->languages->len; i++) {
+    if (g_array_index (table->languages, guint16, i) == langid)
+      return entry->descriptors[i];
+  }
+
+  return entry->descriptors[0];
+}
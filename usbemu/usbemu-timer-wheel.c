@@ -0,0 +1,300 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include "usbemu/usbemu-internal.h"
+
+/* Hierarchical timer wheel of N_LEVELS levels of N_SLOTS slots each. Level
+ * 0 holds timers expiring within N_SLOTS ticks, one slot per tick, and each
+ * level above holds timers N_SLOTS times farther away, N_SLOTS times
+ * coarser. When level 0 wraps around, the due slot of level 1 is cascaded
+ * down, and so on up, so adding and removing timers is O(1) whatever their
+ * number. Ticks are 125 µs, the high-speed microframe, and timers are never
+ * run early. */
+#define TICK_USEC 125
+#define SLOT_BITS 6
+#define N_SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (N_SLOTS - 1)
+#define N_LEVELS 4
+/* About 35 minutes, farther timers are clamped. */
+#define MAX_TICKS (((guint64) 1 << (N_LEVELS * SLOT_BITS)) - 1)
+
+struct _UsbemuTimerWheel {
+  guint ref_count;
+  GSource *source;
+  /* Monotonic time of tick 0. */
+  gint64 origin;
+  /* First tick not run yet. */
+  guint64 tick;
+  guint n_timers;
+  UsbemuWheelTimer *slots[N_LEVELS][N_SLOTS];
+  /* Bit n set when slots[level][n] is not empty. */
+  guint64 occupied[N_LEVELS];
+};
+
+typedef struct {
+  GSource source;
+  UsbemuTimerWheel *wheel;
+} UsbemuTimerWheelSource;
+
+static GPrivate wheel_key;
+
+/* helper functions */
+static void _link (UsbemuTimerWheel *wheel, UsbemuWheelTimer *timer);
+static void _unlink (UsbemuTimerWheel *wheel, UsbemuWheelTimer *timer);
+static void _cascade (UsbemuTimerWheel *wheel);
+static void _arm (UsbemuTimerWheel *wheel);
+static gboolean _dispatch (GSource *source, GSourceFunc callback,
+                           gpointer user_data);
+
+static GSourceFuncs wheel_source_funcs = {
+  NULL,
+  NULL,
+  _dispatch,
+  NULL,
+};
+
+/* Index of the first bit set in @bits, rotated right by @shift. */
+static inline guint
+_first_rotated (guint64 bits,
+                guint   shift)
+{
+  if (shift != 0)
+    bits = (bits >> shift) | (bits << (N_SLOTS - shift));
+
+  return __builtin_ctzll (bits);
+}
+
+static void
+_link (UsbemuTimerWheel *wheel,
+       UsbemuWheelTimer *timer)
+{
+  UsbemuWheelTimer **head;
+  guint64 delta;
+  guint level;
+
+  delta = (timer->expires > wheel->tick) ? timer->expires - wheel->tick : 0;
+  delta = MIN (delta, MAX_TICKS);
+  timer->expires = wheel->tick + delta;
+  for (level = 0; delta >= ((guint64) 1 << ((level + 1) * SLOT_BITS));
+       level++);
+
+  timer->level = level;
+  timer->slot = (timer->expires >> (level * SLOT_BITS)) & SLOT_MASK;
+
+  head = &wheel->slots[level][timer->slot];
+  timer->next = *head;
+  if (*head != NULL)
+    (*head)->pprev = &timer->next;
+  timer->pprev = head;
+  *head = timer;
+  wheel->occupied[level] |= (guint64) 1 << timer->slot;
+}
+
+static void
+_unlink (UsbemuTimerWheel *wheel,
+         UsbemuWheelTimer *timer)
+{
+  *timer->pprev = timer->next;
+  if (timer->next != NULL)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+
+  if (wheel->slots[timer->level][timer->slot] == NULL)
+    wheel->occupied[timer->level] &= ~((guint64) 1 << timer->slot);
+}
+
+/* Move the due slot of each level above 0 one level down, at a wrap of
+ * the level below. */
+static void
+_cascade (UsbemuTimerWheel *wheel)
+{
+  UsbemuWheelTimer *timer, *next;
+  guint level, slot;
+
+  for (level = 1; level < N_LEVELS; level++) {
+    slot = (wheel->tick >> (level * SLOT_BITS)) & SLOT_MASK;
+
+    timer = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((guint64) 1 << slot);
+    for (; timer != NULL; timer = next) {
+      next = timer->next;
+      _link (wheel, timer);
+    }
+
+    if (slot != 0)
+      break;
+  }
+}
+
+/* Wake up at the earliest tick something is due, either a timer of level
+ * 0 or a cascade. */
+static void
+_arm (UsbemuTimerWheel *wheel)
+{
+  guint64 tick, next, base;
+  guint level, shift, current;
+
+  if (wheel->n_timers == 0) {
+    g_source_set_ready_time (wheel->source, -1);
+    return;
+  }
+
+  tick = G_MAXUINT64;
+  if (wheel->occupied[0] != 0)
+    tick = wheel->tick + _first_rotated (wheel->occupied[0],
+                                         wheel->tick & SLOT_MASK);
+
+  for (level = 1; level < N_LEVELS; level++) {
+    if (wheel->occupied[level] == 0)
+      continue;
+
+    /* Slot current was cascaded already, so it is due next round. */
+    shift = level * SLOT_BITS;
+    base = wheel->tick >> shift;
+    current = base & SLOT_MASK;
+    next = (base + 1 + _first_rotated (wheel->occupied[level],
+                                       (current + 1) & SLOT_MASK)) << shift;
+    tick = MIN (tick, next);
+  }
+
+  g_source_set_ready_time (wheel->source,
+                           wheel->origin + (gint64) tick * TICK_USEC);
+}
+
+static gboolean
+_dispatch (GSource     *source,
+           GSourceFunc  callback,
+           gpointer     user_data)
+{
+  UsbemuTimerWheel *wheel = ((UsbemuTimerWheelSource*) source)->wheel;
+  UsbemuWheelTimer *timer;
+  guint64 target, rest;
+  guint slot;
+
+  /* Timer functions may drop the last reference. */
+  wheel->ref_count++;
+
+  target = (g_get_monotonic_time () - wheel->origin) / TICK_USEC;
+  while ((wheel->n_timers != 0) && (wheel->tick <= target)) {
+    slot = wheel->tick & SLOT_MASK;
+    if (slot == 0)
+      _cascade (wheel);
+
+    /* Timers added while running are due from the next tick on. */
+    wheel->tick++;
+    while ((timer = wheel->slots[0][slot]) != NULL) {
+      _unlink (wheel, timer);
+      wheel->n_timers--;
+      timer->func (timer);
+    }
+
+    /* Skip ticks with nothing to run up to the next wrap. */
+    slot = wheel->tick & SLOT_MASK;
+    if (slot != 0) {
+      rest = wheel->occupied[0] >> slot;
+      wheel->tick = (rest != 0) ? wheel->tick + __builtin_ctzll (rest) :
+                                  (wheel->tick | SLOT_MASK) + 1;
+      wheel->tick = MIN (wheel->tick, target + 1);
+    }
+  }
+  /* Nothing pending, catch up at once. */
+  wheel->tick = MAX (wheel->tick, target + 1);
+
+  _arm (wheel);
+  _usbemu_timer_wheel_unref (wheel);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Get the timer wheel of the calling thread, dispatched in its
+ * thread-default main context. */
+UsbemuTimerWheel*
+_usbemu_timer_wheel_ref_default (void)
+{
+  UsbemuTimerWheel *wheel;
+
+  wheel = g_private_get (&wheel_key);
+  if (wheel != NULL) {
+    wheel->ref_count++;
+    return wheel;
+  }
+
+  wheel = g_new0 (UsbemuTimerWheel, 1);
+  wheel->ref_count = 1;
+  wheel->origin = g_get_monotonic_time ();
+  wheel->source = g_source_new (&wheel_source_funcs,
+                                sizeof (UsbemuTimerWheelSource));
+  ((UsbemuTimerWheelSource*) wheel->source)->wheel = wheel;
+  g_source_attach (wheel->source, g_main_context_get_thread_default ());
+  g_private_set (&wheel_key, wheel);
+
+  return wheel;
+}
+
+void
+_usbemu_timer_wheel_unref (UsbemuTimerWheel *wheel)
+{
+  if (--wheel->ref_count != 0)
+    return;
+
+  g_assert (wheel->n_timers == 0);
+
+  if (g_private_get (&wheel_key) == wheel)
+    g_private_set (&wheel_key, NULL);
+  g_source_destroy (wheel->source);
+  g_source_unref (wheel->source);
+  g_free (wheel);
+}
+
+/* Run @timer->func once the monotonic time reaches @time, or at the next
+ * dispatch if it has already. @timer must not be pending. */
+void
+_usbemu_timer_wheel_add (UsbemuTimerWheel *wheel,
+                         UsbemuWheelTimer *timer,
+                         gint64            time)
+{
+  g_assert (timer->pprev == NULL);
+
+  /* Rounded up, so that it never runs early. */
+  time = MAX (time - wheel->origin, 0);
+  timer->expires = MAX ((guint64) (time + TICK_USEC - 1) / TICK_USEC,
+                        wheel->tick);
+  _link (wheel, timer);
+  wheel->n_timers++;
+
+  _arm (wheel);
+}
+
+/* Stop @timer if pending. */
+void
+_usbemu_timer_wheel_remove (UsbemuTimerWheel *wheel,
+                            UsbemuWheelTimer *timer)
+{
+  if (timer->pprev == NULL)
+    return;
+
+  _unlink (wheel, timer);
+  wheel->n_timers--;
+
+  _arm (wheel);
+}
@@ -0,0 +1,256 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#if defined (HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
+
+#include "usbemu/usbemu-urb.h"
+#include "usbemu/usbemu-internal.h"
+
+/* Blocks of 1 << (MIN_CLASS_SHIFT + n) bytes for each size class n. USB max
+ * packet sizes are powers of two, so transfers of a few packets fill their
+ * class well. Larger blocks come from the heap. */
+#define MIN_CLASS_SHIFT 8
+#define N_CLASSES 13
+#define CLASS_SIZE(n) ((gsize) 1 << (MIN_CLASS_SHIFT + (n)))
+
+/* Slabs are carved into blocks of one class and never returned. */
+#define SLAB_SIZE (256 * 1024)
+#define HUGE_SLAB_SIZE (2 * 1024 * 1024)
+
+/* Blocks a thread keeps per class, and moves from or to the depot at once. */
+#define CACHE_LIMIT 64
+#define CACHE_BATCH 16
+
+/* A free block starts with the pointer to the next one. */
+typedef struct {
+  gpointer head;
+  guint count;
+} UsbemuFreeList;
+
+typedef struct {
+  UsbemuFreeList lists[N_CLASSES];
+} UsbemuThreadCache;
+
+static void _thread_cache_free (gpointer data);
+
+static GPrivate thread_cache = G_PRIVATE_INIT (_thread_cache_free);
+
+/* Shared by all threads, protected by depot_lock. */
+static GMutex depot_lock;
+static UsbemuFreeList depot[N_CLASSES];
+static UsbemuUrbPoolStats pool_stats;
+
+static gint use_huge_pages = FALSE;
+
+/* helper functions */
+static void _free_list_push (UsbemuFreeList *list, gpointer block);
+static gpointer _free_list_pop (UsbemuFreeList *list);
+static gpointer _allocate_slab (gsize *size);
+static void _depot_fill (guint index);
+static UsbemuThreadCache* _get_thread_cache (void);
+
+static inline void
+_free_list_push (UsbemuFreeList *list,
+                 gpointer        block)
+{
+  *(gpointer*) block = list->head;
+  list->head = block;
+  list->count++;
+}
+
+static inline gpointer
+_free_list_pop (UsbemuFreeList *list)
+{
+  gpointer block = list->head;
+
+  if (block != NULL) {
+    list->head = *(gpointer*) block;
+    list->count--;
+  }
+
+  return block;
+}
+
+/* Called with depot_lock held. */
+static gpointer
+_allocate_slab (gsize *size)
+{
+  gpointer slab;
+
+#if defined (MAP_HUGETLB)
+  if (g_atomic_int_get (&use_huge_pages)) {
+    gsize huge_size = (*size + HUGE_SLAB_SIZE - 1) & ~(gsize) (HUGE_SLAB_SIZE - 1);
+
+    slab = mmap (NULL, huge_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (slab != MAP_FAILED) {
+      *size = huge_size;
+      pool_stats.n_huge_slabs++;
+      return slab;
+    }
+    /* No huge pages reserved, fall back to regular memory. */
+  }
+#endif
+
+  slab = g_malloc (*size);
+  return slab;
+}
+
+/* Called with depot_lock held. */
+static void
+_depot_fill (guint index)
+{
+  gsize block_size = CLASS_SIZE (index), size, offset;
+  guint8 *slab;
+
+  size = MAX (SLAB_SIZE, block_size);
+  slab = _allocate_slab (&size);
+  pool_stats.n_slabs++;
+  pool_stats.slab_bytes += size;
+
+  for (offset = 0; offset + block_size <= size; offset += block_size)
+    _free_list_push (&depot[index], slab + offset);
+}
+
+static void
+_thread_cache_free (gpointer data)
+{
+  UsbemuThreadCache *cache = data;
+  gpointer block;
+  guint i;
+
+  g_mutex_lock (&depot_lock);
+  for (i = 0; i < N_CLASSES; i++) {
+    while ((block = _free_list_pop (&cache->lists[i])) != NULL)
+      _free_list_push (&depot[i], block);
+  }
+  g_mutex_unlock (&depot_lock);
+
+  g_free (cache);
+}
+
+static UsbemuThreadCache*
+_get_thread_cache (void)
+{
+  UsbemuThreadCache *cache = g_private_get (&thread_cache);
+
+  if (G_UNLIKELY (cache == NULL)) {
+    cache = g_new0 (UsbemuThreadCache, 1);
+    g_private_set (&thread_cache, cache);
+  }
+
+  return cache;
+}
+
+/* Allocate an uninitialized block of at least @size bytes, and return in
+ * @index what to pass back to _usbemu_urb_pool_free(). */
+gpointer
+_usbemu_urb_pool_alloc (gsize  size,
+                        guint *index)
+{
+  UsbemuFreeList *list;
+  gpointer block;
+  guint i;
+
+  for (i = 0; (i < N_CLASSES) && (CLASS_SIZE (i) < size); i++)
+    ;
+  *index = i;
+  if (i == N_CLASSES) {
+    g_atomic_int_inc (&pool_stats.n_oversized);
+    return g_malloc (size);
+  }
+
+  list = &_get_thread_cache ()->lists[i];
+  block = _free_list_pop (list);
+  if (G_LIKELY (block != NULL))
+    return block;
+
+  g_mutex_lock (&depot_lock);
+  if (depot[i].head == NULL)
+    _depot_fill (i);
+  while ((list->count < CACHE_BATCH) &&
+         ((block = _free_list_pop (&depot[i])) != NULL))
+    _free_list_push (list, block);
+  g_mutex_unlock (&depot_lock);
+
+  return _free_list_pop (list);
+}
+
+void
+_usbemu_urb_pool_free (gpointer block,
+                       guint    index)
+{
+  UsbemuFreeList *list;
+  guint n;
+
+  if (index == N_CLASSES) {
+    g_free (block);
+    return;
+  }
+
+  list = &_get_thread_cache ()->lists[index];
+  _free_list_push (list, block);
+  if (G_LIKELY (list->count <= CACHE_LIMIT))
+    return;
+
+  g_mutex_lock (&depot_lock);
+  for (n = 0; n < CACHE_BATCH; n++)
+    _free_list_push (&depot[index], _free_list_pop (list));
+  g_mutex_unlock (&depot_lock);
+}
+
+/**
+ * usbemu_urb_pool_set_huge_pages:
+ * @enable: whether to back new slabs with huge pages.
+ *
+ * #UsbemuUrb objects and their buffers are carved out of slabs of a few
+ * size classes, cached per thread, so that steady traffic does no heap
+ * allocation at all. With @enable, slabs allocated from now on use
+ * MAP_HUGETLB huge pages where the system has some reserved, reducing TLB
+ * pressure of large transfer buffers. Slabs fall back to regular memory
+ * otherwise.
+ */
+void
+usbemu_urb_pool_set_huge_pages (gboolean enable)
+{
+  g_atomic_int_set (&use_huge_pages, enable);
+}
+
+/**
+ * usbemu_urb_pool_get_stats:
+ * @stats: (out caller-allocates): a #UsbemuUrbPoolStats to fill.
+ *
+ * Retrieve counters of the #UsbemuUrb pool, e.g. to check that no slab is
+ * allocated any more once warmed up.
+ */
+void
+usbemu_urb_pool_get_stats (UsbemuUrbPoolStats *stats)
+{
+  g_return_if_fail (stats != NULL);
+
+  g_mutex_lock (&depot_lock);
+  *stats = pool_stats;
+  stats->n_oversized = g_atomic_int_get (&pool_stats.n_oversized);
+  g_mutex_unlock (&depot_lock);
+}
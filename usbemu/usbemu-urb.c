@@ -0,0 +1,233 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "usbemu/usbemu-urb.h"
+#include "usbemu/usbemu-internal.h"
+
+/**
+ * SECTION:usbemu-urb
+ * @title: UsbemuUrb
+ * @short_description: USB request block
+ * @include: usbemu/usbemu.h
+ *
+ * #UsbemuUrb carries one transfer from a transport, e.g.
+ * #UsbemuUsbipServer, to a #UsbemuDevice and back. Transports submit it with
+ * usbemu_device_submit_urb(), devices finish it with
+ * usbemu_device_complete_urb().
+ *
+ * A #UsbemuUrb, its isochronous packet descriptors and its transfer buffer
+ * share one block from a pool of size-classed slabs with per-thread caches,
+ * so that allocating and freeing URBs at high rates does not go through
+ * malloc() once the pool is warmed up.
+ *
+ * Transfer data may also be carried by a #GBytes instead, so that it is
+ * never copied between the transport and the device: transports create OUT
+ * URBs with usbemu_urb_new_with_payload() over the data they received, and
+ * devices answer IN URBs with usbemu_urb_set_payload() using data they
+ * already hold, e.g. a slice of a mapped file with g_bytes_new_from_bytes().
+ */
+
+/* Start of isochronous packet descriptors, then of the transfer buffer. */
+#define URB_HEADER_SIZE ((sizeof (UsbemuUrb) + 15) & ~(gsize) 15)
+
+G_DEFINE_BOXED_TYPE (UsbemuUrb, usbemu_urb, usbemu_urb_ref, usbemu_urb_unref)
+
+/**
+ * usbemu_urb_new:
+ * @endpoint_address: bEndpointAddress of the target endpoint.
+ * @buffer_length: size of the transfer buffer.
+ * @n_iso_packets: number of isochronous packets, or 0.
+ *
+ * Create a new #UsbemuUrb with an uninitialized transfer buffer and zeroed
+ * isochronous packet descriptors, allocated from the URB pool.
+ *
+ * Returns: (transfer full): a new #UsbemuUrb. Free with usbemu_urb_unref().
+ */
+UsbemuUrb*
+usbemu_urb_new (guint8 endpoint_address,
+                gsize  buffer_length,
+                guint  n_iso_packets)
+{
+  UsbemuUrb *urb;
+  gsize iso_size;
+  guint pool_class;
+
+  iso_size = n_iso_packets * sizeof (UsbemuIsoPacket);
+  urb = _usbemu_urb_pool_alloc (URB_HEADER_SIZE + iso_size + buffer_length,
+                                &pool_class);
+  memset (urb, 0, URB_HEADER_SIZE + iso_size);
+
+  urb->ref_count = 1;
+  urb->pool_class = pool_class;
+  urb->endpoint_address = endpoint_address;
+  if (n_iso_packets != 0)
+    urb->iso_packets = (UsbemuIsoPacket*) ((guint8*) urb + URB_HEADER_SIZE);
+  urb->n_iso_packets = n_iso_packets;
+  urb->buffer = (guint8*) urb + URB_HEADER_SIZE + iso_size;
+  urb->buffer_length = buffer_length;
+
+  return urb;
+}
+
+/**
+ * usbemu_urb_new_with_payload:
+ * @endpoint_address: bEndpointAddress of the target endpoint.
+ * @payload: (in): OUT data of the transfer.
+ * @n_iso_packets: number of isochronous packets, or 0.
+ *
+ * Create a new #UsbemuUrb whose buffer is the data of @payload, without
+ * copying it. The buffer must not be written to.
+ *
+ * Returns: (transfer full): a new #UsbemuUrb. Free with usbemu_urb_unref().
+ */
+UsbemuUrb*
+usbemu_urb_new_with_payload (guint8  endpoint_address,
+                             GBytes *payload,
+                             guint   n_iso_packets)
+{
+  UsbemuUrb *urb;
+  gsize size;
+
+  g_return_val_if_fail (payload != NULL, NULL);
+
+  urb = usbemu_urb_new (endpoint_address, 0, n_iso_packets);
+  urb->payload = g_bytes_ref (payload);
+  urb->buffer = (guint8*) g_bytes_get_data (payload, &size);
+  urb->buffer_length = size;
+
+  return urb;
+}
+
+/**
+ * usbemu_urb_ref:
+ * @urb: (in): a #UsbemuUrb.
+ *
+ * Increase reference count of @urb.
+ *
+ * Returns: (transfer full): @urb.
+ */
+UsbemuUrb*
+usbemu_urb_ref (UsbemuUrb *urb)
+{
+  g_return_val_if_fail (urb != NULL, NULL);
+
+  g_atomic_int_inc (&urb->ref_count);
+
+  return urb;
+}
+
+/**
+ * usbemu_urb_unref:
+ * @urb: (in) (transfer full): a #UsbemuUrb.
+ *
+ * Decrease reference count of @urb, and free it when it drops to zero.
+ */
+void
+usbemu_urb_unref (UsbemuUrb *urb)
+{
+  g_return_if_fail (urb != NULL);
+
+  if (!g_atomic_int_dec_and_test (&urb->ref_count))
+    return;
+
+  if (urb->payload != NULL)
+    g_bytes_unref (urb->payload);
+  _usbemu_urb_pool_free (urb, urb->pool_class);
+}
+
+/**
+ * usbemu_urb_next:
+ * @urb: (in): a pending #UsbemuUrb.
+ *
+ * Get the pending #UsbemuUrb submitted after @urb to the same endpoint of
+ * the same device. See usbemu_device_peek_urb().
+ *
+ * Returns: (transfer none) (nullable): the next #UsbemuUrb, or %NULL.
+ */
+UsbemuUrb*
+usbemu_urb_next (UsbemuUrb *urb)
+{
+  g_return_val_if_fail (urb != NULL, NULL);
+
+  return urb->next;
+}
+
+/**
+ * usbemu_urb_get_payload:
+ * @urb: (in): a #UsbemuUrb.
+ *
+ * Get the #GBytes carrying the transfer data of @urb, if any: the OUT data
+ * of a URB created with usbemu_urb_new_with_payload(), or the IN data set
+ * with usbemu_urb_set_payload(). Handlers may keep a reference to it instead
+ * of copying the data.
+ *
+ * Returns: (transfer none) (nullable): the payload, or %NULL if the data is
+ *          in the buffer of @urb.
+ */
+GBytes*
+usbemu_urb_get_payload (UsbemuUrb *urb)
+{
+  g_return_val_if_fail (urb != NULL, NULL);
+
+  return urb->payload;
+}
+
+/**
+ * usbemu_urb_set_payload:
+ * @urb: (in): an IN #UsbemuUrb.
+ * @payload: (in): data to transfer.
+ *
+ * Answer @urb with the data of @payload instead of filling its buffer. The
+ * data is sent as is by the transport, and actual_length is set to its size,
+ * clamped to buffer_length.
+ */
+void
+usbemu_urb_set_payload (UsbemuUrb *urb,
+                        GBytes    *payload)
+{
+  g_return_if_fail (urb != NULL);
+  g_return_if_fail (payload != NULL);
+  g_return_if_fail (urb->payload == NULL);
+
+  urb->payload = g_bytes_ref (payload);
+  urb->actual_length = MIN (g_bytes_get_size (payload), urb->buffer_length);
+}
+
+/**
+ * usbemu_urb_peek_data:
+ * @urb: (in): a #UsbemuUrb.
+ *
+ * Get the transfer data of @urb, either in its payload or in its buffer.
+ *
+ * Returns: (transfer none): the transfer data.
+ */
+const guint8*
+usbemu_urb_peek_data (UsbemuUrb *urb)
+{
+  g_return_val_if_fail (urb != NULL, NULL);
+
+  if (urb->payload != NULL)
+    return g_bytes_get_data (urb->payload, NULL);
+
+  return urb->buffer;
+}
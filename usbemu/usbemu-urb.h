@@ -0,0 +1,209 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#if !defined (__USBEMU_USBEMU_H_INSIDE__) && !defined (LIBUSBEMU_COMPILATION)
+#error "Only <usbemu/usbemu.h> can be included directly."
+#endif
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/**
+ * USBEMU_TYPE_URB:
+ *
+ * Convenient macro for usbemu_urb_get_type().
+ */
+#define USBEMU_TYPE_URB  (usbemu_urb_get_type ())
+
+/**
+ * UsbemuUrbStatus:
+ * @USBEMU_URB_STATUS_COMPLETED: transfer completed successfully.
+ * @USBEMU_URB_STATUS_PENDING: submitted and not yet completed.
+ * @USBEMU_URB_STATUS_STALL: endpoint stalled, or request not supported.
+ * @USBEMU_URB_STATUS_CANCELLED: cancelled by usbemu_device_cancel_urb().
+ * @USBEMU_URB_STATUS_SHUTDOWN: device is not attached.
+ * @USBEMU_URB_STATUS_OVERFLOW: device had more data than the buffer holds.
+ * @USBEMU_URB_STATUS_ERROR: unclassified transfer error.
+ *
+ * Completion status of a #UsbemuUrb or of an isochronous packet in it.
+ */
+typedef enum /*< enum,prefix=USBEMU >*/
+{
+  USBEMU_URB_STATUS_COMPLETED = 0, /*< nick=completed >*/
+  USBEMU_URB_STATUS_PENDING, /*< nick=pending >*/
+  USBEMU_URB_STATUS_STALL, /*< nick=stall >*/
+  USBEMU_URB_STATUS_CANCELLED, /*< nick=cancelled >*/
+  USBEMU_URB_STATUS_SHUTDOWN, /*< nick=shutdown >*/
+  USBEMU_URB_STATUS_OVERFLOW, /*< nick=overflow >*/
+  USBEMU_URB_STATUS_ERROR, /*< nick=error >*/
+} UsbemuUrbStatus;
+
+/**
+ * UsbemuUrbFlags:
+ * @USBEMU_URB_FLAG_NONE: no flag.
+ * @USBEMU_URB_FLAG_SHORT_NOT_OK: a short IN transfer is an error.
+ * @USBEMU_URB_FLAG_ISO_ASAP: schedule isochronous transfer as soon as
+ *     possible, ignoring start_frame.
+ * @USBEMU_URB_FLAG_ZERO_PACKET: terminate an OUT transfer of a multiple of
+ *     max packet size with a zero length packet.
+ *
+ * Transfer flags of a #UsbemuUrb. Values are identical to those of Linux
+ * URBs.
+ */
+typedef enum /*< flags,prefix=USBEMU >*/
+{
+  USBEMU_URB_FLAG_NONE = 0, /*< nick=none >*/
+  USBEMU_URB_FLAG_SHORT_NOT_OK = (1 << 0), /*< nick=short-not-ok >*/
+  USBEMU_URB_FLAG_ISO_ASAP = (1 << 1), /*< nick=iso-asap >*/
+  USBEMU_URB_FLAG_ZERO_PACKET = (1 << 6), /*< nick=zero-packet >*/
+} UsbemuUrbFlags;
+
+/**
+ * USBEMU_URB_SETUP_SIZE:
+ *
+ * Size in bytes of a SETUP packet.
+ */
+#define USBEMU_URB_SETUP_SIZE 8
+
+/**
+ * UsbemuIsoPacket:
+ * @offset: offset of the packet in the transfer buffer.
+ * @length: length of the packet.
+ * @actual_length: number of bytes actually transferred.
+ * @status: completion status of the packet.
+ *
+ * Descriptor of one packet of an isochronous #UsbemuUrb.
+ */
+typedef struct {
+  guint offset;
+  guint length;
+  guint actual_length;
+  UsbemuUrbStatus status;
+} UsbemuIsoPacket;
+
+typedef struct _UsbemuUrb UsbemuUrb;
+
+/**
+ * UsbemuUrbCompleteFunc:
+ * @urb: the completed #UsbemuUrb.
+ * @user_data: user data passed to usbemu_device_submit_urb().
+ *
+ * Called once when a submitted #UsbemuUrb completes, whatever its status.
+ */
+typedef void (*UsbemuUrbCompleteFunc) (UsbemuUrb *urb,
+                                       gpointer   user_data);
+
+/**
+ * UsbemuUrb:
+ * @seqnum: sequence number assigned by the transport, opaque to devices.
+ * @endpoint_address: bEndpointAddress of the target endpoint, i.e. endpoint
+ *     number OR-ed with a #UsbemuEndpointDirections.
+ * @flags: #UsbemuUrbFlags.
+ * @setup: SETUP packet for control transfers.
+ * @buffer: transfer buffer of @buffer_length bytes. Holds OUT data on
+ *     submission, filled with IN data by the device unless it hands out a
+ *     payload with usbemu_urb_set_payload(). Read-only for URBs created with
+ *     usbemu_urb_new_with_payload().
+ * @buffer_length: size of @buffer.
+ * @actual_length: number of bytes actually transferred.
+ * @status: #UsbemuUrbStatus.
+ * @start_frame: start frame of isochronous transfers.
+ * @interval: polling interval of periodic transfers, in (micro)frames.
+ * @iso_packets: array of @n_iso_packets packet descriptors.
+ * @n_iso_packets: number of isochronous packets, 0 for other transfers.
+ * @error_count: number of isochronous packets completed with an error.
+ *
+ * USB request block, a transfer submitted to a #UsbemuDevice.
+ */
+struct _UsbemuUrb {
+  guint32 seqnum;
+  guint8 endpoint_address;
+  UsbemuUrbFlags flags;
+  guint8 setup[USBEMU_URB_SETUP_SIZE];
+
+  guint8 *buffer;
+  gsize buffer_length;
+  gsize actual_length;
+  UsbemuUrbStatus status;
+
+  gint start_frame;
+  guint interval;
+  UsbemuIsoPacket *iso_packets;
+  guint n_iso_packets;
+  guint error_count;
+
+  /*< private >*/
+  gint ref_count;
+  UsbemuUrbCompleteFunc complete_func;
+  gpointer complete_data;
+  /* Links in the endpoint queue of the device it is submitted to. */
+  UsbemuUrb *prev;
+  UsbemuUrb *next;
+  /* Used while handed over to a UsbemuEndpointQueue. */
+  UsbemuUrb *link;
+  UsbemuUrbStatus queued_status;
+  gint cancelled;
+  /* Monotonic time it completes at, while queued to a UsbemuIsoStream. */
+  gint64 deadline;
+  /* Size class of the pool block holding the URB and its buffers. */
+  guint pool_class;
+  /* Zero-copy transfer data, see usbemu_urb_get_payload(). */
+  GBytes *payload;
+};
+
+/**
+ * UsbemuUrbPoolStats:
+ * @n_slabs: number of slabs allocated.
+ * @n_huge_slabs: how many of them are backed by huge pages.
+ * @slab_bytes: total size of slabs.
+ * @n_oversized: number of URBs too large for any size class, allocated from
+ *     the heap.
+ *
+ * Counters of the #UsbemuUrb pool, see usbemu_urb_pool_set_huge_pages().
+ */
+typedef struct {
+  guint n_slabs;
+  guint n_huge_slabs;
+  gsize slab_bytes;
+  guint n_oversized;
+} UsbemuUrbPoolStats;
+
+GType      usbemu_urb_get_type (void) G_GNUC_CONST;
+
+UsbemuUrb* usbemu_urb_new      (guint8     endpoint_address,
+                                gsize      buffer_length,
+                                guint      n_iso_packets);
+UsbemuUrb* usbemu_urb_new_with_payload
+                               (guint8     endpoint_address,
+                                GBytes    *payload,
+                                guint      n_iso_packets);
+UsbemuUrb* usbemu_urb_ref      (UsbemuUrb *urb);
+void       usbemu_urb_unref    (UsbemuUrb *urb);
+UsbemuUrb* usbemu_urb_next     (UsbemuUrb *urb);
+
+GBytes*       usbemu_urb_get_payload (UsbemuUrb *urb);
+void          usbemu_urb_set_payload (UsbemuUrb *urb,
+                                      GBytes    *payload);
+const guint8* usbemu_urb_peek_data   (UsbemuUrb *urb);
+
+void usbemu_urb_pool_set_huge_pages (gboolean            enable);
+void usbemu_urb_pool_get_stats      (UsbemuUrbPoolStats *stats);
+
+G_END_DECLS
@@ -0,0 +1,2245 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined (HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "usbemu/usbemu-usbip-server.h"
+#include "usbemu/usbemu-configuration.h"
+#include "usbemu/usbemu-errors.h"
+#include "usbemu/usbemu-hub.h"
+#include "usbemu/usbemu-interface.h"
+#include "usbemu/usbemu-internal.h"
+
+/**
+ * SECTION:usbemu-usbip-server
+ * @title: UsbemuUsbipServer
+ * @short_description: USB/IP server exporting emulated devices
+ * @include: usbemu/usbemu.h
+ *
+ * #UsbemuUsbipServer exports #UsbemuDevice objects over TCP with the USB/IP
+ * protocol, so that e.g. Linux `usbip attach` can import them through the
+ * vhci-hcd module.
+ *
+ * All sockets are non-blocking and driven by #GSource objects attached to the
+ * thread-default #GMainContext at the time the server was created, so a
+ * single thread serves any number of connections. Each connection imports at
+ * most one device, which stays attached until the connection is closed. A
+ * connection importing a device assigned to a #UsbemuRuntime worker is handed
+ * over to that worker, which then serves both the socket and the device.
+ * Port resets forwarded by the host are applied with usbemu_device_reset().
+ *
+ * A #UsbemuHub may be exported to expose many devices through one
+ * connection. Requests carrying the devid of the import reach the hub
+ * itself. Requests for a device behind it carry the USB address the host
+ * assigned to that device in the devnum half of devid, the bus number
+ * staying that of the import, and are routed with
+ * usbemu_hub_lookup_address(). Such requests complete with -ESHUTDOWN once
+ * no device answers that address. A device given the devnum of the import
+ * as its address can't be reached this way.
+ *
+ * Transfer data is not copied on its way through the server: OUT URBs are
+ * created with usbemu_urb_new_with_payload() over slices of the receive
+ * buffer, and IN data is sent straight from the #UsbemuUrb buffer or from
+ * the payload set with usbemu_urb_set_payload().
+ *
+ * With io_uring available, see usbemu_usbip_server_io_uring_available(),
+ * connections receive with multishot requests into a provided buffer ring
+ * and write replies as asynchronous requests, all of a main loop iteration
+ * submitted with one syscall, instead of polling their sockets and calling
+ * recv() and sendmsg() themselves. OUT payloads are then slices of the ring
+ * buffer they arrived in, which the kernel gets back once they are
+ * released. Only a request split across buffers is copied.
+ *
+ * Replies are queued per connection and written with one sendmsg() call for
+ * many of them. A queue is flushed once it holds #UsbemuUsbipServer:batch-size replies, or
+ * #UsbemuUsbipServer:batch-latency microseconds after its first reply was
+ * queued. Sockets run with TCP_NODELAY, and additionally with TCP_CORK while
+ * a flush of at least #UsbemuUsbipServer:cork-threshold replies is in
+ * progress, so that deep queues leave in full segments. See
+ * usbemu_usbip_server_get_stats() for the counters to tune these against.
+ */
+
+/**
+ * UsbemuUsbipServer:
+ *
+ * USB/IP server object.
+ */
+
+/**
+ * UsbemuUsbipServerClass:
+ * @parent_class: The parent class.
+ *
+ * Class structure for UsbemuUsbipServer.
+ */
+
+#define USBIP_VERSION 0x0111
+
+/* OP_* messages exchanged before a device is imported. */
+#define OP_REQ_IMPORT 0x8003
+#define OP_REP_IMPORT 0x0003
+#define OP_REQ_DEVLIST 0x8005
+#define OP_REP_DEVLIST 0x0005
+
+#define OP_STATUS_OK 0x00
+#define OP_STATUS_DEV_BUSY 0x02
+#define OP_STATUS_NODEV 0x04
+
+#define OP_HEADER_SIZE 8
+#define USBIP_PATH_SIZE 256
+#define USBIP_BUSID_SIZE 32
+#define USBIP_DEVICE_SIZE 312
+#define USBIP_INTERFACE_SIZE 4
+
+/* USBIP_* messages exchanged once a device is imported. */
+#define USBIP_CMD_SUBMIT 0x0001
+#define USBIP_CMD_UNLINK 0x0002
+#define USBIP_RET_SUBMIT 0x0003
+#define USBIP_RET_UNLINK 0x0004
+
+#define USBIP_DIR_OUT 0
+#define USBIP_DIR_IN 1
+
+#define USBIP_HEADER_SIZE 48
+#define USBIP_ISO_PACKET_SIZE 16
+
+/* SETUP packet of SET_FEATURE(PORT_RESET), forwarded by the host when the
+ * device is reset. Matched on its first 4 bytes, as Linux usbip-host does. */
+#define USBIP_PORT_RESET_SETUP "\x23\x03\x04\x00"
+
+/* enum usb_device_speed of Linux. */
+#define USBIP_SPEED_LOW 1
+#define USBIP_SPEED_FULL 2
+#define USBIP_SPEED_HIGH 3
+#define USBIP_SPEED_SUPER 5
+
+/* Indexed by #UsbemuSpeeds. */
+static const guint32 usbip_speeds[] = {
+  [USBEMU_SPEED_LOW] = USBIP_SPEED_LOW,
+  [USBEMU_SPEED_FULL] = USBIP_SPEED_FULL,
+  [USBEMU_SPEED_HIGH] = USBIP_SPEED_HIGH,
+  [USBEMU_SPEED_SUPER] = USBIP_SPEED_SUPER,
+};
+
+/* Linux errno values carried in status fields, whatever the host OS is. */
+#define USBIP_EPIPE 32
+#define USBIP_EPROTO 71
+#define USBIP_EOVERFLOW 75
+#define USBIP_ECONNRESET 104
+#define USBIP_ESHUTDOWN 108
+#define USBIP_EINPROGRESS 115
+
+/* Limits protecting against malformed or hostile peers. */
+#define MAX_TRANSFER_LENGTH (16 * 1024 * 1024)
+#define MAX_ISO_PACKETS 1024
+
+#define MAX_DEVICES_PER_BUS 127
+#define LISTEN_BACKLOG 128
+#define RECEIVE_CHUNK_SIZE 65536
+/* Vectors passed to one sendmsg() call, well below any IOV_MAX. */
+#define MAX_SEND_VECTORS 64
+
+#define SUPPORTED_URB_FLAGS \
+  (USBEMU_URB_FLAG_SHORT_NOT_OK | USBEMU_URB_FLAG_ISO_ASAP | \
+   USBEMU_URB_FLAG_ZERO_PACKET)
+
+typedef struct _UsbemuUsbipConnection UsbemuUsbipConnection;
+
+/* A queued reply: an inline header, then a payload borrowed from @urb, then
+ * bytes owned by @extra. */
+typedef struct {
+  guint8 header[USBIP_HEADER_SIZE];
+  gsize header_size;
+  UsbemuUrb *urb;
+  const guint8 *payload;
+  gsize payload_size;
+  GByteArray *extra;
+} UsbemuUsbipReply;
+
+typedef struct {
+  UsbemuUsbipServer *server;
+  UsbemuDevice *device;
+  gchar *busid;
+  guint32 busnum;
+  guint32 devnum;
+  /* The connection that imported the device, if any. */
+  UsbemuUsbipConnection *connection;
+} UsbemuUsbipExport;
+
+/* Received bytes. OUT payloads are slices of @bytes, each holding a
+ * reference, so that the chunk may be reused once it holds the only one. */
+typedef struct {
+  gint ref_count;
+  GBytes *bytes;
+} UsbemuUsbipChunk;
+
+struct _UsbemuUsbipConnection {
+  gint ref_count;
+  gboolean closed;
+
+  UsbemuUsbipServer *server;
+  /* Context its sources are attached to, that of the server until it
+   * imports a device served by another one. */
+  GMainContext *context;
+  /* Set on import until the connection is handed over to that context. */
+  GMainContext *handover;
+  GSocket *socket;
+  GSource *in_source;
+  /* Attached only while output is blocked. */
+  GSource *out_source;
+  /* Replaces @in_source and @out_source when io_uring is used. */
+  UsbemuIoRing *ring;
+  UsbemuIoRingOp *receive_op;
+  UsbemuIoRingOp *send_op;
+  /* Describes the write in flight, with copies of the headers it sends as
+   * replies move when more are queued. */
+  struct msghdr send_message;
+  GOutputVector send_vectors[MAX_SEND_VECTORS];
+  guint8 send_headers[MAX_SEND_VECTORS * USBIP_HEADER_SIZE];
+  /* Fires batch-latency after the first reply is queued. */
+  GSource *flush_source;
+  gboolean flush_armed;
+  /* Set while decoding input; replies are flushed once it is done. */
+  gboolean processing;
+  gboolean corked;
+
+  /* Received bytes are kept in @in_chunk from @in_start to @in_end. OUT
+   * payloads are slices of it, so it is rewound only when no slice is left,
+   * and replaced otherwise. While a ring buffer is decoded in place,
+   * @in_chunk wraps it and the connection's own chunk is set aside in
+   * @in_spare. */
+  UsbemuUsbipChunk *in_chunk;
+  UsbemuUsbipChunk *in_spare;
+  gboolean in_borrowed;
+  guint8 *in_data;
+  gsize in_capacity;
+  gsize in_start;
+  gsize in_end;
+  /* Array of UsbemuUsbipReply, written from @head on, the first one from
+   * byte @head_offset on. */
+  GArray *replies;
+  guint head;
+  gsize head_offset;
+
+  UsbemuUsbipStats stats;
+
+  UsbemuUsbipExport *export;
+  /* seqnum of an unlinked URB => seqnum of the USBIP_CMD_UNLINK. */
+  GHashTable *unlinks;
+};
+
+struct _UsbemuUsbipServer {
+  GObject parent_instance;
+
+  GMainContext *context;
+  GSocket *listener;
+  GSource *listen_source;
+
+  guint batch_size;
+  guint batch_latency;
+  guint cork_threshold;
+  gboolean io_uring;
+
+  /* busid => UsbemuUsbipExport. */
+  GHashTable *exports;
+  guint n_exported;
+  /* Set of UsbemuUsbipConnection, each holding a reference. */
+  GHashTable *connections;
+  /* Guards @connections and links between exports and connections, which
+   * connections handed over to other threads update when closing. */
+  GMutex lock;
+};
+
+G_DEFINE_TYPE (UsbemuUsbipServer, usbemu_usbip_server, G_TYPE_OBJECT)
+
+enum
+{
+  PROP_0,
+  PROP_BATCH_SIZE,
+  PROP_BATCH_LATENCY,
+  PROP_CORK_THRESHOLD,
+  PROP_IO_URING,
+  N_PROPERTIES
+};
+
+static GParamSpec *props[N_PROPERTIES] = { NULL, };
+
+#define USBEMU_USBIP_SERVER_PROP_BATCH_SIZE__DEFAULT 32
+#define USBEMU_USBIP_SERVER_PROP_BATCH_LATENCY__DEFAULT 0
+#define USBEMU_USBIP_SERVER_PROP_CORK_THRESHOLD__DEFAULT 8
+#define USBEMU_USBIP_SERVER_PROP_IO_URING__DEFAULT TRUE
+
+typedef enum {
+  FLUSH_INPUT,
+  FLUSH_COUNT,
+  FLUSH_LATENCY,
+  FLUSH_WRITABLE,
+} UsbemuUsbipFlushReason;
+
+/* virtual methods for GObjectClass */
+static void gobject_class_set_property (GObject *object, guint prop_id,
+                                        const GValue *value, GParamSpec *pspec);
+static void gobject_class_get_property (GObject *object, guint prop_id,
+                                        GValue *value, GParamSpec *pspec);
+static void gobject_class_dispose (GObject *object);
+static void gobject_class_finalize (GObject *object);
+/* virtual methods for UsbemuUsbipServerClass */
+static void usbemu_usbip_server_class_init (UsbemuUsbipServerClass *server_class);
+/* helper functions */
+static void _export_free (UsbemuUsbipExport *export);
+static UsbemuUsbipExport* _find_export (UsbemuUsbipServer *server,
+                                        UsbemuDevice *device);
+static gboolean _on_listener_readable (GSocket *socket,
+                                       GIOCondition condition,
+                                       gpointer user_data);
+static UsbemuUsbipConnection* _connection_new (UsbemuUsbipServer *server,
+                                               GSocket *socket);
+static UsbemuUsbipConnection* _connection_ref (UsbemuUsbipConnection *connection);
+static void _connection_unref (UsbemuUsbipConnection *connection);
+static void _connection_attach_sources (UsbemuUsbipConnection *connection);
+static void _connection_close (UsbemuUsbipConnection *connection);
+static gboolean _connection_close_in_context (gpointer user_data);
+static void _connection_hand_over (UsbemuUsbipConnection *connection);
+static gboolean _connection_adopt (gpointer user_data);
+static UsbemuUsbipReply* _connection_push_reply (UsbemuUsbipConnection *connection);
+static void _connection_queued (UsbemuUsbipConnection *connection);
+static void _connection_flush (UsbemuUsbipConnection *connection,
+                               UsbemuUsbipFlushReason reason);
+static void _reply_clear (UsbemuUsbipReply *reply);
+static void _connection_clear_replies (UsbemuUsbipConnection *connection);
+static void _add_vector (GOutputVector *vectors, guint *n_vectors,
+                         gconstpointer data, gsize size, gsize *skip);
+static void _connection_consume (UsbemuUsbipConnection *connection,
+                                 gsize sent);
+static void _connection_set_cork (UsbemuUsbipConnection *connection,
+                                  gboolean cork);
+static gboolean _flush_source_dispatch (GSource *source, GSourceFunc callback,
+                                        gpointer user_data);
+static gboolean _on_flush_timeout (gpointer user_data);
+static UsbemuUsbipChunk* _chunk_new (gsize size);
+static UsbemuUsbipChunk* _chunk_new_for_bytes (GBytes *bytes);
+static UsbemuUsbipChunk* _chunk_ref (UsbemuUsbipChunk *chunk);
+static void _chunk_unref (gpointer chunk);
+static gboolean _chunk_is_shared (UsbemuUsbipChunk *chunk);
+static GBytes* _chunk_slice (UsbemuUsbipChunk *chunk, const guint8 *data,
+                             gsize size);
+static void _connection_process (UsbemuUsbipConnection *connection);
+static void _connection_reserve_input (UsbemuUsbipConnection *connection);
+static void _connection_borrow_input (UsbemuUsbipConnection *connection,
+                                      GBytes *bytes);
+static void _connection_return_input (UsbemuUsbipConnection *connection);
+static gboolean _on_socket_readable (GSocket *socket, GIOCondition condition,
+                                     gpointer user_data);
+static guint _connection_fill_vectors (UsbemuUsbipConnection *connection,
+                                       GOutputVector *vectors,
+                                       guint8 *headers);
+static void _connection_drained (UsbemuUsbipConnection *connection);
+static void _connection_send_message (UsbemuUsbipConnection *connection);
+static void _on_ring_received (UsbemuIoRingOp *op, gint result,
+                               GBytes *bytes, gboolean more,
+                               gpointer user_data);
+static void _on_ring_sent (UsbemuIoRingOp *op, gint result,
+                           GBytes *bytes, gboolean more,
+                           gpointer user_data);
+static gboolean _on_socket_writable (GSocket *socket, GIOCondition condition,
+                                     gpointer user_data);
+static gssize _process_op (UsbemuUsbipConnection *connection,
+                           const guint8 *data, gsize size);
+static gssize _process_command (UsbemuUsbipConnection *connection,
+                                const guint8 *data, gsize size);
+static gboolean _route (UsbemuUsbipExport *export, guint32 devid,
+                        UsbemuDevice **device);
+static gssize _process_submit (UsbemuUsbipConnection *connection,
+                               UsbemuDevice *device, const guint8 *data,
+                               gsize size);
+static void _process_unlink (UsbemuUsbipConnection *connection,
+                             UsbemuDevice *device, guint32 seqnum,
+                             guint32 unlink_seqnum);
+static void _on_urb_completed (UsbemuUrb *urb, gpointer user_data);
+static void _append_device (GByteArray *array, UsbemuUsbipExport *export,
+                            gboolean with_interfaces);
+static void _queue_ret_submit (UsbemuUsbipConnection *connection,
+                               UsbemuUrb *urb);
+static void _queue_ret_unlink (UsbemuUsbipConnection *connection,
+                               guint32 seqnum, gint32 status);
+
+/* A ready-time only source, armed by _connection_queued(). */
+static GSourceFuncs flush_source_funcs = {
+  NULL,
+  NULL,
+  _flush_source_dispatch,
+  NULL,
+};
+
+static inline guint16
+_get_u16 (const guint8 *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static inline guint32
+_get_u32 (const guint8 *p)
+{
+  return ((guint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void
+_put_u16 (guint8  *p,
+          guint16  value)
+{
+  p[0] = value >> 8;
+  p[1] = value & 0xFF;
+}
+
+static inline void
+_put_u32 (guint8  *p,
+          guint32  value)
+{
+  p[0] = value >> 24;
+  p[1] = (value >> 16) & 0xFF;
+  p[2] = (value >> 8) & 0xFF;
+  p[3] = value & 0xFF;
+}
+
+/* Append @size zeroed bytes to @array and return a pointer to them, valid
+ * until @array grows again. */
+static guint8*
+_reserve (GByteArray *array,
+          gsize       size)
+{
+  guint offset = array->len;
+
+  g_byte_array_set_size (array, offset + size);
+  memset (array->data + offset, 0, size);
+
+  return array->data + offset;
+}
+
+static gint32
+_status_to_errno (UsbemuUrbStatus status)
+{
+  switch (status) {
+    case USBEMU_URB_STATUS_COMPLETED:
+      return 0;
+    case USBEMU_URB_STATUS_PENDING:
+      return -USBIP_EINPROGRESS;
+    case USBEMU_URB_STATUS_STALL:
+      return -USBIP_EPIPE;
+    case USBEMU_URB_STATUS_CANCELLED:
+      return -USBIP_ECONNRESET;
+    case USBEMU_URB_STATUS_SHUTDOWN:
+      return -USBIP_ESHUTDOWN;
+    case USBEMU_URB_STATUS_OVERFLOW:
+      return -USBIP_EOVERFLOW;
+    default:
+      return -USBIP_EPROTO;
+  }
+}
+
+static void
+gobject_class_set_property (GObject      *object,
+                            guint         prop_id,
+                            const GValue *value,
+                            GParamSpec   *pspec)
+{
+  UsbemuUsbipServer *server = USBEMU_USBIP_SERVER (object);
+
+  switch (prop_id) {
+    case PROP_BATCH_SIZE:
+      server->batch_size = g_value_get_uint (value);
+      break;
+    case PROP_BATCH_LATENCY:
+      server->batch_latency = g_value_get_uint (value);
+      break;
+    case PROP_CORK_THRESHOLD:
+      server->cork_threshold = g_value_get_uint (value);
+      break;
+    case PROP_IO_URING:
+      server->io_uring = g_value_get_boolean (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gobject_class_get_property (GObject    *object,
+                            guint       prop_id,
+                            GValue     *value,
+                            GParamSpec *pspec)
+{
+  UsbemuUsbipServer *server = USBEMU_USBIP_SERVER (object);
+
+  switch (prop_id) {
+    case PROP_BATCH_SIZE:
+      g_value_set_uint (value, server->batch_size);
+      break;
+    case PROP_BATCH_LATENCY:
+      g_value_set_uint (value, server->batch_latency);
+      break;
+    case PROP_CORK_THRESHOLD:
+      g_value_set_uint (value, server->cork_threshold);
+      break;
+    case PROP_IO_URING:
+      g_value_set_boolean (value, server->io_uring);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+  }
+}
+
+static void
+gobject_class_dispose (GObject *object)
+{
+  UsbemuUsbipServer *server = USBEMU_USBIP_SERVER (object);
+  GList *connections, *iter;
+
+  if (server->listen_source != NULL) {
+    g_source_destroy (server->listen_source);
+    g_clear_pointer (&server->listen_source, g_source_unref);
+  }
+  if (server->listener != NULL) {
+    g_socket_close (server->listener, NULL);
+    g_clear_object (&server->listener);
+  }
+
+  /* Closing removes the connection from the set. */
+  g_mutex_lock (&server->lock);
+  connections = g_hash_table_get_keys (server->connections);
+  for (iter = connections; iter != NULL; iter = iter->next)
+    _connection_ref (iter->data);
+  g_mutex_unlock (&server->lock);
+
+  for (iter = connections; iter != NULL; iter = iter->next) {
+    _connection_close (iter->data);
+    _connection_unref (iter->data);
+  }
+  g_list_free (connections);
+
+  g_hash_table_remove_all (server->exports);
+}
+
+static void
+gobject_class_finalize (GObject *object)
+{
+  UsbemuUsbipServer *server = USBEMU_USBIP_SERVER (object);
+
+  g_hash_table_unref (server->connections);
+  g_hash_table_unref (server->exports);
+  g_main_context_unref (server->context);
+  g_mutex_clear (&server->lock);
+}
+
+static void
+usbemu_usbip_server_class_init (UsbemuUsbipServerClass *server_class)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (server_class);
+
+  /* virtual methods */
+
+  object_class->set_property = gobject_class_set_property;
+  object_class->get_property = gobject_class_get_property;
+  object_class->dispose = gobject_class_dispose;
+  object_class->finalize = gobject_class_finalize;
+
+  /* properties */
+
+  /**
+   * UsbemuUsbipServer:batch-size:
+   *
+   * Number of queued replies that makes a connection write them at once.
+   */
+  props[PROP_BATCH_SIZE] =
+        g_param_spec_uint (USBEMU_USBIP_SERVER_PROP_BATCH_SIZE,
+                           "Batch Size", "Batch Size",
+                           1, G_MAXUINT,
+                           USBEMU_USBIP_SERVER_PROP_BATCH_SIZE__DEFAULT,
+                           G_PARAM_READWRITE | \
+                             G_PARAM_CONSTRUCT);
+
+  /**
+   * UsbemuUsbipServer:batch-latency:
+   *
+   * Longest time in microseconds a reply waits for more to be batched with.
+   * With 0, replies are written at the next main loop iteration.
+   */
+  props[PROP_BATCH_LATENCY] =
+        g_param_spec_uint (USBEMU_USBIP_SERVER_PROP_BATCH_LATENCY,
+                           "Batch Latency", "Batch Latency",
+                           0, G_MAXUINT,
+                           USBEMU_USBIP_SERVER_PROP_BATCH_LATENCY__DEFAULT,
+                           G_PARAM_READWRITE | \
+                             G_PARAM_CONSTRUCT);
+
+  /**
+   * UsbemuUsbipServer:cork-threshold:
+   *
+   * Number of replies written at once from which TCP_CORK is set for the
+   * write, or 0 to never cork.
+   */
+  props[PROP_CORK_THRESHOLD] =
+        g_param_spec_uint (USBEMU_USBIP_SERVER_PROP_CORK_THRESHOLD,
+                           "Cork Threshold", "Cork Threshold",
+                           0, G_MAXUINT,
+                           USBEMU_USBIP_SERVER_PROP_CORK_THRESHOLD__DEFAULT,
+                           G_PARAM_READWRITE | \
+                             G_PARAM_CONSTRUCT);
+
+  /**
+   * UsbemuUsbipServer:io-uring:
+   *
+   * Whether connections accepted from now on use io_uring, if available,
+   * see usbemu_usbip_server_io_uring_available().
+   */
+  props[PROP_IO_URING] =
+        g_param_spec_boolean (USBEMU_USBIP_SERVER_PROP_IO_URING,
+                              "io_uring", "io_uring",
+                              USBEMU_USBIP_SERVER_PROP_IO_URING__DEFAULT,
+                              G_PARAM_READWRITE | \
+                                G_PARAM_CONSTRUCT);
+
+  g_object_class_install_properties (object_class, N_PROPERTIES, props);
+}
+
+static void
+usbemu_usbip_server_init (UsbemuUsbipServer *server)
+{
+  server->context = g_main_context_ref_thread_default ();
+  server->listener = NULL;
+  server->listen_source = NULL;
+  server->batch_size = USBEMU_USBIP_SERVER_PROP_BATCH_SIZE__DEFAULT;
+  server->batch_latency = USBEMU_USBIP_SERVER_PROP_BATCH_LATENCY__DEFAULT;
+  server->cork_threshold = USBEMU_USBIP_SERVER_PROP_CORK_THRESHOLD__DEFAULT;
+  server->io_uring = USBEMU_USBIP_SERVER_PROP_IO_URING__DEFAULT;
+  server->exports = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                           (GDestroyNotify) _export_free);
+  server->n_exported = 0;
+  server->connections =
+      g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                             (GDestroyNotify) _connection_unref, NULL);
+  g_mutex_init (&server->lock);
+}
+
+static void
+_export_free (UsbemuUsbipExport *export)
+{
+  UsbemuUsbipConnection *connection = NULL;
+
+  if (export->server != NULL) {
+    g_mutex_lock (&export->server->lock);
+    if (export->connection != NULL)
+      connection = _connection_ref (export->connection);
+    g_mutex_unlock (&export->server->lock);
+  }
+
+  if (connection != NULL) {
+    _connection_close (connection);
+    _connection_unref (connection);
+  }
+
+  g_object_unref (export->device);
+  g_free (export->busid);
+  g_free (export);
+}
+
+static UsbemuUsbipExport*
+_find_export (UsbemuUsbipServer *server,
+              UsbemuDevice      *device)
+{
+  GHashTableIter iter;
+  UsbemuUsbipExport *export;
+
+  g_hash_table_iter_init (&iter, server->exports);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &export)) {
+    if (export->device == device)
+      return export;
+  }
+
+  return NULL;
+}
+
+static gboolean
+_on_listener_readable (GSocket      *socket,
+                       GIOCondition  condition,
+                       gpointer      user_data)
+{
+  UsbemuUsbipServer *server = user_data;
+  GSocket *client;
+  GError *error = NULL;
+
+  while (TRUE) {
+    client = g_socket_accept (socket, NULL, &error);
+    if (client == NULL) {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        g_warning ("Failed to accept USB/IP connection: %s", error->message);
+      g_error_free (error);
+      break;
+    }
+
+    _connection_new (server, client);
+    g_object_unref (client);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static UsbemuUsbipConnection*
+_connection_new (UsbemuUsbipServer *server,
+                 GSocket           *socket)
+{
+  UsbemuUsbipConnection *connection;
+
+  connection = g_new0 (UsbemuUsbipConnection, 1);
+  connection->ref_count = 1;
+  connection->server = server;
+  connection->context = g_main_context_ref (server->context);
+  connection->handover = NULL;
+  connection->socket = g_object_ref (socket);
+  connection->in_chunk = NULL;
+  connection->in_spare = NULL;
+  connection->in_borrowed = FALSE;
+  connection->in_data = NULL;
+  connection->in_capacity = 0;
+  connection->in_start = connection->in_end = 0;
+  connection->replies = g_array_new (FALSE, TRUE, sizeof (UsbemuUsbipReply));
+  connection->unlinks = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  g_socket_set_blocking (socket, FALSE);
+  /* Replies are batched here, so never delay them further in the kernel. */
+  g_socket_set_option (socket, IPPROTO_TCP, TCP_NODELAY, TRUE, NULL);
+
+  _connection_attach_sources (connection);
+
+  /* The set takes over the initial reference. */
+  g_mutex_lock (&server->lock);
+  g_hash_table_add (server->connections, connection);
+  g_mutex_unlock (&server->lock);
+
+  return connection;
+}
+
+static void
+_connection_attach_sources (UsbemuUsbipConnection *connection)
+{
+  GMainContext *thread_context;
+
+  /* The ring of a thread is dispatched in its thread-default context. */
+  thread_context = g_main_context_get_thread_default ();
+  if (thread_context == NULL)
+    thread_context = g_main_context_default ();
+  if (connection->server->io_uring && (thread_context == connection->context))
+    connection->ring = _usbemu_io_ring_ref_default ();
+
+  if (connection->ring != NULL) {
+    connection->receive_op =
+        _usbemu_io_ring_receive (connection->ring,
+                                 g_socket_get_fd (connection->socket),
+                                 _on_ring_received,
+                                 _connection_ref (connection),
+                                 (GDestroyNotify) _connection_unref);
+  } else {
+    connection->in_source = g_socket_create_source (connection->socket,
+                                                    G_IO_IN, NULL);
+    g_source_set_callback (connection->in_source,
+                           (GSourceFunc) _on_socket_readable,
+                           _connection_ref (connection),
+                           (GDestroyNotify) _connection_unref);
+    g_source_attach (connection->in_source, connection->context);
+  }
+
+  connection->flush_source = g_source_new (&flush_source_funcs,
+                                           sizeof (GSource));
+  g_source_set_callback (connection->flush_source, _on_flush_timeout,
+                         _connection_ref (connection),
+                         (GDestroyNotify) _connection_unref);
+  g_source_attach (connection->flush_source, connection->context);
+}
+
+/* Connections are only used from their context, but completions and
+ * closing may drop references from elsewhere. */
+static UsbemuUsbipConnection*
+_connection_ref (UsbemuUsbipConnection *connection)
+{
+  g_atomic_int_inc (&connection->ref_count);
+
+  return connection;
+}
+
+static void
+_connection_unref (UsbemuUsbipConnection *connection)
+{
+  if (!g_atomic_int_dec_and_test (&connection->ref_count))
+    return;
+
+  g_hash_table_unref (connection->unlinks);
+  _connection_clear_replies (connection);
+  g_array_unref (connection->replies);
+  if (connection->in_chunk != NULL)
+    _chunk_unref (connection->in_chunk);
+  if (connection->in_spare != NULL)
+    _chunk_unref (connection->in_spare);
+  g_object_unref (connection->socket);
+  if (connection->handover != NULL)
+    g_main_context_unref (connection->handover);
+  g_main_context_unref (connection->context);
+  g_free (connection);
+}
+
+/* Close @connection from its context, waiting for it if called from another
+ * thread. */
+static void
+_connection_close (UsbemuUsbipConnection *connection)
+{
+  if (connection->closed)
+    return;
+
+  _connection_ref (connection);
+  _usbemu_context_invoke_sync (connection->context,
+                               _connection_close_in_context, connection);
+  _connection_unref (connection);
+}
+
+static gboolean
+_connection_close_in_context (gpointer user_data)
+{
+  UsbemuUsbipConnection *connection = user_data;
+  UsbemuUsbipServer *server = connection->server;
+  UsbemuUsbipExport *export;
+  UsbemuDevice *device = NULL;
+
+  if (connection->closed)
+    return G_SOURCE_REMOVE;
+
+  connection->closed = TRUE;
+  _connection_ref (connection);
+
+  if (connection->in_source != NULL) {
+    g_source_destroy (connection->in_source);
+    g_clear_pointer (&connection->in_source, g_source_unref);
+  }
+  if (connection->flush_source != NULL) {
+    g_source_destroy (connection->flush_source);
+    g_clear_pointer (&connection->flush_source, g_source_unref);
+  }
+  if (connection->out_source != NULL) {
+    g_source_destroy (connection->out_source);
+    g_clear_pointer (&connection->out_source, g_source_unref);
+  }
+  /* They complete later, dropping their references then. */
+  if (connection->receive_op != NULL)
+    _usbemu_io_ring_cancel (connection->ring, connection->receive_op);
+  if (connection->send_op != NULL)
+    _usbemu_io_ring_cancel (connection->ring, connection->send_op);
+  /* Rings are not thread-safe, so never left to the last reference. */
+  if (connection->ring != NULL) {
+    _usbemu_io_ring_unref (connection->ring);
+    connection->ring = NULL;
+  }
+  g_socket_close (connection->socket, NULL);
+  _connection_clear_replies (connection);
+
+  g_mutex_lock (&server->lock);
+  export = connection->export;
+  if (export != NULL) {
+    connection->export = NULL;
+    export->connection = NULL;
+    device = g_object_ref (export->device);
+  }
+  g_mutex_unlock (&server->lock);
+
+  if (device != NULL) {
+    /* Those still completing later only drop their references. */
+    usbemu_device_cancel_all_urbs (device);
+
+    _usbemu_device_set_attached (device, FALSE);
+    g_object_unref (device);
+  }
+
+  /* Drops the reference of the set, not the last one. */
+  g_mutex_lock (&server->lock);
+  g_hash_table_remove (server->connections, connection);
+  g_mutex_unlock (&server->lock);
+
+  _connection_unref (connection);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Move @connection to the context serving the device it just imported.
+ * Its sources are recreated there, where the device is then attached and
+ * the rest of the input processed. With io_uring, this waits for the
+ * operations in flight on the ring of this thread, and is called again as
+ * they complete. */
+static void
+_connection_hand_over (UsbemuUsbipConnection *connection)
+{
+  if (connection->in_source != NULL) {
+    g_source_destroy (connection->in_source);
+    g_clear_pointer (&connection->in_source, g_source_unref);
+  }
+  if (connection->flush_source != NULL) {
+    g_source_destroy (connection->flush_source);
+    g_clear_pointer (&connection->flush_source, g_source_unref);
+  }
+  connection->flush_armed = FALSE;
+  if (connection->out_source != NULL) {
+    g_source_destroy (connection->out_source);
+    g_clear_pointer (&connection->out_source, g_source_unref);
+  }
+
+  if (connection->receive_op != NULL) {
+    _usbemu_io_ring_cancel (connection->ring, connection->receive_op);
+    return;
+  }
+  if (connection->send_op != NULL)
+    return;
+  if (connection->ring != NULL) {
+    _usbemu_io_ring_unref (connection->ring);
+    connection->ring = NULL;
+  }
+
+  g_main_context_unref (connection->context);
+  connection->context = connection->handover;
+  connection->handover = NULL;
+
+  g_main_context_invoke_full (connection->context, G_PRIORITY_DEFAULT,
+                              _connection_adopt, _connection_ref (connection),
+                              (GDestroyNotify) _connection_unref);
+}
+
+static gboolean
+_connection_adopt (gpointer user_data)
+{
+  UsbemuUsbipConnection *connection = user_data;
+
+  if (connection->closed)
+    return G_SOURCE_REMOVE;
+
+  _connection_attach_sources (connection);
+  _usbemu_device_set_attached (connection->export->device, TRUE);
+  if (!connection->closed)
+    _connection_process (connection);
+
+  return G_SOURCE_REMOVE;
+}
+
+static UsbemuUsbipReply*
+_connection_push_reply (UsbemuUsbipConnection *connection)
+{
+  GArray *replies = connection->replies;
+
+  /* Zeroed by the array. */
+  g_array_set_size (replies, replies->len + 1);
+
+  return &g_array_index (replies, UsbemuUsbipReply, replies->len - 1);
+}
+
+/* Decide when to write replies just queued. */
+static void
+_connection_queued (UsbemuUsbipConnection *connection)
+{
+  UsbemuUsbipServer *server = connection->server;
+  guint depth = connection->replies->len - connection->head;
+
+  if (depth > connection->stats.max_queue_depth)
+    connection->stats.max_queue_depth = depth;
+
+  if (depth >= server->batch_size) {
+    _connection_flush (connection, FLUSH_COUNT);
+  } else if (!connection->processing && !connection->flush_armed) {
+    /* Requests being decoded are answered once decoding is done. */
+    g_source_set_ready_time (connection->flush_source,
+                             g_get_monotonic_time () + server->batch_latency);
+    connection->flush_armed = TRUE;
+  }
+}
+
+static void
+_reply_clear (UsbemuUsbipReply *reply)
+{
+  if (reply->urb != NULL)
+    usbemu_urb_unref (reply->urb);
+  if (reply->extra != NULL)
+    g_byte_array_unref (reply->extra);
+}
+
+static void
+_connection_clear_replies (UsbemuUsbipConnection *connection)
+{
+  GArray *replies = connection->replies;
+  guint i;
+
+  for (i = connection->head; i < replies->len; i++)
+    _reply_clear (&g_array_index (replies, UsbemuUsbipReply, i));
+  g_array_set_size (replies, 0);
+  connection->head = 0;
+  connection->head_offset = 0;
+}
+
+static void
+_connection_set_cork (UsbemuUsbipConnection *connection,
+                      gboolean               cork)
+{
+#if defined (TCP_CORK)
+  if (cork == connection->corked)
+    return;
+
+  if (g_socket_set_option (connection->socket, IPPROTO_TCP, TCP_CORK, cork,
+                           NULL)) {
+    connection->corked = cork;
+    if (cork)
+      connection->stats.n_corks++;
+  }
+#endif
+}
+
+/* Append the part of @size bytes at @data not covered by @skip. */
+static void
+_add_vector (GOutputVector *vectors,
+             guint         *n_vectors,
+             gconstpointer  data,
+             gsize          size,
+             gsize         *skip)
+{
+  if (*skip >= size) {
+    *skip -= size;
+    return;
+  }
+
+  vectors[*n_vectors].buffer = (const guint8*) data + *skip;
+  vectors[*n_vectors].size = size - *skip;
+  (*n_vectors)++;
+  *skip = 0;
+}
+
+/* Drop replies fully covered by @sent more bytes written. */
+static void
+_connection_consume (UsbemuUsbipConnection *connection,
+                     gsize                  sent)
+{
+  GArray *replies = connection->replies;
+  UsbemuUsbipReply *reply;
+  gsize size;
+
+  sent += connection->head_offset;
+  while (connection->head < replies->len) {
+    reply = &g_array_index (replies, UsbemuUsbipReply, connection->head);
+    size = reply->header_size + reply->payload_size +
+           ((reply->extra != NULL) ? reply->extra->len : 0);
+    if (sent < size)
+      break;
+
+    sent -= size;
+    _reply_clear (reply);
+    connection->head++;
+    connection->stats.n_replies++;
+  }
+  connection->head_offset = sent;
+}
+
+/* Describe queued replies from the head on with at most MAX_SEND_VECTORS
+ * vectors. Headers are copied to @headers first if not %NULL. */
+static guint
+_connection_fill_vectors (UsbemuUsbipConnection *connection,
+                          GOutputVector         *vectors,
+                          guint8                *headers)
+{
+  GArray *replies = connection->replies;
+  UsbemuUsbipReply *reply;
+  const guint8 *header;
+  guint n_vectors = 0, i;
+  gsize skip;
+
+  skip = connection->head_offset;
+  for (i = connection->head;
+       (i < replies->len) && (n_vectors + 3 <= MAX_SEND_VECTORS); i++) {
+    reply = &g_array_index (replies, UsbemuUsbipReply, i);
+    header = reply->header;
+    if (headers != NULL) {
+      memcpy (headers, reply->header, reply->header_size);
+      header = headers;
+      headers += USBIP_HEADER_SIZE;
+    }
+    _add_vector (vectors, &n_vectors, header, reply->header_size, &skip);
+    _add_vector (vectors, &n_vectors, reply->payload, reply->payload_size,
+                 &skip);
+    if (reply->extra != NULL)
+      _add_vector (vectors, &n_vectors, reply->extra->data,
+                   reply->extra->len, &skip);
+  }
+
+  return n_vectors;
+}
+
+/* Forget replies once all are written. */
+static void
+_connection_drained (UsbemuUsbipConnection *connection)
+{
+  g_array_set_size (connection->replies, 0);
+  connection->head = 0;
+  connection->head_offset = 0;
+
+  /* Push out the last partial segment. */
+  _connection_set_cork (connection, FALSE);
+  if (connection->out_source != NULL) {
+    g_source_destroy (connection->out_source);
+    g_clear_pointer (&connection->out_source, g_source_unref);
+  }
+}
+
+/* Queue a write of replies from the head on to the ring, completed by
+ * _on_ring_sent(). Replies queued meanwhile go with the next one. */
+static void
+_connection_send_message (UsbemuUsbipConnection *connection)
+{
+  G_STATIC_ASSERT (sizeof (GOutputVector) == sizeof (struct iovec));
+
+  memset (&connection->send_message, 0, sizeof (struct msghdr));
+  connection->send_message.msg_iov = (struct iovec*) connection->send_vectors;
+  connection->send_message.msg_iovlen =
+      _connection_fill_vectors (connection, connection->send_vectors,
+                                connection->send_headers);
+
+  connection->send_op =
+      _usbemu_io_ring_send_message (connection->ring,
+                                    g_socket_get_fd (connection->socket),
+                                    &connection->send_message,
+                                    _on_ring_sent,
+                                    _connection_ref (connection),
+                                    (GDestroyNotify) _connection_unref);
+  connection->stats.n_send_calls++;
+}
+
+static void
+_on_ring_sent (UsbemuIoRingOp *op,
+               gint            result,
+               GBytes         *bytes,
+               gboolean        more,
+               gpointer        user_data)
+{
+  UsbemuUsbipConnection *connection = user_data;
+
+  connection->send_op = NULL;
+  if (connection->closed)
+    return;
+
+  if (result < 0) {
+    g_debug ("Failed to send USB/IP reply: %s", g_strerror (-result));
+    _connection_close (connection);
+    return;
+  }
+
+  connection->stats.n_bytes += result;
+  _connection_consume (connection, result);
+  if (connection->head < connection->replies->len)
+    _connection_send_message (connection);
+  else
+    _connection_drained (connection);
+
+  if (connection->handover != NULL)
+    _connection_hand_over (connection);
+}
+
+/* Write queued replies with as few sendmsg() calls as possible, and wait for
+ * the socket to become writable if it would block. */
+static void
+_connection_flush (UsbemuUsbipConnection  *connection,
+                   UsbemuUsbipFlushReason  reason)
+{
+  GArray *replies = connection->replies;
+  GOutputVector vectors[MAX_SEND_VECTORS];
+  GError *error = NULL;
+  guint n_vectors;
+  gssize sent;
+
+  if (connection->flush_armed) {
+    g_source_set_ready_time (connection->flush_source, -1);
+    connection->flush_armed = FALSE;
+  }
+
+  if (connection->head == replies->len)
+    return;
+
+  /* Everything goes once the socket drains, or the write in flight
+   * completes. */
+  if ((connection->out_source != NULL) && (reason != FLUSH_WRITABLE))
+    return;
+  if (connection->send_op != NULL)
+    return;
+
+  switch (reason) {
+    case FLUSH_INPUT:
+      connection->stats.n_input_flushes++;
+      break;
+    case FLUSH_COUNT:
+      connection->stats.n_count_flushes++;
+      break;
+    case FLUSH_LATENCY:
+      connection->stats.n_latency_flushes++;
+      break;
+    default:
+      break;
+  }
+
+  if ((connection->server->cork_threshold != 0) &&
+      (replies->len - connection->head >= connection->server->cork_threshold))
+    _connection_set_cork (connection, TRUE);
+
+  if (connection->ring != NULL) {
+    _connection_send_message (connection);
+    return;
+  }
+
+  while (connection->head < replies->len) {
+    n_vectors = _connection_fill_vectors (connection, vectors, NULL);
+    sent = g_socket_send_message (connection->socket, NULL, vectors,
+                                  n_vectors, NULL, 0, 0, NULL, &error);
+    connection->stats.n_send_calls++;
+    if (sent < 0) {
+      if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_debug ("Failed to send USB/IP reply: %s", error->message);
+        g_error_free (error);
+        _connection_close (connection);
+        return;
+      }
+
+      g_error_free (error);
+      connection->stats.n_blocked++;
+      if (connection->out_source == NULL) {
+        connection->out_source =
+            g_socket_create_source (connection->socket, G_IO_OUT, NULL);
+        g_source_set_callback (connection->out_source,
+                               (GSourceFunc) _on_socket_writable,
+                               _connection_ref (connection),
+                               (GDestroyNotify) _connection_unref);
+        g_source_attach (connection->out_source, connection->context);
+      }
+      return;
+    }
+
+    connection->stats.n_bytes += sent;
+    _connection_consume (connection, sent);
+  }
+
+  _connection_drained (connection);
+}
+
+static gboolean
+_flush_source_dispatch (GSource     *source,
+                        GSourceFunc  callback,
+                        gpointer     user_data)
+{
+  g_source_set_ready_time (source, -1);
+
+  return callback (user_data);
+}
+
+static gboolean
+_on_flush_timeout (gpointer user_data)
+{
+  UsbemuUsbipConnection *connection = user_data;
+
+  connection->flush_armed = FALSE;
+  _connection_flush (connection, FLUSH_LATENCY);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+_on_socket_writable (GSocket      *socket,
+                     GIOCondition  condition,
+                     gpointer      user_data)
+{
+  UsbemuUsbipConnection *connection = user_data;
+
+  /* Destroys this source once drained or closed. */
+  _connection_flush (connection, FLUSH_WRITABLE);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static UsbemuUsbipChunk*
+_chunk_new (gsize size)
+{
+  UsbemuUsbipChunk *chunk;
+
+  chunk = g_new (UsbemuUsbipChunk, 1);
+  chunk->ref_count = 1;
+  chunk->bytes = g_bytes_new_take (g_malloc (size), size);
+
+  return chunk;
+}
+
+static UsbemuUsbipChunk*
+_chunk_new_for_bytes (GBytes *bytes)
+{
+  UsbemuUsbipChunk *chunk;
+
+  chunk = g_new (UsbemuUsbipChunk, 1);
+  chunk->ref_count = 1;
+  chunk->bytes = g_bytes_ref (bytes);
+
+  return chunk;
+}
+
+static UsbemuUsbipChunk*
+_chunk_ref (UsbemuUsbipChunk *chunk)
+{
+  g_atomic_int_inc (&chunk->ref_count);
+
+  return chunk;
+}
+
+/* Slices may be released from any thread. */
+static void
+_chunk_unref (gpointer data)
+{
+  UsbemuUsbipChunk *chunk = data;
+
+  if (!g_atomic_int_dec_and_test (&chunk->ref_count))
+    return;
+
+  g_bytes_unref (chunk->bytes);
+  g_free (chunk);
+}
+
+/* Only the connection creates slices, so a chunk it holds the only
+ * reference to stays unshared until it slices it again. */
+static gboolean
+_chunk_is_shared (UsbemuUsbipChunk *chunk)
+{
+  return g_atomic_int_get (&chunk->ref_count) != 1;
+}
+
+static GBytes*
+_chunk_slice (UsbemuUsbipChunk *chunk,
+              const guint8     *data,
+              gsize             size)
+{
+  return g_bytes_new_with_free_func (data, size, _chunk_unref,
+                                     _chunk_ref (chunk));
+}
+
+/* Make room for at least RECEIVE_CHUNK_SIZE more bytes, moving what is left
+ * to process to the front of the chunk, or into a new chunk if OUT payloads
+ * still point into it or it is too small. */
+static void
+_connection_reserve_input (UsbemuUsbipConnection *connection)
+{
+  gsize pending = connection->in_end - connection->in_start;
+  UsbemuUsbipChunk *chunk;
+  gsize capacity;
+
+  if (connection->in_capacity - connection->in_end >= RECEIVE_CHUNK_SIZE)
+    return;
+
+  if ((connection->in_chunk != NULL) &&
+      !_chunk_is_shared (connection->in_chunk) &&
+      (connection->in_capacity - pending >= RECEIVE_CHUNK_SIZE)) {
+    memmove (connection->in_data, connection->in_data + connection->in_start,
+             pending);
+    connection->in_start = 0;
+    connection->in_end = pending;
+    return;
+  }
+
+  /* Large OUT transfers grow the chunk until they fit. */
+  capacity = MAX (4 * RECEIVE_CHUNK_SIZE, 2 * pending);
+  chunk = _chunk_new (capacity);
+  if (pending != 0) {
+    memcpy ((guint8*) g_bytes_get_data (chunk->bytes, NULL),
+            connection->in_data + connection->in_start, pending);
+  }
+
+  if (connection->in_chunk != NULL)
+    _chunk_unref (connection->in_chunk);
+  connection->in_chunk = chunk;
+  connection->in_data = (guint8*) g_bytes_get_data (chunk->bytes, NULL);
+  connection->in_capacity = capacity;
+  connection->in_start = 0;
+  connection->in_end = pending;
+}
+
+/* Decode @bytes, a ring buffer, in place so that OUT payloads are sliced
+ * from it. Only done with no bytes pending, see _connection_return_input().
+ */
+static void
+_connection_borrow_input (UsbemuUsbipConnection *connection,
+                          GBytes                *bytes)
+{
+  /* A chunk OUT payloads still point into won't be rewound anyway. */
+  if ((connection->in_chunk != NULL) &&
+      _chunk_is_shared (connection->in_chunk))
+    g_clear_pointer (&connection->in_chunk, _chunk_unref);
+
+  connection->in_spare = connection->in_chunk;
+  connection->in_chunk = _chunk_new_for_bytes (bytes);
+  connection->in_borrowed = TRUE;
+  connection->in_data = (guint8*) g_bytes_get_data (bytes,
+                                                    &connection->in_capacity);
+  connection->in_start = 0;
+  connection->in_end = connection->in_capacity;
+}
+
+/* Put the chunk set aside by _connection_borrow_input() back, with a copy of
+ * the incomplete request the ring buffer ends with. The buffer returns to
+ * the kernel once OUT payloads sliced from it are released. */
+static void
+_connection_return_input (UsbemuUsbipConnection *connection)
+{
+  UsbemuUsbipChunk *borrowed = connection->in_chunk;
+  const guint8 *pending_data = connection->in_data + connection->in_start;
+  gsize pending = connection->in_end - connection->in_start;
+
+  connection->in_chunk = connection->in_spare;
+  connection->in_spare = NULL;
+  connection->in_borrowed = FALSE;
+  connection->in_data = NULL;
+  connection->in_capacity = 0;
+  if (connection->in_chunk != NULL) {
+    connection->in_data =
+        (guint8*) g_bytes_get_data (connection->in_chunk->bytes,
+                                    &connection->in_capacity);
+  }
+  connection->in_start = connection->in_end = 0;
+
+  if (pending != 0) {
+    /* Ring buffers are smaller than what is reserved. */
+    _connection_reserve_input (connection);
+    memcpy (connection->in_data, pending_data, pending);
+    connection->in_end = pending;
+  }
+
+  _chunk_unref (borrowed);
+}
+
+static gboolean
+_on_socket_readable (GSocket      *socket,
+                     GIOCondition  condition,
+                     gpointer      user_data)
+{
+  UsbemuUsbipConnection *connection = user_data;
+  GError *error = NULL;
+  gssize received;
+
+  /* One read per dispatch keeps busy connections from starving others. */
+  _connection_reserve_input (connection);
+  received = g_socket_receive (socket,
+                               (gchar*) connection->in_data + connection->in_end,
+                               connection->in_capacity - connection->in_end,
+                               NULL, &error);
+  if (received <= 0) {
+    if ((received < 0) &&
+        g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+      g_error_free (error);
+      return G_SOURCE_CONTINUE;
+    }
+
+    if (error != NULL) {
+      g_debug ("Failed to receive USB/IP request: %s", error->message);
+      g_error_free (error);
+    }
+    _connection_close (connection);
+    return G_SOURCE_REMOVE;
+  }
+
+  connection->in_end += received;
+  _connection_process (connection);
+
+  /* Handed over sources are already destroyed. */
+  return (connection->closed || (connection->in_source == NULL)) ?
+         G_SOURCE_REMOVE : G_SOURCE_CONTINUE;
+}
+
+static void
+_on_ring_received (UsbemuIoRingOp *op,
+                   gint            result,
+                   GBytes         *bytes,
+                   gboolean        more,
+                   gpointer        user_data)
+{
+  UsbemuUsbipConnection *connection = user_data;
+
+  if (!more)
+    connection->receive_op = NULL;
+  if (connection->closed)
+    return;
+
+  if (result > 0) {
+    if (connection->in_start == connection->in_end) {
+      _connection_borrow_input (connection, bytes);
+    } else {
+      /* Ring buffers are smaller than what is reserved. */
+      _connection_reserve_input (connection);
+      memcpy (connection->in_data + connection->in_end,
+              g_bytes_get_data (bytes, NULL), result);
+      connection->in_end += result;
+    }
+    _connection_process (connection);
+  } else if (result != -ECANCELED) {
+    if (result < 0)
+      g_debug ("Failed to receive USB/IP request: %s", g_strerror (-result));
+    _connection_close (connection);
+    return;
+  }
+
+  /* Cancelled for a hand over, see _connection_hand_over(). */
+  if (!more && !connection->closed && (connection->handover != NULL))
+    _connection_hand_over (connection);
+}
+
+static void
+_connection_process (UsbemuUsbipConnection *connection)
+{
+  const guint8 *data;
+  gsize size;
+  gssize consumed;
+
+  /* Completions and signal handlers may close the connection. */
+  _connection_ref (connection);
+
+  connection->processing = TRUE;
+  while (!connection->closed && (connection->handover == NULL)) {
+    data = connection->in_data + connection->in_start;
+    size = connection->in_end - connection->in_start;
+    if (connection->export == NULL)
+      consumed = _process_op (connection, data, size);
+    else
+      consumed = _process_command (connection, data, size);
+    if (consumed == 0)
+      break;
+
+    if (consumed < 0) {
+      g_debug ("Malformed USB/IP request, closing connection");
+      _connection_close (connection);
+      break;
+    }
+
+    connection->in_start += consumed;
+  }
+  connection->processing = FALSE;
+
+  if (connection->in_borrowed)
+    _connection_return_input (connection);
+  /* Rewinding would overwrite OUT payloads still in use. */
+  if ((connection->in_start == connection->in_end) &&
+      (connection->in_chunk != NULL) &&
+      !_chunk_is_shared (connection->in_chunk))
+    connection->in_start = connection->in_end = 0;
+  if (!connection->closed)
+    _connection_flush (connection, FLUSH_INPUT);
+  if (!connection->closed && (connection->handover != NULL))
+    _connection_hand_over (connection);
+
+  _connection_unref (connection);
+}
+
+/* Returns number of bytes consumed, 0 if incomplete, or -1 if malformed. */
+static gssize
+_process_op (UsbemuUsbipConnection *connection,
+             const guint8          *data,
+             gsize                  size)
+{
+  UsbemuUsbipServer *server = connection->server;
+  UsbemuUsbipReply *reply;
+  UsbemuUsbipExport *export;
+  GHashTableIter iter;
+  GMainContext *context;
+  gchar busid[USBIP_BUSID_SIZE];
+  guint32 status;
+
+  if (size < OP_HEADER_SIZE)
+    return 0;
+
+  if (_get_u16 (data) != USBIP_VERSION)
+    return -1;
+
+  switch (_get_u16 (data + 2)) {
+    case OP_REQ_DEVLIST:
+      reply = _connection_push_reply (connection);
+      reply->header_size = OP_HEADER_SIZE + 4;
+      _put_u16 (reply->header, USBIP_VERSION);
+      _put_u16 (reply->header + 2, OP_REP_DEVLIST);
+      _put_u32 (reply->header + 4, OP_STATUS_OK);
+      _put_u32 (reply->header + 8, g_hash_table_size (server->exports));
+
+      reply->extra = g_byte_array_new ();
+      g_hash_table_iter_init (&iter, server->exports);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer*) &export))
+        _append_device (reply->extra, export, TRUE);
+
+      _connection_queued (connection);
+      return OP_HEADER_SIZE;
+
+    case OP_REQ_IMPORT:
+      if (size < OP_HEADER_SIZE + USBIP_BUSID_SIZE)
+        return 0;
+
+      memcpy (busid, data + OP_HEADER_SIZE, USBIP_BUSID_SIZE);
+      busid[USBIP_BUSID_SIZE - 1] = '\0';
+      export = g_hash_table_lookup (server->exports, busid);
+      g_mutex_lock (&server->lock);
+      if (export == NULL)
+        status = OP_STATUS_NODEV;
+      else if ((export->connection != NULL) ||
+               usbemu_device_get_attached (export->device))
+        status = OP_STATUS_DEV_BUSY;
+      else
+        status = OP_STATUS_OK;
+      if (status == OP_STATUS_OK) {
+        export->connection = connection;
+        connection->export = export;
+      }
+      g_mutex_unlock (&server->lock);
+
+      reply = _connection_push_reply (connection);
+      reply->header_size = OP_HEADER_SIZE;
+      _put_u16 (reply->header, USBIP_VERSION);
+      _put_u16 (reply->header + 2, OP_REP_IMPORT);
+      _put_u32 (reply->header + 4, status);
+      if (status == OP_STATUS_OK) {
+        reply->extra = g_byte_array_sized_new (USBIP_DEVICE_SIZE);
+        _append_device (reply->extra, export, FALSE);
+      }
+
+      _connection_queued (connection);
+      if ((status != OP_STATUS_OK) || connection->closed)
+        return OP_HEADER_SIZE + USBIP_BUSID_SIZE;
+
+      /* Devices served by another thread get the connection along. */
+      context = usbemu_device_get_context (export->device);
+      if ((context != NULL) && (context != connection->context))
+        connection->handover = g_main_context_ref (context);
+      else
+        _usbemu_device_set_attached (export->device, TRUE);
+      return OP_HEADER_SIZE + USBIP_BUSID_SIZE;
+
+    default:
+      return -1;
+  }
+}
+
+/* Find the device @devid addresses: the exported device itself, or for an
+ * exported hub, the device behind it the host assigned the USB address in
+ * the devnum half of @devid. Returns FALSE if @devid is not valid for
+ * @export, and TRUE with @device set to %NULL if no device answers. */
+static gboolean
+_route (UsbemuUsbipExport  *export,
+        guint32             devid,
+        UsbemuDevice      **device)
+{
+  *device = NULL;
+
+  if (devid == ((export->busnum << 16) | export->devnum)) {
+    *device = export->device;
+    return TRUE;
+  }
+
+  if (((devid >> 16) != export->busnum) || ((devid & 0xFFFF) > 127) ||
+      !USBEMU_IS_HUB (export->device))
+    return FALSE;
+
+  *device = usbemu_hub_lookup_address (USBEMU_HUB (export->device),
+                                       devid & 0xFFFF);
+  return TRUE;
+}
+
+/* Returns number of bytes consumed, 0 if incomplete, or -1 if malformed. */
+static gssize
+_process_command (UsbemuUsbipConnection *connection,
+                  const guint8          *data,
+                  gsize                  size)
+{
+  UsbemuDevice *device;
+
+  if (size < USBIP_HEADER_SIZE)
+    return 0;
+
+  if (!_route (connection->export, _get_u32 (data + 8), &device) ||
+      (_get_u32 (data + 12) > USBIP_DIR_IN) ||
+      (_get_u32 (data + 16) > USBEMU_EP_15))
+    return -1;
+
+  switch (_get_u32 (data)) {
+    case USBIP_CMD_SUBMIT:
+      return _process_submit (connection, device, data, size);
+
+    case USBIP_CMD_UNLINK:
+      _process_unlink (connection, device, _get_u32 (data + 4),
+                       _get_u32 (data + 20));
+      return USBIP_HEADER_SIZE;
+
+    default:
+      return -1;
+  }
+}
+
+/* @device is %NULL if no device answers the address the URB is for. */
+static gssize
+_process_submit (UsbemuUsbipConnection *connection,
+                 UsbemuDevice          *device,
+                 const guint8          *data,
+                 gsize                  size)
+{
+  UsbemuUrb *urb;
+  UsbemuIsoPacket *packet;
+  GBytes *payload;
+  gboolean in;
+  gint32 length, n_packets;
+  gsize needed;
+  guint32 seqnum;
+  guint8 address;
+  guint i;
+
+  seqnum = _get_u32 (data + 4);
+  in = (_get_u32 (data + 12) == USBIP_DIR_IN);
+  length = (gint32) _get_u32 (data + 24);
+  /* Linux sends -1 or 0 for non-isochronous transfers. */
+  n_packets = MAX ((gint32) _get_u32 (data + 32), 0);
+  if ((length < 0) || (length > MAX_TRANSFER_LENGTH) ||
+      (n_packets > MAX_ISO_PACKETS))
+    return -1;
+
+  needed = USBIP_HEADER_SIZE + (in ? 0 : length) +
+           n_packets * USBIP_ISO_PACKET_SIZE;
+  if (size < needed)
+    return 0;
+
+  if ((device != NULL) && (usbemu_device_lookup_urb (device, seqnum) != NULL))
+    return -1;
+
+  address = _get_u32 (data + 16) | (in ? USBEMU_ENDPOINT_DIRECTION_IN : 0);
+  if (in || (length == 0)) {
+    urb = usbemu_urb_new (address, length, n_packets);
+  } else {
+    /* OUT data is handed over in place. */
+    payload = _chunk_slice (connection->in_chunk, data + USBIP_HEADER_SIZE,
+                            length);
+    urb = usbemu_urb_new_with_payload (address, payload, n_packets);
+    g_bytes_unref (payload);
+  }
+  urb->seqnum = seqnum;
+  urb->flags = _get_u32 (data + 20) & SUPPORTED_URB_FLAGS;
+  urb->start_frame = (gint32) _get_u32 (data + 28);
+  urb->interval = MAX ((gint32) _get_u32 (data + 36), 0);
+  memcpy (urb->setup, data + 40, USBEMU_URB_SETUP_SIZE);
+
+  data += USBIP_HEADER_SIZE;
+  if (!in)
+    data += length;
+
+  for (i = 0, packet = urb->iso_packets; i < n_packets;
+       i++, packet++, data += USBIP_ISO_PACKET_SIZE) {
+    packet->offset = _get_u32 (data);
+    packet->length = _get_u32 (data + 4);
+    if ((packet->offset > length) || (packet->length > length - packet->offset)) {
+      usbemu_urb_unref (urb);
+      return -1;
+    }
+  }
+
+  /* e.g. unplugged from the exported hub meanwhile. */
+  if (device == NULL) {
+    urb->status = USBEMU_URB_STATUS_SHUTDOWN;
+    _queue_ret_submit (connection, urb);
+    usbemu_urb_unref (urb);
+    return needed;
+  }
+
+  /* There is no hub to address it to, so reset the device in place, unless
+   * the device is itself a hub and the request is for one of its ports.
+   * Devices behind an exported hub are reset through their port instead. */
+  if (((address & 0x0F) == USBEMU_EP_CTL) &&
+      (device == connection->export->device) &&
+      (usbemu_device_get_class (device) != USBEMU_CLASS_HUB) &&
+      (memcmp (urb->setup, USBIP_PORT_RESET_SETUP, 4) == 0)) {
+    usbemu_device_reset (device);
+    urb->status = USBEMU_URB_STATUS_COMPLETED;
+    _queue_ret_submit (connection, urb);
+    usbemu_urb_unref (urb);
+    return needed;
+  }
+
+  usbemu_device_submit_urb (device, urb, _on_urb_completed,
+                            _connection_ref (connection));
+  usbemu_urb_unref (urb);
+
+  return needed;
+}
+
+static void
+_process_unlink (UsbemuUsbipConnection *connection,
+                 UsbemuDevice          *device,
+                 guint32                seqnum,
+                 guint32                unlink_seqnum)
+{
+  UsbemuUrb *urb = NULL;
+
+  if (device != NULL)
+    urb = usbemu_device_lookup_urb (device, unlink_seqnum);
+  if (urb == NULL) {
+    /* Already completed and replied. */
+    _queue_ret_unlink (connection, seqnum, 0);
+    return;
+  }
+
+  g_hash_table_insert (connection->unlinks, GUINT_TO_POINTER (unlink_seqnum),
+                       GUINT_TO_POINTER (seqnum));
+  usbemu_device_cancel_urb (device, urb);
+}
+
+static void
+_on_urb_completed (UsbemuUrb *urb,
+                   gpointer   user_data)
+{
+  UsbemuUsbipConnection *connection = user_data;
+  gpointer unlink_seqnum;
+  gboolean unlinked;
+
+  unlinked = g_hash_table_lookup_extended (connection->unlinks,
+                                           GUINT_TO_POINTER (urb->seqnum),
+                                           NULL, &unlink_seqnum);
+  if (unlinked)
+    g_hash_table_remove (connection->unlinks, GUINT_TO_POINTER (urb->seqnum));
+
+  if (!connection->closed) {
+    /* A cancelled URB is answered by USBIP_RET_UNLINK only. One that
+     * completed before the cancellation took effect gets both replies, and
+     * the host ignores the late unlink. */
+    if (!unlinked || (urb->status != USBEMU_URB_STATUS_CANCELLED))
+      _queue_ret_submit (connection, urb);
+    if (unlinked && !connection->closed)
+      _queue_ret_unlink (connection, GPOINTER_TO_UINT (unlink_seqnum),
+                         (urb->status == USBEMU_URB_STATUS_CANCELLED) ?
+                             -USBIP_ECONNRESET : 0);
+  }
+
+  _connection_unref (connection);
+}
+
+static void
+_append_device (GByteArray        *array,
+                UsbemuUsbipExport *export,
+                gboolean           with_interfaces)
+{
+  UsbemuDevice *device = export->device;
+  UsbemuConfiguration *configuration = NULL;
+  UsbemuInterface *interface;
+  guint active, n_interfaces = 0, i;
+  gchar *path;
+  guint8 *p;
+
+  active = usbemu_device_get_active_configuration (device);
+  if (active != 0) {
+    configuration = usbemu_device_peek_configurations (device, NULL)[active - 1];
+    n_interfaces =
+        usbemu_configuration_get_n_alternate_interfaces (configuration);
+  }
+
+  p = _reserve (array, USBIP_DEVICE_SIZE);
+  path = g_strdup_printf ("/sys/devices/usbemu/%s", export->busid);
+  g_strlcpy ((gchar*) p, path, USBIP_PATH_SIZE);
+  g_free (path);
+  p += USBIP_PATH_SIZE;
+  g_strlcpy ((gchar*) p, export->busid, USBIP_BUSID_SIZE);
+  p += USBIP_BUSID_SIZE;
+
+  _put_u32 (p, export->busnum);
+  _put_u32 (p + 4, export->devnum);
+  _put_u32 (p + 8, usbip_speeds[usbemu_device_get_speed (device)]);
+  _put_u16 (p + 12, usbemu_device_get_vendor_id (device));
+  _put_u16 (p + 14, usbemu_device_get_product_id (device));
+  _put_u16 (p + 16, usbemu_device_get_release_number (device));
+  p[18] = usbemu_device_get_class (device);
+  p[19] = usbemu_device_get_sub_class (device);
+  p[20] = usbemu_device_get_protocol (device);
+  p[21] = active;
+  p[22] = usbemu_device_get_n_configurations (device);
+  p[23] = n_interfaces;
+
+  if (!with_interfaces)
+    return;
+
+  for (i = 0; i < n_interfaces; i++) {
+    interface = usbemu_configuration_get_interface (configuration, i,
+        usbemu_device_get_alternate_setting (device, i));
+    p = _reserve (array, USBIP_INTERFACE_SIZE);
+    p[0] = usbemu_interface_get_class (interface);
+    p[1] = usbemu_interface_get_sub_class (interface);
+    p[2] = usbemu_interface_get_protocol (interface);
+  }
+}
+
+static void
+_queue_ret_submit (UsbemuUsbipConnection *connection,
+                   UsbemuUrb             *urb)
+{
+  UsbemuUsbipReply *reply;
+  UsbemuIsoPacket *packet;
+  const guint8 *data;
+  gboolean in;
+  gsize actual_length, data_size;
+  guint8 *p;
+  guint i;
+
+  in = (urb->endpoint_address & USBEMU_ENDPOINT_DIRECTION_IN) != 0;
+
+  /* IN data is either in the buffer, or in a payload of its own size. */
+  data = usbemu_urb_peek_data (urb);
+  data_size = (urb->payload != NULL) ? g_bytes_get_size (urb->payload) :
+                                       urb->buffer_length;
+
+  /* Isochronous IN data is sent packed, without the gaps between packets. */
+  actual_length = MIN (urb->actual_length, data_size);
+  if (in && (urb->n_iso_packets != 0)) {
+    actual_length = 0;
+    for (i = 0, packet = urb->iso_packets; i < urb->n_iso_packets;
+         i++, packet++) {
+      packet->actual_length = MIN (packet->actual_length, packet->length);
+      if (packet->offset + packet->actual_length > data_size)
+        packet->actual_length = (packet->offset < data_size) ?
+                                    data_size - packet->offset : 0;
+      actual_length += packet->actual_length;
+    }
+  }
+
+  reply = _connection_push_reply (connection);
+  reply->header_size = USBIP_HEADER_SIZE;
+  p = reply->header;
+  _put_u32 (p, USBIP_RET_SUBMIT);
+  _put_u32 (p + 4, urb->seqnum);
+  _put_u32 (p + 20, _status_to_errno (urb->status));
+  _put_u32 (p + 24, actual_length);
+  _put_u32 (p + 28, urb->start_frame);
+  _put_u32 (p + 32, urb->n_iso_packets);
+  _put_u32 (p + 36, urb->error_count);
+
+  if (urb->n_iso_packets != 0) {
+    reply->extra = g_byte_array_new ();
+    if (in) {
+      for (i = 0, packet = urb->iso_packets; i < urb->n_iso_packets;
+           i++, packet++)
+        g_byte_array_append (reply->extra, data + packet->offset,
+                             packet->actual_length);
+    }
+
+    for (i = 0, packet = urb->iso_packets; i < urb->n_iso_packets;
+         i++, packet++) {
+      p = _reserve (reply->extra, USBIP_ISO_PACKET_SIZE);
+      _put_u32 (p, packet->offset);
+      _put_u32 (p + 4, packet->length);
+      _put_u32 (p + 8, packet->actual_length);
+      _put_u32 (p + 12, _status_to_errno (packet->status));
+    }
+  } else if (in && (actual_length != 0)) {
+    /* Sent straight from the URB buffer or payload. */
+    reply->urb = usbemu_urb_ref (urb);
+    reply->payload = data;
+    reply->payload_size = actual_length;
+  }
+
+  _connection_queued (connection);
+}
+
+static void
+_queue_ret_unlink (UsbemuUsbipConnection *connection,
+                   guint32                seqnum,
+                   gint32                 status)
+{
+  UsbemuUsbipReply *reply;
+
+  reply = _connection_push_reply (connection);
+  reply->header_size = USBIP_HEADER_SIZE;
+  _put_u32 (reply->header, USBIP_RET_UNLINK);
+  _put_u32 (reply->header + 4, seqnum);
+  _put_u32 (reply->header + 20, status);
+
+  _connection_queued (connection);
+}
+
+/**
+ * usbemu_usbip_server_new:
+ *
+ * Create a new #UsbemuUsbipServer instance serving on the thread-default
+ * #GMainContext.
+ *
+ * Returns: (transfer full): The constructed server object.
+ */
+UsbemuUsbipServer*
+usbemu_usbip_server_new (void)
+{
+  return g_object_new (USBEMU_TYPE_USBIP_SERVER, NULL);
+}
+
+/**
+ * usbemu_usbip_server_io_uring_available:
+ *
+ * Check whether connections can use io_uring, i.e. libusbemu was built with
+ * liburing and the running kernel supports what it needs. Otherwise, they
+ * fall back to polling their sockets whatever #UsbemuUsbipServer:io-uring
+ * says.
+ *
+ * Returns: %TRUE if io_uring is available.
+ */
+gboolean
+usbemu_usbip_server_io_uring_available (void)
+{
+  UsbemuIoRing *ring;
+
+  ring = _usbemu_io_ring_ref_default ();
+  if (ring == NULL)
+    return FALSE;
+
+  _usbemu_io_ring_unref (ring);
+  return TRUE;
+}
+
+/**
+ * usbemu_usbip_server_listen:
+ * @server: (in): a #UsbemuUsbipServer object.
+ * @address: (in): the address to listen on, usually port #USBEMU_USBIP_PORT.
+ * @effective_address: (out) (optional): return location for the bound
+ *     address, useful when listening on port 0, or %NULL.
+ * @error: return location for a #GError, or %NULL.
+ *
+ * Start accepting USB/IP connections on @address. A server listens on one
+ * address at most.
+ *
+ * Returns: %TRUE if succeeded.
+ */
+gboolean
+usbemu_usbip_server_listen (UsbemuUsbipServer  *server,
+                            GSocketAddress     *address,
+                            GSocketAddress    **effective_address,
+                            GError            **error)
+{
+  GSocket *socket;
+
+  g_return_val_if_fail (USBEMU_IS_USBIP_SERVER (server), FALSE);
+  g_return_val_if_fail (G_IS_SOCKET_ADDRESS (address), FALSE);
+  g_return_val_if_fail (server->listener == NULL, FALSE);
+
+  socket = g_socket_new (g_socket_address_get_family (address),
+                         G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, error);
+  if (socket == NULL)
+    return FALSE;
+
+  g_socket_set_blocking (socket, FALSE);
+  g_socket_set_listen_backlog (socket, LISTEN_BACKLOG);
+  if (!g_socket_bind (socket, address, TRUE, error) ||
+      !g_socket_listen (socket, error)) {
+    g_object_unref (socket);
+    return FALSE;
+  }
+
+  if (effective_address != NULL) {
+    *effective_address = g_socket_get_local_address (socket, error);
+    if (*effective_address == NULL) {
+      g_object_unref (socket);
+      return FALSE;
+    }
+  }
+
+  server->listener = socket;
+  server->listen_source = g_socket_create_source (socket, G_IO_IN, NULL);
+  g_source_set_callback (server->listen_source,
+                         (GSourceFunc) _on_listener_readable, server, NULL);
+  g_source_attach (server->listen_source, server->context);
+
+  return TRUE;
+}
+
+/**
+ * usbemu_usbip_server_export_device:
+ * @server: (in): a #UsbemuUsbipServer object.
+ * @device: (in): the #UsbemuDevice to export.
+ * @busid: (in) (nullable): bus ID identifying @device to clients, or %NULL
+ *     to generate one.
+ * @error: return location for a #GError, or %NULL.
+ *
+ * Make @device available for import. @device becomes attached when a client
+ * imports it, and detached when that client disconnects. @device is checked
+ * with usbemu_device_validate() first, so it must be completely built.
+ *
+ * Returns: %TRUE if succeeded. %FALSE if @device is invalid, already exported
+ *          or @busid is in use.
+ */
+gboolean
+usbemu_usbip_server_export_device (UsbemuUsbipServer  *server,
+                                   UsbemuDevice       *device,
+                                   const gchar        *busid,
+                                   GError            **error)
+{
+  UsbemuUsbipExport *export;
+  guint32 busnum, devnum;
+
+  g_return_val_if_fail (USBEMU_IS_USBIP_SERVER (server), FALSE);
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+  g_return_val_if_fail ((busid == NULL) ||
+                        ((*busid != '\0') &&
+                         (strlen (busid) < USBIP_BUSID_SIZE)), FALSE);
+
+  if (_find_export (server, device) != NULL) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_DEVICE_UNAVAILABLE,
+                 "Device already exported");
+    return FALSE;
+  }
+
+  if (!usbemu_device_validate (device, error))
+    return FALSE;
+
+  busnum = 1 + server->n_exported / MAX_DEVICES_PER_BUS;
+  devnum = 1 + server->n_exported % MAX_DEVICES_PER_BUS;
+  export = g_new0 (UsbemuUsbipExport, 1);
+  export->server = server;
+  export->device = g_object_ref (device);
+  export->busid = (busid != NULL) ? g_strdup (busid) :
+                                    g_strdup_printf ("%u-%u", busnum, devnum);
+  export->busnum = busnum;
+  export->devnum = devnum;
+
+  if (g_hash_table_contains (server->exports, export->busid)) {
+    g_set_error (error, USBEMU_ERROR, USBEMU_ERROR_FAILED,
+                 "Bus ID %s already in use", export->busid);
+    _export_free (export);
+    return FALSE;
+  }
+
+  g_hash_table_insert (server->exports, export->busid, export);
+  server->n_exported++;
+
+  return TRUE;
+}
+
+/**
+ * usbemu_usbip_server_unexport_device:
+ * @server: (in): a #UsbemuUsbipServer object.
+ * @device: (in): an exported #UsbemuDevice.
+ *
+ * Withdraw @device from @server. The connection importing it, if any, is
+ * closed.
+ *
+ * Returns: %TRUE if succeeded. %FALSE if @device is not exported.
+ */
+gboolean
+usbemu_usbip_server_unexport_device (UsbemuUsbipServer *server,
+                                     UsbemuDevice      *device)
+{
+  UsbemuUsbipExport *export;
+
+  g_return_val_if_fail (USBEMU_IS_USBIP_SERVER (server), FALSE);
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+
+  export = _find_export (server, device);
+  if (export == NULL)
+    return FALSE;
+
+  g_hash_table_remove (server->exports, export->busid);
+
+  return TRUE;
+}
+
+/**
+ * usbemu_usbip_server_lookup_device:
+ * @server: (in): a #UsbemuUsbipServer object.
+ * @busid: (in): a bus ID.
+ *
+ * Find the device exported as @busid.
+ *
+ * Returns: (transfer none) (nullable): the exported #UsbemuDevice, or %NULL.
+ */
+UsbemuDevice*
+usbemu_usbip_server_lookup_device (UsbemuUsbipServer *server,
+                                   const gchar       *busid)
+{
+  UsbemuUsbipExport *export;
+
+  g_return_val_if_fail (USBEMU_IS_USBIP_SERVER (server), NULL);
+  g_return_val_if_fail (busid != NULL, NULL);
+
+  export = g_hash_table_lookup (server->exports, busid);
+
+  return (export != NULL) ? export->device : NULL;
+}
+
+typedef struct {
+  UsbemuUsbipConnection *connection;
+  UsbemuUsbipStats *stats;
+} UsbemuUsbipStatsCopy;
+
+static gboolean
+_connection_copy_stats (gpointer user_data)
+{
+  UsbemuUsbipStatsCopy *copy = user_data;
+
+  *copy->stats = copy->connection->stats;
+
+  return G_SOURCE_REMOVE;
+}
+
+/**
+ * usbemu_usbip_server_get_stats:
+ * @server: (in): a #UsbemuUsbipServer object.
+ * @device: (in): an exported #UsbemuDevice object.
+ * @stats: (out caller-allocates): a #UsbemuUsbipStats to fill.
+ *
+ * Retrieve reply batching counters of the connection that imported @device.
+ *
+ * Returns: %TRUE if @device is currently imported by a client, %FALSE
+ *     otherwise, in which case @stats is left untouched.
+ */
+gboolean
+usbemu_usbip_server_get_stats (UsbemuUsbipServer *server,
+                               UsbemuDevice      *device,
+                               UsbemuUsbipStats  *stats)
+{
+  UsbemuUsbipExport *export;
+  UsbemuUsbipConnection *connection = NULL;
+  UsbemuUsbipStatsCopy copy;
+
+  g_return_val_if_fail (USBEMU_IS_USBIP_SERVER (server), FALSE);
+  g_return_val_if_fail (USBEMU_IS_DEVICE (device), FALSE);
+  g_return_val_if_fail (stats != NULL, FALSE);
+
+  export = _find_export (server, device);
+  if (export == NULL)
+    return FALSE;
+
+  g_mutex_lock (&server->lock);
+  if (export->connection != NULL)
+    connection = _connection_ref (export->connection);
+  g_mutex_unlock (&server->lock);
+  if (connection == NULL)
+    return FALSE;
+
+  /* Counters are only updated from the context of the connection. */
+  copy.connection = connection;
+  copy.stats = stats;
+  _usbemu_context_invoke_sync (connection->context, _connection_copy_stats,
+                               &copy);
+  _connection_unref (connection);
+  return TRUE;
+}
@@ -0,0 +1,120 @@
+/* usbemu - USB Emulation Library
+ * Copyright (C) 2018 You-Sheng Yang
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#if !defined (__USBEMU_USBEMU_H_INSIDE__) && !defined (LIBUSBEMU_COMPILATION)
+#error "Only <usbemu/usbemu.h> can be included directly."
+#endif
+
+#include <gio/gio.h>
+
+#include <usbemu/usbemu-device.h>
+
+G_BEGIN_DECLS
+
+/**
+ * USBEMU_TYPE_USBIP_SERVER:
+ *
+ * Convenient macro for usbemu_usbip_server_get_type().
+ */
+#define USBEMU_TYPE_USBIP_SERVER  (usbemu_usbip_server_get_type ())
+
+G_DECLARE_FINAL_TYPE (UsbemuUsbipServer, usbemu_usbip_server,
+                      USBEMU, USBIP_SERVER, GObject)
+
+/**
+ * USBEMU_USBIP_PORT:
+ *
+ * Well-known TCP port of USB/IP.
+ */
+#define USBEMU_USBIP_PORT 3240
+
+/**
+ * USBEMU_USBIP_SERVER_PROP_BATCH_SIZE:
+ *
+ * "batch-size" property name.
+ */
+#define USBEMU_USBIP_SERVER_PROP_BATCH_SIZE "batch-size"
+/**
+ * USBEMU_USBIP_SERVER_PROP_BATCH_LATENCY:
+ *
+ * "batch-latency" property name.
+ */
+#define USBEMU_USBIP_SERVER_PROP_BATCH_LATENCY "batch-latency"
+/**
+ * USBEMU_USBIP_SERVER_PROP_CORK_THRESHOLD:
+ *
+ * "cork-threshold" property name.
+ */
+#define USBEMU_USBIP_SERVER_PROP_CORK_THRESHOLD "cork-threshold"
+/**
+ * USBEMU_USBIP_SERVER_PROP_IO_URING:
+ *
+ * "io-uring" property name.
+ */
+#define USBEMU_USBIP_SERVER_PROP_IO_URING "io-uring"
+
+/**
+ * UsbemuUsbipStats:
+ * @n_replies: number of replies written.
+ * @n_bytes: number of bytes written.
+ * @n_send_calls: number of sendmsg() calls, including those that would block.
+ * @n_blocked: number of sendmsg() calls that would block.
+ * @n_count_flushes: flushes triggered by #UsbemuUsbipServer:batch-size.
+ * @n_latency_flushes: flushes triggered by #UsbemuUsbipServer:batch-latency.
+ * @n_input_flushes: flushes at the end of decoding received requests.
+ * @n_corks: number of times TCP_CORK was set.
+ * @max_queue_depth: largest number of replies queued at once.
+ *
+ * Reply batching counters of a USB/IP connection.
+ */
+typedef struct {
+  guint64 n_replies;
+  guint64 n_bytes;
+  guint64 n_send_calls;
+  guint64 n_blocked;
+  guint64 n_count_flushes;
+  guint64 n_latency_flushes;
+  guint64 n_input_flushes;
+  guint64 n_corks;
+  guint max_queue_depth;
+} UsbemuUsbipStats;
+
+UsbemuUsbipServer* usbemu_usbip_server_new (void);
+
+gboolean usbemu_usbip_server_io_uring_available (void);
+
+gboolean usbemu_usbip_server_listen (UsbemuUsbipServer  *server,
+                                     GSocketAddress     *address,
+                                     GSocketAddress    **effective_address,
+                                     GError            **error);
+
+gboolean      usbemu_usbip_server_export_device   (UsbemuUsbipServer  *server,
+                                                   UsbemuDevice       *device,
+                                                   const gchar        *busid,
+                                                   GError            **error);
+gboolean      usbemu_usbip_server_unexport_device (UsbemuUsbipServer  *server,
+                                                   UsbemuDevice       *device);
+UsbemuDevice* usbemu_usbip_server_lookup_device   (UsbemuUsbipServer  *server,
+                                                   const gchar        *busid);
+
+gboolean usbemu_usbip_server_get_stats (UsbemuUsbipServer *server,
+                                        UsbemuDevice      *device,
+                                        UsbemuUsbipStats  *stats);
+
+G_END_DECLS
@@ -20,9 +20,16 @@
 #define __USBEMU_USBEMU_H_INSIDE__
 
 #include <usbemu/usbemu-configuration.h>
+#include <usbemu/usbemu-control.h>
 #include <usbemu/usbemu-device.h>
+#include <usbemu/usbemu-endpoint-queue.h>
 #include <usbemu/usbemu-enums.h>
 #include <usbemu/usbemu-errors.h>
+#include <usbemu/usbemu-hub.h>
 #include <usbemu/usbemu-interface.h>
+#include <usbemu/usbemu-iso-stream.h>
+#include <usbemu/usbemu-runtime.h>
+#include <usbemu/usbemu-urb.h>
+#include <usbemu/usbemu-usbip-server.h>
 
 #undef __USBEMU_USBEMU_H_INSIDE__